@@ -0,0 +1,251 @@
+#include "acl.h"
+
+#include "icmpv6.h"
+#include "ipv6.h"
+#include "log.h"
+#include "utils.h"
+#include "worker.h"
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+acl_classifier *acl_configured = nullptr;
+thread_local acl_classifier *acl_local = nullptr;
+
+/* プレフィックス長のマスク */
+in6_addr acl_prefix_mask(uint8_t prefix_len) {
+  in6_addr mask{};
+  for (int i = 0; i < 16; i++) {
+    int bits = prefix_len - i * 8;
+    mask.s6_addr[i] = bits >= 8 ? 0xff : bits <= 0 ? 0 : (uint8_t)(0xff << (8 - bits));
+  }
+  return mask;
+}
+
+/* ポートの範囲をプレフィックス(値とマスク)に分解する */
+void acl_port_prefixes(uint16_t min, uint16_t max, std::vector<std::pair<uint16_t, uint16_t>> *out) {
+  uint32_t lo = min, hi = max;
+  while (lo <= hi) {
+    uint32_t size = lo == 0 ? 0x10000 : lo & -lo; // loから揃っている最大のブロック
+    while (lo + size - 1 > hi) {
+      size >>= 1;
+    }
+    out->push_back({(uint16_t)lo, (uint16_t)~(size - 1)});
+    lo += size;
+  }
+}
+
+/*
+ * ルールの一覧を分類器にコンパイルする(制御スレッドで動く)
+ * thread_countはヒット数を数えるスレッドの数(ワーカーのidで行を引く)
+ */
+acl_classifier *acl_compile(const acl_rule *rules, uint32_t count, acl_action default_action, int thread_count) {
+  struct tuple_builder {
+    acl_key mask;
+    uint32_t min_rule;
+    std::vector<acl_entry> entries;
+  };
+  std::vector<tuple_builder> builders;
+
+  for (uint32_t r = 0; r < count; r++) {
+    const acl_rule &rule = rules[r];
+    if (rule.src_len > 128 or rule.dst_len > 128 or rule.src_port_min > rule.src_port_max or rule.dst_port_min > rule.dst_port_max) {
+      LOG_ERROR("invalid acl rule %u\n", r);
+      return nullptr;
+    }
+    acl_key mask{};
+    mask.src = acl_prefix_mask(rule.src_len);
+    mask.dst = acl_prefix_mask(rule.dst_len);
+    mask.protocol = rule.protocol_mask;
+    mask.traffic_class = rule.traffic_class_mask;
+    mask.flow_label = rule.flow_label_mask & 0xfffff;
+    if (rule.src_port_min != 0 or rule.src_port_max != 65535 or rule.dst_port_min != 0 or rule.dst_port_max != 65535) {
+      mask.has_ports = 1; // ポートの無いパケット(2つ目以降のフラグメントなど)には合わせない
+    }
+
+    acl_key value{};
+    value.src = rule.src;
+    value.dst = rule.dst;
+    value.protocol = rule.protocol;
+    value.traffic_class = rule.traffic_class;
+    value.flow_label = rule.flow_label;
+    value.has_ports = 1;
+
+    std::vector<std::pair<uint16_t, uint16_t>> src_ports, dst_ports;
+    acl_port_prefixes(rule.src_port_min, rule.src_port_max, &src_ports);
+    acl_port_prefixes(rule.dst_port_min, rule.dst_port_max, &dst_ports);
+    for (const auto &sp : src_ports) {
+      for (const auto &dp : dst_ports) {
+        mask.src_port = sp.second;
+        mask.dst_port = dp.second;
+        value.src_port = sp.first;
+        value.dst_port = dp.first;
+
+        tuple_builder *builder = nullptr;
+        for (tuple_builder &b : builders) {
+          if (acl_key_equals(b.mask, mask)) {
+            builder = &b;
+            break;
+          }
+        }
+        if (builder == nullptr) {
+          if (builders.size() == ACL_MAX_TUPLES) {
+            LOG_ERROR("too many acl tuples (rule %u)\n", r);
+            return nullptr;
+          }
+          builders.push_back({mask, r, {}});
+          builder = &builders.back();
+        }
+        acl_entry entry{};
+        acl_key_and(&entry.key, value, mask);
+        entry.rule = r;
+        builder->entries.push_back(entry);
+      }
+    }
+  }
+
+  acl_classifier *classifier = new acl_classifier();
+  classifier->refs.store(1, std::memory_order_relaxed); // 設定した制御スレッドの分
+  classifier->rule_count = count;
+  classifier->rules = new acl_rule[count > 0 ? count : 1];
+  memcpy(classifier->rules, rules, sizeof(acl_rule) * count);
+  classifier->default_action = default_action;
+  classifier->tuple_count = builders.size();
+  classifier->tuples = new acl_tuple[builders.size() > 0 ? builders.size() : 1];
+  classifier->entry_count = 0;
+
+  // 優先するルールを含むタプルから引けるように並べる(min_ruleは作った順に増えている)
+  for (size_t t = 0; t < builders.size(); t++) {
+    tuple_builder &builder = builders[t];
+    acl_tuple *tuple = &classifier->tuples[t];
+    tuple->mask = builder.mask;
+    tuple->min_rule = builder.min_rule;
+
+    uint32_t size = 4;
+    while (size < builder.entries.size() * 2) { // 半分以上は空けておく
+      size <<= 1;
+    }
+    tuple->table_mask = size - 1;
+    tuple->table = (acl_entry *)aligned_alloc(alignof(acl_entry), sizeof(acl_entry) * size);
+    for (uint32_t i = 0; i < size; i++) {
+      tuple->table[i].rule = UINT32_MAX;
+    }
+    for (const acl_entry &entry : builder.entries) {
+      uint32_t slot = acl_key_hash(entry.key) & tuple->table_mask;
+      while (tuple->table[slot].rule != UINT32_MAX and !acl_key_equals(tuple->table[slot].key, entry.key)) {
+        slot = (slot + 1) & tuple->table_mask;
+      }
+      if (tuple->table[slot].rule == UINT32_MAX) { // 同じキーなら先に書いたルールを残す
+        tuple->table[slot] = entry;
+        classifier->entry_count++;
+      }
+    }
+  }
+
+  // ヒット数はスレッドごとに別のキャッシュラインに置く
+  classifier->hits_stride = (count + 1 + 7) & ~7u;
+  size_t hits_size = sizeof(uint64_t) * classifier->hits_stride * thread_count;
+  classifier->hits = (uint64_t *)aligned_alloc(CACHE_LINE_SIZE, hits_size);
+  memset(classifier->hits, 0, hits_size);
+  return classifier;
+}
+
+/* 分類器を手放す(最後の1つなら解放する) */
+void acl_release(acl_classifier *classifier) {
+  if (classifier == nullptr or classifier->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  for (uint32_t t = 0; t < classifier->tuple_count; t++) {
+    free(classifier->tuples[t].table);
+  }
+  delete[] classifier->tuples;
+  delete[] classifier->rules;
+  free(classifier->hits);
+  delete classifier;
+}
+
+/* 最初に合ったルールの番号を返す(無ければUINT32_MAX) */
+uint32_t acl_classify(const acl_classifier *classifier, const acl_key &key) {
+  uint32_t best = UINT32_MAX;
+  acl_key masked;
+  for (uint32_t t = 0; t < classifier->tuple_count; t++) {
+    const acl_tuple *tuple = &classifier->tuples[t];
+    if (tuple->min_rule >= best) { // 残りのタプルには見つかったものより優先するルールが無い
+      break;
+    }
+    acl_key_and(&masked, key, tuple->mask);
+    uint32_t slot = acl_key_hash(masked) & tuple->table_mask;
+    while (tuple->table[slot].rule != UINT32_MAX) {
+      if (acl_key_equals(tuple->table[slot].key, masked)) {
+        if (tuple->table[slot].rule < best) {
+          best = tuple->table[slot].rule;
+        }
+        break;
+      }
+      slot = (slot + 1) & tuple->table_mask;
+    }
+  }
+  return best;
+}
+
+/* 現在のスレッドの分類器を差し替える(制御リングから受け取った時に呼ぶ) */
+void acl_install(acl_classifier *classifier) {
+  acl_classifier *old = acl_local;
+  acl_local = classifier;
+  acl_release(old);
+}
+
+/* ACLを評価する(ipv6-aclノード) */
+void ipv6_acl_node(graph_buffer **buffers, uint32_t count) {
+  const acl_classifier *classifier = acl_local; // ベクタの途中では差し替わらない
+  uint64_t *hits = &classifier->hits[classifier->hits_stride * current_worker->id];
+  acl_key key;
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+    if (!acl_extract_key(packet, b->len - b->l3_offset, &key)) { // 上位層のヘッダまでたどれないものは評価せずに捨てる
+      graph_drop(b, STATS_DROP_ACL_UNPARSEABLE);
+      continue;
+    }
+
+    uint32_t rule = acl_classify(classifier, key);
+    acl_action action = rule != UINT32_MAX ? classifier->rules[rule].action : classifier->default_action;
+    hits[rule != UINT32_MAX ? rule : classifier->rule_count]++;
+    TRACE_STEP(b, GRAPH_NODE_IPV6_ACL, TRACE_ACL, (uint8_t)action, rule, nullptr);
+
+    if (action == acl_action::permit) {
+      graph_enqueue(GRAPH_NODE_IPV6_LOOKUP, b);
+    } else if (action == acl_action::reject) {
+      icmpv6_send_error(b, ICMPV6_TYPE_DEST_UNREACHABLE, ICMPV6_DEST_UNREACHABLE_ADMIN, 0, STATS_DROP_ACL_DENIED);
+    } else {
+      graph_drop(b, STATS_DROP_ACL_DENIED);
+    }
+  }
+}
+
+/* 設定したACLのルールとヒット数を表示する(全てのスレッドの分を足す) */
+void dump_acl() {
+  const acl_classifier *classifier = acl_configured;
+  if (classifier == nullptr) {
+    printf("no acl\n");
+    return;
+  }
+  printf("acl %u rules, %u tuples, %u entries\n", classifier->rule_count, classifier->tuple_count, classifier->entry_count);
+  for (uint32_t r = 0; r <= classifier->rule_count; r++) {
+    uint64_t hits = 0;
+    for (int i = 0; i <= worker_count; i++) {
+      hits += __atomic_load_n(&classifier->hits[classifier->hits_stride * i + r], __ATOMIC_RELAXED);
+    }
+    if (r == classifier->rule_count) {
+      printf("%5s default %s hits %lu\n", "", acl_action_names[(int)classifier->default_action], hits);
+      break;
+    }
+    const acl_rule &rule = classifier->rules[r];
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &rule.src, src, sizeof(src));
+    inet_ntop(AF_INET6, &rule.dst, dst, sizeof(dst));
+    printf("%5u %s %s/%u -> %s/%u proto %u/0x%02x sport %u-%u dport %u-%u tc %u/0x%02x flow %u/0x%05x hits %lu\n", r, acl_action_names[(int)rule.action], src, rule.src_len,
+           dst, rule.dst_len, rule.protocol, rule.protocol_mask, rule.src_port_min, rule.src_port_max, rule.dst_port_min, rule.dst_port_max, rule.traffic_class,
+           rule.traffic_class_mask, rule.flow_label, rule.flow_label_mask, hits);
+  }
+}
@@ -0,0 +1,218 @@
+#ifndef CURO_ACL_H
+#define CURO_ACL_H
+
+#include "config.h"
+#include "graph.h"
+#include "ipv6.h"
+#include "utils.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * IPv6のACL(経路を引く前にipv6-aclノードで評価する)
+ * ルールは送信元/宛先のプレフィックス、プロトコル、ポートの範囲、トラフィッククラス、フローラベルで指定し、
+ * 先に書いたものほど優先する(最初に合ったルールの動作をとる)
+ *
+ * ルールの一覧はタプル空間探索の分類器にコンパイルする
+ * 各フィールドのマスクの組(タプル)ごとに、マスクした値をキーにするハッシュ表を作るので、
+ * パケットごとの費用はルールの数ではなくタプルの数で決まる(ポートの範囲はプレフィックスに分解してマスクにする)
+ * タプルは含むルールの優先度の順に並べ、見つかったルールより優先度の低いタプルは引かない
+ *
+ * プロトコルとポートは拡張ヘッダ(ACL_MAX_EXTENSION_HEADERS個まで)をたどった先の上位層のヘッダから取る
+ * 2つ目以降のフラグメントにはポートが無いので、ポートを指定しないルールにだけ合う
+ * 拡張ヘッダが多すぎるものや、最初のフラグメントに上位層のヘッダが収まっていないもの(RFC 7112)は評価せずに捨てる
+ *
+ * コンパイルした分類器は書き換えず、制御リングで各ワーカーに渡してポーリング周期の合間に差し替える
+ * ベクタの途中で一覧が変わることはなく、古い分類器は最後に手放したスレッドが解放する
+ */
+
+#define ACL_MAX_TUPLES 1024          // 1つの分類器に入れられるタプルの数
+#define ACL_MAX_EXTENSION_HEADERS 8  // 上位層のヘッダを探す時にたどる拡張ヘッダの数
+
+#define ACL_PROTOCOL_TCP 6
+#define ACL_PROTOCOL_UDP 17
+#define ACL_PROTOCOL_SCTP 132
+
+enum class acl_action : uint8_t {
+  permit,
+  deny,  // 黙って捨てる
+  reject // 捨てて、ICMPv6の宛先到達不能(管理上の禁止)を送り返す
+};
+
+inline const char *const acl_action_names[] = {"permit", "deny", "reject"};
+
+/* ACLのルール */
+struct acl_rule {
+  in6_addr src;
+  uint8_t src_len; // 0なら全て
+  in6_addr dst;
+  uint8_t dst_len;
+  uint8_t protocol;      // 次ヘッダ
+  uint8_t protocol_mask; // 0なら全て
+  uint16_t src_port_min; // TCP/UDP/SCTPのポートの範囲(0~65535なら全て)
+  uint16_t src_port_max;
+  uint16_t dst_port_min;
+  uint16_t dst_port_max;
+  uint8_t traffic_class;
+  uint8_t traffic_class_mask; // 0なら全て
+  uint32_t flow_label;
+  uint32_t flow_label_mask; // 0なら全て
+  acl_action action;
+};
+
+/* 分類器のキー(パケットから取り出したフィールド、マスクも同じ形で持つ) */
+struct alignas(16) acl_key {
+  in6_addr src;
+  in6_addr dst;
+  uint32_t flow_label; // 以下はホストバイトオーダー
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t protocol; // 拡張ヘッダの後の上位層のプロトコル
+  uint8_t traffic_class;
+  uint8_t has_ports; // ポートを取り出せたら1(TCP/UDP/SCTP以外と2つ目以降のフラグメントは0)
+  uint8_t pad[5];
+};
+
+static_assert(sizeof(acl_key) == 48, "acl_key must be three 16-byte words");
+
+/* キーにマスクをかける(16バイトずつまとめて) */
+inline void acl_key_and(acl_key *out, const acl_key &key, const acl_key &mask) {
+#ifdef __SSE2__
+  const __m128i *k = (const __m128i *)&key;
+  const __m128i *m = (const __m128i *)&mask;
+  __m128i *o = (__m128i *)out;
+  _mm_store_si128(o, _mm_and_si128(_mm_load_si128(k), _mm_load_si128(m)));
+  _mm_store_si128(o + 1, _mm_and_si128(_mm_load_si128(k + 1), _mm_load_si128(m + 1)));
+  _mm_store_si128(o + 2, _mm_and_si128(_mm_load_si128(k + 2), _mm_load_si128(m + 2)));
+#else
+  const uint64_t *k = (const uint64_t *)&key;
+  const uint64_t *m = (const uint64_t *)&mask;
+  uint64_t *o = (uint64_t *)out;
+  for (int i = 0; i < 6; i++) {
+    o[i] = k[i] & m[i];
+  }
+#endif
+}
+
+inline bool acl_key_equals(const acl_key &a, const acl_key &b) {
+#ifdef __SSE2__
+  const __m128i *x = (const __m128i *)&a;
+  const __m128i *y = (const __m128i *)&b;
+  __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_load_si128(x), _mm_load_si128(y)), _mm_cmpeq_epi8(_mm_load_si128(x + 1), _mm_load_si128(y + 1)));
+  eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_load_si128(x + 2), _mm_load_si128(y + 2)));
+  return _mm_movemask_epi8(eq) == 0xffff;
+#else
+  return memcmp(&a, &b, sizeof(acl_key)) == 0;
+#endif
+}
+
+inline uint64_t acl_key_hash(const acl_key &key) {
+  const uint64_t *w = (const uint64_t *)&key;
+  uint64_t h = (w[0] ^ fmix64(w[1])) + (w[2] ^ fmix64(w[3])) * 0x9e3779b97f4a7c15ULL + (w[4] ^ fmix64(w[5]));
+  return fmix64(h);
+}
+
+/*
+ * パケットから分類器のキーを取り出す
+ * 拡張ヘッダをたどって上位層のプロトコルを求め、TCP/UDP/SCTPならポートも見る
+ * 拡張ヘッダが多すぎるか途中で切れていて、上位層のヘッダまでたどれなければfalseを返す
+ */
+inline bool acl_extract_key(const ipv6_header *packet, uint32_t len, acl_key *key) {
+  uint32_t ver_tc_fl = ntohl(packet->ver_tc_fl);
+  memcpy(&key->src, &packet->src_addr, sizeof(in6_addr));
+  memcpy(&key->dst, &packet->dst_addr, sizeof(in6_addr));
+  key->flow_label = ver_tc_fl & 0xfffff;
+  key->traffic_class = (ver_tc_fl >> 20) & 0xff;
+  key->src_port = 0;
+  key->dst_port = 0;
+  key->has_ports = 0;
+  memset(key->pad, 0, sizeof(key->pad));
+
+  uint8_t next_hdr = packet->next_hdr;
+  const uint8_t *p = (const uint8_t *)(packet + 1);
+  uint32_t remaining = len - sizeof(ipv6_header);
+  bool later_fragment = false;
+  for (int n = 0;; n++) {
+    uint32_t hdr_len;
+    if (next_hdr == IPV6_PROTOCOL_NUM_HOPOPTS or next_hdr == IPV6_PROTOCOL_NUM_ROUTING or next_hdr == IPV6_PROTOCOL_NUM_OPTS) {
+      hdr_len = remaining >= 2 ? (p[1] + 1) * 8 : 8;
+    } else if (next_hdr == IPV6_PROTOCOL_NUM_FRAGMENT) {
+      hdr_len = 8;
+      later_fragment = remaining >= 4 and (((p[2] << 8) | p[3]) & 0xfff8) != 0; // フラグメントオフセットが0でない
+    } else if (next_hdr == IPV6_PROTOCOL_NUM_AH) {
+      hdr_len = remaining >= 2 ? (p[1] + 2) * 4 : 8;
+    } else {
+      break; // 上位層のヘッダ
+    }
+    if (n == ACL_MAX_EXTENSION_HEADERS or remaining < hdr_len) {
+      return false;
+    }
+    if (later_fragment) { // 上位層のヘッダは最初のフラグメントにしか無い
+      key->protocol = p[0];
+      return true;
+    }
+    next_hdr = p[0];
+    p += hdr_len;
+    remaining -= hdr_len;
+  }
+
+  key->protocol = next_hdr;
+  if (next_hdr == ACL_PROTOCOL_TCP or next_hdr == ACL_PROTOCOL_UDP or next_hdr == ACL_PROTOCOL_SCTP) {
+    if (remaining < 4) {
+      return false;
+    }
+    key->src_port = (p[0] << 8) | p[1];
+    key->dst_port = (p[2] << 8) | p[3];
+    key->has_ports = 1;
+  }
+  return true;
+}
+
+/* タプルのハッシュ表のエントリ */
+struct acl_entry {
+  acl_key key;   // マスクした値
+  uint32_t rule; // 合ったルールの番号(UINT32_MAXなら空き)
+};
+
+/* 同じマスクを持つルールの集まり */
+struct acl_tuple {
+  acl_key mask;
+  uint32_t min_rule;   // 含むルールのうち最も優先するものの番号
+  uint32_t table_mask; // ハッシュ表の大きさ-1
+  acl_entry *table;
+};
+
+/* コンパイルした分類器 */
+struct acl_classifier {
+  std::atomic<int> refs; // 使っているスレッドの数
+  uint32_t rule_count;
+  acl_rule *rules;
+  acl_action default_action; // どのルールにも合わなかった時
+  uint32_t tuple_count;
+  acl_tuple *tuples;
+  uint32_t entry_count; // ポートの範囲を分解した後のエントリの数
+  uint32_t hits_stride; // スレッドごとのヒット数の行の長さ(最後の1つはどのルールにも合わなかった数)
+  uint64_t *hits;       // [スレッドのid][ルール]
+};
+
+extern acl_classifier *acl_configured;         // 最後に設定した分類器(制御スレッドだけが使う)
+extern thread_local acl_classifier *acl_local; // 現在のスレッドが使っている分類器
+
+/* ユニキャストのパケットを渡すノード(ACLが無ければ直接経路を引く) */
+inline graph_node_index acl_input_next_node() { return acl_local != nullptr ? GRAPH_NODE_IPV6_ACL : GRAPH_NODE_IPV6_LOOKUP; }
+
+acl_classifier *acl_compile(const acl_rule *rules, uint32_t count, acl_action default_action, int thread_count);
+void acl_release(acl_classifier *classifier);
+uint32_t acl_classify(const acl_classifier *classifier, const acl_key &key);
+
+void acl_install(acl_classifier *classifier);
+void ipv6_acl_node(graph_buffer **buffers, uint32_t count);
+
+void dump_acl();
+
+#endif // CURO_ACL_H
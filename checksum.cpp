@@ -0,0 +1,164 @@
+#include "checksum.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* 64ビットの和を16ビットに折り返す */
+inline uint16_t checksum_fold(uint64_t sum) {
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+/* 16バイトに満たない残りを足す(1バイト余れば、メモリ上の並びで上位のバイトとして足す) */
+inline uint64_t checksum_tail(const uint8_t *p, size_t len, uint64_t sum) {
+  while (len >= 4) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    sum += v;
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    sum += v;
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    uint8_t last[2] = {*p, 0};
+    uint16_t v;
+    memcpy(&v, last, 2);
+    sum += v;
+  }
+  return sum;
+}
+
+/* 32ビットずつ64ビットの変数に足す(桁あふれは最後にまとめて折り返す) */
+uint16_t checksum_partial_generic(const void *data, size_t len, uint16_t sum) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t acc = sum;
+  while (len >= 16) {
+    uint32_t v[4];
+    memcpy(v, p, 16);
+    acc += (uint64_t)v[0] + v[1] + v[2] + v[3];
+    p += 16;
+    len -= 16;
+  }
+  return checksum_fold(checksum_tail(p, len, acc));
+}
+
+#if defined(__x86_64__)
+
+#define CHECKSUM_SIMD_BLOCK 32768 // 32ビットのレーンが桁あふれしないうちに64ビットへ移す間隔(バイト)
+
+/* 4つの32ビットのレーンの和 */
+inline uint64_t checksum_sum_epi32(__m128i v) {
+  uint32_t lanes[4];
+  _mm_storeu_si128((__m128i *)lanes, v);
+  return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+/* 16ビットの語を32ビットのレーンに広げて足す */
+uint16_t checksum_partial_sse2(const void *data, size_t len, uint16_t sum) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t acc = sum;
+  const __m128i zero = _mm_setzero_si128();
+  while (len >= 16) {
+    size_t block = len < CHECKSUM_SIMD_BLOCK ? len & ~(size_t)15 : CHECKSUM_SIMD_BLOCK;
+    __m128i lo = zero, hi = zero;
+    for (size_t i = 0; i < block; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero));
+      hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero));
+    }
+    acc += checksum_sum_epi32(lo) + checksum_sum_epi32(hi);
+    p += block;
+    len -= block;
+  }
+  return checksum_fold(checksum_tail(p, len, acc));
+}
+
+__attribute__((target("avx2"))) uint16_t checksum_partial_avx2(const void *data, size_t len, uint16_t sum) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t acc = sum;
+  const __m256i zero = _mm256_setzero_si256();
+  while (len >= 32) {
+    size_t block = len < CHECKSUM_SIMD_BLOCK ? len & ~(size_t)31 : CHECKSUM_SIMD_BLOCK;
+    __m256i lo = zero, hi = zero;
+    for (size_t i = 0; i < block; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+      lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(v, zero));
+      hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(v, zero));
+    }
+    __m256i total = _mm256_add_epi32(lo, hi); // 1つのレーンは最大で2*1024*65535なので、足しても桁あふれしない
+    acc += checksum_sum_epi32(_mm256_castsi256_si128(total)) + checksum_sum_epi32(_mm256_extracti128_si256(total, 1));
+    p += block;
+    len -= block;
+  }
+  return checksum_fold(checksum_tail(p, len, acc));
+}
+
+bool checksum_avx2_supported() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/* 使えるうちで一番速い実装を選ぶ(プログラムの起動時に1度だけ) */
+checksum_partial_fn checksum_select(const char **name) {
+#if defined(ENABLE_SIMD_CHECKSUM) && defined(__x86_64__)
+  if (checksum_avx2_supported()) {
+    *name = "avx2";
+    return checksum_partial_avx2;
+  }
+  *name = "sse2";
+  return checksum_partial_sse2;
+#else
+  *name = "generic";
+  return checksum_partial_generic;
+#endif
+}
+
+const char *checksum_impl_name;
+checksum_partial_fn checksum_partial_impl = checksum_select(&checksum_impl_name);
+
+/*
+ * 分割されたデータの部分和
+ * 奇数の長さの断片の後は、次の断片が奇数のオフセットから始まるので、その部分和のバイトを入れ替えて足す
+ */
+uint16_t checksum_iov(const iovec *iov, int count, uint16_t sum) {
+  bool odd = false;
+  for (int i = 0; i < count; i++) {
+    uint16_t s = checksum_partial(iov[i].iov_base, iov[i].iov_len, 0);
+    sum = checksum_add(sum, odd ? __builtin_bswap16(s) : s);
+    odd ^= iov[i].iov_len & 1;
+  }
+  return sum;
+}
+
+/* IPv6の疑似ヘッダの部分和(ipv6_pseudo_headerを組み立てずに、アドレスを直接足す) */
+uint16_t checksum_pseudo_header(const in6_addr &src, const in6_addr &dst, uint32_t len, uint8_t next_hdr) {
+  uint64_t acc = 0;
+  uint32_t words[4];
+  memcpy(words, src.s6_addr, 16);
+  acc += (uint64_t)words[0] + words[1] + words[2] + words[3];
+  memcpy(words, dst.s6_addr, 16);
+  acc += (uint64_t)words[0] + words[1] + words[2] + words[3];
+  acc += htonl(len);
+  acc += htonl(next_hdr);
+  return checksum_fold(acc);
+}
+
+/* lenバイトのフィールドをold_dataからnew_dataに書き換えた後のチェックサム(フィールドは偶数のオフセットから始まること) */
+uint16_t checksum_update(uint16_t check, const void *old_data, const void *new_data, size_t len) {
+  uint16_t sum = checksum_add(~check, ~checksum_partial(old_data, len, 0));
+  return ~checksum_add(sum, checksum_partial(new_data, len, 0));
+}
@@ -0,0 +1,53 @@
+#ifndef CURO_CHECKSUM_H
+#define CURO_CHECKSUM_H
+
+#include "config.h"
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+/*
+ * インターネットチェックサム(RFC 1071)
+ * 部分和は16ビットに折り返した1の補数和で、メモリ上の並びのまま(ネットワークバイトオーダーで)足す
+ * ヘッダに書き込む時はchecksum_finishで否定をとるだけで、htonsは要らない
+ *
+ * 長いデータはSSE2/AVX2でまとめて足す(起動時にCPUを見て選ぶ)
+ * 数個のフィールドを書き換えるだけなら、checksum_update16/checksum_updateで差分だけを反映する(RFC 1624)
+ */
+
+typedef uint16_t (*checksum_partial_fn)(const void *data, size_t len, uint16_t sum);
+
+extern checksum_partial_fn checksum_partial_impl;
+extern const char *checksum_impl_name;
+
+uint16_t checksum_partial_generic(const void *data, size_t len, uint16_t sum);
+#if defined(__x86_64__)
+uint16_t checksum_partial_sse2(const void *data, size_t len, uint16_t sum);
+uint16_t checksum_partial_avx2(const void *data, size_t len, uint16_t sum);
+bool checksum_avx2_supported();
+#endif
+
+/* 1の補数の加算 */
+inline uint16_t checksum_add(uint16_t a, uint16_t b) {
+  uint32_t sum = (uint32_t)a + b;
+  return (sum & 0xffff) + (sum >> 16);
+}
+
+/* dataの部分和をsumに足す */
+inline uint16_t checksum_partial(const void *data, size_t len, uint16_t sum = 0) { return checksum_partial_impl(data, len, sum); }
+
+/* 部分和からヘッダに書き込むチェックサムを作る */
+inline uint16_t checksum_finish(uint16_t sum) { return ~sum; }
+
+uint16_t checksum_iov(const iovec *iov, int count, uint16_t sum = 0);
+uint16_t checksum_pseudo_header(const in6_addr &src, const in6_addr &dst, uint32_t len, uint8_t next_hdr);
+
+/* 16ビットのフィールドをold_valueからnew_valueに書き換えた後のチェックサム(RFC 1624の式3) */
+inline uint16_t checksum_update16(uint16_t check, uint16_t old_value, uint16_t new_value) {
+  return ~checksum_add(checksum_add(~check, ~old_value), new_value);
+}
+
+uint16_t checksum_update(uint16_t check, const void *old_data, const void *new_data, size_t len);
+
+#endif // CURO_CHECKSUM_H
@@ -1,37 +1,36 @@
 #include "config.h"
 
+#include "acl.h"
 #include "ipv6.h"
 #include "log.h"
 #include "net.h"
+#include "nptv6.h"
 #include "patricia_trie.h"
+#include "punt.h"
 #include "utils.h"
+#include "worker.h"
+
+/*
+ * 設定は全てのワーカーへのメッセージとして送り、
+ * 各ワーカーが自分の経路表とNDテーブルに反映する
+ */
 
 /* IPv6ネットワークへの経路を設定 */
 void configure_ipv6_net_route(in6_addr prefix,
                               uint32_t prefix_len,
                               in6_addr next_hop) {
 
-  // 経路エントリの生成
-  ipv6_route_entry *entry;
-  entry = (ipv6_route_entry *)(calloc(
-      1, sizeof(ipv6_route_entry)));
-  entry->type = ipv6_route_type::network;
-  entry->next_hop = next_hop;
-
   // 経路の登録
-  patricia_trie_insert(ipv6_fib, prefix, prefix_len,
-                       entry);
-
-  char addr_str[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &prefix, addr_str,
-            INET6_ADDRSTRLEN);
-
-  char addr_nh[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &next_hop, addr_nh,
-            INET6_ADDRSTRLEN);
-
-  LOG_INFO("configure route to %s/%d via %s\n", addr_str,
-           prefix_len, addr_nh);
+  worker_msg msg{};
+  msg.type = worker_msg_type::route_update;
+  msg.route.type = ROUTE_UPDATE_ADD;
+  msg.route.prefix_len = prefix_len;
+  msg.route.prefix = prefix;
+  msg.route.next_hop = next_hop;
+  worker_broadcast_msg(msg);
+
+  LOG_INFO("configure route to %s/%d via %s\n", prefix,
+           prefix_len, next_hop);
 }
 
 /* デバイスにIPv6アドレスを設定 */
@@ -43,35 +42,144 @@ void configure_ipv6_address(net_device *dev,
     exit(EXIT_FAILURE);
   }
 
-  // IPアドレスの登録
-  dev->ipv6_dev =
+  // IPアドレスの登録(最初に設定したアドレスをNSなどの送信元に使うので、後ろにつなぐ)
+  ipv6_device *v6dev =
       (ipv6_device *)calloc(1, sizeof(ipv6_device));
-  dev->ipv6_dev->address = address;
-  dev->ipv6_dev->prefix_len = prefix_len;
-  dev->ipv6_dev->net_dev = dev;
+  v6dev->address = address;
+  v6dev->prefix_len = prefix_len;
+  v6dev->net_dev = dev;
 
-  char addr_str[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &address, addr_str,
-            INET6_ADDRSTRLEN);
+  ipv6_device **tail = &dev->ipv6_dev;
+  while (*tail != nullptr) {
+    tail = &(*tail)->next;
+  }
+  *tail = v6dev;
 
-  LOG_INFO("configure ipv6 address to %s\n", addr_str);
+  LOG_INFO("configure ipv6 address to %s\n", address);
+
+  // 自分宛ての判定に使うlocal経路を設定
+  worker_msg msg{};
+  msg.type = worker_msg_type::local_route;
+  msg.local.v6dev = v6dev;
+  worker_broadcast_msg(msg);
 
   // IPアドレスを設定すると同時に直接接続ルートを設定
+  msg = {};
+  msg.type = worker_msg_type::connected_route;
+  msg.connected.dev = dev;
+  msg.connected.prefix = address;
+  msg.connected.prefix_len = prefix_len;
+  worker_broadcast_msg(msg);
+
+  LOG_INFO("configure directly connected route %s/%d "
+           "device %s\n",
+           in6_addr_clear_prefix(address, prefix_len), prefix_len, dev->name);
+}
+
+/* 静的なNDエントリを設定 */
+void configure_static_neighbor(net_device *dev,
+                               const uint8_t *mac_addr,
+                               in6_addr address) {
+  if (dev == nullptr) {
+    LOG_ERROR("net device to configure not found\n");
+    exit(EXIT_FAILURE);
+  }
+
+  worker_msg msg{};
+  msg.type = worker_msg_type::static_neighbor;
+  msg.neighbor.dev = dev;
+  msg.neighbor.v6_addr = address;
+  memcpy(msg.neighbor.mac_addr, mac_addr, 6);
+  worker_broadcast_msg(msg);
+}
+
+/*
+ * ACLを設定(ルールの一覧をここでコンパイルし、全てのワーカーに差し替えさせる)
+ * 各ワーカーはポーリング周期の合間に一度に差し替えるので、新旧のルールが混ざって評価されることはない
+ */
+bool configure_acl(const acl_rule *rules, uint32_t count, acl_action default_action) {
+  acl_classifier *classifier = acl_compile(rules, count, default_action, worker_count + 1); // 制御プレーンのスレッドの分も行を用意する
+  if (classifier == nullptr) {
+    return false;
+  }
+
+  int receivers = worker_count + (punt_worker != nullptr ? 1 : 0);
+  classifier->refs.fetch_add(receivers, std::memory_order_relaxed);
+  worker_msg msg{};
+  msg.type = worker_msg_type::acl_update;
+  msg.acl.classifier = classifier;
+  if (!worker_broadcast_msg(msg)) {
+    classifier->refs.fetch_sub(receivers, std::memory_order_relaxed);
+    acl_release(classifier);
+    return false;
+  }
+  acl_release(acl_configured);
+  acl_configured = classifier;
+
+  LOG_INFO("configure acl with %u rules (%u tuples)\n", count, classifier->tuple_count);
+  return true;
+}
+
+/*
+ * NPTv6のプレフィックスの変換を設定(external_devが外部のデバイス)
+ * 内部か外部のプレフィックスが設定済みの組と同じなら、どちら向きに変換するか決まらないので設定しない
+ */
+bool configure_nptv6(net_device *external_dev, in6_addr internal_prefix, in6_addr external_prefix, uint32_t prefix_len) {
+  npt_mapping *mapping = npt_create_mapping(external_dev, internal_prefix, external_prefix, prefix_len);
+  if (mapping == nullptr) {
+    return false;
+  }
+  for (npt_mapping *m = npt_configured; m != nullptr; m = m->next) {
+    if (m->prefix_len == mapping->prefix_len and (in6_addr_equals(m->internal_prefix, mapping->internal_prefix) or in6_addr_equals(m->external_prefix, mapping->external_prefix))) {
+      LOG_ERROR("nptv6 mapping with the same prefix already configured\n");
+      free(mapping);
+      return false;
+    }
+  }
+
+  worker_msg msg{};
+  msg.type = worker_msg_type::npt_mapping_add;
+  msg.npt.mapping = mapping;
+  if (!worker_broadcast_msg(msg)) {
+    free(mapping);
+    return false;
+  }
+  mapping->next = npt_configured;
+  npt_configured = mapping;
+
+  LOG_INFO("configure nptv6 %s/%u <-> %s/%u on %s\n", mapping->internal_prefix, prefix_len, mapping->external_prefix, prefix_len, external_dev->name);
+  return true;
+}
+
+/* 直接接続経路を現在のワーカーの経路表に登録 */
+void install_connected_route(net_device *dev,
+                             in6_addr prefix,
+                             uint32_t prefix_len) {
   ipv6_route_entry *entry;
   entry = (ipv6_route_entry *)calloc(
       1, sizeof(ipv6_route_entry));
   entry->type = ipv6_route_type::connected;
   entry->dev = dev;
 
-  patricia_trie_insert(ipv6_fib, address, prefix_len,
-                       entry);
+  // 同じネットワークのアドレスを複数設定した時は、後から設定したデバイスに置き換える
+  ipv6_route_entry *old = (ipv6_route_entry *)patricia_trie_remove(ipv6_fib, prefix, prefix_len);
+  if (old != nullptr and old->type == ipv6_route_type::local) { // /128のネットワークとして設定されたアドレス
+    patricia_trie_insert(ipv6_fib, prefix, prefix_len, old);
+    free(entry);
+    return;
+  }
+  free(old);
 
-  address = in6_addr_clear_prefix(address, prefix_len);
+  patricia_trie_insert(ipv6_fib, prefix, prefix_len,
+                       entry);
+}
 
-  inet_ntop(AF_INET6, &address, addr_str,
-            INET6_ADDRSTRLEN);
+/* ルータ自身のアドレスを現在のワーカーの経路表にlocal経路として登録 */
+void install_local_route(ipv6_device *v6dev) {
+  ipv6_route_entry *entry = (ipv6_route_entry *)calloc(1, sizeof(ipv6_route_entry));
+  entry->type = ipv6_route_type::local;
+  entry->v6dev = v6dev;
 
-  LOG_INFO("configure directly connected route %s/%d "
-           "device %s\n",
-           addr_str, prefix_len, dev->name);
-}
\ No newline at end of file
+  free(patricia_trie_remove(ipv6_fib, v6dev->address, 128));
+  patricia_trie_insert(ipv6_fib, v6dev->address, 128, entry);
+}
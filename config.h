@@ -4,28 +4,65 @@
 #include <cstdint>
 #include <cstdio>
 
-#define MAX_INTERFACES 8
+#define NUM_WORKERS 0  // 転送処理を行うワーカースレッドの数(0ならCPUの数だけ)
+
+// #define ENABLE_PIPELINE_MODE // 受信・検索・送信を別々のスレッドで行うか(ワーカーは検索の1つだけになる)
+#define MAX_WORKERS 64
+#define TX_QUEUE_LEN 256 // ワーカーごと、デバイスごとの送信キューの長さ(2の累乗)
+
+#define MAX_EPOLL_EVENTS 256 // 1回のepoll_waitで受け取るイベントの最大数(デバイスの数とは関係ない)
+
+#define ENABLE_FLOW_CACHE // 転送できたフローの判断を覚えて、次からはACL・経路表・NDテーブルを引かずに転送するか(flow_cache.h)
+
+#define ENABLE_PUNT_QUEUE // 自分宛てのパケットを転送とは別の制御プレーンのスレッドで処理するか(パイプラインモードでは使わない)
 
 /*
- * 各プロトコルについてデバッグレベルを設定できます
+ * 各プロトコルについて起動時のデバッグレベルを設定できます
+ * 実行中も'l'コマンドや環境変数CURO_LOGで変えられます
  *
  * 0 No debug
  * 1 Print debug message
+ * 2 Print frame dump (ethernet)
  */
 
-#define DEBUG_ETHERNET 1
-#define DEBUG_IPV6 1
+#define DEBUG_ETHERNET 0
+#define DEBUG_IPV6 0
 #define DEBUG_INFO 1
-#define DEBUG_ICMPV6 1
+#define DEBUG_ICMPV6 0
+#define DEBUG_TRIE 0
 
 // #define ENABLE_MYBUF_NON_COPY_MODE // パケット転送時にバッファのコピーを削減するか
 
 #define ENABLE_COMMAND    // 対話的なコマンドを有効化するか
 
+#define ENABLE_CONTROL_SOCKET // 経路更新を受け付ける制御ソケットを有効化するか
+
+#define CONTROL_SOCKET_PATH "/tmp/curo.sock" // 制御ソケットのパス
+#define ROUTE_UPDATE_QUEUE_SIZE 32768        // ワーカーごとに適用待ちの経路更新を溜めておける数(2の累乗)
+#define ROUTE_UPDATE_BATCH_SIZE 256          // 1回のポーリング周期で適用する経路更新の最大数
+#define ROUTE_UPDATE_TIME_SLICE_US 200       // 1回のポーリング周期で経路更新に使う最大の時間(マイクロ秒)
+
+#define ENABLE_SIMD_CHECKSUM // チェックサムをSSE2/AVX2で計算するか(どちらを使うかは起動時にCPUを見て選ぶ)
+
+#define ENABLE_USDT_PROBES // perfやbpftraceから接続できる静的プローブを埋め込むか(probes.h)
+
+// #define ENABLE_LATENCY_HISTOGRAM // 段階ごとの処理時間をTSCで測り、ヒストグラムにするか('h'で表示、'H'で消去)
+
+#define ENABLE_STATS_EXPORT // ワーカーごとの統計を共有メモリ(/dev/shm/curo-stats)に公開するか(tools/curo_stats.cppで読む)
+
 struct net_device;
+struct ipv6_device;
 struct in6_addr;
+struct acl_rule;
+enum class acl_action : uint8_t;
 
 void configure_ipv6_net_route(in6_addr prefix, uint32_t prefix_len, in6_addr next_hop);
 void configure_ipv6_address(net_device *dev, in6_addr address, uint32_t prefix_len);
+void configure_static_neighbor(net_device *dev, const uint8_t *mac_addr, in6_addr address);
+bool configure_acl(const acl_rule *rules, uint32_t count, acl_action default_action);
+bool configure_nptv6(net_device *external_dev, in6_addr internal_prefix, in6_addr external_prefix, uint32_t prefix_len);
+
+void install_connected_route(net_device *dev, in6_addr prefix, uint32_t prefix_len);
+void install_local_route(ipv6_device *v6dev);
 
 #endif // CURO_CONFIG_H
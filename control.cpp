@@ -0,0 +1,284 @@
+#include "control.h"
+
+#include "config.h"
+#include "ipv6.h"
+#include "log.h"
+#include "patricia_trie.h"
+#include "worker.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CONTROL_MAX_CLIENTS 4
+#define CONTROL_RECV_BUFFER_SIZE 16384
+
+/* 制御ソケットに接続しているクライアント */
+struct control_client {
+  int fd;        // -1なら未使用
+  bool paused;   // 更新キューが一杯で受信を止めているか(止めている間はepollから外す)
+  bool draining; // 相手が送信を終えたので、受信済みのメッセージを全てワーカーに渡してから閉じる
+  uint32_t len;
+  uint8_t buffer[CONTROL_RECV_BUFFER_SIZE]; // 受信途中のメッセージを保持
+};
+
+int control_listen_fd = -1;
+control_client control_clients[CONTROL_MAX_CLIENTS];
+
+/*
+ * 制御ソケットはメインスレッドで受信し、経路更新は各ワーカーのリングに積む
+ * ワーカーはパケット処理の合間に、リングから少しずつ取り出して自分の経路表に適用する
+ */
+
+/* 制御ソケットの作成 */
+int control_init(int epoll_fd) {
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    control_clients[i].fd = -1;
+  }
+
+  control_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (control_listen_fd == -1) {
+    LOG_ERROR("failed to open control socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, CONTROL_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+  unlink(CONTROL_SOCKET_PATH); // 前回の起動で残ったソケットファイルを消す
+
+  if (bind(control_listen_fd, (sockaddr *)&addr, sizeof(addr)) == -1 or listen(control_listen_fd, CONTROL_MAX_CLIENTS) == -1) {
+    LOG_ERROR("failed to bind control socket %s: %s\n", CONTROL_SOCKET_PATH, strerror(errno));
+    close(control_listen_fd);
+    control_listen_fd = -1;
+    return -1;
+  }
+
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = control_listen_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, control_listen_fd, &ev) != 0) {
+    LOG_ERROR("failed to epoll_ctl control socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  LOG_INFO("listening route updates on %s\n", CONTROL_SOCKET_PATH);
+  return 0;
+}
+
+void control_close_client(control_client *client) {
+  LOG_INFO("control client %d disconnected\n", client->fd);
+  close(client->fd); // epollからは自動的に外れる
+  client->fd = -1;
+}
+
+void control_close() {
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    if (control_clients[i].fd != -1) {
+      control_close_client(&control_clients[i]);
+    }
+  }
+  if (control_listen_fd != -1) {
+    close(control_listen_fd);
+    unlink(CONTROL_SOCKET_PATH);
+  }
+}
+
+/*
+ * クライアントの受信を止める/再開する
+ * 止めている間はepollから外す(イベントを0にしても切断のEPOLLHUPは届き続け、メインループが回り続けるため)
+ */
+void control_set_client_paused(int epoll_fd, control_client *client, bool paused) {
+  if (paused == client->paused) {
+    return;
+  }
+  if (paused) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, nullptr);
+  } else {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = client->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+  }
+  client->paused = paused;
+}
+
+void control_accept(int epoll_fd) {
+  int fd = accept4(control_listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+  if (fd == -1) {
+    return;
+  }
+
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    if (control_clients[i].fd == -1) {
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        break;
+      }
+      control_clients[i].fd = fd;
+      control_clients[i].paused = false;
+      control_clients[i].draining = false;
+      control_clients[i].len = 0;
+      LOG_INFO("control client %d connected\n", fd);
+      return;
+    }
+  }
+
+  LOG_ERROR("too many control clients\n");
+  close(fd);
+}
+
+/* 受信済みのバイト列からメッセージを取り出してワーカーのリングに積む */
+bool control_parse_client_buffer(control_client *client) {
+  uint32_t offset = 0;
+  uint32_t space = worker_control_ring_space();
+  while (client->len - offset >= sizeof(route_update_msg) and space > 0) {
+    route_update_msg *msg = (route_update_msg *)&client->buffer[offset];
+    if ((msg->type != ROUTE_UPDATE_ADD and msg->type != ROUTE_UPDATE_WITHDRAW) or msg->prefix_len > 128) {
+      LOG_ERROR("invalid route update message type=%d prefix_len=%d\n", msg->type, msg->prefix_len);
+      return false;
+    }
+    worker_msg wmsg{};
+    wmsg.type = worker_msg_type::route_update;
+    wmsg.route = *msg;
+    worker_broadcast_msg(wmsg);
+    space--;
+    offset += sizeof(route_update_msg);
+  }
+
+  // 残りのバイトを先頭に詰める
+  memmove(client->buffer, &client->buffer[offset], client->len - offset);
+  client->len -= offset;
+  return true;
+}
+
+/*
+ * 受信済みのメッセージをワーカーのリングに積み、入りきらなければ受信を止める
+ * 相手が送信を終えていて、全て積み終えたら閉じる
+ */
+void control_process_client(int epoll_fd, control_client *client) {
+  if (!control_parse_client_buffer(client)) {
+    control_close_client(client);
+    return;
+  }
+
+  if (client->draining and client->len < sizeof(route_update_msg)) {
+    if (client->len > 0) {
+      LOG_ERROR("control client %d closed in the middle of a message (%u bytes)\n", client->fd, client->len);
+    }
+    control_close_client(client);
+    return;
+  }
+
+  // リングに入りきらなかった場合は、空きができるまで受信を止める
+  if (client->draining or client->len == sizeof(client->buffer) or (client->len >= sizeof(route_update_msg) and worker_control_ring_space() == 0)) {
+    control_set_client_paused(epoll_fd, client, true);
+  }
+}
+
+void control_receive(int epoll_fd, control_client *client) {
+  if (client->len == sizeof(client->buffer)) { // 読む場所が無い(0バイトのrecvは切断と区別できない)
+    control_process_client(epoll_fd, client);
+    return;
+  }
+
+  // 1回のイベントでは1度だけ読む(残りはレベルトリガで次の周期に回す)
+  ssize_t n = recv(client->fd, &client->buffer[client->len], sizeof(client->buffer) - client->len, 0);
+  if (n == -1 and errno != EAGAIN) {
+    LOG_ERROR("control client %d: %s\n", client->fd, strerror(errno));
+    control_close_client(client);
+    return;
+  }
+  if (n == -1) {
+    return;
+  }
+  if (n == 0) { // 相手が送信を終えた(受信済みの分はワーカーに渡してから閉じる)
+    client->draining = true;
+  }
+  client->len += n;
+  control_process_client(epoll_fd, client);
+}
+
+/* 制御ソケット関連のイベントを処理し、処理したかを返す */
+bool control_handle_event(int epoll_fd, int fd) {
+  if (fd == control_listen_fd) {
+    control_accept(epoll_fd);
+    return true;
+  }
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    if (control_clients[i].fd != -1 and control_clients[i].fd == fd) {
+      control_receive(epoll_fd, &control_clients[i]);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* 経路の追加 */
+void control_route_add(const route_update_msg *msg) {
+  ipv6_route_entry *entry = (ipv6_route_entry *)calloc(1, sizeof(ipv6_route_entry));
+  entry->type = ipv6_route_type::network;
+  entry->next_hop = msg->next_hop;
+
+  // 同じプレフィックスの経路があれば置き換える
+  ipv6_route_entry *old = (ipv6_route_entry *)patricia_trie_remove(ipv6_fib, msg->prefix, msg->prefix_len);
+  if (old != nullptr and old->type != ipv6_route_type::network) { // 直接接続経路とlocal経路は上書きさせない
+    patricia_trie_insert(ipv6_fib, msg->prefix, msg->prefix_len, old);
+    free(entry);
+    return;
+  }
+  free(old);
+
+  patricia_trie_insert(ipv6_fib, msg->prefix, msg->prefix_len, entry);
+}
+
+/* 経路の削除 */
+void control_route_withdraw(const route_update_msg *msg) {
+  ipv6_route_entry *old = (ipv6_route_entry *)patricia_trie_remove(ipv6_fib, msg->prefix, msg->prefix_len);
+  if (old != nullptr and old->type != ipv6_route_type::network) {
+    patricia_trie_insert(ipv6_fib, msg->prefix, msg->prefix_len, old);
+    return;
+  }
+  free(old);
+}
+
+/* 経路更新を現在のワーカーの経路表に適用する */
+void control_apply_route_update(const route_update_msg *msg) {
+  if (msg->type == ROUTE_UPDATE_ADD) {
+    control_route_add(msg);
+  } else {
+    control_route_withdraw(msg);
+  }
+}
+
+/*
+ * ワーカーのリングに空きができていれば、止めていたクライアントの受信を再開する
+ * 送信を終えたクライアントは受信を再開せず、残りのメッセージを積み終えたところで閉じる
+ * まだ止めているクライアントが残っていればtrueを返す
+ */
+bool control_resume_clients(int epoll_fd) {
+  bool paused = false;
+  for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+    control_client *client = &control_clients[i];
+    if (client->fd == -1 or !client->paused) {
+      continue;
+    }
+    if (worker_control_ring_space() > 0) {
+      control_process_client(epoll_fd, client);
+      if (client->fd == -1) {
+        continue;
+      }
+      if (!client->draining and client->len < sizeof(client->buffer) and worker_control_ring_space() > 0) {
+        control_set_client_paused(epoll_fd, client, false);
+        continue;
+      }
+    }
+    paused = true;
+  }
+  return paused;
+}
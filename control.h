@@ -0,0 +1,26 @@
+#ifndef CURO_CONTROL_H
+#define CURO_CONTROL_H
+
+#include <arpa/inet.h>
+#include <cstdint>
+
+#define ROUTE_UPDATE_ADD 1
+#define ROUTE_UPDATE_WITHDRAW 2
+
+/* 制御ソケットから受け取る経路更新メッセージ(34バイト固定長) */
+struct route_update_msg {
+  uint8_t type;       // ROUTE_UPDATE_ADD / ROUTE_UPDATE_WITHDRAW
+  uint8_t prefix_len; // プレフィックス長(0~128)
+  in6_addr prefix;    // 宛先プレフィックス
+  in6_addr next_hop;  // ネクストホップ(追加の時のみ使用)
+} __attribute__((packed));
+
+int control_init(int epoll_fd);
+void control_close();
+
+bool control_handle_event(int epoll_fd, int fd);
+bool control_resume_clients(int epoll_fd);
+
+void control_apply_route_update(const route_update_msg *msg);
+
+#endif // CURO_CONTROL_H
@@ -1,43 +1,59 @@
 #include "ethernet.h"
 
 #include "config.h"
+#include "graph.h"
 #include "ipv6.h"
 #include "log.h"
 #include "my_buf.h"
+#include "probes.h"
 #include "utils.h"
 #include <cstring>
 
-/* イーサネットの受信処理 */
-void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len) {
-  // 送られてきた通信をイーサネットのフレームとして解釈する
-  ethernet_header *header = (ethernet_header *)buffer;
+/* イーサネットの受信処理(ethernet-inputノード) */
+void ethernet_input_node(graph_buffer **buffers, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    if (b->len < ETHERNET_HEADER_SIZE) {
+      graph_drop(b, STATS_DROP_TOO_SHORT);
+      continue;
+    }
 
-  // イーサタイプを抜き出し、ホストバイトオーダーに変換
-  uint16_t ether_type = ntohs(header->type);
+    // 送られてきた通信をイーサネットのフレームとして解釈する
+    ethernet_header *header = (ethernet_header *)b->data;
 
-  // 自分のMACアドレス宛てかブロードキャスト/マルチキャストの通信かを確認する
-  if (memcmp(header->dst_addr, dev->mac_addr, 6) != 0 and memcmp(header->dst_addr, ETHER_ADDR_BCAST, 6) != 0 and memcmp(header->dst_addr, ETHER_ADDR_IPV6_MCAST_PREFIX, 2) != 0) {
-    return;
-  }
+    // イーサタイプを抜き出し、ホストバイトオーダーに変換
+    uint16_t ether_type = ntohs(header->type);
+    CURO_PROBE5(rx_frame, b->rx_dev->name, b->len, header->dst_addr, header->src_addr, ether_type);
+
+    // 自分のMACアドレス宛てかブロードキャスト/マルチキャストの通信かを確認する
+    if (memcmp(header->dst_addr, b->rx_dev->mac_addr, 6) != 0 and memcmp(header->dst_addr, ETHER_ADDR_BCAST, 6) != 0 and memcmp(header->dst_addr, ETHER_ADDR_IPV6_MCAST_PREFIX, 2) != 0) {
+      graph_drop(b, STATS_DROP_NOT_FOR_US);
+      continue;
+    }
 
-  LOG_ETHERNET("received ethernet frame type %04x from %s to %s\n", ether_type, mac_addr_toa(header->src_addr), mac_addr_toa(header->dst_addr));
+    LOG_ETHERNET("received ethernet frame type %04x from %s to %s\n", ether_type, log_mac(header->src_addr), log_mac(header->dst_addr));
 
-  // イーサタイプの値から上位プロトコルを特定する
-  switch (ether_type) {
+    // イーサタイプの値から上位プロトコルを特定する
+    switch (ether_type) {
 
-  case ETHER_TYPE_IPV6: // イーサタイプがIPのものだったら
-    // Ethernetヘッダを外してIP処理へ
-    return ipv6_input(dev, buffer + ETHERNET_HEADER_SIZE, len - ETHERNET_HEADER_SIZE);
+    case ETHER_TYPE_IPV6: // イーサタイプがIPのものだったら
+      // Ethernetヘッダの後ろからIP処理へ
+      b->l3_offset = ETHERNET_HEADER_SIZE;
+      TRACE_STEP(b, GRAPH_NODE_ETHERNET_INPUT, TRACE_ETHER_IPV6, 0, 0, nullptr);
+      graph_enqueue(GRAPH_NODE_IPV6_INPUT, b);
+      break;
 
-  default: // 知らないイーサタイプだったら
-    LOG_ETHERNET("received unhandled ether type %04x\n", ether_type);
-    return;
+    default: // 知らないイーサタイプだったら
+      LOG_ETHERNET("received unhandled ether type %04x\n", ether_type);
+      graph_drop(b, STATS_DROP_UNKNOWN_PROTOCOL);
+      break;
+    }
   }
 }
 
 /* イーサネットにカプセル化して送信 */
 void ethernet_encapsulate_output(net_device *dev, const uint8_t *dst_addr, my_buf *payload_mybuf, uint16_t ether_type) {
-  LOG_ETHERNET("sending ethernet frame type %04x from %s to %s\n", ether_type, mac_addr_toa(dev->mac_addr), mac_addr_toa(dst_addr));
+  LOG_ETHERNET("sending ethernet frame type %04x from %s to %s\n", ether_type, log_mac(dev->mac_addr), log_mac(dst_addr));
 
   my_buf *header_mybuf = my_buf::create(ETHERNET_HEADER_SIZE); // イーサネットヘッダ長分のバッファを確保
   ethernet_header *header = (ethernet_header *)header_mybuf->buffer;
@@ -50,15 +66,13 @@ void ethernet_encapsulate_output(net_device *dev, const uint8_t *dst_addr, my_bu
 
   payload_mybuf->add_header(header_mybuf); // 上位プロトコルから受け取ったバッファにヘッダをつける
 
-#ifdef DEBUG_ETHERNET
-#if DEBUG_ETHERNET > 1
-  printf("[ETHER] sending buffer: ");
-  for (int i = 0; i < header_mybuf->len; ++i) {
-    printf("%02x", header_mybuf->buffer[i]);
+  if (log_enabled(LOG_CATEGORY_ETHERNET, 2)) {
+    char header_str[ETHERNET_HEADER_SIZE * 2 + 1];
+    for (uint32_t i = 0; i < header_mybuf->len; ++i) {
+      sprintf(&header_str[i * 2], "%02x", header_mybuf->buffer[i]);
+    }
+    LOG_AT(LOG_CATEGORY_ETHERNET, 2, "sending buffer: %s\n", header_str);
   }
-  printf("\n");
-#endif
-#endif
 
   uint8_t send_buffer[1550];
   // 全長を計算しながらメモリにバッファを展開する
@@ -67,6 +81,7 @@ void ethernet_encapsulate_output(net_device *dev, const uint8_t *dst_addr, my_bu
   while (current != nullptr) {
     if (total_len + current->len > sizeof(send_buffer)) { // Overflowする場合
       LOG_ETHERNET("frame is too big!\n");
+      stats_count_drop(STATS_DROP_FRAME_TOO_BIG);
       return;
     }
 
@@ -21,7 +21,9 @@ struct ethernet_header {
   uint16_t type;       // イーサタイプ
 } __attribute__((packed));
 
-void ethernet_input(net_device *dev, uint8_t *buffer, ssize_t len);
+struct graph_buffer;
+
+void ethernet_input_node(graph_buffer **buffers, uint32_t count);
 
 struct my_buf;
 
@@ -0,0 +1,325 @@
+#include "flow_cache.h"
+
+#include "log.h"
+#include "nd.h"
+#include "net.h"
+#include "punt.h"
+#include "timer.h"
+#include "utils.h"
+#include "worker.h"
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+thread_local flow_table *flow_local = nullptr;
+thread_local uint32_t flow_generation = 0;
+thread_local timer_entry flow_aging_timer;
+
+/* キーのハッシュ値(ワーカーごとのシードを混ぜて、衝突を狙われにくくする) */
+inline uint64_t flow_hash(const flow_table *table, const acl_key &key) { return fmix64(acl_key_hash(key) ^ table->seed); }
+
+/* ハッシュ値の上位16ビットをタグにする(0は空きを表すので使わない) */
+inline uint16_t flow_tag(uint64_t hash) {
+  uint16_t tag = hash >> 48;
+  return tag != 0 ? tag : 1;
+}
+
+/* もう1つのバケット(タグだけから求まるので、エントリを移す時にキーを読み直さなくてよい) */
+inline uint32_t flow_alt_bucket(const flow_table *table, uint32_t bucket, uint16_t tag) { return (bucket ^ (tag * 0x5bd1e995u)) & table->bucket_mask; }
+
+/* バケットのうちタグが合うスロットのマスク(スロットごとに2ビット) */
+inline uint32_t flow_tag_match(const flow_table *table, uint32_t bucket, uint16_t tag) {
+#ifdef __SSE2__
+  __m128i tags = _mm_load_si128((const __m128i *)table->tags[bucket]);
+  return _mm_movemask_epi8(_mm_cmpeq_epi16(tags, _mm_set1_epi16(tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < FLOW_CACHE_BUCKET_SLOTS; i++) {
+    mask |= (table->tags[bucket][i] == tag ? 3u : 0u) << (i * 2);
+  }
+  return mask;
+#endif
+}
+
+/* マスクの最初のスロットを取り出す */
+inline int flow_next_slot(uint32_t *mask) {
+  int slot = __builtin_ctz(*mask) >> 1;
+  *mask &= ~(3u << (slot * 2));
+  return slot;
+}
+
+/* 段ごとに見る宛先の先頭のビット数 */
+const uint32_t flow_prefix_level_bits[FLOW_CACHE_PREFIX_LEVELS] = {32, 48, 64};
+
+/* 宛先(またはプレフィックス)の先頭bitsビットで引く版の位置 */
+inline uint32_t flow_prefix_slot(const in6_addr &addr, int level) {
+  uint64_t head = 0;
+  memcpy(&head, addr.s6_addr, flow_prefix_level_bits[level] / 8);
+  return ((head + level) * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctz(FLOW_CACHE_PREFIX_VERSIONS)); // 乗算の上位ビット(パケットごとに3回引くので軽くする)
+}
+
+/* 宛先について、今の全体の世代と各段の経路の版の和(どれかが進むと変わる) */
+inline uint32_t flow_current_generation(const flow_table *table, const in6_addr &dst) {
+  uint32_t generation = flow_generation;
+  for (int level = 0; level < FLOW_CACHE_PREFIX_LEVELS; level++) {
+    generation += table->prefix_versions[level][flow_prefix_slot(dst, level)];
+  }
+  return generation;
+}
+
+/*
+ * 経路が追加/削除されたプレフィックスに含まれる宛先のフローを無効にする
+ * プレフィックス長以下で最も長い段の版を進める(/32より短ければ全体の世代を進める)
+ */
+void flow_cache_invalidate_prefix(const in6_addr &prefix, uint32_t prefix_len) {
+  flow_table *table = flow_local;
+  int level = FLOW_CACHE_PREFIX_LEVELS - 1;
+  while (level >= 0 and prefix_len < flow_prefix_level_bits[level]) {
+    level--;
+  }
+  if (table == nullptr or level < 0) {
+    flow_cache_invalidate();
+    return;
+  }
+  table->prefix_versions[level][flow_prefix_slot(prefix, level)]++;
+}
+
+inline flow_entry *flow_entry_at(flow_table *table, uint32_t bucket, int slot) { return &table->entries[bucket * FLOW_CACHE_BUCKET_SLOTS + slot]; }
+
+/* 覚えた近隣がまだ同じスロットにいるか */
+inline bool flow_adj_valid(const flow_entry *entry) { return in6_addr_equals(entry->adj->v6_addr, entry->adj_addr); }
+
+/*
+ * 近隣のエントリが挿入や削除で動いていれば、アドレスでNDテーブルだけを引き直す
+ * 経路の判断は世代で確かめてあるので、同じアドレスの近隣ならそのまま使える(消えていればfalse)
+ */
+inline bool flow_adj_refresh(flow_entry *entry) {
+  if (flow_adj_valid(entry)) {
+    return true;
+  }
+  nd_table_entry *adj = search_nd_table_entry(entry->adj_addr);
+  if (adj == nullptr) {
+    return false;
+  }
+  entry->adj = adj;
+  return true;
+}
+
+/* キーのエントリを探す(無ければnullptr) */
+flow_entry *flow_find(flow_table *table, const acl_key &key, uint64_t hash) {
+  uint16_t tag = flow_tag(hash);
+  uint32_t bucket = hash & table->bucket_mask;
+  for (int i = 0; i < 2; i++) {
+    uint32_t mask = flow_tag_match(table, bucket, tag);
+    while (mask != 0) {
+      flow_entry *entry = flow_entry_at(table, bucket, flow_next_slot(&mask));
+      if (acl_key_equals(entry->key, key)) {
+        return entry;
+      }
+    }
+    bucket = flow_alt_bucket(table, bucket, tag);
+  }
+  return nullptr;
+}
+
+/* バケットの空きスロットに入れる(空きが無ければfalse) */
+bool flow_place(flow_table *table, uint32_t bucket, uint16_t tag, const flow_entry &entry) {
+  uint32_t mask = flow_tag_match(table, bucket, 0);
+  if (mask == 0) {
+    return false;
+  }
+  int slot = flow_next_slot(&mask);
+  table->tags[bucket][slot] = tag;
+  *flow_entry_at(table, bucket, slot) = entry;
+  return true;
+}
+
+/*
+ * 転送できたパケットのフローを覚える(ipv6-lookupノードで近隣を解決済みの時に呼ぶ)
+ * 2つのバケットがどちらも埋まっていれば、エントリをもう1つのバケットへ順に移して場所を空け、
+ * FLOW_CACHE_MAX_KICKS回で空かなければ最後に押し出されたエントリを捨てる
+ */
+void flow_cache_insert(graph_buffer *buffer, nd_table_entry *adj) {
+  flow_table *table = flow_local;
+  const ipv6_header *packet = (const ipv6_header *)(buffer->data + buffer->l3_offset);
+  uint32_t len = buffer->len - buffer->l3_offset;
+
+  flow_entry entry{};
+  if (!acl_extract_key(packet, len, &entry.key)) {
+    return;
+  }
+  uint64_t hash = flow_hash(table, entry.key);
+
+  uint32_t generation = flow_current_generation(table, entry.key.dst);
+  flow_entry *existing = flow_find(table, entry.key, hash);
+  if (existing != nullptr) { // 古い世代のエントリを引き直した(カウンタは引き継ぐ)
+    existing->adj = adj;
+    existing->adj_addr = adj->v6_addr;
+    existing->generation = generation;
+    existing->packets++;
+    existing->bytes += len;
+    existing->last_used = table->epoch;
+    return;
+  }
+
+  entry.adj = adj;
+  entry.adj_addr = adj->v6_addr;
+  entry.packets = 1;
+  entry.bytes = len;
+  entry.generation = generation;
+  entry.last_used = table->epoch;
+  local_stats->flow[STATS_FLOW_INSERTED]++;
+
+  uint16_t tag = flow_tag(hash);
+  uint32_t bucket = hash & table->bucket_mask;
+  if (flow_place(table, bucket, tag, entry) or flow_place(table, flow_alt_bucket(table, bucket, tag), tag, entry)) {
+    table->count++;
+    return;
+  }
+
+  for (int kick = 0; kick < FLOW_CACHE_MAX_KICKS; kick++) {
+    int slot = table->kick_cursor++ % FLOW_CACHE_BUCKET_SLOTS;
+    flow_entry *victim = flow_entry_at(table, bucket, slot);
+    uint16_t victim_tag = table->tags[bucket][slot];
+    flow_entry displaced = *victim;
+    *victim = entry;
+    table->tags[bucket][slot] = tag;
+
+    entry = displaced;
+    tag = victim_tag;
+    bucket = flow_alt_bucket(table, bucket, tag);
+    if (flow_place(table, bucket, tag, entry)) {
+      table->count++;
+      return;
+    }
+  }
+  local_stats->flow[STATS_FLOW_EVICTED]++; // 新しいエントリの代わりに押し出されたものが消える
+}
+
+/*
+ * 覚えているフローならACL、経路、NDを飛ばしてipv6-rewriteノードへ渡す(flow-cacheノード)
+ * Hop LimitとMTUの確認と、近隣の状態の更新(nd_entry_use)はパケットごとに行い、
+ * ICMPv6エラーを返すものや近隣が解決中のものはいつもの経路の検索に回す
+ */
+void flow_cache_node(graph_buffer **buffers, uint32_t count) {
+  flow_table *table = flow_local;
+  acl_key keys[GRAPH_VECTOR_SIZE];
+  uint64_t hashes[GRAPH_VECTOR_SIZE];
+  bool parsed[GRAPH_VECTOR_SIZE];
+
+  // 先にベクタ全体のハッシュ値を求めて、タグのバケットを読み込んでおく
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    parsed[i] = acl_extract_key((const ipv6_header *)(b->data + b->l3_offset), b->len - b->l3_offset, &keys[i]);
+    hashes[i] = flow_hash(table, keys[i]);
+    __builtin_prefetch(table->tags[hashes[i] & table->bucket_mask]);
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+    uint32_t len = b->len - b->l3_offset;
+
+    flow_entry *entry = parsed[i] ? flow_find(table, keys[i], hashes[i]) : nullptr; // たどれないものは覚えていない
+    if (entry == nullptr) {
+      local_stats->flow[STATS_FLOW_MISS]++;
+      graph_enqueue(acl_input_next_node(), b);
+      continue;
+    }
+    if (entry->generation != flow_current_generation(table, keys[i].dst) or !flow_adj_refresh(entry)) {
+      local_stats->flow[STATS_FLOW_STALE]++;
+      graph_enqueue(acl_input_next_node(), b);
+      continue;
+    }
+    net_device *output_dev = entry->adj->dev;
+    if (packet->hop_limit <= 1 or (output_dev->mtu != 0 and len > output_dev->mtu) or !nd_entry_use(entry->adj)) {
+      local_stats->flow[STATS_FLOW_MISS]++;
+      graph_enqueue(acl_input_next_node(), b);
+      continue;
+    }
+
+    local_stats->flow[STATS_FLOW_HIT]++;
+    entry->packets++;
+    entry->bytes += len;
+    entry->last_used = table->epoch;
+    memcpy(b->dst_mac, entry->adj->mac_addr, 6);
+    b->tx_dev = output_dev;
+    TRACE_STEP(b, GRAPH_NODE_FLOW_CACHE, TRACE_FLOW_HIT, 0, output_dev->index, nullptr);
+    graph_enqueue(GRAPH_NODE_IPV6_REWRITE, b);
+  }
+}
+
+/* 表の一部を見て、古い世代のまま使われていないエントリと、一定時間使われていないエントリを消す */
+void flow_aging_timer_callback(timer_entry *timer) {
+  flow_table *table = flow_local;
+  table->epoch++;
+  uint32_t idle_epochs = FLOW_CACHE_IDLE_TIMEOUT_SEC * 1000 / FLOW_CACHE_AGING_INTERVAL_MS;
+  uint32_t buckets = (table->bucket_mask + 1) / FLOW_CACHE_AGING_SLICES;
+  for (uint32_t n = 0; n < buckets; n++) {
+    uint32_t bucket = table->aging_hand;
+    table->aging_hand = (table->aging_hand + 1) & table->bucket_mask;
+    for (int slot = 0; slot < FLOW_CACHE_BUCKET_SLOTS; slot++) {
+      if (table->tags[bucket][slot] == 0) {
+        continue;
+      }
+      flow_entry *entry = flow_entry_at(table, bucket, slot);
+      if (entry->generation != flow_current_generation(table, entry->key.dst) or table->epoch - entry->last_used > idle_epochs) {
+        table->tags[bucket][slot] = 0;
+        table->count--;
+        local_stats->flow[STATS_FLOW_AGED]++;
+      }
+    }
+  }
+  timer_add(timer, FLOW_CACHE_AGING_INTERVAL_MS);
+}
+
+/* 現在のワーカーのフローの表を用意する(転送しない制御プレーンのスレッドには作らない) */
+void flow_cache_init_worker() {
+  flow_local = nullptr;
+#ifdef ENABLE_FLOW_CACHE
+  if (punt_worker != nullptr and current_worker == punt_worker) {
+    return;
+  }
+  flow_table *table = new flow_table();
+  uint32_t bucket_count = FLOW_CACHE_ENTRIES / FLOW_CACHE_BUCKET_SLOTS;
+  table->tags = (uint16_t(*)[FLOW_CACHE_BUCKET_SLOTS])aligned_alloc(CACHE_LINE_SIZE, sizeof(uint16_t) * FLOW_CACHE_ENTRIES);
+  memset(table->tags, 0, sizeof(uint16_t) * FLOW_CACHE_ENTRIES);
+  table->entries = (flow_entry *)aligned_alloc(CACHE_LINE_SIZE, sizeof(flow_entry) * FLOW_CACHE_ENTRIES);
+  table->bucket_mask = bucket_count - 1;
+  std::random_device rd;
+  table->seed = ((uint64_t)rd() << 32) | rd();
+  flow_local = table;
+
+  flow_aging_timer.callback = flow_aging_timer_callback;
+  timer_add(&flow_aging_timer, FLOW_CACHE_AGING_INTERVAL_MS);
+#endif
+}
+
+/* 現在のワーカーのフローを表示する(コマンドの出力なのでログのレベルに関係なく出す) */
+void dump_flow_cache() {
+  flow_table *table = flow_local;
+  if (table == nullptr) {
+    printf("no flow cache\n");
+    return;
+  }
+  printf("flow cache %u / %u entries, generation %u\n", table->count, FLOW_CACHE_ENTRIES, flow_generation);
+  uint32_t shown = 0;
+  for (uint32_t bucket = 0; bucket <= table->bucket_mask and shown < FLOW_CACHE_DUMP_LIMIT; bucket++) {
+    for (int slot = 0; slot < FLOW_CACHE_BUCKET_SLOTS and shown < FLOW_CACHE_DUMP_LIMIT; slot++) {
+      if (table->tags[bucket][slot] == 0) {
+        continue;
+      }
+      const flow_entry *entry = flow_entry_at(table, bucket, slot);
+      char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+      inet_ntop(AF_INET6, &entry->key.src, src, sizeof(src));
+      inet_ntop(AF_INET6, &entry->key.dst, dst, sizeof(dst));
+      bool current = entry->generation == flow_current_generation(table, entry->key.dst) and flow_adj_valid(entry);
+      printf("%s.%u -> %s.%u proto %u packets %lu bytes %lu via %s%s\n", src, entry->key.src_port, dst, entry->key.dst_port, entry->key.protocol, entry->packets,
+             entry->bytes, current ? entry->adj->dev->name : "?", current ? "" : " (stale)");
+      shown++;
+    }
+  }
+  if (table->count > shown) {
+    printf("... %u more\n", table->count - shown);
+  }
+}
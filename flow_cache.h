@@ -0,0 +1,79 @@
+#ifndef CURO_FLOW_CACHE_H
+#define CURO_FLOW_CACHE_H
+
+#include "acl.h"
+#include "config.h"
+#include "graph.h"
+#include <cstdint>
+
+/*
+ * フローキャッシュ(ENABLE_FLOW_CACHE)
+ * 転送できたパケットの5タプル(ACLが見るトラフィッククラスとフローラベルも含める)をキーに、
+ * 出力先の近隣のエントリとフローごとのパケット数/バイト数を覚えておき、
+ * 同じフローの次からのパケットはACL、経路表、NDテーブルを引かずにipv6-rewriteノードへ渡す
+ *
+ * 表はバケットごとに8つのスロットを持つcuckooハッシュで、キーごとに2つのバケットのどちらかに入る
+ * バケットの16ビットのタグ8つをSSE2で1度に比べ、タグが合ったスロットだけキー全体を比べる
+ * 大きさは起動時に決めて増やさず、置き場所が無ければ追い出し、一定時間使われないエントリはタイマーで消す
+ *
+ * 経路表とNDテーブルはワーカーごとに持ち、PACKET_FANOUTで同じフローは同じワーカーに届くので、表もワーカーごとに持つ
+ * ACLなどの設定が届いた時とNDテーブルを拡張した時は全体の世代を進め、古い世代のエントリは使わずに引き直す
+ * NDテーブルのエントリは挿入や削除でも動くが、スキャンのたびに全て引き直さないよう、当たった時に近隣のアドレスを比べる
+ * 経路の追加/削除では、変わったプレフィックスに含まれる宛先のフローだけを引き直させる
+ * (プレフィックスの先頭の/32、/48、/64をハッシュした版を段ごとに持ち、経路の長さで決まる段の版を進める
+ *  エントリには全体の世代と宛先の各段の版の和を覚えておき、当たった時に比べる)
+ */
+
+#define FLOW_CACHE_BUCKET_SLOTS 8         // バケットあたりのスロット数(タグを16バイトで比べる)
+#define FLOW_CACHE_ENTRIES 65536          // ワーカーごとのスロット数(2の累乗、1つ96バイト)
+#define FLOW_CACHE_MAX_KICKS 32           // 挿入時にエントリを追い出して移す最大の回数
+#define FLOW_CACHE_AGING_INTERVAL_MS 1000 // 古いエントリを探す間隔
+#define FLOW_CACHE_AGING_SLICES 8         // 1回で表のこの割合(1/n)のバケットを見る
+#define FLOW_CACHE_IDLE_TIMEOUT_SEC 30    // この時間使われなかったエントリを消す
+#define FLOW_CACHE_DUMP_LIMIT 20          // 'f'で表示するフローの数
+#define FLOW_CACHE_PREFIX_LEVELS 3        // 経路の版を持つ段(/32、/48、/64)
+#define FLOW_CACHE_PREFIX_VERSIONS 1024   // 段ごとの版の数(2の累乗)
+
+struct nd_table_entry;
+
+/* フローのエントリ */
+struct flow_entry {
+  acl_key key;
+  nd_table_entry *adj; // 出力先の近隣(世代が同じ間だけ有効)
+  in6_addr adj_addr;   // adjにいるはずの近隣のアドレス(NDテーブルのエントリは挿入や削除で動くので、使う前に確かめる)
+  uint64_t packets;
+  uint64_t bytes;
+  uint32_t generation; // 入れた時の全体の世代と宛先を含む経路の版の和
+  uint32_t last_used;  // 最後に使ったエージングの周期
+};
+
+/* ワーカーごとのフローの表 */
+struct flow_table {
+  uint16_t (*tags)[FLOW_CACHE_BUCKET_SLOTS]; // 0なら空き
+  flow_entry *entries;                       // [バケット * FLOW_CACHE_BUCKET_SLOTS + スロット]
+  uint32_t bucket_mask;
+  uint32_t count;
+  uint64_t seed;
+  uint32_t epoch;       // エージングの周期ごとに進める時計
+  uint32_t aging_hand;  // 次に見るバケット
+  uint32_t kick_cursor; // 追い出すスロットを選ぶ位置
+  uint32_t prefix_versions[FLOW_CACHE_PREFIX_LEVELS][FLOW_CACHE_PREFIX_VERSIONS]; // 段ごとの経路の版
+};
+
+extern thread_local flow_table *flow_local;     // 使わなければnullptr
+extern thread_local uint32_t flow_generation; // ACLやNDテーブルなどが変わるたびに進める
+
+/* 覚えている転送の判断を全て無効にする(エントリは次に使う時か、エージングで消える) */
+inline void flow_cache_invalidate() { flow_generation++; }
+
+void flow_cache_invalidate_prefix(const in6_addr &prefix, uint32_t prefix_len);
+
+/* ユニキャストのパケットを渡すノード(フローキャッシュを使わなければACLか経路の検索へ) */
+inline graph_node_index flow_cache_input_node() { return flow_local != nullptr ? GRAPH_NODE_FLOW_CACHE : acl_input_next_node(); }
+
+void flow_cache_init_worker();
+void flow_cache_node(graph_buffer **buffers, uint32_t count);
+void flow_cache_insert(graph_buffer *buffer, nd_table_entry *adj);
+void dump_flow_cache();
+
+#endif // CURO_FLOW_CACHE_H
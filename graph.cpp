@@ -0,0 +1,88 @@
+#include "graph.h"
+
+#include "acl.h"
+#include "ethernet.h"
+#include "flow_cache.h"
+#include "icmpv6.h"
+#include "ipv6.h"
+#include "latency.h"
+#include "log.h"
+#include "punt.h"
+
+thread_local graph_runtime *graph = nullptr;
+
+/* グラフのノード */
+struct graph_node {
+  const char *name;
+  void (*process)(graph_buffer **buffers, uint32_t count);
+};
+
+void drop_node(graph_buffer **, uint32_t) {
+  // 受信用のバッファは使い回すので、数えるだけでよい
+}
+
+const graph_node graph_nodes[GRAPH_NODE_COUNT] = {
+    {"ethernet-input", ethernet_input_node},
+    {"ipv6-input", ipv6_input_node},
+    {"flow-cache", flow_cache_node},
+    {"ipv6-acl", ipv6_acl_node},
+    {"ipv6-lookup", ipv6_lookup_node},
+    {"ipv6-rewrite", ipv6_rewrite_node},
+    {"punt", punt_node},
+    {"icmpv6-local", icmpv6_local_node},
+    {"interface-output", interface_output_node},
+    {"drop", drop_node},
+};
+
+/* 現在のスレッドのグラフを用意する */
+void graph_init() { graph = new graph_runtime(); }
+
+/* 処理待ちのパケットがあるノードを順に実行する */
+void graph_dispatch() {
+  for (int i = 0; i < GRAPH_NODE_COUNT; i++) {
+    uint32_t count = graph->pending_count[i];
+    if (count == 0) {
+      continue;
+    }
+    graph->pending_count[i] = 0;
+    graph->current_node = (graph_node_index)i;
+
+    uint64_t start = graph_cycles();
+    graph_nodes[i].process(graph->pending[i], count);
+    uint64_t cycles = graph_cycles() - start;
+    graph_node_stats *stats = &graph->stats[i];
+    stats->cycles += cycles;
+#ifdef ENABLE_LATENCY_HISTOGRAM
+    // 入力のノードはベクタ単位で測り、1パケットあたりにならして記録する
+    if (i == GRAPH_NODE_ETHERNET_INPUT) {
+      latency_record(LATENCY_STAGE_ETHERNET_INPUT, cycles / count);
+    } else if (i == GRAPH_NODE_IPV6_INPUT) {
+      latency_record(LATENCY_STAGE_IPV6_INPUT, cycles / count);
+    }
+#endif
+    stats->calls++;
+    stats->vectors += count;
+  }
+}
+
+/* 書き換えたフレームをデバイスから送信する */
+void interface_output_node(graph_buffer **buffers, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    int result = b->tx_dev->ops.transmit(b->tx_dev, b->data, b->len);
+    TRACE_STEP(b, GRAPH_NODE_INTERFACE_OUTPUT, result == 0 ? TRACE_TX_QUEUED : TRACE_TX_DROPPED, 0, b->tx_dev->index, nullptr);
+  }
+}
+
+const char *graph_node_name(graph_node_index index) { return index < GRAPH_NODE_COUNT ? graph_nodes[index].name : "?"; }
+
+/* ノードごとのカウンタを表示する */
+void dump_graph_stats() {
+  printf("|------------NODE-----------|----CALLS---|---VECTORS--|-VEC/CALL-|--CLOCKS/PKT--|\n");
+  for (int i = 0; i < GRAPH_NODE_COUNT; i++) {
+    graph_node_stats *stats = &graph->stats[i];
+    printf("| %25s | %10lu | %10lu | %8.2f | %12.1f |\n", graph_nodes[i].name, stats->calls, stats->vectors, stats->calls > 0 ? (double)stats->vectors / stats->calls : 0.0,
+           stats->vectors > 0 ? (double)stats->cycles / stats->vectors : 0.0);
+  }
+  printf("|---------------------------|------------|------------|----------|--------------|\n");
+}
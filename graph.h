@@ -0,0 +1,96 @@
+#ifndef CURO_GRAPH_H
+#define CURO_GRAPH_H
+
+#include "net.h"
+#include "stats.h"
+#include "trace.h"
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define GRAPH_VECTOR_SIZE 256 // 1度にノードで処理するパケットの最大数
+#define GRAPH_FRAME_SIZE 1600 // 受信に使うフレームのバッファの大きさ
+
+struct ipv6_device;
+
+/*
+ * 受信処理はノードのグラフとして組み立て、各ノードはパケットのベクタをまとめて処理してから次のノードへ渡す
+ * 同じ処理を続けて行うので、命令キャッシュや分岐予測が1パケットごとに入れ替わらずに済む
+ * ノードは処理する順に並べてあり、後ろのノードにしかパケットを渡さない
+ */
+enum graph_node_index : uint8_t {
+  GRAPH_NODE_ETHERNET_INPUT,
+  GRAPH_NODE_IPV6_INPUT,
+  GRAPH_NODE_FLOW_CACHE,
+  GRAPH_NODE_IPV6_ACL,
+  GRAPH_NODE_IPV6_LOOKUP,
+  GRAPH_NODE_IPV6_REWRITE,
+  GRAPH_NODE_PUNT,
+  GRAPH_NODE_ICMPV6_LOCAL,
+  GRAPH_NODE_INTERFACE_OUTPUT,
+  GRAPH_NODE_DROP,
+  GRAPH_NODE_COUNT
+};
+
+/* グラフを流れるパケット */
+struct graph_buffer {
+  uint8_t *data;       // フレームの先頭
+  uint32_t len;        // フレームの長さ
+  uint16_t l3_offset;  // IPv6ヘッダの位置
+  net_device *rx_dev;  // 受信したデバイス
+  net_device *tx_dev;  // 送信するデバイス(自分宛てならアドレスを持つデバイス)
+  uint8_t dst_mac[6];  // 書き換える宛先のMACアドレス(NDテーブルのエントリは同じベクタの他のパケットの解決で動くので、値で持つ)
+  ipv6_device *local;  // 自分宛てなら宛先のアドレス
+  trace_record *trace; // トレースしていなければnullptr
+};
+
+/* ノードごとのカウンタ */
+struct graph_node_stats {
+  uint64_t calls;   // 呼び出された回数
+  uint64_t vectors; // 処理したパケットの数
+  uint64_t cycles;  // 使ったサイクル数
+};
+
+/* ワーカーごとのグラフの実行時の状態 */
+struct graph_runtime {
+  graph_buffer *pending[GRAPH_NODE_COUNT][GRAPH_VECTOR_SIZE]; // ノードごとの処理待ちのベクタ
+  uint32_t pending_count[GRAPH_NODE_COUNT];
+  graph_node_stats stats[GRAPH_NODE_COUNT];
+  graph_node_index current_node; // 実行中のノード
+  graph_buffer buffers[GRAPH_VECTOR_SIZE];
+  uint8_t frames[GRAPH_VECTOR_SIZE][GRAPH_FRAME_SIZE]; // 受信用のフレームのバッファ
+};
+
+extern thread_local graph_runtime *graph;
+
+/* パケットを次のノードの処理待ちに入れる */
+inline void graph_enqueue(graph_node_index next, graph_buffer *buffer) { graph->pending[next][graph->pending_count[next]++] = buffer; }
+
+/* 捨てる理由を数えてdropノードに渡す */
+inline void graph_drop(graph_buffer *buffer, stats_drop_reason reason) {
+  stats_count_drop(reason);
+  TRACE_STEP(buffer, graph->current_node, TRACE_DROP, reason, 0, nullptr);
+  graph_enqueue(GRAPH_NODE_DROP, buffer);
+}
+
+inline uint64_t graph_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void graph_init();
+void graph_dispatch();
+
+void interface_output_node(graph_buffer **buffers, uint32_t count);
+
+const char *graph_node_name(graph_node_index index);
+
+void dump_graph_stats();
+
+#endif // CURO_GRAPH_H
@@ -1,37 +1,96 @@
 #include "icmpv6.h"
 
+#include "checksum.h"
 #include "config.h"
+#include "ethernet.h"
+#include "graph.h"
 #include "ipv6.h"
 #include "log.h"
 #include "my_buf.h"
 #include "nd.h"
 #include "net.h"
+#include "stats.h"
 #include "utils.h"
+#include "worker.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
+#include <random>
+
+/* 送信元の/64ごとのICMPv6エラーのバケット(bucket.rateが0なら空き) */
+struct icmpv6_error_source {
+  uint64_t prefix;
+  token_bucket bucket;
+};
+
+thread_local token_bucket icmpv6_error_bucket;          // ワーカー全体のエラーの送信レート
+thread_local icmpv6_error_source *icmpv6_error_sources; // ICMPV6_ERROR_SOURCE_SLOTS個
+thread_local uint64_t icmpv6_error_seed;                // 表の位置を送信元から予想できないようにする
+
+/*
+ * NS/NAのオプションを辿り、typeのリンク層アドレスオプションを探す(無ければmac_addrはnullptr)
+ * 長さが0のオプションやはみ出したオプションがあれば、RFC 4861 7.1のとおりパケットごと無効としてfalseを返す
+ */
+bool icmpv6_nd_link_layer_option(void *buffer, size_t len, uint8_t type, uint8_t **mac_addr) {
+  *mac_addr = nullptr;
+  uint8_t *option = (uint8_t *)buffer + offsetof(icmpv6_na, opt_type);
+  uint8_t *end = (uint8_t *)buffer + len;
+  while (option < end) {
+    if (end - option < 2 or option[1] == 0 or end - option < option[1] * 8) {
+      return false;
+    }
+    if (option[0] == type and *mac_addr == nullptr) { // 長さの単位は8バイトなので、MACアドレスは必ず入る
+      *mac_addr = option + 2;
+    }
+    option += option[1] * 8;
+  }
+  return true;
+}
 
 /* ICMPv6パケットの受信処理 */
 void icmpv6_input(ipv6_device *v6dev, in6_addr source, in6_addr dstination, void *buffer, size_t len) {
   icmpv6_hdr *icmp_pkt = (icmpv6_hdr *)buffer;
   LOG_ICMPV6("received icmpv6 code=%d, type=%d\n", icmp_pkt->code, icmp_pkt->type);
+  local_stats->icmpv6_rx[icmp_pkt->type]++;
 
   switch (icmp_pkt->type) {
   case ICMPV6_TYPE_NEIGHBOR_SOLICIATION: {
-    if (len < sizeof(icmpv6_na)) {
+    if (len < offsetof(icmpv6_na, opt_type)) {
       LOG_ICMPV6("received neighbor solicitation packet too short\n");
       return;
     }
 
     icmpv6_na *ns_pkt = (icmpv6_na *)buffer;
-    char target_addr_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &ns_pkt->target_addr, target_addr_str, INET6_ADDRSTRLEN);
-
-    LOG_ICMPV6("received neighbor solicitation (target:%s)\n", target_addr_str);
-
-    if (memcmp(&ns_pkt->target_addr, &v6dev->address, 16) == 0) {
-      LOG_ICMPV6("ns target match! %s\n", target_addr_str);
-      LOG_ICMPV6("option mac address! %s\n", mac_addr_toa(ns_pkt->opt_mac_addr));
-
-      update_nd_table_entry(v6dev->net_dev, ns_pkt->opt_mac_addr, source);
+    uint8_t *source_mac_addr;
+    if (!icmpv6_nd_link_layer_option(buffer, len, ICMPV6_OPTION_SOURCE_LINK_LAYER_ADDRESS, &source_mac_addr)) {
+      LOG_ICMPV6("received neighbor solicitation with invalid option\n");
+      return;
+    }
+    LOG_ICMPV6("received neighbor solicitation (target:%s)\n", ns_pkt->target_addr);
+
+    // 受信したデバイスに設定されたアドレスのどれかがターゲットか
+    ipv6_device *target_dev = ipv6_device_get_address(v6dev->net_dev, ns_pkt->target_addr);
+    if (target_dev != nullptr) {
+      LOG_ICMPV6("ns target match! %s\n", ns_pkt->target_addr);
+
+      // Source Link-Layer Addressオプションが無ければ近隣のエントリを作りも更新もしない(RFC 4861 7.2.3)
+      // その時のNAは、既に解決している近隣にだけ返す
+      uint8_t reply_mac_addr[6];
+      if (source_mac_addr != nullptr) {
+        memcpy(reply_mac_addr, source_mac_addr, 6);
+        LOG_ICMPV6("option mac address! %s\n", log_mac(source_mac_addr));
+        if (!IN6_IS_ADDR_UNSPECIFIED(&source)) {
+          nd_receive_solicitation(v6dev->net_dev, source_mac_addr, source);
+        }
+      } else {
+        nd_table_entry *entry = search_nd_table_entry(source);
+        if (entry == nullptr or !nd_entry_use(entry)) {
+          LOG_ICMPV6("no source link-layer address option and %s is not resolved\n", source);
+          return;
+        }
+        memcpy(reply_mac_addr, entry->mac_addr, 6);
+      }
 
       my_buf *icmpv6_mybuf = my_buf::create(sizeof(icmpv6_na));
       icmpv6_na *napkt = (icmpv6_na *)icmpv6_mybuf->buffer;
@@ -46,93 +105,206 @@ void icmpv6_input(ipv6_device *v6dev, in6_addr source, in6_addr dstination, void
       napkt->opt_length = 1;
       memcpy(&napkt->opt_mac_addr, v6dev->net_dev->mac_addr, 6);
 
-      ipv6_pseudo_header phdr;
-      phdr.src_addr = v6dev->address;
-      phdr.dst_addr = source;
-      phdr.packet_length = htonl(sizeof(icmpv6_na));
-      phdr.zero1 = 0;
-      phdr.zero2 = 0;
-      phdr.next_header = IPV6_PROTOCOL_NUM_ICMP;
-
-      uint16_t psum = ~checksum_16((uint16_t *)&phdr, sizeof(ipv6_pseudo_header), 0);
-
-      napkt->hdr.checksum = checksum_16((uint16_t *)napkt, sizeof(icmpv6_na), psum);
+      uint16_t psum = checksum_pseudo_header(target_dev->address, source, sizeof(icmpv6_na), IPV6_PROTOCOL_NUM_ICMP);
+      napkt->hdr.checksum = checksum_finish(checksum_partial(napkt, sizeof(icmpv6_na), psum));
 
-      ipv6_encap_dev_output(v6dev->net_dev, &ns_pkt->opt_mac_addr[0], source, icmpv6_mybuf, IPV6_PROTOCOL_NUM_ICMP);
+      local_stats->icmpv6_tx[ICMPV6_TYPE_NEIGHBOR_ADVERTISEMENT]++;
+      ipv6_encap_dev_output(v6dev->net_dev, reply_mac_addr, source, target_dev->address, icmpv6_mybuf, IPV6_PROTOCOL_NUM_ICMP);
     }
   } break;
 
   case ICMPV6_TYPE_NEIGHBOR_ADVERTISEMENT: {
-    if (len < sizeof(icmpv6_na)) {
+    if (len < offsetof(icmpv6_na, opt_type)) {
       LOG_ICMPV6("received neighbor advertisement packet too short\n");
       return;
     }
 
     icmpv6_na *napkt = (icmpv6_na *)buffer;
 
-    char target_addr_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &napkt->target_addr, target_addr_str, INET6_ADDRSTRLEN);
-
-    LOG_ICMPV6("updating nd entry %s => %s\n", target_addr_str, mac_addr_toa(napkt->opt_mac_addr));
-
-    update_nd_table_entry(v6dev->net_dev, napkt->opt_mac_addr, napkt->target_addr);
-
-  } break;
-
-  case ICMPV6_TYPE_ECHO_REQUEST: {
-    if (len < sizeof(icmpv6_echo)) {
-      LOG_ICMPV6("received echo request packet too short\n");
+    // Target Link-Layer Addressオプションが無いNAもある
+    uint8_t *target_mac_addr;
+    if (!icmpv6_nd_link_layer_option(buffer, len, ICMPV6_OPTION_TARGET_LINK_LAYER_ADDRESS, &target_mac_addr)) {
+      LOG_ICMPV6("received neighbor advertisement with invalid option\n");
       return;
     }
 
-    icmpv6_echo *echo_packet = (icmpv6_echo *)buffer;
+    if (target_mac_addr != nullptr) {
+      LOG_ICMPV6("updating nd entry %s => %s\n", napkt->target_addr, log_mac(target_mac_addr));
+    } else {
+      LOG_ICMPV6("updating nd entry %s => (no option)\n", napkt->target_addr);
+    }
 
-    LOG_ICMPV6("received echo request id=%d seq=%d\n", ntohs(echo_packet->id), ntohs(echo_packet->seq));
+    nd_receive_advertisement(v6dev->net_dev, target_mac_addr, napkt->target_addr, napkt->flags);
 
-    uint32_t data_len = len - sizeof(icmpv6_echo);
+  } break;
 
-    if (data_len > 256) {
-      LOG_ICMPV6("echo size is too large\n");
-      return;
-    }
+  }
+}
 
-    my_buf *reply_buf = my_buf::create(sizeof(icmpv6_echo) + data_len);
-    icmpv6_echo *reply_pkt = (icmpv6_echo *)reply_buf->buffer;
-    reply_pkt->hdr.type = ICMPV6_TYPE_ECHO_REPLY;
-    reply_pkt->hdr.code = 0;
-    reply_pkt->hdr.checksum = 0;
+/*
+ * エコー要求に受信用のバッファのままで応答する
+ * 送信元と宛先を入れ替えてタイプを書き換えるだけなので、チェックサムは変わったところの差分だけを直す
+ * (アドレスは入れ替えても疑似ヘッダの和が変わらないので、直すのは送信元に別のアドレスを使う時だけ)
+ */
+void icmpv6_echo_reply_in_place(graph_buffer *b, ipv6_header *packet) {
+  icmpv6_echo *echo = (icmpv6_echo *)(packet + 1);
+  LOG_ICMPV6("received echo request id=%d seq=%d\n", ntohs(echo->id), ntohs(echo->seq));
+
+  uint16_t old_type_code, new_type_code;
+  memcpy(&old_type_code, &echo->hdr, sizeof(uint16_t));
+  echo->hdr.type = ICMPV6_TYPE_ECHO_REPLY;
+  memcpy(&new_type_code, &echo->hdr, sizeof(uint16_t));
+  uint16_t checksum = checksum_update16(echo->hdr.checksum, old_type_code, new_type_code);
+
+  in6_addr requester = packet->src_addr;
+  if (!in6_addr_equals(packet->dst_addr, b->local->address)) { // マルチキャスト宛てだった
+    checksum = checksum_update(checksum, &packet->dst_addr, &b->local->address, sizeof(in6_addr));
+  }
+  echo->hdr.checksum = checksum;
+  packet->src_addr = b->local->address;
+  packet->dst_addr = requester;
+  packet->hop_limit = 0xff;
 
-    reply_pkt->id = echo_packet->id;
-    reply_pkt->seq = echo_packet->seq;
+  local_stats->icmpv6_tx[ICMPV6_TYPE_ECHO_REPLY]++;
+  ipv6_local_output(b);
+}
 
-    memcpy(&reply_pkt->data[0], &echo_packet->data[0], data_len);
+/* ICMPv6エラーの流量制限の初期化(ワーカーのスレッドごと) */
+void icmpv6_init_worker() {
+  std::random_device rd;
+  icmpv6_error_seed = ((uint64_t)rd() << 32) | rd();
+  if (icmpv6_error_sources == nullptr) {
+    icmpv6_error_sources = (icmpv6_error_source *)calloc(ICMPV6_ERROR_SOURCE_SLOTS, sizeof(icmpv6_error_source));
+  }
+  // 全体の送信レートをワーカーで分け合う(workersに登録していない単独のワーカーは全て使う)
+  uint32_t rate = worker_count > 0 ? ICMPV6_ERROR_RATE_PER_SEC / worker_count : ICMPV6_ERROR_RATE_PER_SEC;
+  token_bucket_init(&icmpv6_error_bucket, rate > 0 ? rate : 1, ICMPV6_ERROR_BURST);
+}
 
-    ipv6_pseudo_header phdr;
-    phdr.src_addr = v6dev->address;
-    phdr.dst_addr = source;
-    phdr.packet_length = htonl(sizeof(icmpv6_echo) + data_len);
-    phdr.zero1 = 0;
-    phdr.zero2 = 0;
-    phdr.next_header = IPV6_PROTOCOL_NUM_ICMP;
+/*
+ * 受信したパケットにICMPv6エラーを返してよいか
+ * RFC 4443 2.4(e)で禁止されたもの(ICMPv6エラーへのエラー、Packet Too Big以外のマルチキャスト宛てへのエラー、
+ * 送信元が1つのノードを表さないパケットへのエラー)を除き、送信元ごと、全体の順にトークンを使う
+ */
+stats_icmpv6_error_event icmpv6_error_check(const ipv6_header *packet, uint32_t len, uint8_t type, bool link_multicast) {
+  if (packet->next_hdr == IPV6_PROTOCOL_NUM_ICMP) {
+    const icmpv6_hdr *icmp = (const icmpv6_hdr *)(packet + 1);
+    if (len < sizeof(ipv6_header) + sizeof(icmpv6_hdr) or icmp->type < 128) {
+      return STATS_ICMPV6_ERROR_NOT_ALLOWED;
+    }
+  }
+  if (type != ICMPV6_TYPE_PACKET_TOO_BIG and (packet->dst_addr.s6_addr[0] == 0xff or link_multicast)) {
+    return STATS_ICMPV6_ERROR_NOT_ALLOWED;
+  }
+  in6_addr source_addr = packet->src_addr;
+  if (IN6_IS_ADDR_UNSPECIFIED(&source_addr) or IN6_IS_ADDR_LOOPBACK(&source_addr) or IN6_IS_ADDR_MULTICAST(&source_addr)) {
+    return STATS_ICMPV6_ERROR_NOT_ALLOWED;
+  }
 
-    uint16_t psum = ~checksum_16((uint16_t *)&phdr, sizeof(ipv6_pseudo_header), 0);
+  uint64_t prefix;
+  memcpy(&prefix, &source_addr.s6_addr[0], 8);
+  icmpv6_error_source *source = &icmpv6_error_sources[fmix64(prefix ^ icmpv6_error_seed) & (ICMPV6_ERROR_SOURCE_SLOTS - 1)];
+  if (source->bucket.rate == 0 or source->prefix != prefix) { // 初めての送信元(ぶつかった古い送信元は忘れる)
+    source->prefix = prefix;
+    token_bucket_init(&source->bucket, ICMPV6_ERROR_SOURCE_RATE_PER_SEC, ICMPV6_ERROR_SOURCE_BURST);
+  }
+  if (!token_bucket_consume(&source->bucket)) {
+    return STATS_ICMPV6_ERROR_SOURCE_LIMITED;
+  }
+  if (!token_bucket_consume(&icmpv6_error_bucket)) {
+    return STATS_ICMPV6_ERROR_RATE_LIMITED;
+  }
+  return STATS_ICMPV6_ERROR_SENT;
+}
 
-    reply_pkt->hdr.checksum = checksum_16((uint16_t *)reply_pkt, sizeof(icmpv6_echo) + data_len, psum);
+/*
+ * 転送できなかったパケットを捨て、送信元にICMPv6エラーを返す(RFC 4443)
+ * 受信用のバッファの中で元のパケットを後ろにずらし、前にIPv6ヘッダとICMPv6ヘッダを組み立てて送るので、
+ * メモリの確保は要らない(元のパケットはエラー全体が1280バイトに収まるところまでで切る)
+ * 送ってはいけない時や流量制限に引っかかった時は、そのまま捨てる
+ */
+void icmpv6_send_error(graph_buffer *b, uint8_t type, uint8_t code, uint32_t param, stats_drop_reason reason) {
+  stats_count_drop(reason);
+  TRACE_STEP(b, graph->current_node, TRACE_DROP, reason, 0, nullptr);
+
+  ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+  uint32_t len = b->len - b->l3_offset;
+  ethernet_header *eth = (ethernet_header *)b->data;
+  ipv6_device *v6dev = b->rx_dev->ipv6_dev; // 受信したデバイスのアドレスから送る
+  stats_icmpv6_error_event event = v6dev != nullptr ? icmpv6_error_check(packet, len, type, eth->dst_addr[0] & 1) : STATS_ICMPV6_ERROR_NOT_ALLOWED;
+  local_stats->icmpv6_errors[event]++;
+  if (event != STATS_ICMPV6_ERROR_SENT) {
+    LOG_ICMPV6("suppressed icmpv6 error type=%d to %s (%s)\n", type, packet->src_addr, stats_icmpv6_error_event_names[event]);
+    graph_enqueue(GRAPH_NODE_DROP, b);
+    return;
+  }
 
-    ipv6_encap_output(source, v6dev->address, reply_buf, IPV6_PROTOCOL_NUM_ICMP);
+  in6_addr requester = packet->src_addr;
+  uint32_t invoking_len = std::min<uint32_t>(len, ICMPV6_ERROR_MAX_LEN - sizeof(ipv6_header) - sizeof(icmpv6_error));
+  uint32_t payload_len = sizeof(icmpv6_error) + invoking_len;
+  memmove((uint8_t *)packet + sizeof(ipv6_header) + sizeof(icmpv6_error), packet, invoking_len);
+
+  packet->ver_tc_fl = 0x60;
+  packet->payload_len = htons(payload_len);
+  packet->next_hdr = IPV6_PROTOCOL_NUM_ICMP;
+  packet->hop_limit = 0xff;
+  packet->src_addr = v6dev->address;
+  packet->dst_addr = requester;
+
+  icmpv6_error *error = (icmpv6_error *)(packet + 1);
+  error->hdr.type = type;
+  error->hdr.code = code;
+  error->hdr.checksum = 0;
+  error->param = htonl(param);
+  uint16_t psum = checksum_pseudo_header(packet->src_addr, packet->dst_addr, payload_len, IPV6_PROTOCOL_NUM_ICMP);
+  error->hdr.checksum = checksum_finish(checksum_partial(error, payload_len, psum));
+  b->len = b->l3_offset + sizeof(ipv6_header) + payload_len;
+
+  LOG_ICMPV6("sending icmpv6 error type=%d code=%d to %s\n", type, code, requester);
+  TRACE_STEP(b, graph->current_node, TRACE_ICMPV6_ERROR, type, 0, &requester);
+  local_stats->icmpv6_tx[type]++;
+  ipv6_local_output(b);
+}
 
-  } break;
+/* 自分宛てのICMPv6パケットの処理(icmpv6-localノード) */
+void icmpv6_local_node(graph_buffer **buffers, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+    icmpv6_hdr *icmp_pkt = (icmpv6_hdr *)(packet + 1);
+    TRACE_STEP(b, GRAPH_NODE_ICMPV6_LOCAL, TRACE_LOCAL_ICMPV6, icmp_pkt->type, b->local->net_dev->index, nullptr);
+
+    // エコー要求はバッファを書き換えて、そのまま送り返す
+    if (icmp_pkt->type == ICMPV6_TYPE_ECHO_REQUEST) {
+      local_stats->icmpv6_rx[ICMPV6_TYPE_ECHO_REQUEST]++;
+      if (ntohs(packet->payload_len) < sizeof(icmpv6_echo)) {
+        LOG_ICMPV6("received echo request packet too short\n");
+        graph_drop(b, STATS_DROP_TOO_SHORT);
+        continue;
+      }
+      icmpv6_echo_reply_in_place(b, packet);
+      continue;
+    }
+    icmpv6_input(b->local, packet->src_addr, packet->dst_addr, ((uint8_t *)packet) + sizeof(ipv6_header), ntohs(packet->payload_len));
   }
 }
 
-void send_ns_packet(net_device *dev, in6_addr target_addr) {
+/*
+ * NSの送信
+ * dst_mac_addrが指定されていれば、到達性の確認のためにターゲットへユニキャストで送る
+ */
+void send_ns_packet(net_device *dev, in6_addr target_addr, const uint8_t *dst_mac_addr) {
 
   // 要請ノードマルチキャストアドレスを生成
   in6_addr mcast_addr;
-  inet_pton(AF_INET6, "ff02::1:ff00:0000", &mcast_addr);
-  mcast_addr.s6_addr[13] = target_addr.s6_addr[13];
-  mcast_addr.s6_addr[14] = target_addr.s6_addr[14];
-  mcast_addr.s6_addr[15] = target_addr.s6_addr[15];
+  if (dst_mac_addr != nullptr) {
+    mcast_addr = target_addr;
+  } else {
+    inet_pton(AF_INET6, "ff02::1:ff00:0000", &mcast_addr);
+    mcast_addr.s6_addr[13] = target_addr.s6_addr[13];
+    mcast_addr.s6_addr[14] = target_addr.s6_addr[14];
+    mcast_addr.s6_addr[15] = target_addr.s6_addr[15];
+  }
 
   my_buf *ns_buf = my_buf::create(sizeof(icmpv6_na));
   icmpv6_na *ns_pkt = (icmpv6_na *)ns_buf->buffer;
@@ -149,19 +321,15 @@ void send_ns_packet(net_device *dev, in6_addr target_addr) {
   ns_pkt->opt_type = ICMPV6_OPTION_SOURCE_LINK_LAYER_ADDRESS;
   memcpy(&ns_pkt->opt_mac_addr, dev->mac_addr, 6);
 
-  ipv6_pseudo_header phdr;
-  phdr.src_addr = dev->ipv6_dev->address;
-  phdr.dst_addr = mcast_addr;
-  phdr.packet_length = htonl(sizeof(icmpv6_na));
-  phdr.zero1 = 0;
-  phdr.zero2 = 0;
-  phdr.next_header = IPV6_PROTOCOL_NUM_ICMP;
-
-  uint16_t psum = ~checksum_16((uint16_t *)&phdr, sizeof(ipv6_pseudo_header), 0);
-
-  ns_pkt->hdr.checksum = checksum_16((uint16_t *)ns_pkt, sizeof(icmpv6_na), psum);
+  uint16_t psum = checksum_pseudo_header(dev->ipv6_dev->address, mcast_addr, sizeof(icmpv6_na), IPV6_PROTOCOL_NUM_ICMP);
+  ns_pkt->hdr.checksum = checksum_finish(checksum_partial(ns_pkt, sizeof(icmpv6_na), psum));
 
   LOG_ICMPV6("sending NS...\n");
+  local_stats->icmpv6_tx[ICMPV6_TYPE_NEIGHBOR_SOLICIATION]++;
 
-  ipv6_encap_dev_mcast_output(dev, mcast_addr, ns_buf, IPV6_PROTOCOL_NUM_ICMP);
+  if (dst_mac_addr != nullptr) {
+    ipv6_encap_dev_output(dev, dst_mac_addr, mcast_addr, dev->ipv6_dev->address, ns_buf, IPV6_PROTOCOL_NUM_ICMP);
+  } else {
+    ipv6_encap_dev_mcast_output(dev, mcast_addr, ns_buf, IPV6_PROTOCOL_NUM_ICMP);
+  }
 }
\ No newline at end of file
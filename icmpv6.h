@@ -2,14 +2,37 @@
 #define CURO_ICMPV6_H
 
 #include "ipv6.h"
+#include "stats.h"
 #include <iostream>
 
+#define ICMPV6_TYPE_DEST_UNREACHABLE 1
+#define ICMPV6_TYPE_PACKET_TOO_BIG 2
+#define ICMPV6_TYPE_TIME_EXCEEDED 3
+
+#define ICMPV6_DEST_UNREACHABLE_NO_ROUTE 0
+#define ICMPV6_DEST_UNREACHABLE_ADMIN 1
+#define ICMPV6_DEST_UNREACHABLE_ADDRESS 3
+#define ICMPV6_TIME_EXCEEDED_HOP_LIMIT 0
+
 #define ICMPV6_TYPE_ECHO_REQUEST 128
 #define ICMPV6_TYPE_ECHO_REPLY 129
 
 #define ICMPV6_TYPE_ROUTER_SOLICIATION 133
 #define ICMPV6_TYPE_NEIGHBOR_SOLICIATION 135
 #define ICMPV6_TYPE_NEIGHBOR_ADVERTISEMENT 136
+#define ICMPV6_TYPE_REDIRECT 137
+
+/*
+ * ICMPv6エラーの流量制限(RFC 4443 2.4(f))
+ * 送信元の/64ごとのバケットで1つの送信元からの嵐を抑え、ワーカー全体のバケットで送信元を散らした走査を抑える
+ * 送信元ごとのバケットはワーカーごとの直接マップの表で持ち、別の送信元とぶつかったら満タンのバケットで置き換える
+ */
+#define ICMPV6_ERROR_RATE_PER_SEC 1000      // 全体で1秒あたりに送信できるエラーの数
+#define ICMPV6_ERROR_BURST 100              // 全体で連続して送信できるエラーの数
+#define ICMPV6_ERROR_SOURCE_RATE_PER_SEC 10 // 送信元ごとに1秒あたりに送信できるエラーの数
+#define ICMPV6_ERROR_SOURCE_BURST 10        // 送信元ごとに連続して送信できるエラーの数
+#define ICMPV6_ERROR_SOURCE_SLOTS 1024      // 送信元ごとのバケットの数(2の累乗)
+#define ICMPV6_ERROR_MAX_LEN 1280           // エラーのパケットの最大の長さ(IPv6の最小MTUに収める)
 
 #define ICMPV6_NA_FLAG_ROUTER 0b10000000
 #define ICMPV6_NA_FLAG_SOLICITED 0b01000000
@@ -21,6 +44,12 @@ struct icmpv6_hdr {
   uint16_t checksum;
 } __attribute__((packed));
 
+struct icmpv6_error {
+  icmpv6_hdr hdr;
+  uint32_t param; // Packet Too BigならMTU、それ以外は0
+  uint8_t invoking_packet[]; // エラーの原因になったパケット(収まる分だけ)
+} __attribute__((packed));
+
 struct icmpv6_echo {
   icmpv6_hdr hdr;
   uint16_t id;
@@ -41,6 +70,12 @@ struct icmpv6_na {
 } __attribute__((packed));
 
 void icmpv6_input(ipv6_device *v6dev, in6_addr source, in6_addr dstination, void *buffer, size_t len);
-void send_ns_packet(net_device *dev, in6_addr target_addr);
+
+struct graph_buffer;
+
+void icmpv6_local_node(graph_buffer **buffers, uint32_t count);
+void icmpv6_init_worker();
+void icmpv6_send_error(graph_buffer *b, uint8_t type, uint8_t code, uint32_t param, stats_drop_reason reason);
+void send_ns_packet(net_device *dev, in6_addr target_addr, const uint8_t *dst_mac_addr = nullptr);
 
 #endif // CURO_ICMPV6_H
@@ -1,30 +1,27 @@
 #include "ipv6.h"
 
+#include "acl.h"
 #include "config.h"
 #include "ethernet.h"
+#include "flow_cache.h"
+#include "graph.h"
 #include "icmpv6.h"
+#include "latency.h"
 #include "log.h"
 #include "my_buf.h"
 #include "nd.h"
+#include "nptv6.h"
+#include "probes.h"
+#include "punt.h"
 #include "patricia_trie.h"
 #include "utils.h"
 
 /**
  * IPv6ルーティングテーブルのルートノード
  */
-patricia_node *ipv6_fib;
+thread_local patricia_node *ipv6_fib; // ワーカーごとに持つ
 
-int in6_addr_equals(in6_addr addr1, in6_addr addr2) {
-  for (int i = 0; i < 7; i++) {
-    if (addr1.s6_addr32[i] != addr2.s6_addr32[i])
-      return 0;
-  }
-  return 1;
-}
-
-long in6_addr_sum(in6_addr addr) { return (addr.s6_addr32[0] + addr.s6_addr32[1] + addr.s6_addr32[2] + addr.s6_addr32[3]); }
-
-// テキストでエントリを出力する
+// テキストでエントリを出力する(コマンドの出力なのでログのレベルに関係なく出す)
 void dump_ipv6_route(patricia_node *root) {
 
   patricia_node *current_node;
@@ -44,12 +41,14 @@ void dump_ipv6_route(patricia_node *root) {
         ipv6_route_entry *entry = (ipv6_route_entry *)current_node->data;
 
         if (entry->type == ipv6_route_type::connected) {
-          LOG_IPV6("%s/%d via %s\n", ipv6_str, patricia_trie_get_prefix_len(current_node), entry->dev->name);
+          printf("%s/%d via %s\n", ipv6_str, patricia_trie_get_prefix_len(current_node), entry->dev->name);
         } else if (entry->type == ipv6_route_type::network) {
           char ipv6_nh_str[INET6_ADDRSTRLEN];
           inet_ntop(AF_INET6, &(entry->next_hop), ipv6_nh_str, INET6_ADDRSTRLEN);
 
-          LOG_IPV6("%s/%d next hop %s\n", ipv6_str, patricia_trie_get_prefix_len(current_node), ipv6_nh_str);
+          printf("%s/%d next hop %s\n", ipv6_str, patricia_trie_get_prefix_len(current_node), ipv6_nh_str);
+        } else if (entry->type == ipv6_route_type::local) {
+          printf("%s/%d local %s\n", ipv6_str, patricia_trie_get_prefix_len(current_node), entry->v6dev->net_dev->name);
         }
       }
     }
@@ -63,115 +62,248 @@ void dump_ipv6_route(patricia_node *root) {
   }
 }
 
-/* 自分宛のIPパケットの処理 */
-void ipv6_input_to_ours(net_device *input_dev, ipv6_header *packet, size_t len) {
-
-  switch (packet->next_hdr) {
-  case IPV6_PROTOCOL_NUM_ICMP:
-    return icmpv6_input(input_dev->ipv6_dev, packet->src_addr, packet->dst_addr, ((uint8_t *)packet) + sizeof(ipv6_header), len - sizeof(ipv6_header));
-  default:
-    break;
+/* デバイスに設定されたアドレスのうち、指定したアドレスを探す */
+ipv6_device *ipv6_device_get_address(net_device *dev, const in6_addr &address) {
+  for (ipv6_device *v6dev = dev->ipv6_dev; v6dev; v6dev = v6dev->next) {
+    if (in6_addr_equals(v6dev->address, address)) {
+      return v6dev;
+    }
   }
+  return nullptr;
 }
 
-void ipv6_output_to_host(net_device *dev, in6_addr dst_addr, in6_addr src_addr, my_buf *buffer);
+void ipv6_output_to_host(net_device *dev, in6_addr dst_addr, my_buf *buffer);
 void ipv6_output_to_next_hop(in6_addr dst_addr, my_buf *buffer);
 
-void ipv6_input(net_device *input_dev, uint8_t *buffer, ssize_t len) {
+/*
+ * IPv6の受信処理(ipv6-inputノード)
+ * ユニキャストは自分宛てかどうかも含めてipv6-lookupノードの経路表の検索1回で決める
+ */
+void ipv6_input_node(graph_buffer **buffers, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    net_device *input_dev = b->rx_dev;
+
+    if (input_dev->ipv6_dev == nullptr) {
+      LOG_IPV6("received ipv6 packet from non ipv6 device %s\n", input_dev->name);
+      graph_drop(b, STATS_DROP_NOT_FOR_US);
+      continue;
+    }
 
-  if (input_dev->ipv6_dev == nullptr) {
-    LOG_IPV6("received ipv6 packet from non ipv6 device %s\n", input_dev->name);
-    return;
-  }
+    uint32_t len = b->len - b->l3_offset;
+    if (len < sizeof(ipv6_header)) {
+      LOG_IPV6("received ipv6 packet too short from %s\n", input_dev->name);
+      graph_drop(b, STATS_DROP_TOO_SHORT);
+      continue;
+    }
 
-  if (len < sizeof(in6_addr)) {
-    LOG_IPV6("received ipv6 packet too short from %s\n", input_dev->name);
-    return;
-  }
+    // 送られてきたバッファをキャストして扱う
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
 
-  // 送られてきたバッファをキャストして扱う
-  ipv6_header *packet = (ipv6_header *)buffer;
+    if ((ntohl(packet->ver_tc_fl) >> 28) != 6 or ntohs(packet->payload_len) > len - sizeof(ipv6_header)) {
+      graph_drop(b, STATS_DROP_BAD_HEADER);
+      continue;
+    }
+    b->len = b->l3_offset + sizeof(ipv6_header) + ntohs(packet->payload_len); // イーサネットのパディングを除く
 
-  if (packet->ver_tc_fl & 0b1111 != 6) {
-    return;
-  }
+    LOG_IPV6("received ipv6 packet next-header 0x%02x %s =>> %s\n", packet->next_hdr, packet->src_addr, packet->dst_addr);
 
-  char src_addr_str[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &packet->src_addr, src_addr_str, INET6_ADDRSTRLEN);
+    // マルチキャストアドレスの判定
+    if (packet->dst_addr.s6_addr[0] == 0xff) { // ff00::/8の範囲だったら
+      // 受信したデバイスのアドレスのどれかの要請ノードマルチキャストアドレスか
+      ipv6_device *v6dev = input_dev->ipv6_dev;
+      while (v6dev != nullptr and memcmp(&v6dev->address.s6_addr[13], &packet->dst_addr.s6_addr[13], 3) != 0) {
+        v6dev = v6dev->next;
+      }
+      if (v6dev != nullptr and packet->next_hdr == IPV6_PROTOCOL_NUM_ICMP) {
+        LOG_IPV6("packet to multicast address (solicited-node multicast address)\n");
+        b->tx_dev = input_dev;
+        b->local = v6dev;
+        TRACE_STEP(b, GRAPH_NODE_IPV6_INPUT, TRACE_IPV6_SOLICITED_NODE, 0, input_dev->index, nullptr);
+        graph_enqueue(punt_local_node(), b); // 自分宛の通信として処理
+      } else {
+        graph_drop(b, STATS_DROP_NOT_FOR_US); // マルチキャストは転送しない
+      }
+      continue;
+    }
 
-  char dst_addr_str[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &packet->dst_addr, dst_addr_str, INET6_ADDRSTRLEN);
+    if (!npt_translate_inbound(b, packet)) { // 外部のデバイスからなら、経路を引く前に宛先を内部のアドレスにする
+      graph_drop(b, STATS_DROP_NPTV6);
+      continue;
+    }
 
-  LOG_IPV6("received ipv6 packet next-header 0x%02x %s =>> %s\n", packet->next_hdr, src_addr_str, dst_addr_str);
+    TRACE_STEP(b, GRAPH_NODE_IPV6_INPUT, TRACE_IPV6_UNICAST, 0, 0, nullptr);
+    graph_enqueue(flow_cache_input_node(), b);
+  }
+}
 
-  // マルチキャストアドレスの判定
-  if (packet->dst_addr.s6_addr[0] == 0xff) { // ff00::/8の範囲だったら
+/* パケットを出力するデバイス(ネクストホップの近隣のエントリがまだ無ければ、経路表から探す) */
+net_device *ipv6_output_dev(ipv6_route_entry *route, const in6_addr &next_hop, nd_table_entry *entry) {
+  if (entry != nullptr) {
+    return entry->dev;
+  }
+  if (route->type == ipv6_route_type::connected) {
+    return route->dev;
+  }
+  patricia_node *res = patricia_trie_search(ipv6_fib, next_hop);
+  if (res != nullptr and res->data != nullptr and ((ipv6_route_entry *)res->data)->type == ipv6_route_type::connected) {
+    return ((ipv6_route_entry *)res->data)->dev;
+  }
+  return nullptr;
+}
 
-    if (memcmp(&input_dev->ipv6_dev->address.s6_addr[13], &packet->dst_addr.s6_addr[13], 3) == 0) {
-      LOG_IPV6("packet to multicast address (solicited-node multicast address)\n");
-      return ipv6_input_to_ours(input_dev, packet, len); // 自分宛の通信として処理
+/*
+ * フォワーディングテーブルの検索(ipv6-lookupノード)
+ * local経路に当たれば自分宛てとして処理し、
+ * ネクストホップのアドレスが解決済みならフレームをその場で書き換えて送り、
+ * まだならパケットをコピーしてNDのキューで待たせる
+ */
+void ipv6_lookup_node(graph_buffer **buffers, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+
+    LATENCY_START(lookup_start);
+    patricia_node *res_node = patricia_trie_search(ipv6_fib, packet->dst_addr); // ルーティングテーブルをルックアップ
+    LATENCY_RECORD(LATENCY_STAGE_FIB_LOOKUP, lookup_start);
+
+    if (res_node == nullptr or res_node->data == nullptr) { // 宛先までの経路がなかったらパケットを破棄
+      LOG_IPV6("No route to %s\n", packet->dst_addr);
+      CURO_PROBE4(fib_miss, b->rx_dev->name, &packet->src_addr, &packet->dst_addr, b->len - b->l3_offset);
+      icmpv6_send_error(b, ICMPV6_TYPE_DEST_UNREACHABLE, ICMPV6_DEST_UNREACHABLE_NO_ROUTE, 0, STATS_DROP_NO_ROUTE);
+      continue;
     }
-  }
 
-  // 宛先IPアドレスをルータが持ってるか調べる
-  for (net_device *dev = net_dev_list; dev; dev = dev->next) {
-    if (dev->ipv6_dev != nullptr) {
-      // 宛先IPアドレスがルータの持っているIPアドレスの処理
-      if (memcmp(&dev->ipv6_dev->address, &packet->dst_addr, 16) == 0) {
-        return ipv6_input_to_ours(dev, packet, len); // 自分宛の通信として処理
+    ipv6_route_entry *route = (ipv6_route_entry *)res_node->data;
+    if (route->type == ipv6_route_type::local) { // 宛先IPアドレスをルータが持っている
+      b->tx_dev = route->v6dev->net_dev;
+      b->local = route->v6dev;
+      TRACE_STEP(b, GRAPH_NODE_IPV6_LOOKUP, TRACE_FIB_LOCAL, 0, b->tx_dev->index, &route->v6dev->address); // 宛先と同じアドレス(パックされたヘッダのメンバのアドレスは取らない)
+      if (packet->next_hdr == IPV6_PROTOCOL_NUM_ICMP) {
+        graph_enqueue(punt_local_node(), b);
+      } else {
+        graph_drop(b, STATS_DROP_UNKNOWN_PROTOCOL);
       }
+      continue;
     }
-  }
 
-  // 自分宛てのパケット出ない場合フォワーディングテーブルの検索
-
-  // 宛先IPアドレスがルータの持っているIPアドレスでない場合はフォワーディングを行う
-  patricia_node *res_node = patricia_trie_search(ipv6_fib, packet->dst_addr); // ルーティングテーブルをルックアップ
+    if (packet->hop_limit <= 1) { // 転送するとHop Limitが0になる
+      LOG_IPV6("Hop limit exceeded %s =>> %s\n", packet->src_addr, packet->dst_addr);
+      icmpv6_send_error(b, ICMPV6_TYPE_TIME_EXCEEDED, ICMPV6_TIME_EXCEEDED_HOP_LIMIT, 0, STATS_DROP_HOP_LIMIT);
+      continue;
+    }
 
-  if (res_node == nullptr or res_node->data == nullptr) { // 宛先までの経路がなかったらパケットを破棄
+    in6_addr next_hop = route->type == ipv6_route_type::connected ? packet->dst_addr : route->next_hop;
+    if (route->type == ipv6_route_type::connected) {
+      TRACE_STEP(b, GRAPH_NODE_IPV6_LOOKUP, TRACE_FIB_CONNECTED, 0, route->dev->index, nullptr);
+    } else {
+      TRACE_STEP(b, GRAPH_NODE_IPV6_LOOKUP, TRACE_FIB_NETWORK, 0, 0, &route->next_hop);
+    }
 
-    LOG_IPV6("No route to %s\n", dst_addr_str);
-    // Drop packet
-    return;
-  }
+    LATENCY_START(nd_start);
+    nd_table_entry *entry = search_nd_table_entry(next_hop);
+    bool resolved = entry != nullptr and nd_entry_use(entry);
+    LATENCY_RECORD(LATENCY_STAGE_ND_RESOLVE, nd_start);
+    uint32_t len = b->len - b->l3_offset;
+    net_device *output_dev = ipv6_output_dev(route, next_hop, entry);
+    if (output_dev != nullptr and output_dev->mtu != 0 and len > output_dev->mtu) { // 出力先のMTUを超える(ルータは分割しない)
+      LOG_IPV6("Packet too big for %s (%u > %u)\n", output_dev->name, len, output_dev->mtu);
+      icmpv6_send_error(b, ICMPV6_TYPE_PACKET_TOO_BIG, 0, output_dev->mtu, STATS_DROP_PACKET_TOO_BIG);
+      continue;
+    }
 
-  ipv6_route_entry *route = (ipv6_route_entry *)res_node->data;
+    if (resolved) {
+      memcpy(b->dst_mac, entry->mac_addr, 6); // 書き換えるまでに後ろのパケットのアドレス解決でエントリが動くことがある
+      b->tx_dev = entry->dev;
+      if (flow_local != nullptr) { // 次からはこのフローの検索を飛ばす
+        flow_cache_insert(b, entry);
+      }
+      TRACE_STEP(b, GRAPH_NODE_IPV6_LOOKUP, TRACE_ND_HIT, 0, entry->dev->index, &next_hop);
+      graph_enqueue(GRAPH_NODE_IPV6_REWRITE, b);
+      continue;
+    }
 
-  packet->hop_limit--; // Hop Limitをデクリメント
+    // アドレス解決が必要なので、受信用のバッファからコピーしてNDに任せる
+    TRACE_STEP(b, GRAPH_NODE_IPV6_LOOKUP, TRACE_ND_MISS, 0, 0, &next_hop);
+    if (!npt_translate_outbound(b, packet, output_dev)) {
+      graph_drop(b, STATS_DROP_NPTV6);
+      continue;
+    }
+    packet->hop_limit--; // Hop Limitをデクリメント
 
-  my_buf *ipv6_fwd_mybuf = my_buf::create(len);
-  memcpy(ipv6_fwd_mybuf->buffer, buffer, len);
-  ipv6_fwd_mybuf->len = len;
+    my_buf *ipv6_fwd_mybuf = my_buf::create(len);
+    memcpy(ipv6_fwd_mybuf->buffer, packet, len);
 
-  if (route->type == ipv6_route_type::connected) { // 直接接続ネットワークの経路なら
-    LOG_IPV6("forwarding ipv6 packet to host\n");
-    ipv6_output_to_host(route->dev, packet->dst_addr, packet->src_addr, ipv6_fwd_mybuf); // hostに直接送信
-    return;
-  } else if (route->type == ipv6_route_type::network) { // 直接接続ネットワークの経路ではなかったら
-    LOG_IPV6("forwarding ipv6 packet to network\n");
-    ipv6_output_to_next_hop(route->next_hop, ipv6_fwd_mybuf); // next hopに送信
-    return;
+    if (route->type == ipv6_route_type::connected) { // 直接接続ネットワークの経路なら
+      LOG_IPV6("forwarding ipv6 packet to host\n");
+      ipv6_output_to_host(route->dev, packet->dst_addr, ipv6_fwd_mybuf); // hostに直接送信
+    } else { // 直接接続ネットワークの経路ではなかったら
+      LOG_IPV6("forwarding ipv6 packet to network\n");
+      ipv6_output_to_next_hop(route->next_hop, ipv6_fwd_mybuf); // next hopに送信
+    }
   }
 }
 
-// IPv6アドレスが、ネットワーク内の物か調べる
-int in6_is_in_network(in6_addr address, in6_addr prefix,
-                      int prefix_len) {
+/* 転送するフレームのヘッダをその場で書き換える(ipv6-rewriteノード) */
+void ipv6_rewrite_node(graph_buffer **buffers, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+    if (!npt_translate_outbound(b, packet, b->tx_dev)) { // 外部のデバイスに出すなら、送信元を外部のアドレスにする
+      graph_drop(b, STATS_DROP_NPTV6);
+      continue;
+    }
+    packet->hop_limit--; // Hop Limitをデクリメント
+    TRACE_STEP(b, GRAPH_NODE_IPV6_REWRITE, TRACE_REWRITE, packet->hop_limit, b->tx_dev->index, nullptr);
 
-  // 各ビットを比較してネットワーク内かどうかを確認
-  for (int i = 0; i < prefix_len; i++) {
-    int byte_index = i / 8;
-    int bit_index = i % 8;
+    ethernet_header *eth = (ethernet_header *)b->data;
+    memcpy(eth->dst_addr, b->dst_mac, 6);
+    memcpy(eth->src_addr, b->tx_dev->mac_addr, 6);
+    graph_enqueue(GRAPH_NODE_INTERFACE_OUTPUT, b);
+  }
+}
 
-    if ((address.s6_addr[byte_index] &
-         (1 << (7 - bit_index))) !=
-        (prefix.s6_addr[byte_index] &
-         (1 << (7 - bit_index)))) {
-      return 0; // ネットワーク外
-    }
+/*
+ * ルータ自身が受信用のバッファの中に組み立てたパケットを送る(icmpv6-localノードから呼ぶ)
+ * 転送と同じように経路表とNDテーブルを引き、近隣が解決済みならイーサネットヘッダをその場で書き換えて
+ * interface-outputノードへ渡すので、メモリの確保もコピーも要らない
+ * 未解決の時だけ、コピーしてNDのキューで待たせる
+ */
+void ipv6_local_output(graph_buffer *b) {
+  ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+  patricia_node *res_node = patricia_trie_search(ipv6_fib, packet->dst_addr);
+  ipv6_route_entry *route = res_node != nullptr ? (ipv6_route_entry *)res_node->data : nullptr;
+  if (route == nullptr or route->type == ipv6_route_type::local) { // 自分自身には送らない
+    LOG_IPV6("No route to %s\n", packet->dst_addr);
+    graph_drop(b, STATS_DROP_NO_ROUTE);
+    return;
+  }
+
+  in6_addr next_hop = route->type == ipv6_route_type::connected ? packet->dst_addr : route->next_hop;
+  nd_table_entry *entry = search_nd_table_entry(next_hop);
+  if (!npt_translate_outbound(b, packet, ipv6_output_dev(route, next_hop, entry))) {
+    graph_drop(b, STATS_DROP_NPTV6);
+    return;
+  }
+  if (entry != nullptr and nd_entry_use(entry)) {
+    b->tx_dev = entry->dev;
+    TRACE_STEP(b, graph->current_node, TRACE_ND_HIT, 0, entry->dev->index, &next_hop);
+    ethernet_header *eth = (ethernet_header *)b->data;
+    memcpy(eth->dst_addr, entry->mac_addr, 6);
+    memcpy(eth->src_addr, entry->dev->mac_addr, 6);
+    graph_enqueue(GRAPH_NODE_INTERFACE_OUTPUT, b);
+    return;
   }
 
-  return 1; // ネットワーク内
+  TRACE_STEP(b, graph->current_node, TRACE_ND_MISS, 0, 0, &next_hop);
+  uint32_t len = b->len - b->l3_offset;
+  my_buf *buffer = my_buf::create(len);
+  memcpy(buffer->buffer, packet, len);
+  if (route->type == ipv6_route_type::connected) {
+    ipv6_output_to_host(route->dev, packet->dst_addr, buffer);
+  } else {
+    ipv6_output_to_next_hop(route->next_hop, buffer);
+  }
 }
 
 void ipv6_encap_output(in6_addr dst_addr,
@@ -202,24 +334,6 @@ void ipv6_encap_output(in6_addr dst_addr,
   v6h_buf->src_addr = src_addr;
   v6h_buf->dst_addr = dst_addr;
 
-  // ルーティング/フォワーディングが実装されてないとき用
-  for (net_device *dev = net_dev_list; dev;
-       dev = dev->next) {
-    if (dev->ipv6_dev == nullptr)
-      continue;
-    // 宛先アドレスと同じネットワークを持ったデバイスを探す
-    if (in6_is_in_network(dst_addr,
-                          dev->ipv6_dev->address,
-                          dev->ipv6_dev->prefix_len)) {
-      ipv6_output_to_host(dev, dst_addr,
-                          dev->ipv6_dev->address,
-                          v6h_mybuf);
-      return;
-    }
-  }
-
-  return;
-
   patricia_node *res =
       patricia_trie_search(ipv6_fib, dst_addr);
   if (res != nullptr and res->data != nullptr) {
@@ -228,18 +342,20 @@ void ipv6_encap_output(in6_addr dst_addr,
     if (route_entry->type ==
         ipv6_route_type::connected) {
       ipv6_output_to_host(
-          route_entry->dev, dst_addr,
-          route_entry->dev->ipv6_dev->address,
-          v6h_mybuf);
+          route_entry->dev, dst_addr, v6h_mybuf);
+      return;
     } else if (route_entry->type ==
                ipv6_route_type::network) {
       ipv6_output_to_next_hop(route_entry->next_hop,
                               v6h_mybuf);
+      return;
     }
   }
+  stats_count_drop(STATS_DROP_NO_ROUTE);
+  my_buf::my_buf_free(v6h_mybuf, true); // 宛先が無いか自分宛てなら捨てる
 }
 
-void ipv6_encap_dev_output(net_device *output_dev, const uint8_t *dst_mac_addr, in6_addr dst_addr, my_buf *buffer, uint8_t next_hdr_num) {
+void ipv6_encap_dev_output(net_device *output_dev, const uint8_t *dst_mac_addr, in6_addr dst_addr, in6_addr src_addr, my_buf *buffer, uint8_t next_hdr_num) {
 
   // 連結リストをたどってIPヘッダで必要なIPパケットの全長を算出する
   uint16_t payload_len = 0;
@@ -259,7 +375,7 @@ void ipv6_encap_dev_output(net_device *output_dev, const uint8_t *dst_mac_addr,
   v6h_buf->payload_len = htons(payload_len);
   v6h_buf->next_hdr = next_hdr_num;
   v6h_buf->hop_limit = 0xff;
-  v6h_buf->src_addr = output_dev->ipv6_dev->address;
+  v6h_buf->src_addr = src_addr;
   v6h_buf->dst_addr = dst_addr;
 
   ethernet_encapsulate_output(output_dev, dst_mac_addr, v6h_mybuf, ETHER_TYPE_IPV6);
@@ -297,22 +413,9 @@ void ipv6_encap_dev_mcast_output(net_device *output_dev, in6_addr dst_addr, my_b
   ethernet_encapsulate_output(output_dev, dst_mac_addr, v6h_mybuf, ETHER_TYPE_IPV6);
 }
 
-void ipv6_output_to_host(net_device *dev, in6_addr dst_addr, in6_addr src_addr, my_buf *buffer) { // devいらない?
-
-  nd_table_entry *nde = search_nd_table_entry(dst_addr);
-  if (!nde) { // ARPエントリが無かったら
-
-    char dst_addr_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &dst_addr, dst_addr_str, INET6_ADDRSTRLEN);
-
-    LOG_IPV6("Trying ipv6 output to host, but no nd record to %s\n", dst_addr_str);
-    send_ns_packet(dev, dst_addr);     // ARPリクエストの送信
-    my_buf::my_buf_free(buffer, true); // Drop packet
-    return;
-  } else {
-    ethernet_encapsulate_output(nde->dev, nde->mac_addr, buffer,
-                                ETHER_TYPE_IPV6); // イーサネットでカプセル化して送信
-  }
+void ipv6_output_to_host(net_device *dev, in6_addr dst_addr, my_buf *buffer) {
+  // NDでアドレスを解決して送信する(解決するまではNDのキューで待たせる)
+  nd_output(dev, dst_addr, buffer);
 }
 
 void ipv6_output_to_next_hop(in6_addr dst_addr, my_buf *buffer) {
@@ -320,23 +423,24 @@ void ipv6_output_to_next_hop(in6_addr dst_addr, my_buf *buffer) {
 
   if (entry == nullptr) {
 
+    // ネクストホップがどのデバイスの先にいるか調べて、アドレス解決を始める
     patricia_node *res = patricia_trie_search(ipv6_fib, dst_addr);
     if (res != nullptr and res->data != nullptr) {
       ipv6_route_entry *route_entry = (ipv6_route_entry *)res->data;
 
       if (route_entry != nullptr and route_entry->type == ipv6_route_type::connected) {
-        send_ns_packet(route_entry->dev, dst_addr);
+        nd_output(route_entry->dev, dst_addr, buffer);
         return;
       }
     }
 
-    char dst_addr_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &dst_addr, dst_addr_str, INET6_ADDRSTRLEN);
-    LOG_IPV6("next hop unreachable %s\n", dst_addr_str);
+    LOG_IPV6("next hop unreachable %s\n", dst_addr);
+    stats_count_drop(STATS_DROP_NO_ROUTE);
+    my_buf::my_buf_free(buffer, true); // Drop packet
 
   } else {
 
     LOG_IPV6("found nd entry to next hop!\n");
-    ethernet_encapsulate_output(entry->dev, entry->mac_addr, buffer, ETHER_TYPE_IPV6);
+    nd_entry_output(entry, buffer);
   }
-}
\ No newline at end of file
+}
@@ -5,7 +5,14 @@
 #include <arpa/inet.h>
 #include <iostream>
 #include <queue>
-
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define IPV6_PROTOCOL_NUM_HOPOPTS 0x00
+#define IPV6_PROTOCOL_NUM_ROUTING 0x2b
+#define IPV6_PROTOCOL_NUM_FRAGMENT 0x2c
+#define IPV6_PROTOCOL_NUM_AH 0x33
 #define IPV6_PROTOCOL_NUM_ICMP 0x3a
 #define IPV6_PROTOCOL_NUM_NONXT 0x3b
 #define IPV6_PROTOCOL_NUM_OPTS 0x3c
@@ -15,19 +22,21 @@
 
 struct patricia_node;
 
-extern patricia_node *ipv6_fib;
+extern thread_local patricia_node *ipv6_fib;
 
+/* デバイスに設定したIPv6アドレス(1つのデバイスに複数設定でき、nextでつなぐ) */
 struct ipv6_device {
   in6_addr address;    // IPv6アドレス
   uint32_t prefix_len; // プレフィックス長(0~128)
   uint8_t scope;       // スコープ
   net_device *net_dev; // ネットワークデバイスへのポインタ
-  ipv6_device *next;   // 次のIPv6デバイス
+  ipv6_device *next;   // 同じデバイスの次のアドレス
 };
 
 enum class ipv6_route_type {
   connected, // 直接接続されているネットワークの経路　
-  network
+  network,
+  local // ルータ自身のアドレス(/128)で、自分宛ての判定にも使う
 };
 
 struct net_device;
@@ -37,6 +46,7 @@ struct ipv6_route_entry {
   union {
     net_device *dev;
     in6_addr next_hop;
+    ipv6_device *v6dev; // localの時、宛先のアドレス
   };
 };
 
@@ -49,26 +59,31 @@ struct ipv6_header {
   in6_addr dst_addr;
 } __attribute__((packed));
 
-struct ipv6_pseudo_header {
-  in6_addr src_addr;
-  in6_addr dst_addr;
-  uint32_t packet_length;
-  uint16_t zero1;
-  uint8_t zero2;
-  uint8_t next_header;
-};
+/* 2つのIPv6アドレスが等しいかを16バイトまとめて比較する */
+inline int in6_addr_equals(const in6_addr &addr1, const in6_addr &addr2) {
+#ifdef __SSE2__
+  __m128i a = _mm_loadu_si128((const __m128i *)&addr1);
+  __m128i b = _mm_loadu_si128((const __m128i *)&addr2);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+#else
+  return ((addr1.s6_addr32[0] ^ addr2.s6_addr32[0]) | (addr1.s6_addr32[1] ^ addr2.s6_addr32[1]) | (addr1.s6_addr32[2] ^ addr2.s6_addr32[2]) | (addr1.s6_addr32[3] ^ addr2.s6_addr32[3])) == 0;
+#endif
+}
 
-int in6_addr_equals(in6_addr addr1, in6_addr addr2);
+void dump_ipv6_route(patricia_node *root);
 
-long in6_addr_sum(in6_addr addr);
+ipv6_device *ipv6_device_get_address(net_device *dev, const in6_addr &address);
 
-void dump_ipv6_route(patricia_node *root);
+struct graph_buffer;
 
-void ipv6_input(net_device *input_dev, uint8_t *buffer, ssize_t len);
+void ipv6_input_node(graph_buffer **buffers, uint32_t count);
+void ipv6_lookup_node(graph_buffer **buffers, uint32_t count);
+void ipv6_rewrite_node(graph_buffer **buffers, uint32_t count);
+void ipv6_local_output(graph_buffer *buffer);
 
 struct my_buf;
 
-void ipv6_encap_dev_output(net_device *output_dev, const uint8_t *dst_mac_addr, in6_addr dst_addr, my_buf *buffer, uint8_t next_hdr_num);
+void ipv6_encap_dev_output(net_device *output_dev, const uint8_t *dst_mac_addr, in6_addr dst_addr, in6_addr src_addr, my_buf *buffer, uint8_t next_hdr_num);
 
 void ipv6_encap_dev_mcast_output(net_device *output_dev, in6_addr dst_addr, my_buf *buffer, uint8_t next_hdr_num);
 
@@ -0,0 +1,82 @@
+#include "latency.h"
+
+#include "log.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+latency_histograms latency_unused; // ワーカー以外のスレッドが記録した分(表示しない)
+thread_local latency_histograms *latency = &latency_unused;
+
+double latency_cycles_per_ns = 1.0;
+
+const char *latency_stage_names[LATENCY_STAGE_COUNT] = {"rx-poll", "ethernet-input", "ipv6-input", "fib-lookup", "nd-resolve", "tx-flush"};
+
+uint64_t latency_clock_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* サイクル数を時間に直すため、TSCの周波数を測っておく */
+void init_latency() {
+  uint64_t start_ns = latency_clock_ns();
+  uint64_t start_cycles = latency_now();
+  timespec wait{0, 20000000};
+  nanosleep(&wait, nullptr);
+  uint64_t elapsed_ns = latency_clock_ns() - start_ns;
+  uint64_t elapsed_cycles = latency_now() - start_cycles;
+  latency_cycles_per_ns = (double)elapsed_cycles / elapsed_ns;
+  LOG_INFO("latency histograms enabled (%.3f cycles/ns)\n", latency_cycles_per_ns);
+}
+
+/* 現在のワーカーのヒストグラムを用意する */
+void latency_init_worker() { latency = new latency_histograms(); }
+
+/* バケットに入る最大の値 */
+uint64_t latency_bucket_value(uint32_t index) {
+  if (index < LATENCY_SUB_BUCKETS * 2) {
+    return index;
+  }
+  uint32_t shift = (index >> LATENCY_SUB_BUCKET_BITS) - 1;
+  uint64_t mantissa = LATENCY_SUB_BUCKETS + (index & (LATENCY_SUB_BUCKETS - 1));
+  return ((mantissa + 1) << shift) - 1;
+}
+
+/* 記録した値のうち、割合ratioの位置にある値 */
+uint64_t latency_percentile(const latency_histogram *hist, double ratio) {
+  uint64_t rank = (uint64_t)(hist->count * ratio);
+  if (rank >= hist->count) {
+    rank = hist->count - 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen > rank) {
+      uint64_t value = latency_bucket_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+/* 現在のワーカーのヒストグラムを表示する */
+void dump_latency_histograms() {
+  printf("|------STAGE-----|---SAMPLES---|-----P50-----|-----P99-----|----P99.9----|-----MAX-----|\n");
+  for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+    const latency_histogram *hist = &latency->stages[i];
+    if (hist->count == 0) {
+      printf("| %14s | %11d | %11s | %11s | %11s | %11s |\n", latency_stage_names[i], 0, "-", "-", "-", "-");
+      continue;
+    }
+    uint64_t values[4] = {latency_percentile(hist, 0.5), latency_percentile(hist, 0.99), latency_percentile(hist, 0.999), hist->max};
+    printf("| %14s | %11lu |", latency_stage_names[i], hist->count);
+    for (uint64_t value : values) {
+      printf(" %8.0f ns |", value / latency_cycles_per_ns);
+    }
+    printf("\n");
+  }
+  printf("|----------------|-------------|-------------|-------------|-------------|-------------|\n");
+}
+
+void reset_latency_histograms() { memset(latency, 0, sizeof(latency_histograms)); }
@@ -0,0 +1,93 @@
+#ifndef CURO_LATENCY_H
+#define CURO_LATENCY_H
+
+#include "config.h"
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * 処理の段階ごとにかかったサイクル数をヒストグラムに記録する
+ * ENABLE_LATENCY_HISTOGRAMが無効ならLATENCY_*マクロは何も生成しない
+ * 有効なら1回の記録はTSCの読み出しと、バケットの位置の計算(clz1回)と加算だけで済む
+ *
+ * ヒストグラムは対数と線形を組み合わせたもの(HDRヒストグラムと同じ考え方)で、
+ * 2の累乗の区間ごとにLATENCY_SUB_BUCKETS個に等分するので、相対誤差は1/32以下になる
+ */
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BITS 40 // これ以上のサイクル数は最後のバケットにまとめる(3GHzで約6分)
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/* 計測する段階 */
+enum latency_stage : uint8_t {
+  LATENCY_STAGE_RX_POLL,        // デバイスからの受信(recvmmsg)
+  LATENCY_STAGE_ETHERNET_INPUT, // ethernet-inputノード(1パケットあたり)
+  LATENCY_STAGE_IPV6_INPUT,     // ipv6-inputノード(1パケットあたり)
+  LATENCY_STAGE_FIB_LOOKUP,     // ルーティングテーブルの検索
+  LATENCY_STAGE_ND_RESOLVE,     // 近隣キャッシュの検索とアドレス解決の開始
+  LATENCY_STAGE_TX_FLUSH,       // 送信キューのまとめての送信(sendmmsg)
+  LATENCY_STAGE_COUNT
+};
+
+struct latency_histogram {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+};
+
+/* ワーカーごとのヒストグラム(そのワーカーだけが書き込む) */
+struct latency_histograms {
+  latency_histogram stages[LATENCY_STAGE_COUNT];
+};
+
+extern thread_local latency_histograms *latency;
+
+inline uint64_t latency_now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+inline uint32_t latency_bucket_index(uint64_t value) {
+  if (value < LATENCY_SUB_BUCKETS * 2) {
+    return value;
+  }
+  uint32_t bits = 63 - __builtin_clzll(value); // 最上位のビットの位置
+  if (bits >= LATENCY_MAX_BITS) {
+    return LATENCY_BUCKETS - 1;
+  }
+  uint32_t shift = bits - LATENCY_SUB_BUCKET_BITS;
+  return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+inline void latency_record(latency_stage stage, uint64_t cycles) {
+  latency_histogram *hist = &latency->stages[stage];
+  hist->buckets[latency_bucket_index(cycles)]++;
+  hist->count++;
+  if (cycles > hist->max) {
+    hist->max = cycles;
+  }
+}
+
+#ifdef ENABLE_LATENCY_HISTOGRAM
+#define LATENCY_START(name) uint64_t name = latency_now()
+#define LATENCY_RECORD(stage, name) latency_record(stage, latency_now() - (name))
+#define LATENCY_RECORD_CYCLES(stage, cycles) latency_record(stage, cycles)
+#else
+#define LATENCY_START(name)
+#define LATENCY_RECORD(stage, name)
+#define LATENCY_RECORD_CYCLES(stage, cycles)
+#endif
+
+void init_latency();
+void latency_init_worker();
+void dump_latency_histograms();
+void reset_latency_histograms();
+
+#endif // CURO_LATENCY_H
@@ -0,0 +1,291 @@
+#include "log.h"
+
+#include "spsc_ring.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <pthread.h>
+
+std::atomic<uint8_t> log_levels[LOG_CATEGORY_COUNT] = {DEBUG_ETHERNET, DEBUG_IPV6, DEBUG_ICMPV6, DEBUG_TRIE, DEBUG_INFO};
+
+const char *log_category_names[LOG_CATEGORY_COUNT] = {"ether", "ipv6", "icmpv6", "trie", "info"};
+
+/* スレッドごとのログのリング */
+struct log_ring {
+  spsc_ring<log_record, LOG_RING_SIZE> ring;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> drops{0}; // 書き込み側が更新
+  uint64_t drops_reported = 0;                             // 出力スレッドが更新
+};
+
+log_ring *log_rings[LOG_MAX_THREADS];
+std::atomic<uint32_t> log_ring_count{0};
+std::atomic<uint64_t> log_register_drops{0}; // リングを割り当てられなかったスレッドが捨てた数
+
+thread_local log_ring *log_local_ring = nullptr;
+thread_local bool log_local_ring_failed = false;
+
+pthread_t log_thread;
+std::atomic<bool> log_running{false};
+bool log_thread_started = false;
+
+uint64_t log_now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 現在のスレッドのリングを用意する(スレッドが初めてログを書く時に1度だけ) */
+log_ring *log_register_thread() {
+  if (log_local_ring_failed) {
+    return nullptr;
+  }
+  static std::atomic<uint32_t> reserved{0};
+  uint32_t index = reserved.fetch_add(1, std::memory_order_relaxed);
+  if (index >= LOG_MAX_THREADS) {
+    log_local_ring_failed = true;
+    return nullptr;
+  }
+  log_ring *ring = new log_ring();
+  log_rings[index] = ring;
+  // 番号の順に公開する(先に番号を取ったスレッドが登録し終えるのを待つ)
+  uint32_t expected = index;
+  while (!log_ring_count.compare_exchange_weak(expected, index + 1, std::memory_order_release, std::memory_order_relaxed)) {
+    expected = index;
+  }
+  log_local_ring = ring;
+  return ring;
+}
+
+/* 書き込むエントリをリングから取り出す(一杯ならnullptr) */
+log_record *log_begin(log_category category, const char *format) {
+  log_ring *ring = log_local_ring;
+  if (ring == nullptr) {
+    ring = log_register_thread();
+    if (ring == nullptr) {
+      log_register_drops.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+  }
+  log_record *record = ring->ring.reserve();
+  if (record == nullptr) {
+    ring->drops.store(ring->drops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  record->timestamp = log_now_ns();
+  record->format = format;
+  record->category = category;
+  record->truncated = false;
+  record->len = 0;
+  return record;
+}
+
+void log_commit() { log_local_ring->ring.commit(); }
+
+/* 書式の変換指定を1つ読み、引数の種類に合わせた指定に直して出力する */
+const char *log_format_arg(FILE *out, const char *p, const log_record *record, uint16_t *offset) {
+  // フラグ、幅、精度をそのまま残し、長さの修飾子は引数の種類に合わせて付け直す
+  char spec[32] = "%";
+  size_t spec_len = 1;
+  while (*p != '\0' and strchr("-+ #0123456789.*", *p) != nullptr and spec_len < sizeof(spec) - 4) {
+    spec[spec_len++] = *p++;
+  }
+  while (*p != '\0' and strchr("hlLqjzt", *p) != nullptr) {
+    p++;
+  }
+  char conversion = *p;
+  if (conversion == '\0') {
+    return p;
+  }
+  p++;
+
+  if (*offset >= record->len) {
+    fputs("(?)", out);
+    return p;
+  }
+  uint8_t type = record->args[*offset];
+  const uint8_t *data = &record->args[*offset + 1];
+
+  switch (type) {
+  case LOG_ARG_INT:
+  case LOG_ARG_UINT: {
+    uint64_t v;
+    memcpy(&v, data, sizeof(v));
+    *offset += 1 + sizeof(v);
+    if (conversion == 'c') {
+      spec[spec_len++] = 'c';
+      spec[spec_len] = '\0';
+      fprintf(out, spec, (int)v);
+    } else {
+      spec[spec_len++] = 'l';
+      spec[spec_len++] = 'l';
+      spec[spec_len++] = conversion == 's' ? 'd' : conversion;
+      spec[spec_len] = '\0';
+      fprintf(out, spec, v);
+    }
+  } break;
+  case LOG_ARG_DOUBLE: {
+    double v;
+    memcpy(&v, data, sizeof(v));
+    *offset += 1 + sizeof(v);
+    spec[spec_len++] = conversion;
+    spec[spec_len] = '\0';
+    fprintf(out, spec, v);
+  } break;
+  case LOG_ARG_POINTER: {
+    const void *v;
+    memcpy(&v, data, sizeof(v));
+    *offset += 1 + sizeof(v);
+    fprintf(out, "%p", v);
+  } break;
+  case LOG_ARG_STRING:
+  case LOG_ARG_IN6_ADDR:
+  case LOG_ARG_MAC_ADDR: {
+    char str[INET6_ADDRSTRLEN > LOG_MAX_STRING_LEN + 1 ? INET6_ADDRSTRLEN : LOG_MAX_STRING_LEN + 1];
+    if (type == LOG_ARG_STRING) {
+      memcpy(str, &data[1], data[0]);
+      str[data[0]] = '\0';
+      *offset += 2 + data[0];
+    } else if (type == LOG_ARG_IN6_ADDR) {
+      inet_ntop(AF_INET6, data, str, sizeof(str));
+      *offset += 1 + sizeof(in6_addr);
+    } else {
+      strcpy(str, mac_addr_toa(data));
+      *offset += 1 + 6;
+    }
+    spec[spec_len++] = 's';
+    spec[spec_len] = '\0';
+    fprintf(out, spec, str);
+  } break;
+  default:
+    *offset = record->len;
+    break;
+  }
+  return p;
+}
+
+/* エントリを書式化して出力する */
+void log_print_record(FILE *out, const log_record *record) {
+  fprintf(out, "[%s] ", log_category_names[record->category]);
+  uint16_t offset = 0;
+  const char *p = record->format;
+  while (*p != '\0') {
+    const char *percent = strchr(p, '%');
+    if (percent == nullptr) {
+      fputs(p, out);
+      break;
+    }
+    fwrite(p, 1, percent - p, out);
+    p = percent + 1;
+    if (*p == '%') {
+      fputc('%', out);
+      p++;
+      continue;
+    }
+    p = log_format_arg(out, p, record, &offset);
+  }
+  if (record->truncated) {
+    fputs("[log] previous record truncated\n", out);
+  }
+}
+
+/* 全てのリングから時刻の古い順にエントリを出力する(出力したらtrue) */
+bool log_drain() {
+  bool printed = false;
+  uint32_t count = log_ring_count.load(std::memory_order_acquire);
+  for (int n = 0; n < LOG_RING_SIZE; n++) { // 書き込みが続いても、途中で捨てた数の報告とフラッシュを行う
+    log_ring *oldest = nullptr;
+    log_record *oldest_record = nullptr;
+    for (uint32_t i = 0; i < count; i++) {
+      log_record *record = log_rings[i]->ring.front();
+      if (record != nullptr and (oldest_record == nullptr or record->timestamp < oldest_record->timestamp)) {
+        oldest = log_rings[i];
+        oldest_record = record;
+      }
+    }
+    if (oldest == nullptr) {
+      break;
+    }
+    log_print_record(stdout, oldest_record);
+    oldest->ring.release();
+    printed = true;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t drops = log_rings[i]->drops.load(std::memory_order_relaxed);
+    if (drops != log_rings[i]->drops_reported) {
+      printf("[log] %lu records dropped (ring full)\n", drops - log_rings[i]->drops_reported);
+      log_rings[i]->drops_reported = drops;
+      printed = true;
+    }
+  }
+  static uint64_t register_drops_reported = 0;
+  uint64_t register_drops = log_register_drops.load(std::memory_order_relaxed);
+  if (register_drops != register_drops_reported) {
+    printf("[log] %lu records dropped (too many threads)\n", register_drops - register_drops_reported);
+    register_drops_reported = register_drops;
+    printed = true;
+  }
+  if (printed) {
+    fflush(stdout);
+  }
+  return printed;
+}
+
+/* ログを出力するスレッド */
+void *log_thread_main(void *) {
+  while (log_running.load(std::memory_order_acquire)) {
+    if (!log_drain()) {
+      timespec wait{0, 1000000}; // 何も無ければ1ミリ秒待つ
+      nanosleep(&wait, nullptr);
+    }
+  }
+  return nullptr;
+}
+
+/* ログを出力するスレッドを始める */
+void init_log() {
+  // 環境変数でカテゴリごとのレベルを変えられる(例: CURO_LOG=ipv6=1,ether=0)
+  const char *env = getenv("CURO_LOG");
+  while (env != nullptr and *env != '\0') {
+    for (int i = 0; i < LOG_CATEGORY_COUNT; i++) {
+      size_t len = strlen(log_category_names[i]);
+      if (strncmp(env, log_category_names[i], len) == 0 and env[len] == '=') {
+        set_log_level((log_category)i, atoi(&env[len + 1]));
+      }
+    }
+    env = strchr(env, ',');
+    env = env != nullptr ? env + 1 : nullptr;
+  }
+
+  log_running.store(true, std::memory_order_release);
+  if (pthread_create(&log_thread, nullptr, log_thread_main, nullptr) != 0) {
+    LOG_ERROR("failed to create log thread\n");
+    log_running.store(false);
+    return;
+  }
+  log_thread_started = true;
+  atexit(stop_log); // exitで終了した時も残りを出力する
+}
+
+/* ログを出力するスレッドを止めて、残っているエントリを出力する */
+void stop_log() {
+  if (log_thread_started) {
+    log_running.store(false, std::memory_order_release);
+    pthread_join(log_thread, nullptr);
+    log_thread_started = false;
+  }
+  log_drain();
+}
+
+void set_log_level(log_category category, uint8_t level) { log_levels[category].store(level, std::memory_order_relaxed); }
+
+/* 転送処理のデバッグログをまとめて有効・無効にする */
+void toggle_debug_log() {
+  uint8_t level = log_levels[LOG_CATEGORY_IPV6].load(std::memory_order_relaxed) > 0 ? 0 : 1;
+  set_log_level(LOG_CATEGORY_ETHERNET, level);
+  set_log_level(LOG_CATEGORY_IPV6, level);
+  set_log_level(LOG_CATEGORY_ICMPV6, level);
+  printf("debug log %s\n", level > 0 ? "enabled" : "disabled");
+}
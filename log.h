@@ -2,28 +2,143 @@
 #define CURO_LOG_H
 
 #include "config.h"
+#include <atomic>
+#include <cstring>
+#include <netinet/in.h>
+#include <type_traits>
 
-#if DEBUG_ETHERNET > 0
-#define LOG_ETHERNET(...) printf("[ether] ");printf(__VA_ARGS__)
-#else
-#define LOG_ETHERNET(...)
-#endif
-
-#if DEBUG_IPV6 > 0
-#define LOG_IPV6(...) printf("[ipv6] ");printf(__VA_ARGS__);
-#else
-#define LOG_IPV6(...)
-#endif
-
-#if DEBUG_ICMPV6 > 0
-#define LOG_ICMPV6(...)                                                                                                                                                                                  \
-    printf("[icmpv6] ");                                                                                                                                                                                 \
-    printf(__VA_ARGS__);
-#else
-#define LOG_ICMPV6(...)
-#endif
-
-#define LOG_INFO(...)  printf("[info] "); printf(__VA_ARGS__)
+#define LOG_RECORD_SIZE 256   // 1つのログのエントリの大きさ
+#define LOG_RING_SIZE 4096    // スレッドごとのログのリングの大きさ(2の累乗)
+#define LOG_MAX_THREADS 256   // ログを書けるスレッドの最大数
+#define LOG_MAX_STRING_LEN 128 // 引数の文字列をエントリにコピーする最大の長さ
+
+/*
+ * ログはカテゴリごとに実行時にレベルを変えられる
+ * 無効なレベルのログは分岐1つで飛ばし、引数の評価も書式化も行わない
+ * 有効なログは書式と引数をバイナリのままスレッドごとのリングに書き込み、
+ * バックグラウンドのスレッドが書式化して出力するので、転送処理が出力で止まることはない
+ * in6_addrとlog_mac()で包んだMACアドレスは%sで受け取り、書式化する時に文字列にする
+ */
+enum log_category : uint8_t {
+  LOG_CATEGORY_ETHERNET,
+  LOG_CATEGORY_IPV6,
+  LOG_CATEGORY_ICMPV6,
+  LOG_CATEGORY_TRIE,
+  LOG_CATEGORY_INFO,
+  LOG_CATEGORY_COUNT
+};
+
+extern std::atomic<uint8_t> log_levels[LOG_CATEGORY_COUNT];
+
+inline bool log_enabled(log_category category, uint8_t level) { return __builtin_expect(log_levels[category].load(std::memory_order_relaxed) >= level, 0); }
+
+#define LOG_AT(category, level, ...)        \
+  do {                                      \
+    if (log_enabled(category, level)) {     \
+      log_write(category, __VA_ARGS__);     \
+    }                                       \
+  } while (0)
+
+#define LOG_ETHERNET(...) LOG_AT(LOG_CATEGORY_ETHERNET, 1, __VA_ARGS__)
+#define LOG_IPV6(...) LOG_AT(LOG_CATEGORY_IPV6, 1, __VA_ARGS__)
+#define LOG_ICMPV6(...) LOG_AT(LOG_CATEGORY_ICMPV6, 1, __VA_ARGS__)
+#define LOG_TRIE(...) LOG_AT(LOG_CATEGORY_TRIE, 1, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_CATEGORY_INFO, 1, __VA_ARGS__)
+
+// エラーは稀で、直後に終了することもあるのでその場で出力する
 #define LOG_ERROR(...) fprintf(stderr, "[error %s:%d] ", __FILE__, __LINE__);fprintf(stderr, __VA_ARGS__);
 
-#endif //CURO_LOG_H
+/* エントリに書き込む引数の種類 */
+enum log_arg_type : uint8_t {
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_POINTER,
+  LOG_ARG_STRING,
+  LOG_ARG_IN6_ADDR,
+  LOG_ARG_MAC_ADDR
+};
+
+/* リングに書き込むログのエントリ */
+struct log_record {
+  uint64_t timestamp; // 書き込んだ時刻(ナノ秒)、スレッドをまたいで並べるのに使う
+  const char *format; // 書式(文字列リテラルなのでポインタだけ持つ)
+  uint8_t category;
+  uint8_t truncated;  // 引数が入りきらなかったか
+  uint16_t len;       // argsに書き込んだ長さ
+  uint8_t args[LOG_RECORD_SIZE - 2 * sizeof(uint64_t) - 4];
+};
+
+/* MACアドレスを書式化するときまで6バイトのまま持つための引数 */
+struct log_mac_addr {
+  uint8_t addr[6];
+};
+
+inline log_mac_addr log_mac(const uint8_t *addr) {
+  log_mac_addr mac;
+  memcpy(mac.addr, addr, 6);
+  return mac;
+}
+
+void init_log();
+void stop_log();
+void set_log_level(log_category category, uint8_t level);
+void toggle_debug_log();
+
+log_record *log_begin(log_category category, const char *format);
+void log_commit();
+
+inline void log_put_raw(log_record *record, log_arg_type type, const void *data, uint16_t len) {
+  if ((size_t)record->len + 1 + len > sizeof(record->args)) {
+    record->truncated = true;
+    return;
+  }
+  record->args[record->len] = type;
+  memcpy(&record->args[record->len + 1], data, len);
+  record->len += 1 + len;
+}
+
+/* 文字列はポインタの先が書き換わるかもしれないのでコピーしておく */
+inline void log_put_string(log_record *record, const char *str) {
+  uint8_t buf[LOG_MAX_STRING_LEN + 1];
+  uint8_t len = str == nullptr ? 0 : strnlen(str, LOG_MAX_STRING_LEN);
+  buf[0] = len;
+  memcpy(&buf[1], str, len);
+  log_put_raw(record, LOG_ARG_STRING, buf, len + 1);
+}
+
+inline void log_put(log_record *record, const in6_addr &addr) { log_put_raw(record, LOG_ARG_IN6_ADDR, &addr, sizeof(in6_addr)); }
+
+inline void log_put(log_record *record, const log_mac_addr &mac) { log_put_raw(record, LOG_ARG_MAC_ADDR, mac.addr, 6); }
+
+template <typename T> inline void log_put(log_record *record, const T &value) {
+  using V = std::decay_t<T>;
+  if constexpr (std::is_same_v<V, char *> or std::is_same_v<V, const char *>) {
+    log_put_string(record, value);
+  } else if constexpr (std::is_floating_point_v<V>) {
+    double v = value;
+    log_put_raw(record, LOG_ARG_DOUBLE, &v, sizeof(v));
+  } else if constexpr (std::is_pointer_v<V>) {
+    const void *v = value;
+    log_put_raw(record, LOG_ARG_POINTER, &v, sizeof(v));
+  } else if constexpr (std::is_signed_v<V>) {
+    int64_t v = value;
+    log_put_raw(record, LOG_ARG_INT, &v, sizeof(v));
+  } else {
+    static_assert(std::is_integral_v<V> or std::is_enum_v<V>, "unsupported log argument");
+    uint64_t v = (uint64_t)value;
+    log_put_raw(record, LOG_ARG_UINT, &v, sizeof(v));
+  }
+}
+
+/* ログをリングに書き込む(リングが一杯なら捨てて数える) */
+template <typename... Args> void log_write(log_category category, const char *format, const Args &...args) {
+  log_record *record = log_begin(category, format);
+  if (record == nullptr) {
+    return;
+  }
+  (log_put(record, args), ...);
+  log_commit();
+}
+
+#endif // CURO_LOG_H
@@ -6,18 +6,37 @@
 #include <netpacket/packet.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "acl.h"
+#include "checksum.h"
 #include "config.h"
+#include "control.h"
 #include "ethernet.h"
+#include "graph.h"
 #include "ipv6.h"
+#include "latency.h"
 #include "log.h"
+#include "my_buf.h"
 #include "nd.h"
 #include "net.h"
+#include "nptv6.h"
 #include "patricia_trie.h"
+#include "pipeline.h"
+#include "probes.h"
+#include "punt.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
 #include "utils.h"
+#include "worker.h"
+
+#ifndef PACKET_FANOUT_HASH
+#define PACKET_FANOUT_HASH 0 // linux/if_packet.hの値(netpacket/packet.hには無い)
+#endif
 
 /*  無視するネットワークインターフェースたち  */
 #define IGNORE_INTERFACES                                                                                                                                                                              \
@@ -34,24 +53,9 @@ bool is_ignore_interface(const char *ifname) {
   return false;
 }
 
-/* インターフェース名からデバイスを探す */
-net_device *get_net_device_by_name(const char *name) {
-  net_device *dev;
-  for (dev = net_dev_list; dev; dev = dev->next) {
-    if (strcmp(dev->name, name) == 0) {
-      return dev;
-    }
-  }
-  return nullptr;
-}
-
 /* 設定する */
 void configure() {
 
-  in6_addr root_addr;
-  memset(&root_addr, 0x00, sizeof(root_addr));
-  ipv6_fib = create_patricia_node(root_addr, 0, false, nullptr);
-
   in6_addr addr6_to_host1;
   inet_pton(AF_INET6, "2001:db8:0:1001::1", &addr6_to_host1);
 
@@ -75,26 +79,74 @@ void configure() {
   inet_pton(AF_INET6, "2001:db8:0:1001::2", &addr6_host1);
   // ip -6 neigh add 2001:db8:0:1001::1 lladdr 9e:b7:96:aa:4a:8a dev host1-router1
 
-  update_nd_table_entry(get_net_device_by_name("router1-host1"), mac_addr_host1, addr6_host1);
+  configure_static_neighbor(get_net_device_by_name("router1-host1"), mac_addr_host1, addr6_host1);
 }
 
 /* 宣言のみ */
 int net_device_transmit(struct net_device *dev, uint8_t *buffer, size_t len);
+int net_device_flush(net_device *dev);
 int net_device_poll(net_device *dev);
 
 /* デバイスのプラットフォーム依存のデータ */
 struct net_device_data {
-  int fd; // socketのfile descriptor
+  int ifindex; // インターフェースのインデックス
 };
 
+/*
+ * ワーカー用にデバイスのソケットを開く
+ * 同じデバイスのソケットは同じfanoutグループに入れ、受信したパケットをフロー単位でワーカーに振り分ける
+ * receiveがfalseなら、プロトコル0のままbindして送信だけに使う(制御プレーンのスレッド用)
+ */
+int open_device_socket(net_device *dev, bool receive = true) {
+  // ETH_P_ALLで開くと全デバイス向けのフックが登録され、bindの付け替えで毎回RCUの猶予期間を待つので、プロトコル0で開いてからbindで指定する
+  int sock = socket(PF_PACKET, SOCK_RAW | SOCK_NONBLOCK, 0);
+  if (sock == -1) {
+    LOG_ERROR("failed open socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // ソケットにインターフェースをbindする
+  sockaddr_ll addr{};
+  memset(&addr, 0x00, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = receive ? htons(ETH_P_ALL) : 0;
+  addr.sll_ifindex = ((net_device_data *)dev->data)->ifindex;
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    LOG_ERROR("failed to bind: %s\n", strerror(errno));
+    close(sock);
+    return -1;
+  }
+
+  if (receive and worker_count > 1) {
+    int fanout_id = (getpid() + dev->index) & 0xffff;
+    int fanout_arg = fanout_id | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) == -1) {
+      LOG_ERROR("failed to setsockopt PACKET_FANOUT: %s\n", strerror(errno));
+      close(sock);
+      return -1;
+    }
+  }
+  return sock;
+}
+
 /* エントリポイント */
 int main() {
   struct ifreq ifr {};
   struct ifaddrs *addrs;
 
+  // ログを出力するスレッドを始める
+  init_log();
+
   // ネットワークインターフェースを情報を取得
   getifaddrs(&addrs);
 
+  // インターフェースの情報を得るためのソケット(デバイスが多くても開き直さずに使い回す)
+  int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    LOG_ERROR("failed open socket: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
   for (ifaddrs *tmp = addrs; tmp; tmp = tmp->ifa_next) {
     if (tmp->ifa_addr && tmp->ifa_addr->sa_family == AF_PACKET) {
 
@@ -107,13 +159,6 @@ int main() {
         continue;
       }
 
-      // ソケットをオープン
-      int sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-      if (sock == -1) {
-        LOG_ERROR("failed open socket: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-      }
-
       // インターフェースのインデックスを取得
       if (ioctl(sock, SIOCGIFINDEX, &ifr) == -1) {
         LOG_ERROR("failed to ioctl SIOCGIFINDEX: %s\n", strerror(errno));
@@ -121,22 +166,11 @@ int main() {
         exit(EXIT_FAILURE);
       }
 
-      // ソケットにインターフェースをbindする
-      sockaddr_ll addr{};
-      memset(&addr, 0x00, sizeof(addr));
-      addr.sll_family = AF_PACKET;
-      addr.sll_protocol = htons(ETH_P_ALL);
-      addr.sll_ifindex = ifr.ifr_ifindex;
-      if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        LOG_ERROR("failed to bind: %s\n", strerror(errno));
-        close(sock);
-        exit(EXIT_FAILURE);
-      }
+      int ifindex = ifr.ifr_ifindex;
 
       // インターフェースのMACアドレスを取得
       if (ioctl(sock, SIOCGIFHWADDR, &ifr) != 0) {
         LOG_ERROR("failed to ioctl SIOCGIFHWADDR %s\n", strerror(errno));
-        close(sock);
         continue;
       }
 
@@ -146,6 +180,7 @@ int main() {
       net_device *dev = (net_device *)calloc(1, sizeof(net_device) + sizeof(net_device_data));
       // 送信用の関数を設定
       dev->ops.transmit = net_device_transmit;
+      dev->ops.flush = net_device_flush;
       // 受信用の関数を設定
       dev->ops.poll = net_device_poll;
 
@@ -153,19 +188,21 @@ int main() {
       strcpy(dev->name, tmp->ifa_name);
       // net_deviceにMACアドレスをセット
       memcpy(dev->mac_addr, &ifr.ifr_hwaddr.sa_data[0], 6);
-      ((net_device_data *)dev->data)->fd = sock;
+      // インターフェースのMTUを取得(MACアドレスと同じ領域に返るので、コピーした後に呼ぶ)
+      if (ioctl(sock, SIOCGIFMTU, &ifr) == 0) {
+        dev->mtu = ifr.ifr_mtu;
+      }
+      ((net_device_data *)dev->data)->ifindex = ifindex;
 
-      LOG_INFO("created device %s socket %d address %s \n", dev->name, sock, mac_addr_toa(dev->mac_addr));
+      // 通し番号とifindexで引けるように登録する
+      net_device_register(dev, ifindex);
 
-      // net_deviceの連結リストに連結させる
-      net_device *next;
-      next = net_dev_list;
-      net_dev_list = dev;
-      dev->next = next;
+      LOG_INFO("created device %s ifindex %d address %s mtu %u\n", dev->name, ifindex, log_mac(dev->mac_addr), dev->mtu);
     }
   }
   // 確保されていたメモリを解放
   freeifaddrs(addrs);
+  close(sock); // 受信・送信用のソケットはワーカーごとに開く
 
   // 1つも有効化されたインターフェースをが無かったら終了
   if (net_dev_list == nullptr) {
@@ -173,13 +210,67 @@ int main() {
     exit(EXIT_FAILURE);
   }
 
-  init_nd_table();
+  // インターフェースが多いとソケットの数も増えるので、開けるファイルの数を上限まで上げる
+  rlimit nofile{};
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 and nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+
+#ifdef ENABLE_PIPELINE_MODE
+  // 検索を行うワーカーを1つだけ用意し、デバイスのソケットは受信・送信スレッドが使う
+  if (init_workers(1, net_dev_count) < 0 or init_pipeline(net_dev_count) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  for (net_device *dev = net_dev_list; dev; dev = dev->next) {
+    int sock = open_device_socket(dev);
+    if (sock < 0) {
+      exit(EXIT_FAILURE);
+    }
+    pipeline_set_device_fd(dev, sock);
+  }
+  LOG_INFO("using pipeline mode\n");
+#else
+  // ワーカーを準備して、ワーカーごとにデバイスのソケットを開く
+  if (init_workers(NUM_WORKERS, net_dev_count) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < worker_count; i++) {
+    for (net_device *dev = net_dev_list; dev; dev = dev->next) {
+      int sock = open_device_socket(dev);
+      if (sock < 0) {
+        exit(EXIT_FAILURE);
+      }
+      workers[i]->devs[dev->index].fd = sock;
+    }
+  }
+  LOG_INFO("using %d workers\n", worker_count);
+#ifdef ENABLE_PUNT_QUEUE
+  // 自分宛てのパケットを処理する制御プレーンのスレッドは、受信はワーカーから受け取り、送信だけ自分のソケットで行う
+  if (init_punt(net_dev_count) < 0) {
+    exit(EXIT_FAILURE);
+  }
+  for (net_device *dev = net_dev_list; dev; dev = dev->next) {
+    int sock = open_device_socket(dev, false);
+    if (sock < 0) {
+      exit(EXIT_FAILURE);
+    }
+    punt_worker->devs[dev->index].fd = sock;
+  }
+#endif
+#endif
+#ifdef ENABLE_LATENCY_HISTOGRAM
+  init_latency();
+#endif
+  init_trace();
+  LOG_INFO("using %s checksum\n", checksum_impl_name);
 
-  in6_addr root_addr;
-  memset(&root_addr, 0x00, sizeof(root_addr));
-  ipv6_fib = create_patricia_node(root_addr, 0, false, nullptr);
+#ifdef ENABLE_STATS_EXPORT
+  // 統計を共有メモリに公開する(開けなくても転送は続ける)
+  init_stats_export(worker_count + (punt_worker != nullptr ? 1 : 0), net_dev_count);
+#endif
 
-  // ネットワーク設定の投入
+  // ネットワーク設定の投入(各ワーカーへのメッセージとして積まれる)
   configure();
 
 #ifdef ENABLE_COMMAND
@@ -193,10 +284,10 @@ int main() {
 #endif
 
   int epoll_fd;
-  epoll_event ev, ev_ret[MAX_INTERFACES + 1];
+  epoll_event ev, ev_ret[MAX_EPOLL_EVENTS];
 
-  // epollの初期化
-  epoll_fd = epoll_create(MAX_INTERFACES + 1);
+  // epollの初期化(メインスレッドは対話的なコマンドと制御ソケットだけを扱う)
+  epoll_fd = epoll_create(MAX_EPOLL_EVENTS);
   if (epoll_fd < 0) {
     perror("failed to epoll_create");
     return 1;
@@ -210,65 +301,188 @@ int main() {
     return 1;
   }
 
-  for (net_device *dev = net_dev_list; dev; dev = dev->next) {
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.fd = ((net_device_data *)dev->data)->fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ((net_device_data *)dev->data)->fd, &ev) != 0) {
-      perror("failed to epoll_ctl");
-      return 1;
-    }
-  }
+#ifdef ENABLE_CONTROL_SOCKET
+  // 経路更新を受け付ける制御ソケットを開く
+  control_init(epoll_fd);
+#endif
+
+  // 転送処理を始める
+  start_workers();
+#ifdef ENABLE_PIPELINE_MODE
+  start_pipeline();
+#endif
 
-  // デバイスから通信を受信
   int nfds;
+  int timeout = -1;
   while (true) {
-    nfds = epoll_wait(epoll_fd, ev_ret, MAX_INTERFACES + 1, -1);
-    if (nfds <= 0) {
+    nfds = epoll_wait(epoll_fd, ev_ret, MAX_EPOLL_EVENTS, timeout);
+    if (nfds < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       perror("failed to epoll_wait");
       return 1;
     }
 
     for (int i = 0; i < nfds; i++) {
+#ifdef ENABLE_CONTROL_SOCKET
+      if (control_handle_event(epoll_fd, ev_ret[i].data.fd)) {
+        continue;
+      }
+#endif
       if (ev_ret[i].data.fd == STDIN_FILENO) {
         int input = getchar(); // 入力を受け取る
         if (input != -1) {     // 入力があったら
           printf("\n");
           if (input == 'a') {
-            dump_nd_table_entry();
+            worker_run_command('a', true);
           } else if (input == 'r')
-            dump_ipv6_route(ipv6_fib);
-          else if (input == 'q')
+            worker_run_command('r', false); // 経路表は全てのワーカーで同じ
+          else if (input == 'c') {
+            dump_worker_counters();
+          } else if (input == 'g') { // ノードごとのカウンタ
+            worker_run_command('g', true);
+          } else if (input == 'f') { // フローキャッシュ
+            worker_run_command('f', true);
+          } else if (input == 'A') { // ACLのルールごとのヒット数
+            dump_acl();
+          } else if (input == 'N') { // NPTv6の変換の組
+            dump_npt_mappings();
+          } else if (input == 'l') { // 転送処理のデバッグログの切り替え
+            toggle_debug_log();
+          } else if (input == 't') { // パケットトレースの開始・停止
+            toggle_trace();
+          } else if (input == 'T') { // 記録したパケットトレースの表示
+            dump_trace();
+#ifdef ENABLE_LATENCY_HISTOGRAM
+          } else if (input == 'h') { // 段階ごとの処理時間のヒストグラム
+            worker_run_command('h', true);
+          } else if (input == 'H') {
+            worker_run_command('H', true);
+#endif
+#ifdef ENABLE_PIPELINE_MODE
+          } else if (input == 'p') {
+            dump_pipeline_stats();
+#endif
+          } else if (input == 'q')
             goto exit_loop;
         }
       }
-
-      for (net_device *dev = net_dev_list; dev; dev = dev->next) {
-        if (ev_ret[i].data.fd == ((net_device_data *)dev->data)->fd) {
-          dev->ops.poll(dev);
-        }
-      }
     }
+
+#ifdef ENABLE_CONTROL_SOCKET
+    // ワーカーのキューが一杯で受信を止めている制御クライアントがあれば、空くのを定期的に確認する
+    timeout = control_resume_clients(epoll_fd) ? 10 : -1;
+#endif
   }
 
 exit_loop:
+#ifdef ENABLE_PIPELINE_MODE
+  stop_pipeline();
+#endif
+  stop_workers();
+#ifdef ENABLE_CONTROL_SOCKET
+  control_close();
+#endif
+#ifdef ENABLE_STATS_EXPORT
+  close_stats_export();
+#endif
 
+  stop_log();
   printf("Goodbye!\n");
   return 0;
 }
 
-/* ネットデバイスの送信処理 */
+/* ネットデバイスの送信処理(送信キューに入れて、周期の最後にまとめて送信する) */
 int net_device_transmit(struct net_device *dev, uint8_t *buffer, size_t len) {
-  // Socketを通して送信
-  send(((net_device_data *)dev->data)->fd, buffer, len, 0);
+#ifdef ENABLE_PIPELINE_MODE
+  // 送信スレッドに渡す
+  worker_device *wdev = worker_device_of(dev);
+  if (pipeline_transmit(dev, buffer, len) == -1) {
+    return -1;
+  }
+  wdev->tx_packets++;
+  wdev->tx_bytes += len;
+  return 0;
+#else
+  return worker_queue_tx(dev, buffer, len);
+#endif
+}
+
+/* 送信キューのフレームをまとめて送信する */
+int net_device_flush(net_device *dev) {
+  worker_device *wdev = worker_device_of(dev);
+  mmsghdr msgs[TX_QUEUE_LEN];
+  iovec iovs[TX_QUEUE_LEN];
+
+  while (wdev->tx_count > 0) {
+    uint32_t count = wdev->tx_count;
+    for (uint32_t i = 0; i < count; i++) {
+      worker_tx_frame *frame = &wdev->tx_queue[(wdev->tx_head + i) & (TX_QUEUE_LEN - 1)];
+      iovs[i].iov_base = frame->data;
+      iovs[i].iov_len = frame->len;
+      memset(&msgs[i], 0, sizeof(mmsghdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // このワーカーのSocketを通して送信
+    LATENCY_START(flush_start);
+    int n = sendmmsg(wdev->fd, msgs, count, MSG_DONTWAIT);
+    LATENCY_RECORD(LATENCY_STAGE_TX_FLUSH, flush_start);
+    if (n == -1) {
+      if (errno == EAGAIN or errno == ENOBUFS) {
+        // ソケットのバッファが空くまでキューに残しておく(その間に来たものはキューが一杯なら捨てる)
+        wdev->tx_eagain++;
+        worker_set_tx_blocked(dev, true);
+        return 0;
+      }
+      // 先頭のフレームが送れない場合は、それを捨てて残りを送る
+      LOG_ERROR("failed to send on %s: %s\n", dev->name, strerror(errno));
+      wdev->tx_errors++;
+      n = 1;
+    } else {
+      wdev->tx_flushes++;
+      if ((uint32_t)n > wdev->tx_batch_max) {
+        wdev->tx_batch_max = n;
+      }
+      for (int i = 0; i < n; i++) {
+        wdev->tx_packets++;
+        wdev->tx_bytes += msgs[i].msg_len;
+        CURO_PROBE3(tx_frame, dev->name, iovs[i].iov_base, msgs[i].msg_len);
+      }
+    }
+
+    for (int i = 0; i < n; i++) {
+      worker_release_tx(&wdev->tx_queue[wdev->tx_head]);
+      wdev->tx_head = (wdev->tx_head + 1) & (TX_QUEUE_LEN - 1);
+    }
+    wdev->tx_count -= n;
+  }
   return 0;
 }
 
 /* ネットワークデバイスの受信処理 */
 int net_device_poll(net_device *dev) {
-  uint8_t buffer[1550];
-  // Socketから受信
-  ssize_t n = recv(((net_device_data *)dev->data)->fd, buffer, sizeof(buffer), 0);
+  worker_device *wdev = worker_device_of(dev);
+  mmsghdr msgs[GRAPH_VECTOR_SIZE];
+  iovec iovs[GRAPH_VECTOR_SIZE];
+  sockaddr_ll addrs[GRAPH_VECTOR_SIZE];
+
+  // グラフの受信用のバッファに1度にまとめて受信する
+  for (int i = 0; i < GRAPH_VECTOR_SIZE; i++) {
+    iovs[i].iov_base = graph->frames[i];
+    iovs[i].iov_len = GRAPH_FRAME_SIZE;
+    memset(&msgs[i], 0, sizeof(mmsghdr));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_ll);
+  }
+
+  // このワーカーのSocketから受信
+  LATENCY_START(poll_start);
+  int n = recvmmsg(wdev->fd, msgs, GRAPH_VECTOR_SIZE, MSG_DONTWAIT, nullptr);
   if (n == -1) {
     if (errno == EAGAIN) { // 受け取るデータが無い場合
       return 0;
@@ -276,8 +490,27 @@ int net_device_poll(net_device *dev) {
       return -1; // 他のエラーなら
     }
   }
-  // 受信したデータをイーサネットに送る
-  ethernet_input(dev, buffer, n);
+  LATENCY_RECORD(LATENCY_STAGE_RX_POLL, poll_start);
+
+  for (int i = 0; i < n; i++) {
+    if (addrs[i].sll_pkttype == PACKET_OUTGOING) { // 他のワーカーが送信したフレームは無視する
+      continue;
+    }
+    wdev->rx_packets++;
+    wdev->rx_bytes += msgs[i].msg_len;
+
+    graph_buffer *b = &graph->buffers[i];
+    b->data = graph->frames[i];
+    b->len = msgs[i].msg_len;
+    b->rx_dev = dev;
+    b->trace = nullptr;
+    if (trace_enabled()) {
+      trace_capture(b);
+    }
+    graph_enqueue(GRAPH_NODE_ETHERNET_INPUT, b); // 受信したデータをイーサネットに送る
+  }
+  graph_dispatch();
+  trace_commit();
 
   return 0;
 }
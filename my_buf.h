@@ -7,26 +7,65 @@
 #include <cstring>
 #include <string>
 
+#define MY_BUF_CACHE_BUFFER_SIZE 1600 // これ以下の長さのmy_bufはスレッドごとのキャッシュから確保する
+#define MY_BUF_CACHE_MAX_COUNT 1024   // スレッドごとにキャッシュしておくmy_bufの最大数
+
 struct my_buf {
   my_buf *previous = nullptr; // 前のmy_buf
   my_buf *next = nullptr;     // 後ろのmy_buf
   uint32_t len = 0;           // my_bufに含むバッファの長さ
+  uint32_t capacity = 0;      // 確保してあるバッファの長さ
 #ifdef ENABLE_MYBUF_NON_COPY_MODE
   uint8_t *buf_ptr = nullptr;
 #endif
   uint8_t buffer[]; // バッファ
 
+  /*
+   * 解放されたmy_bufのキャッシュ
+   * ワーカーは互いにメモリを共有しないので、スレッドごとに持つ
+   */
+  inline static thread_local my_buf *cache = nullptr;
+  inline static thread_local uint32_t cache_count = 0;
+  inline static thread_local uint64_t created = 0; // このスレッドで作ったmy_bufの数(キャッシュから取り出した分も数える)
+
   /* my_bufのメモリ確保 */
   static my_buf *create(uint32_t len) {
-    my_buf *buf = (my_buf *)calloc(1, sizeof(my_buf) + len);
+    my_buf *buf;
+    uint32_t capacity = len;
+    created++;
+    if (len <= MY_BUF_CACHE_BUFFER_SIZE) {
+      capacity = MY_BUF_CACHE_BUFFER_SIZE;
+      if (cache != nullptr) { // キャッシュから取り出す
+        buf = cache;
+        cache = buf->next;
+        cache_count--;
+        memset((void *)buf, 0, sizeof(my_buf) + len); // ヘッダも既定値(全て0)に戻す
+        buf->len = len;
+        buf->capacity = capacity;
+        return buf;
+      }
+    }
+    buf = (my_buf *)calloc(1, sizeof(my_buf) + capacity);
     buf->len = len;
+    buf->capacity = capacity;
     return buf;
   }
 
+  /* 1つのmy_bufを解放する */
+  static void release(my_buf *buf) {
+    if (buf->capacity == MY_BUF_CACHE_BUFFER_SIZE and cache_count < MY_BUF_CACHE_MAX_COUNT) {
+      buf->next = cache;
+      cache = buf;
+      cache_count++;
+      return;
+    }
+    free(buf);
+  }
+
   /*  my_bufのメモリ開放 */
   static void my_buf_free(my_buf *buf, bool is_recursive = false) {
     if (!is_recursive) {
-      free(buf);
+      release(buf);
       return;
     }
 
@@ -34,7 +73,7 @@ struct my_buf {
     while (tail != nullptr) {
       tmp = tail;
       tail = tmp->previous;
-      free(tmp);
+      release(tmp);
     }
   }
 
@@ -1,76 +1,566 @@
 #include "nd.h"
 
+#include "ethernet.h"
+#include "flow_cache.h"
+#include "icmpv6.h"
+#include "latency.h"
+#include "log.h"
+#include "my_buf.h"
 #include "net.h"
+#include "probes.h"
 #include "utils.h"
+#include "worker.h"
+#include <cstddef>
+#include <cstdlib>
+#include <random>
 
-// TODO タイマーを追加
+/*
+ * NDテーブルはRobin Hood法のオープンアドレスハッシュテーブル
+ * 探索中のキーより本来の位置から近いエントリに出会ったら、そのキーは存在しないと分かるので、
+ * 負荷率が高くても探索の長さが短く抑えられる
+ */
+thread_local nd_table_entry *nd_table = nullptr;
+thread_local uint32_t nd_table_mask = 0;  // スロット数-1
+thread_local uint32_t nd_table_count = 0; // 登録されているエントリ数
+thread_local uint32_t nd_clock_hand = 0;  // 追い出すエントリを探すCLOCKの針(スロットの位置)
+thread_local uint64_t nd_table_seed = 0;  // ハッシュのシード(起動ごとに変えて衝突を狙われにくくする)
 
-/* グローバル変数にテーブルを保持  */
-nd_table_entry *nd_table[ND_TABLE_SIZE];
+thread_local nd_statistics nd_stats;
+thread_local token_bucket nd_ns_bucket; // ワーカーごとのNSの送信レート
+
+uint32_t nd_table_max_entries = ND_TABLE_MAX_ENTRIES; // ワーカーを起動する前にだけ変える(curo-benchは追い出しを試すために下げる)
+
+/* 128ビットのアドレス全体からハッシュ値を計算する */
+inline uint64_t nd_table_hash(const in6_addr &addr) {
+  uint64_t hi, lo;
+  memcpy(&hi, &addr.s6_addr[0], 8);
+  memcpy(&lo, &addr.s6_addr[8], 8);
+  return fmix64(fmix64(hi ^ nd_table_seed) ^ lo);
+}
+
+nd_table_entry *nd_table_alloc(uint32_t size) {
+  nd_table_entry *table = (nd_table_entry *)aligned_alloc(64, sizeof(nd_table_entry) * size);
+  memset((void *)table, 0, sizeof(nd_table_entry) * size); // 全て0なら空きスロット(タイマーも未登録)
+  return table;
+}
+
+/*
+ * テーブルにエントリを挿入する(キーが存在しないことと、空きがあることが前提)
+ * エントリのタイマーは登録されていない状態で渡し、timer_armedならtimer.expireで登録し直す
+ */
+nd_table_entry *nd_table_insert(nd_table_entry entry, bool timer_armed) {
+  nd_table_entry *inserted = nullptr;
+  uint32_t index = entry.hash & nd_table_mask;
+  entry.psl = 1;
+
+  while (true) {
+    nd_table_entry *slot = &nd_table[index];
+    if (slot->psl == 0) { // 空きスロットに入れる
+      *slot = entry;
+      if (timer_armed) {
+        timer_add_at(&slot->timer, slot->timer.expire);
+      }
+      return inserted != nullptr ? inserted : slot;
+    }
+    if (slot->psl < entry.psl) { // 本来の位置から近いエントリから場所を奪い、そのエントリを先に進める
+      bool slot_timer_armed = timer_pending(&slot->timer);
+      timer_cancel(&slot->timer);
+      nd_table_entry tmp = *slot;
+      *slot = entry;
+      if (timer_armed) {
+        timer_add_at(&slot->timer, slot->timer.expire);
+      }
+      entry = tmp;
+      timer_armed = slot_timer_armed;
+      if (inserted == nullptr) {
+        inserted = slot;
+      }
+    }
+    entry.psl++;
+    index = (index + 1) & nd_table_mask;
+  }
+}
+
+/* テーブルのスロット数を変更して全エントリを入れ直す */
+void nd_table_resize(uint32_t size) {
+  nd_table_entry *old_table = nd_table;
+  uint32_t old_size = nd_table_mask + 1;
+
+  nd_table = nd_table_alloc(size);
+  nd_table_mask = size - 1;
+  flow_cache_invalidate(); // 古いテーブルを解放するので、フローキャッシュが覚えているポインタは使えなくなる
+
+  for (uint32_t i = 0; i < old_size; i++) {
+    if (old_table[i].psl != 0) {
+      bool timer_armed = timer_pending(&old_table[i].timer);
+      timer_cancel(&old_table[i].timer);
+      nd_table_insert(old_table[i], timer_armed);
+    }
+  }
+  free(old_table);
+}
 
 /* NDテーブルの初期化 */
 void init_nd_table() {
-  for (int i = 0; i < ND_TABLE_SIZE; i++) {
-    nd_table[i] = nullptr;
+  std::random_device rd;
+  nd_table_seed = ((uint64_t)rd() << 32) | rd();
+  nd_table = nd_table_alloc(ND_TABLE_INITIAL_SIZE);
+  nd_table_mask = ND_TABLE_INITIAL_SIZE - 1;
+  nd_table_count = 0;
+  // 全体の送信レートをワーカーで分け合う(workersに登録していない単独のワーカーは全て使う)
+  uint32_t rate = worker_count > 0 ? ND_NS_RATE_PER_SEC / worker_count : ND_NS_RATE_PER_SEC;
+  token_bucket_init(&nd_ns_bucket, rate > 0 ? rate : 1, ND_NS_BURST);
+}
+
+/* NDテーブルの検索 */
+nd_table_entry *search_nd_table_entry(in6_addr v6_addr) {
+  uint64_t hash = nd_table_hash(v6_addr);
+  uint32_t index = hash & nd_table_mask;
+
+  for (uint16_t psl = 1;; psl++) {
+    nd_table_entry *slot = &nd_table[index];
+    // 空きか、自分より本来の位置に近いエントリに当たったら見つからない
+    if (slot->psl < psl) {
+      return nullptr;
+    }
+    if (slot->hash == (uint32_t)hash and in6_addr_equals(slot->v6_addr, v6_addr)) {
+      return slot;
+    }
+    index = (index + 1) & nd_table_mask;
   }
 }
 
-/* NDテーブルにエントリの追加と更新 */
-void update_nd_table_entry(net_device *dev, uint8_t *mac_addr, in6_addr v6_addr) {
+void nd_entry_timer_callback(timer_entry *timer);
+void nd_table_remove_slot(nd_table_entry *slot);
 
-  // 候補の場所は、HashテーブルのIPアドレスのハッシュがindexのもの
-  const uint32_t index = in6_addr_sum(v6_addr) % ND_TABLE_SIZE;
-  nd_table_entry **candidate = &nd_table[index];
+/* 解決中のエントリ数をワーカーのデバイスごとに数える */
+inline void nd_count_incomplete(net_device *dev, int diff) {
+  if (dev != nullptr) {
+    worker_device_of(dev)->nd_incomplete += diff;
+  }
+}
+
+/*
+ * テーブルが一杯なので、CLOCKアルゴリズムでエントリを1つ追い出す
+ * 解決中のエントリを最優先で追い出し、次に最近使われていないエントリを追い出す
+ * 静的なエントリは追い出さない
+ */
+bool nd_table_evict() {
+  uint32_t size = nd_table_mask + 1;
+  nd_table_entry *victim = nullptr;
+
+  // 参照ビットを落としながら一周すれば、必ず候補が見つかる
+  for (uint32_t scanned = 0; scanned < size * 2; scanned++) {
+    nd_table_entry *slot = &nd_table[nd_clock_hand];
+    nd_clock_hand = (nd_clock_hand + 1) & nd_table_mask;
 
-  while (*candidate != nullptr) { // 連結リストの末尾までたどる
-    // 途中で同じIPアドレスのエントリがあったら、そのエントリを更新する
-    if (in6_addr_equals((*candidate)->v6_addr, v6_addr)) {
-      memcpy((*candidate)->mac_addr, mac_addr, 6);
-      (*candidate)->v6_addr = v6_addr;
-      (*candidate)->dev = dev;
+    if (slot->psl == 0 or slot->state == nd_state::permanent) {
+      continue;
+    }
+    if (slot->state == nd_state::incomplete) {
+      victim = slot;
+      break;
+    }
+    if (slot->referenced) {
+      slot->referenced = 0;
+    } else if (victim == nullptr) {
+      victim = slot;
+    }
+    if (victim != nullptr and scanned >= ND_EVICT_SCAN_SLOTS) { // 一定数見ても解決中のエントリが無ければ諦める
+      break;
+    }
+  }
+
+  if (victim == nullptr) {
+    return false;
+  }
+
+  if (victim->state == nd_state::incomplete) {
+    nd_stats.evicted_incomplete++;
+  } else {
+    nd_stats.evicted_other++;
+  }
+  nd_table_remove_slot(victim);
+  return true;
+}
+
+/* 新しいエントリを作成する(キーが存在しないことが前提) */
+nd_table_entry *nd_table_create_entry(net_device *dev, in6_addr v6_addr, nd_state state) {
+  // 上限に達していたら、既存のエントリを追い出して場所を空ける
+  if (nd_table_count >= nd_table_max_entries and !nd_table_evict()) {
+    return nullptr;
+  }
+
+  // 負荷率が上限を超えるならテーブルを拡張する
+  if ((uint64_t)(nd_table_count + 1) * 100 > (uint64_t)(nd_table_mask + 1) * ND_TABLE_MAX_LOAD_PERCENT) {
+    nd_table_resize((nd_table_mask + 1) * 2);
+    LOG_INFO("resized nd table to %u slots\n", nd_table_mask + 1);
+  }
+
+  nd_table_entry new_entry{};
+  new_entry.v6_addr = v6_addr;
+  new_entry.hash = (uint32_t)nd_table_hash(v6_addr);
+  new_entry.state = state;
+  new_entry.dev = dev;
+  new_entry.timer.callback = nd_entry_timer_callback;
+
+  if (state == nd_state::incomplete) {
+    nd_count_incomplete(dev, 1);
+  }
+  nd_table_count++;
+  return nd_table_insert(new_entry, false);
+}
+
+/* エントリを取り除き、後ろに続くエントリを1つずつ前に詰める(backward shift deletion) */
+void nd_table_remove_slot(nd_table_entry *slot) {
+  timer_cancel(&slot->timer);
+  if (slot->state == nd_state::incomplete) {
+    nd_count_incomplete(slot->dev, -1);
+  }
+  if (slot->pending != nullptr) { // 解決できなかったパケットは破棄
+    for (uint32_t i = 0; i < slot->pending->count; i++) {
+      stats_count_drop(STATS_DROP_NO_ND);
+      my_buf::my_buf_free(slot->pending->packets[i], true);
+    }
+    free(slot->pending);
+  }
+
+  uint32_t index = slot - nd_table;
+  while (true) {
+    uint32_t next = (index + 1) & nd_table_mask;
+    if (nd_table[next].psl <= 1) { // 空きか、本来の位置にいるエントリなら終わり
+      break;
+    }
+    bool timer_armed = timer_pending(&nd_table[next].timer);
+    timer_cancel(&nd_table[next].timer);
+    nd_table[index] = nd_table[next];
+    nd_table[index].psl--;
+    if (timer_armed) {
+      timer_add_at(&nd_table[index].timer, nd_table[index].timer.expire);
+    }
+    index = next;
+  }
+  nd_table[index] = nd_table_entry{};
+  nd_table_count--;
+}
+
+/* NDテーブルからエントリを削除する */
+bool delete_nd_table_entry(in6_addr v6_addr) {
+  nd_table_entry *slot = search_nd_table_entry(v6_addr);
+  if (slot == nullptr) {
+    return false;
+  }
+  nd_table_remove_slot(slot);
+  return true;
+}
+
+/* エントリの状態を変え、その状態のタイマーを設定する */
+void nd_entry_set_state(nd_table_entry *entry, nd_state state) {
+  if (entry->state == nd_state::incomplete and state != nd_state::incomplete) {
+    nd_count_incomplete(entry->dev, -1);
+  } else if (entry->state != nd_state::incomplete and state == nd_state::incomplete) {
+    nd_count_incomplete(entry->dev, 1);
+  }
+  entry->state = state;
+  entry->probes = 0;
+
+  switch (state) {
+  case nd_state::reachable:
+    timer_add(&entry->timer, ND_REACHABLE_TIME_MS);
+    break;
+  case nd_state::stale:
+    timer_add(&entry->timer, ND_STALE_TIMEOUT_MS);
+    break;
+  case nd_state::delay:
+    timer_add(&entry->timer, ND_DELAY_FIRST_PROBE_TIME_MS);
+    break;
+  case nd_state::incomplete:
+  case nd_state::probe:
+    timer_add(&entry->timer, ND_RETRANS_TIMER_MS);
+    break;
+  case nd_state::permanent:
+    timer_cancel(&entry->timer);
+    break;
+  }
+}
+
+/*
+ * エントリのNSを送信する
+ * 流量制限に引っかかった場合も試行として数えるので、送れないまま解決中のエントリが残り続けることはない
+ */
+void nd_entry_send_ns(nd_table_entry *entry, bool unicast) {
+  entry->probes++;
+  if (!token_bucket_consume(&nd_ns_bucket)) {
+    nd_stats.ns_rate_limited++;
+    return;
+  }
+  nd_stats.ns_sent++;
+  CURO_PROBE3(ns_sent, entry->dev->name, &entry->v6_addr, unicast);
+  send_ns_packet(entry->dev, entry->v6_addr, unicast ? entry->mac_addr : nullptr);
+}
+
+/* アドレス解決が終わったので、溜めていたパケットを送信する */
+void nd_entry_flush_pending(nd_table_entry *entry) {
+  nd_pending_queue *pending = entry->pending;
+  if (pending == nullptr) {
+    return;
+  }
+  entry->pending = nullptr;
+
+  net_device *dev = entry->dev;
+  uint8_t mac_addr[6];
+  memcpy(mac_addr, entry->mac_addr, 6); // 送信中にエントリが動いても良いようにコピーしておく
+
+  for (uint32_t i = 0; i < pending->count; i++) {
+    ethernet_encapsulate_output(dev, mac_addr, pending->packets[i], ETHER_TYPE_IPV6);
+  }
+  free(pending);
+}
+
+/* 状態ごとのタイマーの期限が来た */
+void nd_entry_timer_callback(timer_entry *timer) {
+  nd_table_entry *entry = (nd_table_entry *)((uint8_t *)timer - offsetof(nd_table_entry, timer));
+
+  switch (entry->state) {
+  case nd_state::incomplete:
+    if (entry->probes < ND_MAX_MULTICAST_SOLICIT) { // NSを再送する
+      nd_entry_send_ns(entry, false);
+      timer_add(&entry->timer, ND_RETRANS_TIMER_MS);
+      return;
+    }
+    nd_table_remove_slot(entry); // アドレス解決に失敗
+    return;
+  case nd_state::reachable:
+    nd_entry_set_state(entry, nd_state::stale);
+    return;
+  case nd_state::delay:
+    nd_entry_set_state(entry, nd_state::probe);
+    nd_entry_send_ns(entry, true);
+    return;
+  case nd_state::probe:
+    if (entry->probes < ND_MAX_UNICAST_SOLICIT) {
+      nd_entry_send_ns(entry, true);
+      timer_add(&entry->timer, ND_RETRANS_TIMER_MS);
       return;
     }
-    *candidate = (*candidate)->next;
+    nd_table_remove_slot(entry); // 到達できなくなった
+    return;
+  case nd_state::stale: // 長い間使われていないので削除
+    nd_table_remove_slot(entry);
+    return;
+  case nd_state::permanent:
+    return;
   }
+}
 
-  // 連結リストの末尾に新しくエントリを作成
-  *candidate = (nd_table_entry *)calloc(1, sizeof(nd_table_entry));
-  memcpy((*candidate)->mac_addr, mac_addr, 6);
-  (*candidate)->v6_addr = v6_addr;
-  (*candidate)->dev = dev;
+/* NDテーブルにエントリを指定した状態で追加・更新する */
+void update_nd_table_entry(net_device *dev, uint8_t *mac_addr, in6_addr v6_addr, nd_state state) {
+  nd_table_entry *entry = search_nd_table_entry(v6_addr);
+  if (entry == nullptr) {
+    entry = nd_table_create_entry(dev, v6_addr, state);
+    if (entry == nullptr) {
+      LOG_ERROR("nd table is full\n");
+      return;
+    }
+  }
+
+  memcpy(entry->mac_addr, mac_addr, 6);
+  nd_entry_set_state(entry, state);
+  entry->dev = dev;
+  nd_entry_flush_pending(entry);
 }
 
-/* NDテーブルの検索 */
-nd_table_entry *search_nd_table_entry(in6_addr v6_addr) {
-  // 初めの候補の場所は、HashテーブルのIPアドレスのハッシュがindexのもの
-  nd_table_entry *candidate = nd_table[in6_addr_sum(v6_addr) % ND_TABLE_SIZE];
+/* NSの送信元のリンク層アドレスを現在のワーカーのNDテーブルに学習する(RFC 4861 7.2.3) */
+void nd_learn_solicitation(net_device *dev, const uint8_t *mac_addr, in6_addr source) {
+  nd_table_entry *entry = search_nd_table_entry(source);
+  if (entry == nullptr) {
+    entry = nd_table_create_entry(dev, source, nd_state::stale);
+    if (entry == nullptr) {
+      return;
+    }
+    memcpy(entry->mac_addr, mac_addr, 6);
+    nd_entry_set_state(entry, nd_state::stale);
+    return;
+  }
+  if (entry->state == nd_state::permanent) {
+    return;
+  }
+  if (entry->state == nd_state::incomplete or memcmp(entry->mac_addr, mac_addr, 6) != 0) {
+    if (entry->state == nd_state::incomplete) {
+      local_stats->nd[STATS_ND_RESOLVED]++;
+    }
+    memcpy(entry->mac_addr, mac_addr, 6);
+    nd_entry_set_state(entry, nd_state::stale);
+    entry->dev = dev;
+    nd_entry_flush_pending(entry);
+  }
+}
+
+/*
+ * NAの内容を現在のワーカーの近隣キャッシュに反映する(RFC 4861 7.2.5)
+ * mac_addrはTarget Link-Layer Addressオプションが無ければnullptr
+ */
+void nd_learn_advertisement(const uint8_t *mac_addr, in6_addr target, uint8_t flags) {
+  nd_table_entry *entry = search_nd_table_entry(target);
+  if (entry == nullptr or entry->state == nd_state::permanent) { // 要求していないアドレスのNAは無視
+    return;
+  }
+
+  bool solicited = flags & ICMPV6_NA_FLAG_SOLICITED;
+  bool override = flags & ICMPV6_NA_FLAG_OVERRIDE;
+
+  if (entry->state == nd_state::incomplete) {
+    if (mac_addr == nullptr) {
+      return;
+    }
+    local_stats->nd[STATS_ND_RESOLVED]++;
+    memcpy(entry->mac_addr, mac_addr, 6);
+    nd_entry_set_state(entry, solicited ? nd_state::reachable : nd_state::stale);
+    nd_entry_flush_pending(entry);
+    return;
+  }
 
-  // 候補のエントリが検索しているIPアドレスの物でなかった場合、そのエントリの連結リストを調べる
-  while (candidate != nullptr) {
-    if (in6_addr_equals(candidate->v6_addr, v6_addr)) { // 連結リストの中に検索しているIPアドレスの物があったら
-      return candidate;
+  bool mac_changed = mac_addr != nullptr and memcmp(entry->mac_addr, mac_addr, 6) != 0;
+  if (!override and mac_changed) {
+    if (entry->state == nd_state::reachable) {
+      nd_entry_set_state(entry, nd_state::stale);
     }
-    candidate = candidate->next;
+    return;
+  }
+
+  if (mac_changed) {
+    memcpy(entry->mac_addr, mac_addr, 6);
+  }
+  if (solicited) {
+    nd_entry_set_state(entry, nd_state::reachable);
+  } else if (mac_changed) {
+    nd_entry_set_state(entry, nd_state::stale);
+  }
+}
+
+/* NSを受信したワーカーで学習し、他のワーカーにも伝える */
+void nd_receive_solicitation(net_device *dev, const uint8_t *mac_addr, in6_addr source) {
+  nd_learn_solicitation(dev, mac_addr, source);
+
+  nd_event event{};
+  event.dev = dev;
+  event.v6_addr = source;
+  memcpy(event.mac_addr, mac_addr, 6);
+  event.has_mac_addr = true;
+  event.is_advertisement = false;
+  worker_publish_nd_event(event);
+}
+
+/* NAを受信したワーカーで学習し、他のワーカーにも伝える */
+void nd_receive_advertisement(net_device *dev, const uint8_t *mac_addr, in6_addr target, uint8_t flags) {
+  nd_learn_advertisement(mac_addr, target, flags);
+
+  nd_event event{};
+  event.dev = dev;
+  event.v6_addr = target;
+  if (mac_addr != nullptr) {
+    memcpy(event.mac_addr, mac_addr, 6);
+    event.has_mac_addr = true;
   }
+  event.is_advertisement = true;
+  event.flags = flags;
+  worker_publish_nd_event(event);
+}
 
-  // 連結リストの中に見つからなかったら
-  return nullptr;
+/* アドレス解決待ちのキューにパケットを入れる(一杯なら古いものから捨てる) */
+void nd_entry_enqueue(nd_table_entry *entry, my_buf *buffer) {
+  if (entry->pending == nullptr) {
+    entry->pending = (nd_pending_queue *)calloc(1, sizeof(nd_pending_queue));
+  }
+  nd_pending_queue *pending = entry->pending;
+  if (pending->count == ND_PENDING_QUEUE_LEN) {
+    stats_count_drop(STATS_DROP_NO_ND);
+    my_buf::my_buf_free(pending->packets[0], true);
+    memmove(&pending->packets[0], &pending->packets[1], sizeof(my_buf *) * (ND_PENDING_QUEUE_LEN - 1));
+    pending->count--;
+  }
+  pending->packets[pending->count++] = buffer;
+}
+
+/*
+ * エントリのMACアドレスを送信に使えるか確かめ、使ったことを記録する
+ * まだ解決中ならfalseを返す
+ */
+bool nd_entry_use(nd_table_entry *entry) {
+  switch (entry->state) {
+  case nd_state::incomplete:
+    return false;
+  case nd_state::stale: // 使われたので到達性の確認を始める
+    nd_entry_set_state(entry, nd_state::delay);
+    break;
+  default:
+    break;
+  }
+  entry->referenced = 1;
+  return true;
+}
+
+/* 既存のエントリを使ってパケットを送信する */
+void nd_entry_output(nd_table_entry *entry, my_buf *buffer) {
+  if (!nd_entry_use(entry)) { // 解決できるまで溜めておく(NSは再送タイマーに任せて送らない)
+    CURO_PROBE3(nd_miss, entry->dev->name, &entry->v6_addr, 0);
+    nd_stats.ns_coalesced++;
+    nd_entry_enqueue(entry, buffer);
+    return;
+  }
+  ethernet_encapsulate_output(entry->dev, entry->mac_addr, buffer, ETHER_TYPE_IPV6);
+}
+
+/* 近隣のアドレスを解決してパケットを送信する */
+void nd_output(net_device *dev, in6_addr v6_addr, my_buf *buffer) {
+  nd_table_entry *entry = search_nd_table_entry(v6_addr);
+  if (entry != nullptr) {
+    nd_entry_output(entry, buffer);
+    return;
+  }
+
+  // デバイスごとに同時に解決できる数を制限して、スキャンで近隣キャッシュが埋まらないようにする
+  if (worker_device_of(dev)->nd_incomplete >= ND_MAX_INCOMPLETE_PER_INTERFACE) {
+    nd_stats.resolution_limited++;
+    stats_count_drop(STATS_DROP_NO_ND);
+    my_buf::my_buf_free(buffer, true);
+    return;
+  }
+
+  // エントリが無ければアドレス解決を始めて、パケットは解決するまで溜めておく
+  CURO_PROBE3(nd_miss, dev->name, &v6_addr, 1);
+  LATENCY_START(resolve_start);
+  entry = nd_table_create_entry(dev, v6_addr, nd_state::incomplete);
+  if (entry == nullptr) {
+    stats_count_drop(STATS_DROP_NO_ND);
+    my_buf::my_buf_free(buffer, true);
+    return;
+  }
+  nd_entry_set_state(entry, nd_state::incomplete);
+  nd_entry_enqueue(entry, buffer);
+  nd_entry_send_ns(entry, false);
+  LATENCY_RECORD(LATENCY_STAGE_ND_RESOLVE, resolve_start);
 }
 
 /* NDテーブルの出力 */
 void dump_nd_table_entry() {
+  const char *state_names[] = {"INCOMPLETE", "REACHABLE", "STALE", "DELAY", "PROBE", "PERMANENT"};
+
   printf("|--------------IPv6 ADDRESS---------------|----MAC "
-         "ADDRESS----|-----DEVICE------|-INDEX-|\n");
+         "ADDRESS----|-----DEVICE------|---STATE----|-INDEX-|\n");
 
-  nd_table_entry *entry_ptr;
-  for (int i = 0; i < ND_TABLE_SIZE; ++i) {
-    entry_ptr = nd_table[i];
-    while (entry_ptr != nullptr) {
-      char addr_str[INET6_ADDRSTRLEN];
-      inet_ntop(AF_INET6, &entry_ptr->v6_addr, addr_str, INET6_ADDRSTRLEN);
-      printf("| %39s | %14s | %15s |  %04d |\n", addr_str, mac_addr_toa(entry_ptr->mac_addr), entry_ptr->dev->name, i);
-      entry_ptr = entry_ptr->next;
+  for (uint32_t i = 0; i <= nd_table_mask; ++i) {
+    nd_table_entry *entry_ptr = &nd_table[i];
+    if (entry_ptr->psl == 0) {
+      continue;
     }
+    char addr_str[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &entry_ptr->v6_addr, addr_str, INET6_ADDRSTRLEN);
+    printf("| %39s | %14s | %15s | %10s |  %04d |\n", addr_str, mac_addr_toa(entry_ptr->mac_addr), entry_ptr->dev->name, state_names[(int)entry_ptr->state], i);
   }
-  printf("|-----------------------------------------|-------------------|-----------------|-------|\n");
-}
\ No newline at end of file
+  printf("|-----------------------------------------|-------------------|-----------------|------------|-------|\n");
+  printf("%u entries in %u slots\n", nd_table_count, nd_table_mask + 1);
+  printf("NS sent %lu, suppressed %lu (coalesced %lu, rate limited %lu)\n", nd_stats.ns_sent, nd_stats.ns_coalesced + nd_stats.ns_rate_limited, nd_stats.ns_coalesced,
+         nd_stats.ns_rate_limited);
+  printf("resolution limited %lu, evicted %lu incomplete / %lu others\n", nd_stats.resolution_limited, nd_stats.evicted_incomplete, nd_stats.evicted_other);
+}
@@ -4,24 +4,97 @@
 #include <cstdint>
 
 #include "ipv6.h"
+#include "timer.h"
 
-#define ND_TABLE_SIZE 1111
+#define ND_TABLE_INITIAL_SIZE 1024   // NDテーブルの初期スロット数(2の累乗)
+#define ND_TABLE_MAX_LOAD_PERCENT 85 // これを超えるとテーブルを2倍に拡張する
+
+/* RFC 4861 10. Protocol Constants */
+#define ND_MAX_MULTICAST_SOLICIT 3
+#define ND_MAX_UNICAST_SOLICIT 3
+#define ND_REACHABLE_TIME_MS 30000
+#define ND_RETRANS_TIMER_MS 1000
+#define ND_DELAY_FIRST_PROBE_TIME_MS 5000
+
+#define ND_STALE_TIMEOUT_MS 60000 // 使われないままSTALEのエントリを削除するまでの時間
+#define ND_PENDING_QUEUE_LEN 8    // アドレス解決待ちの間に溜めておけるパケットの数
+
+#define ND_NS_RATE_PER_SEC 100 // 全体で1秒あたりに送信できるNSの数
+#define ND_NS_BURST 20         // 連続して送信できるNSの数
+
+#define ND_TABLE_MAX_ENTRIES 131072         // NDテーブルに登録できるエントリ数の上限
+#define ND_MAX_INCOMPLETE_PER_INTERFACE 256 // 1つのデバイスで同時にアドレス解決できる数
+#define ND_EVICT_SCAN_SLOTS 256             // 追い出す候補を探すのに1度に見るスロット数
 
 struct net_device;
+struct my_buf;
+
+/* 近隣キャッシュエントリの状態(RFC 4861 7.3.2) */
+enum class nd_state : uint8_t {
+  incomplete, // アドレス解決中
+  reachable,  // 到達性が確認されている
+  stale,      // 到達性が確認されてから時間が経っている
+  delay,      // STALEの状態で使われたので確認を待っている
+  probe,      // ユニキャストのNSで到達性を確認中
+  permanent   // 静的に設定されたエントリ
+};
+
+/* アドレス解決待ちのパケットのキュー */
+struct nd_pending_queue {
+  uint32_t count;
+  my_buf *packets[ND_PENDING_QUEUE_LEN];
+};
 
+/*
+ * NDテーブルのエントリ
+ * エントリはオープンアドレス法のテーブルに直接格納されるので、
+ * 挿入や削除でエントリの位置が動くことに注意
+ */
 struct nd_table_entry {
+  in6_addr v6_addr;    // キー(先頭に置いて16バイトでまとめて比較する)
+  uint32_t hash;       // キーのハッシュ値の下位32ビット
+  uint16_t psl;        // 本来の位置からの距離+1(0なら空きスロット)
   uint8_t mac_addr[6];
-  in6_addr v6_addr;
+  nd_state state;
+  uint8_t probes;      // 現在の状態で送ったNSの数
+  uint8_t referenced;  // 前回CLOCKの針が通ってから使われたか
   net_device *dev;
-  nd_table_entry *next;
+  timer_entry timer;   // 状態ごとのタイマー
+  nd_pending_queue *pending;
 };
 
+/* NSの送信に関するカウンタ */
+struct nd_statistics {
+  uint64_t ns_sent;        // 送信したNS
+  uint64_t ns_coalesced;   // 解決中のエントリにまとめられて送らなかったNS
+  uint64_t ns_rate_limited; // 流量制限で送らなかったNS
+  uint64_t resolution_limited; // デバイスごとの上限でアドレス解決を始めずに破棄したパケット
+  uint64_t evicted_incomplete; // 上限に達して追い出した解決中のエントリ
+  uint64_t evicted_other;      // 上限に達して追い出したそれ以外のエントリ
+};
+
+extern thread_local nd_statistics nd_stats;
+extern thread_local uint32_t nd_table_count; // 登録されているエントリ数
+extern uint32_t nd_table_max_entries; // NDテーブルに登録できるエントリ数の上限(既定はND_TABLE_MAX_ENTRIES)
+
 void init_nd_table();
 
-void update_nd_table_entry(net_device *dev, uint8_t *mac_addr, in6_addr v6_addr);
+void update_nd_table_entry(net_device *dev, uint8_t *mac_addr, in6_addr v6_addr, nd_state state);
 
 nd_table_entry *search_nd_table_entry(in6_addr v6_addr);
 
+bool delete_nd_table_entry(in6_addr v6_addr);
+
+void nd_learn_solicitation(net_device *dev, const uint8_t *mac_addr, in6_addr source);
+void nd_learn_advertisement(const uint8_t *mac_addr, in6_addr target, uint8_t flags);
+
+void nd_receive_solicitation(net_device *dev, const uint8_t *mac_addr, in6_addr source);
+void nd_receive_advertisement(net_device *dev, const uint8_t *mac_addr, in6_addr target, uint8_t flags);
+
+void nd_output(net_device *dev, in6_addr v6_addr, my_buf *buffer);
+void nd_entry_output(nd_table_entry *entry, my_buf *buffer);
+bool nd_entry_use(nd_table_entry *entry);
+
 void dump_nd_table_entry();
 
-#endif
\ No newline at end of file
+#endif
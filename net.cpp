@@ -1,4 +1,99 @@
 #include "net.h"
 
+#include <cstdlib>
+
 /* net_deviceの連結リストの先頭 */
 net_device *net_dev_list;
+
+/* net_device::indexで引くデバイスの配列 */
+net_device **net_devs = nullptr;
+uint32_t net_dev_count = 0;
+uint32_t net_devs_capacity = 0;
+
+/* ifindexで引くデバイスの配列(使われていないifindexはnullptr) */
+net_device **net_dev_by_ifindex = nullptr;
+uint32_t net_dev_ifindex_size = 0;
+
+/*
+ * インターフェース名で引くハッシュテーブル(オープンアドレス法)
+ * デバイスの数の2倍以上のスロットを持たせ、探索を短く保つ
+ */
+net_device **net_dev_name_table = nullptr;
+uint32_t net_dev_name_mask = 0;
+
+/* インターフェース名のハッシュ(FNV-1a) */
+uint32_t net_device_name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = name; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void net_device_name_insert(net_device *dev) {
+  uint32_t index = net_device_name_hash(dev->name) & net_dev_name_mask;
+  while (net_dev_name_table[index] != nullptr) {
+    index = (index + 1) & net_dev_name_mask;
+  }
+  net_dev_name_table[index] = dev;
+}
+
+/* 配列の大きさを、indexが収まる2の累乗まで広げる */
+net_device **net_device_array_grow(net_device **array, uint32_t *size, uint32_t index) {
+  uint32_t new_size = *size > 0 ? *size : 16;
+  while (new_size <= index) {
+    new_size *= 2;
+  }
+  if (new_size == *size) {
+    return array;
+  }
+  array = (net_device **)realloc(array, sizeof(net_device *) * new_size);
+  memset(&array[*size], 0, sizeof(net_device *) * (new_size - *size));
+  *size = new_size;
+  return array;
+}
+
+/* デバイスを登録し、通し番号を割り当てる */
+void net_device_register(net_device *dev, int ifindex) {
+  dev->index = net_dev_count++;
+  net_devs = net_device_array_grow(net_devs, &net_devs_capacity, dev->index);
+  net_devs[dev->index] = dev;
+
+  net_dev_by_ifindex = net_device_array_grow(net_dev_by_ifindex, &net_dev_ifindex_size, ifindex);
+  net_dev_by_ifindex[ifindex] = dev;
+
+  // 名前のテーブルが半分を超えたら作り直す
+  if (net_dev_count * 2 > net_dev_name_mask) {
+    uint32_t size = (net_dev_name_mask + 1) * 2;
+    if (size < 64) {
+      size = 64;
+    }
+    free(net_dev_name_table);
+    net_dev_name_table = (net_device **)calloc(size, sizeof(net_device *));
+    net_dev_name_mask = size - 1;
+    for (uint32_t i = 0; i < net_dev_count - 1; i++) {
+      net_device_name_insert(net_devs[i]);
+    }
+  }
+  net_device_name_insert(dev);
+
+  // net_deviceの連結リストに連結させる
+  dev->next = net_dev_list;
+  net_dev_list = dev;
+}
+
+/* インターフェース名からデバイスを探す */
+net_device *get_net_device_by_name(const char *name) {
+  if (net_dev_name_table == nullptr) {
+    return nullptr;
+  }
+  uint32_t index = net_device_name_hash(name) & net_dev_name_mask;
+  while (net_dev_name_table[index] != nullptr) {
+    if (strcmp(net_dev_name_table[index]->name, name) == 0) {
+      return net_dev_name_table[index];
+    }
+    index = (index + 1) & net_dev_name_mask;
+  }
+  return nullptr;
+}
@@ -8,7 +8,8 @@
 struct net_device;
 
 struct net_device_ops {
-  int (*transmit)(net_device *dev, uint8_t *buffer, size_t len);
+  int (*transmit)(net_device *dev, uint8_t *buffer, size_t len); // 送信キューに入れる
+  int (*flush)(net_device *dev);                                 // 送信キューのフレームをまとめて送信する
   int (*poll)(net_device *dev);
 };
 
@@ -16,7 +17,9 @@ struct ipv6_device;
 
 struct net_device {
   char name[32]; // インターフェース名
+  uint32_t index; // デバイスの通し番号(ワーカーごとのデバイスのデータの添字)
   uint8_t mac_addr[6];
+  uint32_t mtu; // 送信できるIPv6パケットの最大の長さ(0なら確認しない)
   net_device_ops ops;
   ipv6_device *ipv6_dev;
   net_device *next;
@@ -26,4 +29,21 @@ struct net_device {
 /* net_deviceの連結リストの先頭 */
 extern net_device *net_dev_list;
 
+extern net_device **net_devs; // net_device::indexで引く
+extern uint32_t net_dev_count;
+
+extern net_device **net_dev_by_ifindex; // ifindexで引く
+extern uint32_t net_dev_ifindex_size;
+
+/* ifindexからデバイスを探す */
+inline net_device *get_net_device_by_ifindex(int ifindex) {
+  if (ifindex < 0 or (uint32_t)ifindex >= net_dev_ifindex_size) {
+    return nullptr;
+  }
+  return net_dev_by_ifindex[ifindex];
+}
+
+void net_device_register(net_device *dev, int ifindex);
+net_device *get_net_device_by_name(const char *name);
+
 #endif // CURO_NET_H
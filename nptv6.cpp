@@ -0,0 +1,146 @@
+#include "nptv6.h"
+
+#include "checksum.h"
+#include "log.h"
+#include "net.h"
+#include "patricia_trie.h"
+#include "utils.h"
+#include "worker.h"
+#include <cstring>
+
+npt_mapping *npt_configured = nullptr;
+
+thread_local patricia_node *npt_inbound_trie = nullptr;
+thread_local patricia_node *npt_outbound_trie = nullptr;
+
+/*
+ * 変換の組を作る(制御スレッドで動く)
+ * プレフィックスの1の補数和の差を前もって計算しておく(RFC 6296の3.1)
+ */
+npt_mapping *npt_create_mapping(net_device *dev, in6_addr internal_prefix, in6_addr external_prefix, uint32_t prefix_len) {
+  if (dev == nullptr or prefix_len == 0 or prefix_len > NPTV6_MAX_PREFIX_LEN) {
+    LOG_ERROR("invalid nptv6 mapping (prefix length %u)\n", prefix_len);
+    return nullptr;
+  }
+  npt_mapping *mapping = (npt_mapping *)calloc(1, sizeof(npt_mapping));
+  mapping->dev = dev;
+  mapping->internal_prefix = in6_addr_clear_prefix(internal_prefix, prefix_len);
+  mapping->external_prefix = in6_addr_clear_prefix(external_prefix, prefix_len);
+  mapping->prefix_len = prefix_len;
+
+  uint16_t internal_sum = checksum_partial(&mapping->internal_prefix, sizeof(in6_addr));
+  uint16_t external_sum = checksum_partial(&mapping->external_prefix, sizeof(in6_addr));
+  mapping->outbound_adjustment = checksum_add(internal_sum, (uint16_t)~external_sum);
+  mapping->inbound_adjustment = checksum_add(external_sum, (uint16_t)~internal_sum);
+  return mapping;
+}
+
+/*
+ * アドレスのプレフィックスを書き換え、打ち消す語にadjustmentを足す(RFC 6296の3.2~3.5)
+ * 打ち消す語が0xffffで書き換えられなければfalseを返す
+ */
+bool npt_rewrite_prefix(uint8_t *addr, const in6_addr &prefix, uint8_t prefix_len, uint16_t adjustment) {
+  int word = 3; // /48以下ならサブネットID
+  if (prefix_len > 48) {
+    word = 4;
+    while (word < 8 and addr[word * 2] == 0xff and addr[word * 2 + 1] == 0xff) {
+      word++;
+    }
+    if (word == 8) {
+      return false;
+    }
+  }
+  uint16_t value;
+  memcpy(&value, addr + word * 2, sizeof(value));
+  if (value == 0xffff) {
+    return false;
+  }
+
+  uint32_t bytes = prefix_len / 8;
+  memcpy(addr, prefix.s6_addr, bytes);
+  if (prefix_len % 8 != 0) {
+    uint8_t mask = 0xff << (8 - prefix_len % 8);
+    addr[bytes] = (prefix.s6_addr[bytes] & mask) | (addr[bytes] & ~mask);
+  }
+
+  value = checksum_add(value, adjustment);
+  if (value == 0xffff) { // 1の補数で同じ値の0にする(戻す時に元の語に戻るように)
+    value = 0;
+  }
+  memcpy(addr + word * 2, &value, sizeof(value));
+  return true;
+}
+
+/* ワーカーのスレッドで、変換の組を入れるトライを用意する */
+void npt_init_worker() {
+  in6_addr root_addr;
+  memset(&root_addr, 0x00, sizeof(root_addr));
+  npt_inbound_trie = create_patricia_node(root_addr, 0, false, nullptr);
+  npt_outbound_trie = create_patricia_node(root_addr, 0, false, nullptr);
+}
+
+/* 変換の組を現在のワーカーのトライに登録 */
+void install_npt_mapping(npt_mapping *mapping) {
+  patricia_trie_insert(npt_inbound_trie, mapping->external_prefix, mapping->prefix_len, mapping);
+  patricia_trie_insert(npt_outbound_trie, mapping->internal_prefix, mapping->prefix_len, mapping);
+  worker_device_of(mapping->dev)->npt_mappings++;
+}
+
+/*
+ * 外部のデバイスで受信したパケットの宛先を内部のプレフィックスに書き換える(ipv6-inputノードから呼ぶ)
+ * 変換できないパケットならfalseを返す
+ */
+bool npt_translate_inbound(graph_buffer *b, ipv6_header *packet) {
+  if (worker_device_of(b->rx_dev)->npt_mappings == 0) {
+    return true;
+  }
+  patricia_node *res = patricia_trie_search(npt_inbound_trie, packet->dst_addr);
+  if (res == nullptr or res->data == nullptr or ((npt_mapping *)res->data)->dev != b->rx_dev) {
+    return true;
+  }
+  npt_mapping *mapping = (npt_mapping *)res->data;
+  if (!npt_rewrite_prefix(packet->dst_addr.s6_addr, mapping->internal_prefix, mapping->prefix_len, mapping->inbound_adjustment)) {
+    LOG_IPV6("nptv6 cannot translate %s\n", packet->dst_addr);
+    return false;
+  }
+  in6_addr translated = packet->dst_addr;
+  TRACE_STEP(b, GRAPH_NODE_IPV6_INPUT, TRACE_NPTV6, 0, b->rx_dev->index, &translated);
+  return true;
+}
+
+/*
+ * 外部のデバイスから送信するパケットの送信元を外部のプレフィックスに書き換える(出力先が決まった後に呼ぶ)
+ * 変換できないパケットならfalseを返す
+ */
+bool npt_translate_outbound(graph_buffer *b, ipv6_header *packet, net_device *output_dev) {
+  if (output_dev == nullptr or worker_device_of(output_dev)->npt_mappings == 0) {
+    return true;
+  }
+  patricia_node *res = patricia_trie_search(npt_outbound_trie, packet->src_addr);
+  if (res == nullptr or res->data == nullptr or ((npt_mapping *)res->data)->dev != output_dev) {
+    return true;
+  }
+  npt_mapping *mapping = (npt_mapping *)res->data;
+  if (!npt_rewrite_prefix(packet->src_addr.s6_addr, mapping->external_prefix, mapping->prefix_len, mapping->outbound_adjustment)) {
+    LOG_IPV6("nptv6 cannot translate %s\n", packet->src_addr);
+    return false;
+  }
+  in6_addr translated = packet->src_addr;
+  TRACE_STEP(b, graph->current_node, TRACE_NPTV6, 1, output_dev->index, &translated);
+  return true;
+}
+
+/* 設定した変換の組を表示する */
+void dump_npt_mappings() {
+  if (npt_configured == nullptr) {
+    printf("no nptv6 mappings\n");
+    return;
+  }
+  for (npt_mapping *mapping = npt_configured; mapping != nullptr; mapping = mapping->next) {
+    char internal[INET6_ADDRSTRLEN], external[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &mapping->internal_prefix, internal, sizeof(internal));
+    inet_ntop(AF_INET6, &mapping->external_prefix, external, sizeof(external));
+    printf("%s/%u <-> %s/%u on %s (adjustment out 0x%04x in 0x%04x)\n", internal, mapping->prefix_len, external, mapping->prefix_len, mapping->dev->name,
+           ntohs(mapping->outbound_adjustment), ntohs(mapping->inbound_adjustment));
+  }
+}
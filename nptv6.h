@@ -0,0 +1,57 @@
+#ifndef CURO_NPTV6_H
+#define CURO_NPTV6_H
+
+#include "config.h"
+#include "graph.h"
+#include "ipv6.h"
+#include <cstdint>
+#include <netinet/in.h>
+
+/*
+ * ステートレスなIPv6のプレフィックス変換(NPTv6、RFC 6296)
+ * 外部のデバイスごとに内部のプレフィックスと外部のプレフィックスの組(長さは64以下で同じ)を設定し、
+ *   外部のデバイスで受信したパケットの宛先は、外部のプレフィックスから内部のプレフィックスへ(経路を引く前、ipv6-inputノード)
+ *   外部のデバイスから送信するパケットの送信元は、内部のプレフィックスから外部のプレフィックスへ(出力先が決まった後、ipv6-rewriteノード)
+ * 書き換える
+ *
+ * プレフィックスを書き換えた分のチェックサムの差は、同じアドレスのプレフィックスより後ろの16ビットの1語で打ち消す
+ * (/48以下ならビット48~63のサブネットID、/49~/64ならインターフェースIDのうち最初の0xffffでない語)
+ * アドレスの1の補数和が変わらないので、TCP/UDP/ICMPv6のチェックサムは書き換えなくてよい
+ *
+ * 変換の組はワーカーごとのパトリシアトライに入れ、向きごとに1つずつ持つ
+ * 外部のデバイスを通るパケットだけ、1回の検索でどれだけ組があっても当てはまるものを見つける
+ */
+
+#define NPTV6_MAX_PREFIX_LEN 64 // 打ち消す語をプレフィックスの後ろに置ける長さ
+
+struct net_device;
+struct patricia_node;
+
+/* プレフィックスの変換の組(設定した後は書き換えない) */
+struct npt_mapping {
+  net_device *dev; // 外部のデバイス
+  in6_addr internal_prefix;
+  in6_addr external_prefix;
+  uint8_t prefix_len;
+  uint16_t outbound_adjustment; // 内部から外部に書き換えた時に打ち消す語に足す値
+  uint16_t inbound_adjustment;  // 外部から内部に書き換えた時に打ち消す語に足す値
+  npt_mapping *next;            // 設定した一覧(制御スレッドだけが使う)
+};
+
+extern npt_mapping *npt_configured; // 設定した組の一覧
+
+extern thread_local patricia_node *npt_inbound_trie;  // 外部のプレフィックスで引く
+extern thread_local patricia_node *npt_outbound_trie; // 内部のプレフィックスで引く
+
+npt_mapping *npt_create_mapping(net_device *dev, in6_addr internal_prefix, in6_addr external_prefix, uint32_t prefix_len);
+bool npt_rewrite_prefix(uint8_t *addr, const in6_addr &prefix, uint8_t prefix_len, uint16_t adjustment);
+
+void npt_init_worker();
+void install_npt_mapping(npt_mapping *mapping);
+
+bool npt_translate_inbound(graph_buffer *b, ipv6_header *packet);
+bool npt_translate_outbound(graph_buffer *b, ipv6_header *packet, net_device *output_dev);
+
+void dump_npt_mappings();
+
+#endif // CURO_NPTV6_H
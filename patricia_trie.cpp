@@ -69,9 +69,7 @@ patricia_node *create_patricia_node(in6_addr address, int bits_len, int is_prefi
   node->address = address;
   node->bits_len = bits_len;
   node->is_prefix = is_prefix;
-
-  char addr_str[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &address, addr_str, sizeof(addr_str));
+  node->data = nullptr;
 
   return node;
 }
@@ -94,12 +92,12 @@ patricia_node *patricia_trie_search(patricia_node *root, in6_addr address) {
 
     int match_len = in6_addr_get_match_bits_len(address, next_node->address, current_bits_len + next_node->bits_len - 1);
 
-    if (next_node->is_prefix) {
-      last_matched = next_node;
+    if (match_len != current_bits_len + next_node->bits_len) { // 途中で食い違ったノードはマッチしていない
+      break;
     }
 
-    if (match_len != current_bits_len + next_node->bits_len) {
-      break;
+    if (next_node->is_prefix) {
+      last_matched = next_node;
     }
 
     current_node = next_node;
@@ -119,9 +117,6 @@ patricia_node *patricia_trie_insert(patricia_node *root, in6_addr address, int p
   // 引数で渡されたプレフィックスをきれいにする
   address = in6_addr_clear_prefix(address, prefix_len);
 
-  char addr_str[INET6_ADDRSTRLEN];
-  inet_ntop(AF_INET6, &address, addr_str, sizeof(addr_str));
-
   // 枝を辿る
   while (true) { // ループ内では次に進むノードを決定する
 
@@ -141,9 +136,11 @@ patricia_node *patricia_trie_insert(patricia_node *root, in6_addr address, int p
       }
     }
 
-    int match_len = in6_addr_get_match_bits_len(address, next_node->address, current_bits_len + next_node->bits_len - 1);
+    // 次のノードの方が長い時は、追加するプレフィックスの長さまでしか比べない
+    int end_bit = current_bits_len + next_node->bits_len;
+    int match_len = in6_addr_get_match_bits_len(address, next_node->address, (end_bit < prefix_len ? end_bit : prefix_len) - 1);
 
-    if (match_len == current_bits_len + next_node->bits_len) { // 次のノードと全マッチ
+    if (match_len == end_bit) { // 次のノードと全マッチ
       current_bits_len += next_node->bits_len;
       current_node = next_node;
 
@@ -171,9 +168,14 @@ patricia_node *patricia_trie_insert(patricia_node *root, in6_addr address, int p
 
       LOG_TRIE("Separated %d & %d\n", im_node_bits_len, next_node->bits_len);
 
-      if (prefix_len == current_bits_len + match_len) {
-        next_node->is_prefix = true;
-        next_node->data = data_ptr;
+      if (prefix_len == match_len) { // 中間ノード自体が目的のプレフィックスの場合
+        im_node->is_prefix = true;
+        im_node->data = data_ptr;
+        if (in6_addr_get_bit(next_node->address, match_len) == 0) {
+          im_node->left = next_node;
+        } else {
+          im_node->right = next_node;
+        }
         break;
       }
 
@@ -194,6 +196,78 @@ patricia_node *patricia_trie_insert(patricia_node *root, in6_addr address, int p
   return root;
 }
 
+// 子を1つしか持たない中間ノードを取り除き、子を親に直接つなぐ
+void patricia_trie_compact_node(patricia_node *node) {
+  while (node != nullptr and node->parent != nullptr and !node->is_prefix) {
+    patricia_node *parent = node->parent;
+    patricia_node *child;
+
+    if (node->left == nullptr and node->right == nullptr) { // 葉なので削除
+      child = nullptr;
+    } else if (node->left == nullptr or node->right == nullptr) { // 子が1つなので子と統合
+      child = (node->left != nullptr) ? node->left : node->right;
+      child->bits_len += node->bits_len;
+      child->parent = parent;
+    } else { // 子が2つある中間ノードは残す
+      return;
+    }
+
+    if (parent->left == node) {
+      parent->left = child;
+    } else {
+      parent->right = child;
+    }
+    free(node);
+
+    if (child != nullptr) {
+      return;
+    }
+    node = parent; // 葉を消した場合は親も不要になっているかもしれない
+  }
+}
+
+// トライ木からプレフィックスを削除し、登録されていたデータを返す
+void *patricia_trie_remove(patricia_node *root, in6_addr address, int prefix_len) {
+
+  int current_bits_len = 0;
+  patricia_node *current_node = root;
+  patricia_node *next_node;
+
+  address = in6_addr_clear_prefix(address, prefix_len);
+
+  while (current_bits_len < prefix_len) {
+    next_node = (in6_addr_get_bit(address, current_bits_len) == 0) ? current_node->left : current_node->right;
+    if (next_node == nullptr) {
+      return nullptr;
+    }
+
+    int end_bit = current_bits_len + next_node->bits_len;
+    if (end_bit > prefix_len) {
+      return nullptr;
+    }
+
+    int match_len = in6_addr_get_match_bits_len(address, next_node->address, end_bit - 1);
+    if (match_len != end_bit) {
+      return nullptr;
+    }
+
+    current_node = next_node;
+    current_bits_len = end_bit;
+  }
+
+  if (!current_node->is_prefix or current_node->parent == nullptr) { // ルートノードは消さない
+    return nullptr;
+  }
+
+  void *data = current_node->data;
+  current_node->is_prefix = false;
+  current_node->data = nullptr;
+
+  patricia_trie_compact_node(current_node);
+
+  return data;
+}
+
 int patricia_trie_get_prefix_len(patricia_node *node) {
   int sum = 0;
   patricia_node *current = node;
@@ -220,7 +294,7 @@ int patricia_trie_get_distance_from_root(patricia_node *node) {
   return sum;
 }
 
-char in6_addr_bits_string[130];
+thread_local char in6_addr_bits_string[130];
 // IPv6アドレスをビット列の文字列に変換する
 char *in6_addr_to_bits_string(in6_addr addr, int start_bit, int end_bit) {
 
@@ -343,11 +417,8 @@ void dump_patricia_trie_text(patricia_node *root) {
     current_node = node_queue.front();
     node_queue.pop();
 
-    char ipv6_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &(current_node->address), ipv6_str, INET6_ADDRSTRLEN);
-
     LOG_TRIE("%s\n", in6_addr_to_bits_string(current_node->address, 0, 127));
-    LOG_TRIE("%s/%d (%d) %d nodes - %s\n", ipv6_str, patricia_trie_get_prefix_len(current_node), current_node->bits_len, patricia_trie_get_distance_from_root(current_node),
+    LOG_TRIE("%s/%d (%d) %d nodes - %s\n", current_node->address, patricia_trie_get_prefix_len(current_node), current_node->bits_len, patricia_trie_get_distance_from_root(current_node),
              current_node->is_prefix ? "prefix" : "not prefix");
 
     if (current_node->left != nullptr) {
@@ -1,18 +1,9 @@
 #ifndef CURO_PATRICIA_TRIE_H
 #define CURO_PATRICIA_TRIE_H
 
+#include "log.h"
 #include <arpa/inet.h>
 
-#define DEBUG_TRIE 0
-
-#if DEBUG_TRIE > 0
-#define LOG_TRIE(...)                                                                                                                                                                                  \
-  printf("[TRIE] ");                                                                                                                                                                                   \
-  printf(__VA_ARGS__)
-#else
-#define LOG_TRIE(...)
-#endif
-
 struct patricia_node {
   patricia_node *left, *right, *parent;
   in6_addr address; // IPv6アドレス
@@ -33,6 +24,7 @@ int patricia_trie_get_prefix_len(patricia_node *node);
 patricia_node *create_patricia_node(in6_addr address, int bits_len, int is_prefix, patricia_node *parent);
 patricia_node *patricia_trie_search(patricia_node *root, in6_addr address);
 patricia_node *patricia_trie_insert(patricia_node *root, in6_addr address, int prefix_len, void *data_ptr);
+void *patricia_trie_remove(patricia_node *root, in6_addr address, int prefix_len);
 void dump_patricia_trie_dot(patricia_node *root);
 void dump_patricia_trie_text(patricia_node *root);
 
@@ -0,0 +1,439 @@
+#include "pipeline.h"
+
+#include "ethernet.h"
+#include "graph.h"
+#include "ipv6.h"
+#include "log.h"
+#include "utils.h"
+#include "worker.h"
+#include <atomic>
+#include <cerrno>
+#include <ctime>
+#include <netpacket/packet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * パイプラインモード
+ * デバイスごとの受信スレッドがフレームを受け取ってヘッダを確かめ、
+ * 検索スレッド(ワーカー0)が経路表とNDテーブルを引いて、デバイスごとの送信スレッドがまとめて送信する
+ * ステージ間は記述子のポインタを渡すSPSCリングでつなぎ、使い終わった記述子は確保したスレッドへ返す
+ */
+
+/* 記述子を確保するスレッドごとの記述子の置き場 */
+struct pipeline_pool {
+  pkt_desc *descs;
+  pkt_desc *free_list[PIPELINE_POOL_SIZE];
+  uint32_t free_count;
+  spsc_ring<pkt_desc *, PIPELINE_POOL_SIZE> **returns; // 解放するスレッドごとの返却用リング
+};
+
+/* デバイスごとのステージの状態 */
+struct pipeline_device {
+  net_device *dev;
+  int fd;
+  int rx_cpu;
+  int tx_cpu;
+  int tx_wake_fd; // 送信リングに記述子を入れた時に送信スレッドを起こすeventfd
+  pthread_t rx_thread;
+  pthread_t tx_thread;
+  pkt_desc_ring rx_ring; // 受信スレッドから検索スレッドへ
+  pkt_desc_ring tx_ring; // 検索スレッドから送信スレッドへ
+  pipeline_ring_stats rx_stats;     // 受信スレッドが更新
+  pipeline_ring_stats lookup_stats; // 検索スレッドが更新
+  pipeline_ring_stats tx_stats;     // 送信スレッドが更新
+  uint64_t tx_enqueue_drops;        // 送信リングが一杯で捨てた数(検索スレッドが更新)
+};
+
+int pipeline_device_count = 0;
+pipeline_device *pipeline_devs = nullptr;
+pipeline_pool *pipeline_pools = nullptr; // 受信スレッドがデバイスの添字、検索スレッドがpipeline_device_count
+
+int pipeline_stop_fd = -1;
+std::atomic<bool> pipeline_stopping{false};
+
+/* 検索スレッドの記述子の置き場と、解放する時の番号 */
+inline int pipeline_lookup_id() { return pipeline_device_count; }
+
+uint64_t pipeline_now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 記述子を確保する(確保するスレッドからのみ呼ぶ) */
+pkt_desc *pipeline_alloc(int owner) {
+  pipeline_pool *pool = &pipeline_pools[owner];
+  if (pool->free_count == 0) { // 返却されたものを回収する
+    for (int i = 0; i <= pipeline_device_count; i++) {
+      pkt_desc *desc;
+      while (pool->returns[i] != nullptr and pool->returns[i]->pop(&desc)) {
+        pool->free_list[pool->free_count++] = desc;
+      }
+    }
+    if (pool->free_count == 0) {
+      return nullptr;
+    }
+  }
+  return pool->free_list[--pool->free_count];
+}
+
+/* 記述子を確保したスレッドへ返す */
+void pipeline_release(pkt_desc *desc, int releaser) {
+  pipeline_pool *pool = &pipeline_pools[desc->owner];
+  if (desc->owner == releaser) {
+    pool->free_list[pool->free_count++] = desc;
+    return;
+  }
+  pool->returns[releaser]->push(desc); // 記述子の総数と同じ大きさなので溢れない
+}
+
+/* リングから取り出した時の統計を更新する */
+inline void pipeline_account(pipeline_ring_stats *stats, pkt_desc *desc, uint64_t now, uint32_t depth) {
+  uint64_t wait = now - desc->enqueued;
+  stats->packets++;
+  stats->wait_ns_total += wait;
+  if (wait > stats->wait_ns_max) {
+    stats->wait_ns_max = wait;
+  }
+  if (depth > stats->depth_max) {
+    stats->depth_max = depth;
+  }
+}
+
+/* CPUに固定する */
+void pipeline_pin_cpu(int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    LOG_ERROR("failed to pin pipeline thread to cpu %d: %s\n", cpu, strerror(errno));
+  }
+}
+
+/* 転送の前に、受信したフレームのイーサネットとIPv6のヘッダを確かめる */
+bool pipeline_parse(net_device *dev, const uint8_t *frame, uint32_t len) {
+  if (len < ETHERNET_HEADER_SIZE + sizeof(ipv6_header)) {
+    return false;
+  }
+  auto *eth = (const ethernet_header *)frame;
+  if (memcmp(eth->dst_addr, dev->mac_addr, 6) != 0 and memcmp(eth->dst_addr, ETHER_ADDR_IPV6_MCAST_PREFIX, 2) != 0) {
+    return false;
+  }
+  if (ntohs(eth->type) != ETHER_TYPE_IPV6) {
+    return false;
+  }
+  auto *v6h = (const ipv6_header *)(frame + ETHERNET_HEADER_SIZE);
+  if ((ntohl(v6h->ver_tc_fl) >> 28) != 6) {
+    return false;
+  }
+  return ntohs(v6h->payload_len) + sizeof(ipv6_header) <= len - ETHERNET_HEADER_SIZE;
+}
+
+/* 受信スレッド */
+void *pipeline_rx_main(void *arg) {
+  int index = (int)(intptr_t)arg;
+  pipeline_device *pdev = &pipeline_devs[index];
+  pipeline_pin_cpu(pdev->rx_cpu);
+
+  pkt_desc *descs[PIPELINE_BATCH_SIZE];
+  mmsghdr msgs[PIPELINE_BATCH_SIZE];
+  iovec iovs[PIPELINE_BATCH_SIZE];
+  sockaddr_ll addrs[PIPELINE_BATCH_SIZE];
+  int allocated = 0;
+
+  pollfd fds[2] = {{pdev->fd, POLLIN, 0}, {pipeline_stop_fd, POLLIN, 0}};
+  while (!pipeline_stopping.load(std::memory_order_acquire)) {
+    // 受信に使う記述子を用意する
+    while (allocated < PIPELINE_BATCH_SIZE) {
+      pkt_desc *desc = pipeline_alloc(index);
+      if (desc == nullptr) {
+        break;
+      }
+      descs[allocated++] = desc;
+    }
+    if (allocated == 0) { // 後ろのステージが詰まっているので空くのを待つ
+      usleep(100);
+      continue;
+    }
+
+    for (int i = 0; i < allocated; i++) {
+      iovs[i] = {descs[i]->data, PIPELINE_DESC_DATA_SIZE};
+      memset(&msgs[i], 0, sizeof(mmsghdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_ll);
+    }
+
+    int n = recvmmsg(pdev->fd, msgs, allocated, MSG_DONTWAIT, nullptr);
+    if (n <= 0) {
+      if (n == -1 and errno != EAGAIN and errno != EINTR) {
+        LOG_ERROR("failed to recvmmsg on %s: %s\n", pdev->dev->name, strerror(errno));
+      }
+      poll(fds, 2, -1);
+      continue;
+    }
+    pdev->rx_stats.batches++;
+
+    uint64_t now = pipeline_now_ns();
+    bool wake = false;
+    int kept = 0; // 使わなかった記述子は次の受信に回す
+    for (int i = 0; i < n; i++) {
+      pkt_desc *desc = descs[i];
+      if (addrs[i].sll_pkttype == PACKET_OUTGOING or !pipeline_parse(pdev->dev, desc->data, msgs[i].msg_len)) {
+        pdev->rx_stats.drops++;
+        descs[kept++] = desc;
+        continue;
+      }
+      desc->dev = pdev->dev;
+      desc->len = msgs[i].msg_len;
+      desc->enqueued = now;
+      bool was_empty;
+      if (!pdev->rx_ring.push(desc, &was_empty)) {
+        pdev->rx_stats.drops++;
+        descs[kept++] = desc;
+        continue;
+      }
+      pdev->rx_stats.packets++;
+      wake |= was_empty;
+    }
+    for (int i = n; i < allocated; i++) {
+      descs[kept++] = descs[i];
+    }
+    allocated = kept;
+
+    if (wake) {
+      worker_wake(workers[0]);
+    }
+  }
+
+  for (int i = 0; i < allocated; i++) {
+    pipeline_release(descs[i], index);
+  }
+  return nullptr;
+}
+
+/* 送信スレッド */
+void *pipeline_tx_main(void *arg) {
+  int index = (int)(intptr_t)arg;
+  pipeline_device *pdev = &pipeline_devs[index];
+  pipeline_pin_cpu(pdev->tx_cpu);
+
+  pkt_desc *descs[PIPELINE_BATCH_SIZE];
+  mmsghdr msgs[PIPELINE_BATCH_SIZE];
+  iovec iovs[PIPELINE_BATCH_SIZE];
+
+  pollfd fds[2] = {{pdev->tx_wake_fd, POLLIN, 0}, {pipeline_stop_fd, POLLIN, 0}};
+  while (!pipeline_stopping.load(std::memory_order_acquire)) {
+    int n = 0;
+    uint32_t depth = pdev->tx_ring.size();
+    while (n < PIPELINE_BATCH_SIZE and pdev->tx_ring.pop(&descs[n])) {
+      n++;
+    }
+    if (n == 0) {
+      poll(fds, 2, -1);
+      uint64_t count;
+      read(pdev->tx_wake_fd, &count, sizeof(count));
+      continue;
+    }
+
+    uint64_t now = pipeline_now_ns();
+    for (int i = 0; i < n; i++) {
+      pipeline_account(&pdev->tx_stats, descs[i], now, depth);
+      iovs[i] = {descs[i]->data, descs[i]->len};
+      memset(&msgs[i], 0, sizeof(mmsghdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = sendmmsg(pdev->fd, msgs, n, 0);
+    if (sent < 0) {
+      sent = 0;
+    }
+    pdev->tx_stats.batches++;
+    pdev->tx_stats.drops += n - sent;
+
+    for (int i = 0; i < n; i++) {
+      pipeline_release(descs[i], index);
+    }
+  }
+  return nullptr;
+}
+
+/*
+ * 受信リングから記述子を取り出してIPv6の処理をする(検索スレッドのワーカーから呼ぶ)
+ * 取り出しきれなかった記述子が残っていればtrueを返す
+ */
+bool pipeline_lookup_poll() {
+  bool remaining = false;
+  for (int i = 0; i < pipeline_device_count; i++) {
+    pipeline_device *pdev = &pipeline_devs[i];
+    uint32_t depth = pdev->rx_ring.size();
+    if (depth == 0) {
+      continue;
+    }
+
+    uint64_t now = pipeline_now_ns();
+    pkt_desc *descs[PIPELINE_BATCH_SIZE];
+    int n = 0;
+    while (n < PIPELINE_BATCH_SIZE and pdev->rx_ring.pop(&descs[n])) {
+      pkt_desc *desc = descs[n];
+      pipeline_account(&pdev->lookup_stats, desc, now, depth);
+      worker_device *wdev = worker_device_of(desc->dev);
+      wdev->rx_packets++;
+      wdev->rx_bytes += desc->len;
+
+      graph_buffer *b = &graph->buffers[n];
+      b->data = desc->data;
+      b->len = desc->len;
+      b->l3_offset = ETHERNET_HEADER_SIZE;
+      b->rx_dev = desc->dev;
+      b->trace = nullptr;
+      if (trace_enabled()) {
+        trace_capture(b);
+      }
+      // イーサネットヘッダは受信スレッドで確かめてあるので、IPv6の処理から始める
+      graph_enqueue(GRAPH_NODE_IPV6_INPUT, b);
+      n++;
+    }
+    graph_dispatch(); // 送信する時は記述子にコピーされるので、この後すぐに返してよい
+    trace_commit();
+    for (int j = 0; j < n; j++) {
+      pipeline_release(descs[j], pipeline_lookup_id());
+    }
+    pdev->lookup_stats.batches++;
+    if (n == PIPELINE_BATCH_SIZE) {
+      remaining = true;
+    }
+  }
+  return remaining;
+}
+
+/* フレームを記述子にコピーして送信スレッドに渡す(検索スレッドから呼ぶ) */
+int pipeline_transmit(net_device *dev, uint8_t *buffer, size_t len) {
+  pipeline_device *pdev = &pipeline_devs[dev->index];
+  if (len > PIPELINE_DESC_DATA_SIZE) {
+    pdev->tx_enqueue_drops++;
+    return -1;
+  }
+  pkt_desc *desc = pipeline_alloc(pipeline_lookup_id());
+  if (desc == nullptr) {
+    pdev->tx_enqueue_drops++;
+    return -1;
+  }
+  memcpy(desc->data, buffer, len);
+  desc->dev = dev;
+  desc->len = len;
+  desc->enqueued = pipeline_now_ns();
+
+  bool was_empty;
+  if (!pdev->tx_ring.push(desc, &was_empty)) {
+    pipeline_release(desc, pipeline_lookup_id());
+    pdev->tx_enqueue_drops++;
+    return -1;
+  }
+  if (was_empty) {
+    uint64_t one = 1;
+    write(pdev->tx_wake_fd, &one, sizeof(one));
+  }
+  return 0;
+}
+
+/* パイプラインの準備 */
+int init_pipeline(int device_count) {
+  pipeline_device_count = device_count;
+  pipeline_devs = new pipeline_device[device_count]();
+  pipeline_pools = new pipeline_pool[device_count + 1]();
+
+  pipeline_stop_fd = eventfd(0, EFD_NONBLOCK);
+  if (pipeline_stop_fd == -1) {
+    LOG_ERROR("failed to create eventfd: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // 検索スレッドはワーカー0のCPUを使い、受信・送信スレッドは残りのCPUに順に割り当てる
+  int cpus[CPU_SETSIZE];
+  int cpu_count = worker_allowed_cpus(cpus);
+  int next_cpu = 1;
+  for (int i = 0; i < device_count; i++) {
+    pipeline_device *pdev = &pipeline_devs[i];
+    pdev->fd = -1;
+    pdev->rx_cpu = cpu_count > 0 ? cpus[next_cpu++ % cpu_count] : -1;
+    pdev->tx_cpu = cpu_count > 0 ? cpus[next_cpu++ % cpu_count] : -1;
+    pdev->tx_wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (pdev->tx_wake_fd == -1) {
+      LOG_ERROR("failed to create eventfd: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  for (int owner = 0; owner <= device_count; owner++) {
+    pipeline_pool *pool = &pipeline_pools[owner];
+    pool->descs = new pkt_desc[PIPELINE_POOL_SIZE];
+    for (int i = 0; i < PIPELINE_POOL_SIZE; i++) {
+      pool->descs[i].owner = owner;
+      pool->free_list[i] = &pool->descs[i];
+    }
+    pool->free_count = PIPELINE_POOL_SIZE;
+
+    // 記述子を解放するのは送信スレッドと検索スレッド
+    pool->returns = new spsc_ring<pkt_desc *, PIPELINE_POOL_SIZE> *[device_count + 1]();
+    for (int releaser = 0; releaser <= device_count; releaser++) {
+      if (releaser != owner) {
+        pool->returns[releaser] = new spsc_ring<pkt_desc *, PIPELINE_POOL_SIZE>();
+      }
+    }
+  }
+  return 0;
+}
+
+void pipeline_set_device_fd(net_device *dev, int fd) {
+  pipeline_devs[dev->index].dev = dev;
+  pipeline_devs[dev->index].fd = fd;
+}
+
+/* 受信・送信スレッドを起動する */
+void start_pipeline() {
+  for (int i = 0; i < pipeline_device_count; i++) {
+    if (pthread_create(&pipeline_devs[i].rx_thread, nullptr, pipeline_rx_main, (void *)(intptr_t)i) != 0 or
+        pthread_create(&pipeline_devs[i].tx_thread, nullptr, pipeline_tx_main, (void *)(intptr_t)i) != 0) {
+      LOG_ERROR("failed to start pipeline threads for %s\n", pipeline_devs[i].dev->name);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void stop_pipeline() {
+  pipeline_stopping.store(true, std::memory_order_release);
+  uint64_t one = 1;
+  write(pipeline_stop_fd, &one, sizeof(one)); // 読み出さないので全てのスレッドのpollが返り続ける
+  for (int i = 0; i < pipeline_device_count; i++) {
+    pthread_join(pipeline_devs[i].rx_thread, nullptr);
+    pthread_join(pipeline_devs[i].tx_thread, nullptr);
+  }
+}
+
+void dump_pipeline_ring(const char *name, uint32_t depth, const pipeline_ring_stats *stats) {
+  printf("  %-7s depth %4u (max %4u) packets %lu batches %lu drops %lu wait avg %lu ns max %lu ns\n", name, depth, stats->depth_max, stats->packets, stats->batches, stats->drops,
+         stats->packets > 0 ? stats->wait_ns_total / stats->packets : 0, stats->wait_ns_max);
+}
+
+/* ステージごとのリングの長さと待ち時間を表示する */
+void dump_pipeline_stats() {
+  for (int i = 0; i < pipeline_device_count; i++) {
+    pipeline_device *pdev = &pipeline_devs[i];
+    printf("%s (rx cpu %d, tx cpu %d)\n", pdev->dev->name, pdev->rx_cpu, pdev->tx_cpu);
+    printf("  rx      packets %lu batches %lu drops %lu\n", pdev->rx_stats.packets, pdev->rx_stats.batches, pdev->rx_stats.drops);
+    dump_pipeline_ring("lookup", pdev->rx_ring.size(), &pdev->lookup_stats);
+    dump_pipeline_ring("tx", pdev->tx_ring.size(), &pdev->tx_stats);
+    printf("  tx enqueue drops %lu\n", pdev->tx_enqueue_drops);
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef CURO_PIPELINE_H
+#define CURO_PIPELINE_H
+
+#include "config.h"
+#include "net.h"
+#include "spsc_ring.h"
+#include <cstdint>
+
+#define PIPELINE_DESC_DATA_SIZE 1600 // 記述子に収められるフレームの最大長
+#define PIPELINE_POOL_SIZE 2048      // 記述子を確保するスレッドごとの記述子の数(2の累乗)
+#define PIPELINE_RING_SIZE 1024      // ステージ間のリングの大きさ(2の累乗)
+#define PIPELINE_BATCH_SIZE 32       // 1度に受信・送信するフレームの最大数
+
+/* ステージ間で受け渡すパケットの記述子 */
+struct alignas(CACHE_LINE_SIZE) pkt_desc {
+  net_device *dev;    // 受信したデバイス、または送信するデバイス
+  uint32_t len;       // フレームの長さ
+  uint16_t owner;     // 記述子を確保したスレッド(解放時にここへ返す)
+  uint64_t enqueued;  // リングに入れた時刻(ナノ秒)
+  alignas(CACHE_LINE_SIZE) uint8_t data[PIPELINE_DESC_DATA_SIZE];
+};
+
+/* リングごとの統計(読み出す側のスレッドだけが更新する) */
+struct alignas(CACHE_LINE_SIZE) pipeline_ring_stats {
+  uint64_t packets;       // 取り出した記述子の数
+  uint64_t wait_ns_total; // リングに入ってから取り出されるまでの時間の合計
+  uint64_t wait_ns_max;
+  uint32_t depth_max;     // 取り出す時に見たリングの長さの最大
+  uint64_t batches;       // まとめて処理した回数
+  uint64_t drops;         // リングや記述子が足りずに捨てた数
+};
+
+typedef spsc_ring<pkt_desc *, PIPELINE_RING_SIZE> pkt_desc_ring;
+
+int init_pipeline(int device_count);
+void pipeline_set_device_fd(net_device *dev, int fd);
+void start_pipeline();
+void stop_pipeline();
+
+bool pipeline_lookup_poll();
+int pipeline_transmit(net_device *dev, uint8_t *buffer, size_t len);
+
+void dump_pipeline_stats();
+
+#endif // CURO_PIPELINE_H
@@ -0,0 +1,65 @@
+#ifndef CURO_PROBES_H
+#define CURO_PROBES_H
+
+#include "config.h"
+#include <cstdint>
+
+/*
+ * USDTの静的プローブ(プロバイダ名はcuro)
+ * sys/sdt.hと同じ形式の.note.stapsdtノートを出力するので、perfやbpftraceからそのまま使える
+ *   bpftrace -e 'usdt:./build/curo:curo:fib_miss { printf("%s\n", str(arg0)); }'
+ * プローブの位置にはnop命令が1つ置かれるだけで、誰も接続していなければ分岐も関数呼び出しも無い
+ * 引数は全て8バイトに揃えて渡す(アドレスやデバイス名はポインタ)
+ *
+ *   rx_frame(dev_name, len, dst_mac, src_mac, ether_type)  ethernet-inputで受け取ったフレーム
+ *   fib_miss(dev_name, src_addr, dst_addr, len)              経路が見つからなかったパケット
+ *   nd_miss(dev_name, addr, new_entry)                       近隣のアドレスが未解決だったパケット
+ *   ns_sent(dev_name, target_addr, unicast)                  送信したNS
+ *   tx_frame(dev_name, frame, len)                           送信したフレーム
+ */
+#define CURO_PROBE_STR_(x) #x
+#define CURO_PROBE_STR(x) CURO_PROBE_STR_(x)
+
+#define CURO_PROBE_ASM(provider, name, args)                                     \
+  "990: nop\n"                                                                  \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                 \
+  ".balign 4\n"                                                                 \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                            \
+  "991: .asciz \"stapsdt\"\n"                                                   \
+  "992: .balign 4\n"                                                            \
+  "993: .8byte 990b\n"                                                          \
+  ".8byte _.stapsdt.base\n"                                                     \
+  ".8byte 0\n"                                                                  \
+  ".asciz \"" CURO_PROBE_STR(provider) "\"\n"                                   \
+  ".asciz \"" CURO_PROBE_STR(name) "\"\n"                                       \
+  ".asciz \"" args "\"\n"                                                       \
+  "994: .balign 4\n"                                                            \
+  ".popsection\n"                                                               \
+  ".ifndef _.stapsdt.base\n"                                                    \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"       \
+  ".weak _.stapsdt.base\n"                                                      \
+  ".hidden _.stapsdt.base\n"                                                    \
+  "_.stapsdt.base: .space 1\n"                                                  \
+  ".size _.stapsdt.base, 1\n"                                                   \
+  ".popsection\n"                                                               \
+  ".endif\n"
+
+#define CURO_PROBE_ARG(n, x) [a##n] "nor"((uint64_t)(x))
+
+#if defined(ENABLE_USDT_PROBES) && defined(__x86_64__)
+#define CURO_PROBE3(name, x1, x2, x3)                                                                                  \
+  __asm__ __volatile__(CURO_PROBE_ASM(curo, name, "8@%[a1] 8@%[a2] 8@%[a3]")::CURO_PROBE_ARG(1, x1), CURO_PROBE_ARG(2, x2), \
+                       CURO_PROBE_ARG(3, x3))
+#define CURO_PROBE4(name, x1, x2, x3, x4)                                                                                     \
+  __asm__ __volatile__(CURO_PROBE_ASM(curo, name, "8@%[a1] 8@%[a2] 8@%[a3] 8@%[a4]")::CURO_PROBE_ARG(1, x1), CURO_PROBE_ARG(2, x2), \
+                       CURO_PROBE_ARG(3, x3), CURO_PROBE_ARG(4, x4))
+#define CURO_PROBE5(name, x1, x2, x3, x4, x5)                                                                                          \
+  __asm__ __volatile__(CURO_PROBE_ASM(curo, name, "8@%[a1] 8@%[a2] 8@%[a3] 8@%[a4] 8@%[a5]")::CURO_PROBE_ARG(1, x1), CURO_PROBE_ARG(2, x2), \
+                       CURO_PROBE_ARG(3, x3), CURO_PROBE_ARG(4, x4), CURO_PROBE_ARG(5, x5))
+#else
+#define CURO_PROBE3(name, x1, x2, x3)
+#define CURO_PROBE4(name, x1, x2, x3, x4)
+#define CURO_PROBE5(name, x1, x2, x3, x4, x5)
+#endif
+
+#endif // CURO_PROBES_H
@@ -0,0 +1,139 @@
+#include "punt.h"
+
+#include "icmpv6.h"
+#include "ipv6.h"
+#include "log.h"
+#include "utils.h"
+#include "worker.h"
+#include <cstring>
+
+worker *punt_worker = nullptr;
+punt_ring *punt_rings[MAX_WORKERS]; // 送信元のワーカーのidで引く
+
+thread_local punt_ring *punt_local_ring = nullptr;          // ワーカーから制御プレーンへのリング
+thread_local token_bucket punt_buckets[STATS_PUNT_CLASS_COUNT]; // ワーカーごと、種類ごとの流量の制限
+
+/*
+ * 制御プレーンのスレッドを用意する(init_workersの後、start_workersの前に呼ぶ)
+ * idはワーカーの次の番号にして、ND学習イベントのリングを各ワーカーに足す
+ */
+int init_punt(int device_count) {
+  punt_worker = worker_create(worker_count, -1, device_count); // 転送に使うCPUには固定しない
+  if (punt_worker == nullptr) {
+    return -1;
+  }
+  for (int i = 0; i < worker_count; i++) {
+    punt_rings[i] = new punt_ring();
+    workers[i]->nd_rings[punt_worker->id] = new spsc_ring<nd_event, WORKER_ND_EVENT_RING_SIZE>();
+  }
+  LOG_INFO("punting local packets to a control plane thread\n");
+  return 0;
+}
+
+/* ワーカーのスレッドで、制御プレーンへのリングと流量の制限を用意する */
+void punt_init_worker(worker *w) {
+  if (punt_worker == nullptr or w == punt_worker) {
+    punt_local_ring = nullptr;
+    return;
+  }
+  punt_local_ring = punt_rings[w->id];
+
+  const uint32_t rates[STATS_PUNT_CLASS_COUNT] = {PUNT_ND_RATE_PER_SEC, PUNT_ECHO_RATE_PER_SEC, PUNT_OTHER_RATE_PER_SEC};
+  const uint32_t bursts[STATS_PUNT_CLASS_COUNT] = {PUNT_ND_BURST, PUNT_ECHO_BURST, PUNT_OTHER_BURST};
+  for (int c = 0; c < STATS_PUNT_CLASS_COUNT; c++) {
+    uint32_t rate = rates[c] / worker_count;
+    token_bucket_init(&punt_buckets[c], rate > 0 ? rate : 1, bursts[c]);
+  }
+}
+
+/* ICMPv6のタイプで種類を決める */
+stats_punt_class punt_classify(const ipv6_header *packet, uint32_t len) {
+  if (len < sizeof(ipv6_header) + sizeof(icmpv6_hdr)) {
+    return STATS_PUNT_OTHER;
+  }
+  uint8_t type = ((const icmpv6_hdr *)(packet + 1))->type;
+  if (type >= ICMPV6_TYPE_ROUTER_SOLICIATION and type <= ICMPV6_TYPE_REDIRECT) {
+    return STATS_PUNT_ND;
+  }
+  if (type == ICMPV6_TYPE_ECHO_REQUEST) {
+    return STATS_PUNT_ECHO;
+  }
+  return STATS_PUNT_OTHER;
+}
+
+/*
+ * 自分宛てのパケットを制御プレーンのスレッドに渡す(puntノード、ワーカーで動く)
+ * 種類ごとの制限を超えたものとリングが一杯の時のものは、コピーせずにその場で捨てる
+ */
+void punt_node(graph_buffer **buffers, uint32_t count) {
+  bool wake = false;
+  for (uint32_t i = 0; i < count; i++) {
+    graph_buffer *b = buffers[i];
+    ipv6_header *packet = (ipv6_header *)(b->data + b->l3_offset);
+    stats_punt_class punt_class = punt_classify(packet, b->len - b->l3_offset);
+
+    if (!token_bucket_consume(&punt_buckets[punt_class])) {
+      local_stats->punt[punt_class][STATS_PUNT_POLICED]++;
+      graph_drop(b, STATS_DROP_PUNT_POLICED);
+      continue;
+    }
+    punt_packet *p = punt_local_ring->reserve();
+    if (p == nullptr) {
+      local_stats->punt[punt_class][STATS_PUNT_QUEUE_FULL]++;
+      graph_drop(b, STATS_DROP_PUNT_QUEUE_FULL);
+      continue;
+    }
+    p->rx_dev = b->rx_dev;
+    p->local = b->local;
+    p->len = b->len;
+    p->l3_offset = b->l3_offset;
+    memcpy(p->data, b->data, b->len);
+    bool was_empty;
+    punt_local_ring->commit(&was_empty);
+    wake |= was_empty;
+
+    local_stats->punt[punt_class][STATS_PUNT_QUEUED]++;
+    TRACE_STEP(b, GRAPH_NODE_PUNT, TRACE_PUNT, punt_class, 0, nullptr);
+  }
+  if (wake) { // 制御プレーンのスレッドが待機していれば起こす(ベクタごとに1回だけ)
+    worker_wake(punt_worker);
+  }
+}
+
+/*
+ * ワーカーから渡されたパケットを処理する(制御プレーンのスレッドで動く)
+ * 1つのワーカーの洪水で他のワーカーの分が待たされないように、ワーカーごとにPUNT_BATCH_SIZEずつ順に取り出す
+ * 残っていればtrueを返す
+ */
+bool punt_poll() {
+  uint32_t n = 0;
+  for (int i = 0; i < worker_count; i++) {
+    punt_ring *ring = punt_rings[i];
+    punt_packet *p;
+    for (uint32_t taken = 0; taken < PUNT_BATCH_SIZE and n < GRAPH_VECTOR_SIZE and (p = ring->front()) != nullptr; taken++) {
+      memcpy(graph->frames[n], p->data, p->len);
+      graph_buffer *b = &graph->buffers[n++];
+      b->data = graph->frames[n - 1];
+      b->len = p->len;
+      b->l3_offset = p->l3_offset;
+      b->rx_dev = p->rx_dev;
+      b->tx_dev = p->local->net_dev;
+      b->local = p->local;
+      b->trace = nullptr;
+      ring->release();
+      graph_enqueue(GRAPH_NODE_ICMPV6_LOCAL, b);
+    }
+  }
+  if (n > 0) {
+    graph_dispatch();
+  }
+
+  // 待機に入る前に、リングのcommitのwas_emptyと対になるフェンスを置いてから残りを確かめる
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (int i = 0; i < worker_count; i++) {
+    if (!punt_rings[i]->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,53 @@
+#ifndef CURO_PUNT_H
+#define CURO_PUNT_H
+
+#include "config.h"
+#include "graph.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include <cstdint>
+
+/*
+ * 自分宛てのパケットを転送とは別の制御プレーンのスレッドで処理する
+ * ワーカーはpuntノードで種類ごとのトークンバケットを通したパケットだけを、ワーカーごとのリングにコピーして渡す
+ * NSやpingの洪水は制限を超えた分がリングに入る前に捨てられるので、転送に使うサイクルはほとんど減らない
+ * 制御プレーンのスレッドはワーカーと同じ仕組み(経路表、NDテーブル、タイマー、送信キュー)で動き、
+ * NS/NAで学習した内容はND学習イベントのリングで各ワーカーに伝える
+ */
+
+#define PUNT_RING_SIZE 256 // ワーカーごとの制御プレーンへのリングの長さ(2の累乗)
+#define PUNT_BATCH_SIZE 32 // 制御プレーンのスレッドが1周期で1つのワーカーから取り出す最大数
+
+// 種類ごとの流量の制限(全体の値で、ワーカーの数で分け合う)
+#define PUNT_ND_RATE_PER_SEC 2000
+#define PUNT_ND_BURST 200
+#define PUNT_ECHO_RATE_PER_SEC 1000
+#define PUNT_ECHO_BURST 100
+#define PUNT_OTHER_RATE_PER_SEC 500
+#define PUNT_OTHER_BURST 50
+
+struct worker;
+
+/* 制御プレーンに渡すパケット(リングの中にフレームごと置く) */
+struct punt_packet {
+  net_device *rx_dev;
+  ipv6_device *local; // 宛先のアドレス
+  uint32_t len;
+  uint16_t l3_offset;
+  uint8_t data[GRAPH_FRAME_SIZE];
+};
+
+typedef spsc_ring<punt_packet, PUNT_RING_SIZE> punt_ring;
+
+extern worker *punt_worker; // 制御プレーンのスレッド(使わなければnullptr)
+extern thread_local punt_ring *punt_local_ring;
+
+/* 自分宛てのパケットを渡すノード(制御プレーンのスレッドがあればpunt、無ければその場で処理する) */
+inline graph_node_index punt_local_node() { return punt_local_ring != nullptr ? GRAPH_NODE_PUNT : GRAPH_NODE_ICMPV6_LOCAL; }
+
+int init_punt(int device_count);
+void punt_init_worker(worker *w);
+void punt_node(graph_buffer **buffers, uint32_t count);
+bool punt_poll();
+
+#endif // CURO_PUNT_H
@@ -0,0 +1,111 @@
+#ifndef CURO_SPSC_RING_H
+#define CURO_SPSC_RING_H
+
+#include <atomic>
+#include <cstdint>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * 1つのスレッドが書き込み、1つのスレッドが読み出すロックフリーのリングバッファ
+ * 読み出し側と書き込み側の位置を別々のキャッシュラインに置き、
+ * 相手の位置は必要になった時だけ読み直すことでキャッシュラインの行き来を減らす
+ * Nは2の累乗
+ */
+template <typename T, uint32_t N> struct spsc_ring {
+  static_assert((N & (N - 1)) == 0, "size of spsc_ring must be power of 2");
+
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> head{0}; // 次に読み出す位置(読み出し側が更新)
+  uint32_t cached_tail = 0;                                // 読み出し側が最後に見た書き込み位置
+  alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> tail{0}; // 次に書き込む位置(書き込み側が更新)
+  uint32_t cached_head = 0;                                // 書き込み側が最後に見た読み出し位置
+  alignas(CACHE_LINE_SIZE) T items[N];
+
+  /*
+   * 書き込み側: 一杯ならfalseを返す
+   * was_emptyを渡すと、読み出し側がそれまでの項目を全て読み終えていた(待機に入ったかもしれない)かを返す
+   */
+  bool push(const T &item, bool *was_empty = nullptr) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - cached_head == N) {
+      cached_head = head.load(std::memory_order_acquire);
+      if (t - cached_head == N) {
+        return false;
+      }
+    }
+    items[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    if (was_empty != nullptr) {
+      // 読み出し側のpopと対になるフェンスで、どちらかが必ず相手の更新を見るようにする
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      *was_empty = head.load(std::memory_order_acquire) == t;
+    }
+    return true;
+  }
+
+  /*
+   * 書き込み側: 次に書き込む項目をその場で組み立てるために取り出す(一杯ならnullptr)
+   * 組み立て終わったらcommitで読み出し側に見せる(was_emptyはpushと同じ)
+   */
+  T *reserve() {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t - cached_head == N) {
+      cached_head = head.load(std::memory_order_acquire);
+      if (t - cached_head == N) {
+        return nullptr;
+      }
+    }
+    return &items[t & (N - 1)];
+  }
+
+  void commit(bool *was_empty = nullptr) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    tail.store(t + 1, std::memory_order_release);
+    if (was_empty != nullptr) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      *was_empty = head.load(std::memory_order_acquire) == t;
+    }
+  }
+
+  /* 読み出し側: 先頭の項目をコピーせずに参照する(空ならnullptr)、使い終わったらreleaseで返す */
+  T *front() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == cached_tail) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h == cached_tail) {
+        return nullptr;
+      }
+    }
+    return &items[h & (N - 1)];
+  }
+
+  void release() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  /* 読み出し側: 空ならfalseを返す */
+  bool pop(T *item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h == cached_tail) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h == cached_tail) {
+        return false;
+      }
+    }
+    *item = items[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* 書き込み側から見た空き */
+  uint32_t free_space() {
+    cached_head = head.load(std::memory_order_acquire);
+    return N - (tail.load(std::memory_order_relaxed) - cached_head);
+  }
+
+  /* 現在溜まっている数(どちらのスレッドからでも読めるおおよその値) */
+  uint32_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+  bool empty() const { return size() == 0; }
+};
+
+#endif // CURO_SPSC_RING_H
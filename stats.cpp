@@ -0,0 +1,147 @@
+#include "stats.h"
+
+#include "config.h"
+#include "log.h"
+#include "nd.h"
+#include "net.h"
+#include "punt.h"
+#include "worker.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * カウンタはワーカーごとにキャッシュラインを分けて持ち、ワーカーだけが書き込む
+ * 一定の間隔でワーカー自身が共有メモリの自分の領域に書き出すので、
+ * 外部のcuro-statsはルータにシステムコールを発行させずに何度でも読める
+ */
+
+stats_counters stats_unused; // ワーカー以外のスレッドが数えた分(公開しない)
+thread_local stats_counters *local_stats = &stats_unused;
+
+stats_shm_header *stats_shm = nullptr;
+size_t stats_shm_size = 0;
+
+/* 統計を公開する共有メモリを作る(ワーカーを始める前に呼ぶ) */
+int init_stats_export(int worker_count, int device_count) {
+  size_t workers_offset = sizeof(stats_shm_header) + sizeof(stats_shm_device_info) * device_count;
+  workers_offset = (workers_offset + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+  size_t worker_size = sizeof(stats_shm_worker) + sizeof(stats_shm_device) * device_count;
+  worker_size = (worker_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+  stats_shm_size = workers_offset + worker_size * worker_count;
+
+  int fd = shm_open(STATS_SHM_NAME, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd == -1) {
+    LOG_ERROR("failed to shm_open %s: %s\n", STATS_SHM_NAME, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, stats_shm_size) == -1) {
+    LOG_ERROR("failed to ftruncate stats: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  void *addr = mmap(nullptr, stats_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG_ERROR("failed to mmap stats: %s\n", strerror(errno));
+    return -1;
+  }
+
+  stats_shm = (stats_shm_header *)addr;
+  stats_shm->version = STATS_SHM_VERSION;
+  stats_shm->worker_count = worker_count;
+  stats_shm->device_count = device_count;
+  stats_shm->workers_offset = workers_offset;
+  stats_shm->worker_size = worker_size;
+  stats_shm->pid = getpid();
+  stats_shm->drop_reason_count = STATS_DROP_COUNT;
+  stats_shm->nd_event_count = STATS_ND_COUNT;
+  stats_shm->icmpv6_error_event_count = STATS_ICMPV6_ERROR_COUNT;
+  stats_shm->punt_class_count = STATS_PUNT_CLASS_COUNT;
+  stats_shm->punt_event_count = STATS_PUNT_EVENT_COUNT;
+  stats_shm->flow_event_count = STATS_FLOW_COUNT;
+
+  stats_shm_device_info *infos = stats_shm_device_infos(stats_shm);
+  for (int i = 0; i < device_count; i++) {
+    strncpy(infos[i].name, net_devs[i]->name, STATS_DEVICE_NAME_LEN - 1);
+  }
+  for (int i = 0; i < worker_count; i++) {
+    worker *w = i < ::worker_count ? workers[i] : punt_worker; // 最後は制御プレーンのスレッド
+    w->stats_shm = stats_shm_worker_at(stats_shm, i);
+  }
+
+  // 読む側には全て書き終えてからmagicを見せる
+  std::atomic_thread_fence(std::memory_order_release);
+  stats_shm->magic = STATS_SHM_MAGIC;
+
+  LOG_INFO("exporting stats on %s\n", STATS_SHM_NAME);
+  return 0;
+}
+
+void close_stats_export() {
+  if (stats_shm == nullptr) {
+    return;
+  }
+  munmap(stats_shm, stats_shm_size);
+  shm_unlink(STATS_SHM_NAME);
+  stats_shm = nullptr;
+}
+
+uint64_t stats_now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* NDの統計はNDテーブルと一緒に持っているので、現在のワーカーのカウンタに写す */
+void stats_collect_nd(stats_counters *counters) {
+  counters->nd[STATS_ND_NS_SENT] = nd_stats.ns_sent;
+  counters->nd[STATS_ND_NS_COALESCED] = nd_stats.ns_coalesced;
+  counters->nd[STATS_ND_NS_RATE_LIMITED] = nd_stats.ns_rate_limited;
+  counters->nd[STATS_ND_RESOLUTION_LIMITED] = nd_stats.resolution_limited;
+  counters->nd[STATS_ND_EVICTED] = nd_stats.evicted_incomplete + nd_stats.evicted_other;
+}
+
+/* 現在のワーカーのカウンタを共有メモリに書き出す */
+void stats_publish(worker *w) {
+  stats_shm_worker *shm = w->stats_shm;
+  stats_counters *counters = &w->stats;
+  stats_collect_nd(counters);
+
+  // seqlock: 書き込み中は奇数にする
+  uint32_t seq = shm->seq.load(std::memory_order_relaxed);
+  shm->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  shm->published_ns = stats_now_ns();
+  memcpy(&shm->counters, counters, sizeof(stats_counters));
+  stats_shm_device *devs = stats_shm_devices_of(shm);
+  for (uint32_t i = 0; i < net_dev_count; i++) {
+    worker_device *wdev = &w->devs[i];
+    devs[i].rx_packets = wdev->rx_packets;
+    devs[i].rx_bytes = wdev->rx_bytes;
+    devs[i].tx_packets = wdev->tx_packets;
+    devs[i].tx_bytes = wdev->tx_bytes;
+    devs[i].tx_drops = wdev->tx_queue_drops;
+    devs[i].tx_errors = wdev->tx_errors;
+  }
+
+  shm->seq.store(seq + 2, std::memory_order_release);
+}
+
+void stats_timer_callback(timer_entry *timer) {
+  stats_publish(current_worker);
+  timer_add(timer, STATS_PUBLISH_INTERVAL_MS);
+}
+
+/* ワーカーのスレッドでカウンタを使い始める */
+void stats_start_worker(worker *w) {
+  local_stats = &w->stats;
+  if (w->stats_shm != nullptr) {
+    w->stats_timer.callback = stats_timer_callback;
+    timer_add(&w->stats_timer, STATS_PUBLISH_INTERVAL_MS);
+  }
+}
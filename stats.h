@@ -0,0 +1,162 @@
+#ifndef CURO_STATS_H
+#define CURO_STATS_H
+
+#include "spsc_ring.h"
+#include "timer.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define STATS_SHM_NAME "/curo-stats" // 統計を公開する共有メモリの名前
+#define STATS_SHM_MAGIC 0x6375726f   // "curo"
+#define STATS_SHM_VERSION 7
+#define STATS_PUBLISH_INTERVAL_MS 10 // ワーカーが共有メモリに統計を書き出す間隔
+#define STATS_DEVICE_NAME_LEN 32
+
+/* パケットを捨てた理由 */
+enum stats_drop_reason : uint8_t {
+  STATS_DROP_TOO_SHORT,        // ヘッダに満たない
+  STATS_DROP_BAD_HEADER,       // バージョンや長さがおかしい
+  STATS_DROP_NOT_FOR_US,       // 他のホスト宛てや、参加していないマルチキャスト
+  STATS_DROP_UNKNOWN_PROTOCOL, // 扱わないイーサタイプや次ヘッダ
+  STATS_DROP_NO_ROUTE,         // 経路が無い
+  STATS_DROP_NO_ND,            // アドレス解決できなかった、または解決待ちの上限を超えた
+  STATS_DROP_FRAME_TOO_BIG,    // 送信するフレームが大きすぎる
+  STATS_DROP_HOP_LIMIT,        // 転送するとHop Limitが0になる
+  STATS_DROP_PACKET_TOO_BIG,   // 出力先のMTUを超える
+  STATS_DROP_PUNT_POLICED,     // 制御プレーンへ渡す流量の制限を超えた
+  STATS_DROP_PUNT_QUEUE_FULL,  // 制御プレーンへのキューが一杯
+  STATS_DROP_ACL_DENIED,       // ACLで拒否した
+  STATS_DROP_NPTV6,            // NPTv6で変換できない(チェックサムを打ち消す語が0xffff)
+  STATS_DROP_ACL_UNPARSEABLE,  // 拡張ヘッダをたどって上位層のヘッダを見つけられず、ACLで評価できない
+  STATS_DROP_COUNT
+};
+
+/* NDの出来事 */
+enum stats_nd_event : uint8_t {
+  STATS_ND_NS_SENT,
+  STATS_ND_NS_COALESCED,
+  STATS_ND_NS_RATE_LIMITED,
+  STATS_ND_RESOLUTION_LIMITED,
+  STATS_ND_EVICTED,
+  STATS_ND_RESOLVED,        // 解決中のエントリがNAで解決した
+  STATS_ND_EVENT_PUBLISHED, // 他のワーカーに渡した学習内容
+  STATS_ND_EVENT_APPLIED,   // 他のワーカーから受け取って反映した学習内容
+  STATS_ND_EVENT_DROPPED,   // リングが一杯で渡せなかった学習内容
+  STATS_ND_COUNT
+};
+
+/* ICMPv6エラーの送信(送らなかった時はどの理由で抑えたか) */
+enum stats_icmpv6_error_event : uint8_t {
+  STATS_ICMPV6_ERROR_SENT,
+  STATS_ICMPV6_ERROR_RATE_LIMITED,   // ワーカー全体のトークンバケット
+  STATS_ICMPV6_ERROR_SOURCE_LIMITED, // 送信元ごとのトークンバケット
+  STATS_ICMPV6_ERROR_NOT_ALLOWED,    // RFC 4443 2.4(e)で送ってはいけないパケット
+  STATS_ICMPV6_ERROR_COUNT
+};
+
+/* 制御プレーンのスレッドに渡す自分宛てのパケットの種類(種類ごとに流量を制限する) */
+enum stats_punt_class : uint8_t {
+  STATS_PUNT_ND,    // RS/RA/NS/NA/Redirect
+  STATS_PUNT_ECHO,  // エコー要求
+  STATS_PUNT_OTHER, // その他のICMPv6
+  STATS_PUNT_CLASS_COUNT
+};
+
+enum stats_punt_event : uint8_t {
+  STATS_PUNT_QUEUED,
+  STATS_PUNT_POLICED,
+  STATS_PUNT_QUEUE_FULL,
+  STATS_PUNT_EVENT_COUNT
+};
+
+/* フローキャッシュの出来事 */
+enum stats_flow_event : uint8_t {
+  STATS_FLOW_HIT,         // 経路もNDも引かずに転送した
+  STATS_FLOW_MISS,        // ACLと経路の検索に回した
+  STATS_FLOW_STALE,       // 経路表やNDテーブルが変わった後のエントリだったので引き直した
+  STATS_FLOW_INSERTED,
+  STATS_FLOW_EVICTED,     // 置き場所が見つからずに追い出した
+  STATS_FLOW_AGED,        // 一定時間使われなかったので消した
+  STATS_FLOW_COUNT
+};
+
+/* ワーカーごとのカウンタ(そのワーカーだけが書き込む) */
+struct alignas(CACHE_LINE_SIZE) stats_counters {
+  uint64_t drops[STATS_DROP_COUNT];
+  uint64_t icmpv6_rx[256]; // タイプごと
+  uint64_t icmpv6_tx[256];
+  uint64_t nd[STATS_ND_COUNT];
+  uint64_t icmpv6_errors[STATS_ICMPV6_ERROR_COUNT];
+  uint64_t punt[STATS_PUNT_CLASS_COUNT][STATS_PUNT_EVENT_COUNT];
+  uint64_t flow[STATS_FLOW_COUNT];
+};
+
+extern thread_local stats_counters *local_stats;
+
+inline void stats_count_drop(stats_drop_reason reason) { local_stats->drops[reason]++; }
+
+/*
+ * 共有メモリの構成
+ *   stats_shm_header
+ *   stats_shm_device_info * device_count
+ *   (stats_shm_worker + stats_shm_device * device_count) * worker_count
+ * ワーカーごとの領域はseqlockで守り、書き込み中はseqが奇数になる
+ * 読む側はseqが偶数で、読む前後で変わっていなければ一貫した値として使う
+ */
+struct stats_shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t worker_count;
+  uint32_t device_count;
+  uint32_t workers_offset; // 最初のワーカーの領域の位置
+  uint32_t worker_size;    // ワーカーごとの領域の大きさ
+  uint32_t pid;
+  uint32_t drop_reason_count;
+  uint32_t nd_event_count;
+  uint32_t icmpv6_error_event_count;
+  uint32_t punt_class_count;
+  uint32_t punt_event_count;
+  uint32_t flow_event_count;
+};
+
+struct stats_shm_device_info {
+  char name[STATS_DEVICE_NAME_LEN];
+};
+
+struct stats_shm_device {
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+  uint64_t tx_drops;
+  uint64_t tx_errors;
+};
+
+struct alignas(CACHE_LINE_SIZE) stats_shm_worker {
+  std::atomic<uint32_t> seq;
+  uint64_t published_ns; // 書き出した時刻(CLOCK_MONOTONIC)
+  stats_counters counters;
+};
+
+inline stats_shm_device_info *stats_shm_device_infos(stats_shm_header *header) { return (stats_shm_device_info *)(header + 1); }
+
+inline stats_shm_worker *stats_shm_worker_at(stats_shm_header *header, uint32_t id) { return (stats_shm_worker *)((uint8_t *)header + header->workers_offset + (size_t)header->worker_size * id); }
+
+inline stats_shm_device *stats_shm_devices_of(stats_shm_worker *worker) { return (stats_shm_device *)(worker + 1); }
+
+inline const char *const stats_drop_reason_names[STATS_DROP_COUNT] = {"too short", "bad header", "not for us", "unknown protocol", "no route", "no nd", "frame too big", "hop limit", "packet too big", "punt policed", "punt queue full", "acl denied", "npt untranslatable", "acl unparseable"};
+inline const char *const stats_nd_event_names[STATS_ND_COUNT] = {"ns sent", "ns coalesced", "ns rate limited", "resolution limited", "evicted", "resolved", "events published", "events applied", "events dropped"};
+inline const char *const stats_icmpv6_error_event_names[STATS_ICMPV6_ERROR_COUNT] = {"sent", "rate limited", "source rate limited", "not allowed"};
+inline const char *const stats_punt_class_names[STATS_PUNT_CLASS_COUNT] = {"nd", "echo", "other"};
+inline const char *const stats_punt_event_names[STATS_PUNT_EVENT_COUNT] = {"queued", "policed", "queue full"};
+inline const char *const stats_flow_event_names[STATS_FLOW_COUNT] = {"hit", "miss", "stale", "inserted", "evicted", "aged"};
+
+struct worker;
+
+int init_stats_export(int worker_count, int device_count);
+void close_stats_export();
+void stats_start_worker(worker *w);
+void stats_collect_nd(stats_counters *counters);
+
+#endif // CURO_STATS_H
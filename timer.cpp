@@ -0,0 +1,167 @@
+#include "timer.h"
+
+#include "log.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/*
+ * 階層化タイマーホイール
+ * 近い期限のタイマーは下の階層に、遠い期限のタイマーは上の階層に入れておき、
+ * 下の階層が一周するたびに上の階層の1スロット分を下の階層に振り分け直す
+ * 登録・取り消しは連結リストの付け外しだけなのでO(1)
+ */
+thread_local timer_entry timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // 各スロットの番兵
+thread_local uint64_t timer_wheel_jiffies = 0;                            // 次に処理するtick
+
+uint64_t timer_now_ticks() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000ull + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+void init_timer_wheel() {
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      timer_wheel[level][slot].prev = &timer_wheel[level][slot];
+      timer_wheel[level][slot].next = &timer_wheel[level][slot];
+    }
+  }
+  timer_wheel_jiffies = timer_now_ticks();
+}
+
+void timer_list_append(timer_entry *head, timer_entry *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/* 期限までの長さから、タイマーを入れる階層とスロットを決める */
+void timer_wheel_enqueue(timer_entry *timer) {
+  uint64_t delta = timer->expire - timer_wheel_jiffies;
+
+  if ((int64_t)delta < 0) { // 既に期限を過ぎているものは次のtickで処理する
+    timer_list_append(&timer_wheel[0][timer_wheel_jiffies & (TIMER_WHEEL_SLOTS - 1)], timer);
+    return;
+  }
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    int shift = TIMER_WHEEL_SLOT_BITS * level;
+    if (delta < (1ull << (shift + TIMER_WHEEL_SLOT_BITS)) or level == TIMER_WHEEL_LEVELS - 1) {
+      if (level == TIMER_WHEEL_LEVELS - 1 and delta >= (1ull << (shift + TIMER_WHEEL_SLOT_BITS))) { // 最大の長さに丸める
+        timer->expire = timer_wheel_jiffies + (1ull << (shift + TIMER_WHEEL_SLOT_BITS)) - 1;
+      }
+      timer_list_append(&timer_wheel[level][(timer->expire >> shift) & (TIMER_WHEEL_SLOTS - 1)], timer);
+      return;
+    }
+  }
+}
+
+/* タイマーを登録する(登録済みなら期限を更新する) */
+void timer_add(timer_entry *timer, uint32_t delay_ms) {
+  timer_cancel(timer);
+  timer->expire = timer_now_ticks() + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  timer_wheel_enqueue(timer);
+}
+
+/*
+ * 期限(tick)を指定してタイマーを登録する
+ * タイマーを埋め込んだ構造体をメモリ上で動かす時は、取り消してから動かし、元の期限で登録し直す
+ */
+void timer_add_at(timer_entry *timer, uint64_t expire) {
+  timer_cancel(timer);
+  timer->expire = expire;
+  timer_wheel_enqueue(timer);
+}
+
+/* タイマーを取り消す */
+void timer_cancel(timer_entry *timer) {
+  if (!timer_pending(timer)) {
+    return;
+  }
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = nullptr;
+}
+
+
+/* 上の階層のスロットのタイマーを、下の階層に振り分け直す */
+void timer_wheel_cascade(int level) {
+  int index = (timer_wheel_jiffies >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  timer_entry *head = &timer_wheel[level][index];
+
+  timer_entry *timer = head->next;
+  head->prev = head->next = head;
+  while (timer != head) {
+    timer_entry *next = timer->next;
+    timer_wheel_enqueue(timer);
+    timer = next;
+  }
+
+  if (index == 0 and level + 1 < TIMER_WHEEL_LEVELS) {
+    timer_wheel_cascade(level + 1);
+  }
+}
+
+/* 現在時刻までに期限が来たタイマーを実行する */
+void timer_wheel_run() {
+  uint64_t now = timer_now_ticks();
+
+  while (timer_wheel_jiffies <= now) {
+    int index = timer_wheel_jiffies & (TIMER_WHEEL_SLOTS - 1);
+    if (index == 0) {
+      timer_wheel_cascade(1);
+    }
+
+    // コールバックの中で登録し直されても良いように、一旦別のリストに移してから実行する
+    timer_entry expired;
+    timer_entry *head = &timer_wheel[0][index];
+    if (head->next == head) {
+      timer_wheel_jiffies++;
+      continue;
+    }
+    expired.next = head->next;
+    expired.prev = head->prev;
+    expired.next->prev = &expired;
+    expired.prev->next = &expired;
+    head->prev = head->next = head;
+
+    timer_wheel_jiffies++;
+
+    while (expired.next != &expired) {
+      timer_entry *timer = expired.next;
+      timer_cancel(timer);
+      timer->callback(timer);
+    }
+  }
+}
+
+/* 一定間隔でタイマーホイールを進めるためのtimerfdを作成する */
+int timer_wheel_create_timerfd() {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (fd == -1) {
+    LOG_ERROR("failed to timerfd_create: %s\n", strerror(errno));
+    return -1;
+  }
+
+  itimerspec spec{};
+  spec.it_interval.tv_nsec = TIMER_TICK_MS * 1000000;
+  spec.it_value.tv_nsec = TIMER_TICK_MS * 1000000;
+  if (timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+    LOG_ERROR("failed to timerfd_settime: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void timer_wheel_handle_timerfd(int fd) {
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+  timer_wheel_run();
+}
@@ -0,0 +1,35 @@
+#ifndef CURO_TIMER_H
+#define CURO_TIMER_H
+
+#include <cstdint>
+
+#define TIMER_TICK_MS 10           // タイマーの分解能(ミリ秒)
+#define TIMER_WHEEL_LEVELS 4       // 階層の数
+#define TIMER_WHEEL_SLOT_BITS 6    // 1階層あたりのスロット数のビット数
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/*
+ * タイマーホイールに登録するタイマー
+ * 使う側の構造体に埋め込み、コールバックで埋め込み先を取り出して使う
+ */
+struct timer_entry {
+  timer_entry *prev = nullptr; // 登録されていなければnullptr
+  timer_entry *next = nullptr;
+  uint64_t expire = 0;         // 期限(tick)
+  void (*callback)(timer_entry *timer) = nullptr;
+};
+
+void init_timer_wheel();
+
+int timer_wheel_create_timerfd();
+void timer_wheel_handle_timerfd(int fd);
+
+void timer_wheel_run();
+
+void timer_add(timer_entry *timer, uint32_t delay_ms);
+void timer_add_at(timer_entry *timer, uint64_t expire);
+void timer_cancel(timer_entry *timer);
+
+inline bool timer_pending(const timer_entry *timer) { return timer->prev != nullptr; }
+
+#endif // CURO_TIMER_H
@@ -0,0 +1,859 @@
+/*
+ * curo-bench: ソケットを使わずに転送処理の性能を測る
+ * メモリ上の受信デバイス(bench0)に合成したIPv6のフレームを流し込み、
+ * 本体と同じグラフで転送して送信デバイス(bench1)の送信キューから回収する
+ * 権限もネットワークの設定も要らないので、データパスを変更するたびに同じ条件で測れる
+ * パケットあたりのmallocの回数と、作ったmy_bufの数(キャッシュから取り出してコピーした分も含む)を表示する
+ * 送信したフレームの宛先MACアドレスが次ホップの近隣のものでなければ失敗にする
+ *
+ * -cを付けると、転送の代わりにチェックサムの実装ごとの速さを64~9000バイトで比べる
+ * -fを付けると、その割合(%)のフレームをルータ自身へのエコー要求にして、制御プレーンへの洪水の中での転送の速さを測る
+ * -Pを付けると、自分宛てのパケットを制御プレーンのスレッドに渡す(本体と同じpuntの経路)
+ * -aを付けると、転送するパケットには合わないその数のACLのルールを入れて、全てのタプルを引く場合の費用を測る
+ * -xを付けると、その数のNPTv6の変換の組を送信デバイスに入れ、転送する全てのパケットの送信元を書き換える
+ * -eを付けると、UDPの前にその数の宛先オプションヘッダを挟み、半分を53番宛てにしてACLの「UDPの53番を拒否」で捨てさせる
+ *   (53番宛ての4つに1つは先頭を2つ目以降のフラグメントにするので、ポートを指定したルールには合わずに転送される
+ *    ACL_MAX_EXTENSION_HEADERSより多ければ全て評価できずに捨てる)
+ * -Nを付けると、その割合(%)のフレームを接続ネットワークの/64のランダムなアドレス宛てのUDPにして、スキャンの中での転送の速さを測る
+ *   (経路の次ホップは学習した到達済みの近隣にし、NDテーブルの上限を下げて、解決中のエントリが入りきらずに追い出しが起きるようにする)
+ *
+ * 使い方: curo-bench [-n パケット数] [-s フレーム長] [-t 経路の数] [-d uniform|zipf|single|echo] [-r 乱数の種] [-c] [-f 割合] [-P] [-a ACLのルールの数] [-x NPTv6の組の数]
+ *                    [-e 拡張ヘッダの数] [-N スキャンの割合]
+ */
+#include "acl.h"
+#include "checksum.h"
+#include "config.h"
+#include "ethernet.h"
+#include "graph.h"
+#include "icmpv6.h"
+#include "ipv6.h"
+#include "log.h"
+#include "my_buf.h"
+#include "nd.h"
+#include "net.h"
+#include "nptv6.h"
+#include "patricia_trie.h"
+#include "punt.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include "worker.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_POOL_SIZE 65536 // 前もって作っておくフレームの数
+#define BENCH_CHECKSUM_BYTES (16 * 1024 * 1024) // チェックサムの実装ごと、長さごとに計算するバイト数
+#define BENCH_SWEEP_DEVICES 4      // -Nでスキャンされる接続ネットワークのデバイスの数
+#define BENCH_SWEEP_NEIGHBORS 1024 // -Nで経路の次ホップにする到達済みの近隣の数
+
+/*
+ * mallocを横取りして、計測中にメモリを割り当てた回数を数える
+ * (operator newもmallocを呼ぶので一緒に数えられる)
+ */
+std::atomic<uint64_t> bench_allocs{0};
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  bench_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  bench_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bench_allocs.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+}
+
+enum class bench_distribution {
+  uniform, // 全ての経路に均等に
+  zipf,    // 一部の経路に偏らせる(s=1のZipf分布)
+  single,  // 1つの宛先だけ
+  echo     // ルータ自身へのエコー要求(応答はbench0から送り返される)
+};
+
+struct bench_options {
+  uint64_t packets = 1000000;
+  uint32_t frame_size = 64;
+  uint32_t table_size = 1000;
+  bench_distribution distribution = bench_distribution::uniform;
+  uint32_t seed = 1;
+  bool checksum = false; // チェックサムの速さを測る
+  uint32_t flood_percent = 0; // ルータ自身へのエコー要求にするフレームの割合
+  bool punt = false;          // 制御プレーンのスレッドを使う
+  uint32_t acl_rules = 0;     // ACLのルールの数
+  uint32_t npt_mappings = 0;  // NPTv6の変換の組の数
+  int ext_headers = -1;       // UDPの前に挟む宛先オプションヘッダの数(負なら拡張ヘッダとACLの確認をしない)
+  uint32_t sweep_percent = 0; // 接続ネットワークの/64をスキャンするフレームの割合
+};
+
+struct bench_route {
+  in6_addr prefix;
+  uint32_t prefix_len;
+};
+
+/* 前もって作っておいたフレーム */
+struct bench_frame {
+  uint8_t data[GRAPH_FRAME_SIZE];
+  bool flood;  // -fで混ぜたルータ自身へのエコー要求
+  bool denied; // -eでACLに捨てられるはずのもの
+  bool sweep;  // -Nで混ぜたスキャンのフレーム(流し込むたびに宛先を変える)
+};
+
+std::vector<bench_frame> bench_pool;
+uint64_t bench_pool_next = 0;
+uint64_t bench_rx_remaining = 0; // これから流し込むパケットの数
+uint64_t bench_flood_rx = 0;     // 流し込んだうち、-fで混ぜたエコー要求の数
+uint64_t bench_denied_rx = 0;    // 流し込んだうち、-eでACLに捨てられるはずのものの数
+uint64_t bench_sweep_rx = 0;     // 流し込んだうち、-Nで混ぜたスキャンのフレームの数
+uint64_t bench_sweep_next = 0;   // 次にスキャンするアドレスの通し番号
+bool bench_learned_next_hops = false; // -Nで、経路の次ホップを学習した近隣にしたか(フローラベルに近隣の番号を入れる)
+std::atomic<uint64_t> bench_bad_mac{0}; // 次ホップと違う宛先MACアドレスで送られたフレーム(-Pでは制御プレーンのスレッドも送る)
+
+uint8_t bench_rx_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+uint8_t bench_tx_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+uint8_t bench_peer_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x03};
+uint8_t bench_sender_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x04};
+
+/* -Nでスキャンされるi番目のデバイスの接続ネットワーク(2001:db8:ff10+i::/64) */
+in6_addr bench_sweep_prefix(uint32_t i) {
+  in6_addr prefix;
+  inet_pton(AF_INET6, "2001:db8:ff10::", &prefix);
+  prefix.s6_addr[5] += i;
+  return prefix;
+}
+
+/*
+ * スキャンのフレームにする: n番目のアドレスを、デバイスを順に替えながら接続ネットワークの/64からばらばらに選ぶ
+ * 中身は正しい長さとチェックサムを持つUDP(traceroute風に33434番宛て)
+ */
+void bench_make_sweep(ipv6_header *ip, uint64_t n) {
+  uint32_t payload_len = ntohs(ip->payload_len);
+  ip->next_hdr = ACL_PROTOCOL_UDP;
+  ip->dst_addr = bench_sweep_prefix(n % BENCH_SWEEP_DEVICES);
+  uint64_t iid = (n / BENCH_SWEEP_DEVICES + 1) * 0x9e3779b97f4a7c15; // 連番を64ビットに散らす
+  memcpy(&ip->dst_addr.s6_addr[8], &iid, 8);
+
+  uint8_t *udp = (uint8_t *)(ip + 1);
+  udp[0] = 1024 >> 8;
+  udp[1] = 1024 & 0xff;
+  udp[2] = 33434 >> 8;
+  udp[3] = 33434 & 0xff;
+  udp[4] = payload_len >> 8;
+  udp[5] = payload_len & 0xff;
+  udp[6] = udp[7] = 0;
+  uint16_t psum = checksum_pseudo_header(ip->src_addr, ip->dst_addr, payload_len, ACL_PROTOCOL_UDP);
+  uint16_t sum = checksum_finish(checksum_partial(udp, payload_len, psum));
+  memcpy(&udp[6], &sum, 2);
+}
+
+/* 受信デバイス: プールのフレームを受信用のバッファにコピーしてグラフに流す(net_device_pollと同じ手順) */
+int bench_poll(net_device *dev) {
+  worker_device *wdev = worker_device_of(dev);
+  uint32_t n = bench_rx_remaining < GRAPH_VECTOR_SIZE ? bench_rx_remaining : GRAPH_VECTOR_SIZE;
+  for (uint32_t i = 0; i < n; i++) {
+    const bench_frame *frame = &bench_pool[bench_pool_next++ & (BENCH_POOL_SIZE - 1)];
+    uint32_t len = ETHERNET_HEADER_SIZE + sizeof(ipv6_header) + ntohs(((ipv6_header *)(frame->data + ETHERNET_HEADER_SIZE))->payload_len);
+    memcpy(graph->frames[i], frame->data, len);
+    bench_flood_rx += frame->flood;
+    bench_denied_rx += frame->denied;
+    if (frame->sweep) { // 同じアドレスを2度引かないように、コピーした方の宛先を変える
+      bench_make_sweep((ipv6_header *)(graph->frames[i] + ETHERNET_HEADER_SIZE), bench_sweep_next++);
+      bench_sweep_rx++;
+    }
+    wdev->rx_packets++;
+    wdev->rx_bytes += len;
+
+    graph_buffer *b = &graph->buffers[i];
+    b->data = graph->frames[i];
+    b->len = len;
+    b->rx_dev = dev;
+    b->trace = nullptr;
+    graph_enqueue(GRAPH_NODE_ETHERNET_INPUT, b);
+  }
+  bench_rx_remaining -= n;
+  graph_dispatch();
+  trace_commit();
+  return n;
+}
+
+/*
+ * 送信したフレームの宛先MACアドレスが、書き換えるはずの近隣のものか
+ * bench1から出るものは経路の次ホップ(-Nではフローラベルの番号の学習した近隣)、bench0から出るものはエコー応答の宛先
+ * -Nのスキャンされるデバイスから出るのはNSだけなので見ない(NSの宛先は確かめられない)
+ */
+bool bench_dst_mac_ok(net_device *dev, const uint8_t *data, uint32_t len) {
+  const ethernet_header *eth = (const ethernet_header *)data;
+  if (dev->index == 0) {
+    return memcmp(eth->dst_addr, bench_sender_mac, 6) == 0;
+  }
+  if (dev->index != 1) {
+    return true;
+  }
+  if (!bench_learned_next_hops) {
+    return memcmp(eth->dst_addr, bench_peer_mac, 6) == 0;
+  }
+  if (len < ETHERNET_HEADER_SIZE + sizeof(ipv6_header)) {
+    return false;
+  }
+  const ipv6_header *ip = (const ipv6_header *)(data + ETHERNET_HEADER_SIZE);
+  if (ip->next_hdr == IPV6_PROTOCOL_NUM_ICMP) { // 学習した近隣の到達性を確かめるNSにはフローラベルの番号が無い
+    return true;
+  }
+  uint32_t label = ntohl(ip->ver_tc_fl) & 0xfffff;
+  uint8_t expected[6] = {0x02, 0x00, 0x00, 0x02, (uint8_t)(label >> 8), (uint8_t)label};
+  return memcmp(eth->dst_addr, expected, 6) == 0;
+}
+
+/* 送信デバイス: 送信キューのフレームの宛先MACアドレスを確かめ、数えて捨てる */
+int bench_flush(net_device *dev) {
+  worker_device *wdev = worker_device_of(dev);
+  while (wdev->tx_count > 0) {
+    worker_tx_frame *frame = &wdev->tx_queue[wdev->tx_head];
+    if (!bench_dst_mac_ok(dev, frame->data, frame->len)) {
+      bench_bad_mac.fetch_add(1, std::memory_order_relaxed);
+    }
+    wdev->tx_packets++;
+    wdev->tx_bytes += frame->len;
+    worker_release_tx(frame);
+    wdev->tx_head = (wdev->tx_head + 1) & (TX_QUEUE_LEN - 1);
+    wdev->tx_count--;
+  }
+  return 0;
+}
+
+net_device *bench_create_device(const char *name, const uint8_t *mac_addr) {
+  net_device *dev = (net_device *)calloc(1, sizeof(net_device));
+  strcpy(dev->name, name);
+  memcpy(dev->mac_addr, mac_addr, 6);
+  dev->ops.transmit = worker_queue_tx;
+  dev->ops.flush = bench_flush;
+  dev->ops.poll = bench_poll;
+  net_device_register(dev, net_dev_count + 1); // ifindexは使わないので重ならない値にする
+  return dev;
+}
+
+in6_addr bench_addr(const char *str) {
+  in6_addr addr;
+  inet_pton(AF_INET6, str, &addr);
+  return addr;
+}
+
+/* 2001:db8::/32の中に/40から/64までの経路を作る(接続ネットワークの2001:db8:ff00::/40とは重ならない) */
+std::vector<bench_route> bench_make_routes(uint32_t count, std::mt19937_64 &rng) {
+  std::vector<bench_route> routes;
+  std::uniform_int_distribution<uint32_t> len_dist(40, 64);
+  while (routes.size() < count) {
+    bench_route route{};
+    route.prefix = bench_addr("2001:db8::");
+    uint64_t bits = rng();
+    memcpy(&route.prefix.s6_addr[4], &bits, 4);
+    route.prefix.s6_addr[4] &= 0x7f;
+    route.prefix_len = len_dist(rng);
+    route.prefix = in6_addr_clear_prefix(route.prefix, route.prefix_len);
+    routes.push_back(route);
+  }
+  return routes;
+}
+
+/* ルータ自身へのエコー要求にする */
+void bench_make_echo(ipv6_header *ip, uint32_t payload_len, uint16_t seq) {
+  ip->next_hdr = IPV6_PROTOCOL_NUM_ICMP;
+  ip->dst_addr = bench_addr("2001:db8:ff00::1");
+  icmpv6_echo *echo = (icmpv6_echo *)(ip + 1);
+  echo->hdr.type = ICMPV6_TYPE_ECHO_REQUEST;
+  echo->id = htons(1);
+  echo->seq = htons(seq);
+  uint16_t psum = checksum_pseudo_header(ip->src_addr, ip->dst_addr, payload_len, IPV6_PROTOCOL_NUM_ICMP);
+  echo->hdr.checksum = checksum_finish(checksum_partial(echo, payload_len, psum));
+}
+
+/*
+ * UDPの前に宛先オプションヘッダ(8バイトのPadN)をcount個挟む
+ * later_fragmentなら先頭をオフセットが0でないフラグメントヘッダにする
+ * 捨てられるはずならtrueを返す
+ */
+bool bench_make_ext_headers(ipv6_header *ip, int count, uint16_t dst_port, bool later_fragment) {
+  uint8_t *p = (uint8_t *)(ip + 1);
+  uint8_t *next_hdr = &ip->next_hdr;
+  for (int i = 0; i < count; i++) {
+    bool fragment = later_fragment and i == 0;
+    *next_hdr = fragment ? IPV6_PROTOCOL_NUM_FRAGMENT : IPV6_PROTOCOL_NUM_OPTS;
+    memset(p, 0, 8);
+    if (fragment) {
+      p[3] = 8; // オフセット1(8バイト目から)
+    } else {
+      p[2] = 1; // PadN
+      p[3] = 4;
+    }
+    next_hdr = &p[0];
+    p += 8;
+  }
+  *next_hdr = ACL_PROTOCOL_UDP;
+  p[0] = 1024 >> 8;
+  p[2] = dst_port >> 8;
+  p[3] = dst_port & 0xff;
+  if (later_fragment and count > 0) { // 上位層のヘッダをたどらないので、ポートを指定したルールに合わない
+    return false;
+  }
+  return count > ACL_MAX_EXTENSION_HEADERS or dst_port == 53;
+}
+
+/* 宛先の分布に従ってフレームを作っておく */
+void bench_make_pool(const bench_options &options, const std::vector<bench_route> &routes, std::mt19937_64 &rng) {
+  std::vector<double> cdf(routes.size());
+  double sum = 0;
+  for (size_t i = 0; i < routes.size(); i++) {
+    sum += options.distribution == bench_distribution::zipf ? 1.0 / (i + 1) : 1.0;
+    cdf[i] = sum;
+  }
+  std::uniform_real_distribution<double> pick(0, sum);
+
+  // -Nで、宛先に最長一致する経路の次ホップの近隣の番号を引くため(経路は重なっていて、同じプレフィックスは後で設定したものが残る)
+  patricia_node *next_hop_trie = nullptr;
+  if (bench_learned_next_hops) {
+    next_hop_trie = create_patricia_node(in6_addr{}, 0, false, nullptr);
+    for (size_t i = 0; i < routes.size(); i++) {
+      patricia_trie_insert(next_hop_trie, routes[i].prefix, routes[i].prefix_len, (void *)(uintptr_t)(i % BENCH_SWEEP_NEIGHBORS));
+    }
+  }
+
+  in6_addr src = bench_addr("2001:db8:ff00::2");
+  uint32_t payload_len = options.frame_size - ETHERNET_HEADER_SIZE - sizeof(ipv6_header);
+  bench_pool.resize(BENCH_POOL_SIZE);
+  for (uint32_t i = 0; i < BENCH_POOL_SIZE; i++) {
+    size_t index = 0;
+    if (options.distribution != bench_distribution::single) {
+      index = std::lower_bound(cdf.begin(), cdf.end(), pick(rng)) - cdf.begin();
+      index = index < routes.size() ? index : routes.size() - 1;
+    }
+    // 経路のプレフィックスの中のアドレスを宛先にする
+    in6_addr dst = routes[index].prefix;
+    uint64_t host = options.distribution == bench_distribution::single ? 1 : rng();
+    for (uint32_t bit = routes[index].prefix_len; bit < 128; bit++) {
+      if ((host >> (bit % 64)) & 1) {
+        dst.s6_addr[bit / 8] |= 0x80 >> (bit % 8);
+      }
+    }
+
+    uint8_t *data = bench_pool[i].data;
+    memset(data, 0, options.frame_size);
+    ethernet_header *eth = (ethernet_header *)data;
+    memcpy(eth->dst_addr, bench_rx_mac, 6);
+    memcpy(eth->src_addr, bench_sender_mac, 6);
+    eth->type = htons(ETHER_TYPE_IPV6);
+    ipv6_header *ip = (ipv6_header *)(data + ETHERNET_HEADER_SIZE);
+    uint32_t neighbor = next_hop_trie != nullptr ? (uint32_t)(uintptr_t)patricia_trie_search(next_hop_trie, dst)->data : 0;
+    ip->ver_tc_fl = htonl(0x60000000 | neighbor); // フローラベルに次ホップの近隣の番号を入れておく
+    ip->payload_len = htons(payload_len);
+    ip->next_hdr = 17; // UDP(中身は見ない)
+    ip->hop_limit = 64;
+    ip->src_addr = src;
+    ip->dst_addr = dst;
+
+    bench_pool[i].flood = options.distribution != bench_distribution::echo and rng() % 100 < options.flood_percent;
+    bench_pool[i].sweep = options.distribution != bench_distribution::echo and !bench_pool[i].flood and rng() % 100 < options.sweep_percent;
+    if (options.distribution == bench_distribution::echo or bench_pool[i].flood) {
+      bench_make_echo(ip, payload_len, i);
+    } else if (bench_pool[i].sweep) {
+      bench_make_sweep(ip, i);
+    } else if (options.ext_headers >= 0) {
+      uint16_t dst_port = rng() % 2 == 0 ? 53 : 54;
+      bench_pool[i].denied = bench_make_ext_headers(ip, options.ext_headers, dst_port, dst_port == 53 and rng() % 4 == 0);
+    }
+  }
+}
+
+/*
+ * 送信元が2001:db8:ee00::/40の中のACLのルールを作る(ベンチマークのパケットの送信元は2001:db8:ff00::2なので合わない)
+ * よくある4つの形を順に使うので、ルールの数を増やしてもタプルの数は変わらない
+ */
+std::vector<acl_rule> bench_make_acl(uint32_t count, std::mt19937_64 &rng) {
+  std::vector<acl_rule> rules(count);
+  for (uint32_t i = 0; i < count; i++) {
+    acl_rule &rule = rules[i];
+    rule.src = bench_addr("2001:db8:ee00::");
+    uint64_t bits = rng();
+    memcpy(&rule.src.s6_addr[5], &bits, 8);
+    rule.src_port_max = 65535;
+    rule.dst_port_max = 65535;
+    rule.action = i % 2 == 0 ? acl_action::deny : acl_action::permit;
+    switch (i % 4) {
+    case 0: // 送信元の/48を全て
+      rule.src_len = 48;
+      break;
+    case 1: // 送信元の/64からのUDPの特定のポート
+      rule.src_len = 64;
+      rule.protocol = 17;
+      rule.protocol_mask = 0xff;
+      rule.dst_port_min = rule.dst_port_max = 53;
+      break;
+    case 2: // 送信元の/56からのTCPのポートの範囲
+      rule.src_len = 56;
+      rule.protocol = 6;
+      rule.protocol_mask = 0xff;
+      rule.dst_port_min = 8000;
+      rule.dst_port_max = 8191;
+      break;
+    case 3: // 送信元のホストからの特定のトラフィッククラスとフローラベル
+      rule.src_len = 128;
+      rule.traffic_class = 0xb8;
+      rule.traffic_class_mask = 0xfc;
+      rule.flow_label = bits & 0xfffff;
+      rule.flow_label_mask = 0xfffff;
+      break;
+    }
+    rule.src = in6_addr_clear_prefix(rule.src, rule.src_len);
+  }
+  return rules;
+}
+
+uint64_t bench_now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 制御メッセージのリングが空になるまで処理する */
+void bench_apply_config(worker *w) {
+  while (worker_process_control_ring(w)) {
+  }
+}
+
+/*
+ * NPTv6の変換の組を入れる(最初の1つはベンチマークのパケットの送信元2001:db8:ff00::/48を2001:db8:fe00::/48にするもの)
+ * 残りはfd00::/8の中のランダムな/48同士の組で、パケットには合わないがトライの深さを増やす
+ */
+bool bench_configure_npt(net_device *dev, uint32_t count, worker *w, std::mt19937_64 &rng) {
+  if (!configure_nptv6(dev, bench_addr("2001:db8:ff00::"), bench_addr("2001:db8:fe00::"), 48)) {
+    return false;
+  }
+  for (uint32_t i = 1; i < count; i++) {
+    in6_addr internal = bench_addr("fd00::"), external = bench_addr("fd80::");
+    uint64_t bits = rng();
+    memcpy(&internal.s6_addr[1], &bits, 5);
+    memcpy(&external.s6_addr[1], (uint8_t *)&bits + 3, 5);
+    internal.s6_addr[1] &= 0x7f;
+    external.s6_addr[1] |= 0x80;
+    configure_nptv6(dev, internal, external, 48); // 同じプレフィックスを引いたら入れない
+    if (i % 1024 == 1023) {
+      bench_apply_config(w);
+    }
+  }
+  return true;
+}
+
+/* count個のパケットを流して、全て処理し終えるまで回す */
+void bench_run(worker *w, net_device *rx_dev, uint64_t count) {
+  bench_rx_remaining = count;
+  while (bench_rx_remaining > 0) {
+    rx_dev->ops.poll(rx_dev);
+    worker_flush_tx(w);
+  }
+}
+
+/* 以前の実装(16ビットずつ順に足す)で、比べる基準にする */
+uint16_t bench_checksum_serial(const void *data, size_t len, uint16_t sum) {
+  const uint16_t *buffer = (const uint16_t *)data;
+  uint32_t acc = sum;
+  while (len > 1) {
+    acc += *buffer++;
+    len -= 2;
+  }
+  if (len > 0) {
+    acc += *(const uint8_t *)buffer;
+  }
+  while (acc >> 16) {
+    acc = (acc & 0xffff) + (acc >> 16);
+  }
+  return acc;
+}
+
+struct bench_checksum_impl {
+  const char *name;
+  checksum_partial_fn fn;
+};
+
+/* 全ての実装が基準と同じ値になるか、分割した計算や差分の反映と全体の計算が合うかを確かめる */
+bool bench_checksum_verify(const std::vector<bench_checksum_impl> &impls, std::mt19937_64 &rng) {
+  std::vector<uint8_t> data(9000 + 64);
+  for (uint8_t &byte : data) {
+    byte = rng();
+  }
+  for (int n = 0; n < 10000; n++) {
+    size_t offset = rng() % 64; // 揃っていない位置からも読む
+    size_t len = n < 2000 ? n % 300 : rng() % 9001;
+    uint16_t start = rng();
+    uint16_t expected = bench_checksum_serial(&data[offset], len, start);
+    for (const bench_checksum_impl &impl : impls) {
+      if (impl.fn(&data[offset], len, start) != expected) {
+        printf("%s mismatch at offset %zu len %zu\n", impl.name, offset, len);
+        return false;
+      }
+    }
+
+    // 任意の位置で3つに分けても同じ
+    size_t cut1 = len > 0 ? rng() % (len + 1) : 0;
+    size_t cut2 = cut1 + (len > cut1 ? rng() % (len - cut1 + 1) : 0);
+    iovec iov[3] = {{&data[offset], cut1}, {&data[offset + cut1], cut2 - cut1}, {&data[offset + cut2], len - cut2}};
+    if (checksum_iov(iov, 3, start) != expected) {
+      printf("iov mismatch at len %zu cut %zu %zu\n", len, cut1, cut2);
+      return false;
+    }
+
+    // 偶数の位置の16バイトを書き換えても、差分の反映と計算し直した値が同じ
+    if (len >= 32) {
+      size_t field = (rng() % ((len - 16) / 2)) * 2;
+      uint8_t old_data[16], new_data[16];
+      memcpy(old_data, &data[offset + field], 16);
+      for (uint8_t &byte : new_data) {
+        byte = rng();
+      }
+      uint16_t check = checksum_finish(bench_checksum_serial(&data[offset], len, 0));
+      memcpy(&data[offset + field], new_data, 16);
+      uint16_t recomputed = checksum_finish(bench_checksum_serial(&data[offset], len, 0));
+      uint16_t updated = checksum_update(check, old_data, new_data, 16);
+      uint16_t word_old, word_new;
+      memcpy(&word_old, old_data, 2);
+      memcpy(&word_new, new_data, 2);
+      memcpy(&data[offset + field], old_data, 16);
+      memcpy(&data[offset + field], &word_new, 2);
+      uint16_t recomputed16 = checksum_finish(bench_checksum_serial(&data[offset], len, 0));
+      uint16_t updated16 = checksum_update16(check, word_old, word_new);
+      memcpy(&data[offset + field], new_data, 16);
+      // 0x0000と0xffffはどちらも1の補数の0なので同じとみなす
+      if ((uint16_t)(recomputed + 1) > 1 ? updated != recomputed : (uint16_t)(updated + 1) > 1) {
+        printf("incremental update mismatch at len %zu field %zu\n", len, field);
+        return false;
+      }
+      if ((uint16_t)(recomputed16 + 1) > 1 ? updated16 != recomputed16 : (uint16_t)(updated16 + 1) > 1) {
+        printf("16-bit incremental update mismatch at len %zu field %zu\n", len, field);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/* 実装ごと、長さごとにチェックサムを計算する速さを比べる */
+int bench_checksum(const bench_options &options) {
+  std::vector<bench_checksum_impl> impls = {{"serial", bench_checksum_serial}, {"generic", checksum_partial_generic}};
+#if defined(__x86_64__)
+  impls.push_back({"sse2", checksum_partial_sse2});
+  if (checksum_avx2_supported()) {
+    impls.push_back({"avx2", checksum_partial_avx2});
+  }
+#endif
+  std::mt19937_64 rng(options.seed);
+  if (!bench_checksum_verify(impls, rng)) {
+    return 2;
+  }
+  printf("checksum implementations agree (dispatching to %s)\n", checksum_impl_name);
+
+  const uint32_t sizes[] = {64, 128, 256, 512, 1024, 1500, 4096, 9000};
+  std::vector<uint8_t> data(9000);
+  for (uint8_t &byte : data) {
+    byte = rng();
+  }
+  printf("|  BYTES |");
+  for (const bench_checksum_impl &impl : impls) {
+    printf(" %17s |", impl.name);
+  }
+  printf("\n");
+  volatile uint16_t sink = 0;
+  for (uint32_t size : sizes) {
+    printf("| %6u |", size);
+    uint64_t iterations = BENCH_CHECKSUM_BYTES / size;
+    double serial_ns = 0;
+    for (const bench_checksum_impl &impl : impls) {
+      uint64_t start = bench_now_ns();
+      uint16_t sum = 0;
+      for (uint64_t i = 0; i < iterations; i++) {
+        sum = impl.fn(data.data(), size, sum);
+      }
+      sink = sum;
+      double ns = (double)(bench_now_ns() - start) / iterations;
+      if (serial_ns == 0) {
+        serial_ns = ns;
+      }
+      printf(" %7.1f ns %5.1fx |", ns, serial_ns / ns);
+    }
+    printf("\n");
+  }
+  (void)sink;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  bench_options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:t:d:r:cf:Pa:x:e:N:")) != -1) {
+    switch (opt) {
+    case 'n':
+      options.packets = strtoull(optarg, nullptr, 10);
+      break;
+    case 's':
+      options.frame_size = atoi(optarg);
+      break;
+    case 't':
+      options.table_size = atoi(optarg);
+      break;
+    case 'd':
+      if (strcmp(optarg, "zipf") == 0) {
+        options.distribution = bench_distribution::zipf;
+      } else if (strcmp(optarg, "single") == 0) {
+        options.distribution = bench_distribution::single;
+      } else if (strcmp(optarg, "echo") == 0) {
+        options.distribution = bench_distribution::echo;
+      } else {
+        options.distribution = bench_distribution::uniform;
+      }
+      break;
+    case 'r':
+      options.seed = atoi(optarg);
+      break;
+    case 'c':
+      options.checksum = true;
+      break;
+    case 'f':
+      options.flood_percent = std::min(atoi(optarg), 100);
+      break;
+    case 'P':
+      options.punt = true;
+      break;
+    case 'a':
+      options.acl_rules = atoi(optarg);
+      break;
+    case 'x':
+      options.npt_mappings = atoi(optarg);
+      break;
+    case 'e':
+      options.ext_headers = std::min(atoi(optarg), 64);
+      break;
+    case 'N':
+      options.sweep_percent = std::min(atoi(optarg), 100);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n packets] [-s frame_size] [-t table_size] [-d uniform|zipf|single|echo] [-r seed] [-c] [-f flood_percent] [-P] [-a acl_rules] [-x npt_mappings] [-e ext_headers]"
+              " [-N sweep_percent]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (options.checksum) {
+    return bench_checksum(options);
+  }
+  uint32_t min_size = ETHERNET_HEADER_SIZE + sizeof(ipv6_header) +   (options.distribution == bench_distribution::echo or options.flood_percent > 0 ? sizeof(icmpv6_echo) : 0);
+  if (options.ext_headers >= 0) {
+    min_size = std::max<uint32_t>(min_size, ETHERNET_HEADER_SIZE + sizeof(ipv6_header) + options.ext_headers * 8 + 8);
+  }
+  if (options.sweep_percent > 0) { // UDPのヘッダが入る長さ
+    min_size = std::max<uint32_t>(min_size, ETHERNET_HEADER_SIZE + sizeof(ipv6_header) + 8);
+  }
+  options.frame_size = std::min(std::max(options.frame_size, min_size), (uint32_t)1514);
+  options.table_size = std::max(options.table_size, 1u);
+
+  set_log_level(LOG_CATEGORY_INFO, 0); // 経路ごとの設定のログは出さない
+
+  // メモリ上のデバイスを2つ用意して、このスレッドをワーカーとして使う
+  net_device *rx_dev = bench_create_device("bench0", bench_rx_mac);
+  net_device *tx_dev = bench_create_device("bench1", bench_tx_mac);
+  std::vector<net_device *> sweep_devs;
+  if (options.sweep_percent > 0) {
+    for (uint32_t i = 0; i < BENCH_SWEEP_DEVICES; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "bench%u", i + 2);
+      uint8_t mac_addr[6] = {0x02, 0x00, 0x00, 0x00, 0x01, (uint8_t)i};
+      sweep_devs.push_back(bench_create_device(name, mac_addr));
+    }
+    // 到達済みの近隣と静的なエントリは入り、全てのデバイスの解決中のエントリは入りきらない上限にする
+    nd_table_max_entries = BENCH_SWEEP_NEIGHBORS + 2 + ND_MAX_INCOMPLETE_PER_INTERFACE * BENCH_SWEEP_DEVICES / 2;
+  }
+  if (init_workers(1, net_dev_count) < 0) {
+    return 1;
+  }
+  if (options.punt and init_punt(net_dev_count) < 0) {
+    return 1;
+  }
+  worker *w = workers[0];
+  worker_init_thread(w);
+  if (punt_worker != nullptr and !worker_start(punt_worker)) {
+    return 1;
+  }
+
+  configure_ipv6_address(rx_dev, bench_addr("2001:db8:ff00::1"), 64);
+  configure_ipv6_address(tx_dev, bench_addr("2001:db8:ff01::1"), 64);
+  in6_addr next_hop = bench_addr("2001:db8:ff01::2");
+  configure_static_neighbor(tx_dev, bench_peer_mac, next_hop);
+  configure_static_neighbor(rx_dev, bench_sender_mac, bench_addr("2001:db8:ff00::2")); // エコー応答の宛先
+  for (uint32_t i = 0; i < sweep_devs.size(); i++) {
+    in6_addr address = bench_sweep_prefix(i);
+    address.s6_addr[15] = 1;
+    configure_ipv6_address(sweep_devs[i], address, 64);
+  }
+  bench_apply_config(w);
+
+  // -Nでは、NSを受け取って学習した近隣(STALE)を経路の次ホップにする(静的なエントリは追い出されないので試験にならない)
+  std::vector<in6_addr> next_hops{next_hop};
+  if (options.sweep_percent > 0) {
+    bench_learned_next_hops = true;
+    next_hops.clear();
+    for (uint32_t i = 0; i < BENCH_SWEEP_NEIGHBORS; i++) {
+      in6_addr neighbor = bench_addr("2001:db8:ff01::1:0");
+      neighbor.s6_addr[14] = i >> 8;
+      neighbor.s6_addr[15] = i & 0xff;
+      uint8_t mac_addr[6] = {0x02, 0x00, 0x00, 0x02, (uint8_t)(i >> 8), (uint8_t)i};
+      nd_learn_solicitation(tx_dev, mac_addr, neighbor);
+      next_hops.push_back(neighbor);
+    }
+  }
+
+  std::mt19937_64 rng(options.seed);
+  std::vector<bench_route> routes = bench_make_routes(options.table_size, rng);
+  for (size_t i = 0; i < routes.size(); i++) {
+    configure_ipv6_net_route(routes[i].prefix, routes[i].prefix_len, next_hops[i % next_hops.size()]);
+    if (i % 1024 == 1023) { // 制御メッセージのリングが溢れないように適宜反映する
+      bench_apply_config(w);
+    }
+  }
+  if (options.acl_rules > 0 or options.ext_headers >= 0) {
+    std::vector<acl_rule> acl = bench_make_acl(options.acl_rules, rng);
+    if (options.ext_headers >= 0) { // 先頭にUDPの53番を拒否するルールを入れる
+      acl_rule rule{};
+      rule.protocol = ACL_PROTOCOL_UDP;
+      rule.protocol_mask = 0xff;
+      rule.src_port_max = 65535;
+      rule.dst_port_min = rule.dst_port_max = 53;
+      rule.action = acl_action::deny;
+      acl.insert(acl.begin(), rule);
+    }
+    if (!configure_acl(acl.data(), acl.size(), acl_action::permit)) {
+      return 1;
+    }
+  }
+  if (options.npt_mappings > 0 and !bench_configure_npt(tx_dev, options.npt_mappings, w, rng)) {
+    return 1;
+  }
+  bench_apply_config(w);
+  while (punt_worker != nullptr and !punt_worker->control_ring.empty()) { // 制御プレーンのスレッドにも設定が届くまで待つ
+    usleep(1000);
+  }
+  bench_make_pool(options, routes, rng);
+
+  const char *distribution_names[] = {"uniform", "zipf", "single", "echo"};
+  printf("frame %u bytes, %u routes, %s destinations, %lu packets\n", options.frame_size, options.table_size, distribution_names[(int)options.distribution],
+         options.packets);
+  if (options.flood_percent > 0) {
+    printf("%u%% echo requests to the router, %s\n", options.flood_percent, options.punt ? "punted to the control plane thread" : "answered inline");
+  }
+  if (options.npt_mappings > 0) {
+    printf("nptv6 %u mappings on %s\n", options.npt_mappings, tx_dev->name);
+  }
+  if (options.sweep_percent > 0) {
+    printf("%u%% of frames sweep %d connected /64s, %zu learned next hops, nd table limit %u entries\n", options.sweep_percent, BENCH_SWEEP_DEVICES, next_hops.size(),
+           nd_table_max_entries);
+  }
+  if (acl_configured != nullptr) {
+    printf("acl %u rules, %u tuples, %u entries\n", acl_configured->rule_count, acl_configured->tuple_count, acl_configured->entry_count);
+  }
+
+  // キャッシュを温めてから測る
+  bench_run(w, rx_dev, std::min<uint64_t>(options.packets, BENCH_POOL_SIZE));
+
+  worker_device *rx = &w->devs[rx_dev->index];
+  worker_device *tx = &w->devs[(options.distribution == bench_distribution::echo ? rx_dev : tx_dev)->index];
+  uint64_t rx_before = rx->rx_packets;
+  uint64_t tx_before = tx->tx_packets;
+  uint64_t flood_before = bench_flood_rx;
+  uint64_t denied_before = bench_denied_rx;
+  uint64_t sweep_before = bench_sweep_rx;
+  nd_statistics nd_before = nd_stats;
+  uint64_t inline_before = rx_dev != tx_dev ? w->devs[rx_dev->index].tx_packets : 0;
+  uint64_t punt_before = punt_worker != nullptr ? punt_worker->devs[rx_dev->index].tx_packets : 0;
+  stats_counters drops_before = w->stats;
+  uint64_t allocs_before = bench_allocs.load(std::memory_order_relaxed);
+  uint64_t bufs_before = my_buf::created; // キャッシュから出したmy_bufはmallocを呼ばないので別に数える
+  uint64_t start = bench_now_ns();
+
+  bench_run(w, rx_dev, options.packets);
+
+  uint64_t elapsed = bench_now_ns() - start;
+  uint64_t allocs = bench_allocs.load(std::memory_order_relaxed) - allocs_before;
+  uint64_t bufs = my_buf::created - bufs_before;
+  uint64_t received = rx->rx_packets - rx_before;
+  uint64_t forwarded = tx->tx_packets - tx_before;
+  uint64_t flood = bench_flood_rx - flood_before;
+  uint64_t denied = bench_denied_rx - denied_before;
+  uint64_t sweep = bench_sweep_rx - sweep_before;
+  uint64_t transit = received - flood - denied - sweep; // -fのエコー要求、-eでACLに捨てられるもの、-Nのスキャンを除いた転送すべきパケット
+
+  printf("forwarded %lu / %lu packets in %.3f s\n", forwarded, transit, elapsed / 1e9);
+  printf("%.3f Mpps, %.1f ns/packet, %.2f allocs/packet, %.2f my_bufs/packet\n", forwarded / (elapsed / 1e3), (double)elapsed / received, (double)allocs / received,
+         (double)bufs / received);
+  if (flood > 0) {
+    printf("echo requests to the router %lu, answered inline %lu\n", flood, w->devs[rx_dev->index].tx_packets - inline_before);
+  }
+  if (punt_worker != nullptr) {
+    worker_stop(punt_worker);
+    printf("punt:");
+    for (int c = 0; c < STATS_PUNT_CLASS_COUNT; c++) {
+      printf(" %s", stats_punt_class_names[c]);
+      for (int e = 0; e < STATS_PUNT_EVENT_COUNT; e++) {
+        printf(" %s %lu", stats_punt_event_names[e], w->stats.punt[c][e] - drops_before.punt[c][e]);
+      }
+      printf("%s", c + 1 < STATS_PUNT_CLASS_COUNT ? "," : "\n");
+    }
+    printf("echo replies from the control plane thread %lu\n", punt_worker->devs[rx_dev->index].tx_packets - punt_before);
+  }
+  printf("drops:");
+  for (int i = 0; i < STATS_DROP_COUNT; i++) {
+    printf(" %s %lu%s", stats_drop_reason_names[i], w->stats.drops[i] - drops_before.drops[i], i + 1 < STATS_DROP_COUNT ? "," : "\n");
+  }
+  printf("tx queue drops %lu\n", tx->tx_queue_drops);
+  uint64_t bad_mac = bench_bad_mac.load(std::memory_order_relaxed);
+  if (bad_mac > 0) {
+    printf("frames sent to a wrong destination mac address %lu\n", bad_mac);
+  }
+  uint64_t acl_dropped = 0;
+  if (options.ext_headers >= 0) {
+    uint64_t acl_denied = w->stats.drops[STATS_DROP_ACL_DENIED] - drops_before.drops[STATS_DROP_ACL_DENIED];
+    uint64_t unparseable = w->stats.drops[STATS_DROP_ACL_UNPARSEABLE] - drops_before.drops[STATS_DROP_ACL_UNPARSEABLE];
+    acl_dropped = acl_denied + unparseable;
+    printf("%d extension headers: expected acl drops %lu, denied %lu, unparseable %lu\n", options.ext_headers, denied, acl_denied, unparseable);
+  }
+  bool survived = true;
+  if (options.sweep_percent > 0) {
+    uint32_t established = 0, incomplete = 0;
+    for (const in6_addr &neighbor : next_hops) {
+      nd_table_entry *entry = search_nd_table_entry(neighbor);
+      established += entry != nullptr and entry->state != nd_state::incomplete;
+    }
+    for (net_device *dev : sweep_devs) {
+      incomplete += w->devs[dev->index].nd_incomplete;
+    }
+    survived = established == next_hops.size();
+    printf("nd sweep: %lu addresses, table %u / %u entries (incomplete %u), ns sent %lu, rate limited %lu, resolution limited %lu, evicted %lu incomplete / %lu others\n",
+           sweep, nd_table_count, nd_table_max_entries, incomplete, nd_stats.ns_sent - nd_before.ns_sent, nd_stats.ns_rate_limited - nd_before.ns_rate_limited,
+           nd_stats.resolution_limited - nd_before.resolution_limited, nd_stats.evicted_incomplete - nd_before.evicted_incomplete,
+           nd_stats.evicted_other - nd_before.evicted_other);
+    printf("established next hops %u / %zu survived\n", established, next_hops.size());
+  }
+  return forwarded == transit and acl_dropped == denied and survived and bad_mac == 0 ? 0 : 2;
+}
@@ -0,0 +1,723 @@
+/*
+ * curo-sim: 1つのプロセスの中で複数のルータをつないだトポロジを動かす
+ * ルータごとにワーカーを1つ作り、それぞれのスレッドが本体と同じグラフ、経路表、NDテーブルを持つ
+ * (スレッドごとの状態なので、ルータ同士は何も共有しない)
+ * ルータ間はメモリ上の仮想リンクでつなぎ、リンクごとに遅延と損失を設定できる
+ * 各ルータには端末の代わりになるスタブのデバイスがあり、そこから注入したパケットが
+ * 宛先のルータのスタブに届くまでを数えるので、複数ホップの転送、リンク上のNDの解決、
+ * 経路の入れ替え(リンクを落として経路を計算し直す)を権限なしで試せる
+ *
+ * 使い方: curo-sim [-n ルータ数] [-t line|ring|random] [-d 遅延(us)] [-l 損失(%)] [-p パケット数] [-i 送信間隔(us)] [-c 経路の入れ替え回数] [-r 乱数の種]
+ */
+#include "config.h"
+#include "ethernet.h"
+#include "graph.h"
+#include "ipv6.h"
+#include "log.h"
+#include "my_buf.h"
+#include "net.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+#include "utils.h"
+#include "worker.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <queue>
+#include <random>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+#define SIM_MAX_ROUTERS 100
+#define SIM_INBOX_SIZE 1024     // デバイスごとの受信待ちのフレームの数(2の累乗)
+#define SIM_HOP_LIMIT 64        // 注入するパケットのHop Limit
+#define SIM_PAYLOAD_MAGIC 0x63757273
+#define SIM_NEXT_HDR 253        // 実験用の次ヘッダ(ルータは中身を見ない)
+#define SIM_DRAIN_MS 1500       // 最後のパケットを送ってから待つ時間(NDの再送を待てるだけ)
+
+enum class sim_topology {
+  line,  // 0-1-2-...-n-1
+  ring,  // lineの両端をつなぐ
+  random // ランダムな木に、ルータ数の半分のリンクを足す
+};
+
+struct sim_options {
+  int routers = 10;
+  sim_topology topology = sim_topology::line;
+  uint32_t delay_us = 100;
+  double loss = 0;
+  uint64_t packets = 10000;
+  uint32_t interval_us = 100;
+  uint32_t churn = 0;
+  uint32_t seed = 1;
+};
+
+/* 受信待ちのフレーム */
+struct sim_frame {
+  uint64_t deliver_at; // 受け取れるようになる時刻(CLOCK_MONOTONIC、ナノ秒)
+  my_buf *buf;
+};
+
+struct sim_router;
+struct sim_link;
+
+/* デバイスのデータ(net_device::dataに置く) */
+struct sim_port {
+  sim_router *router;
+  sim_link *link;   // スタブならnullptr
+  net_device *peer; // リンクの反対側のデバイス
+  in6_addr addr;    // このデバイスのアドレス
+  std::mt19937_64 rng; // 損失を決める乱数(送信するルータのスレッドだけが使う)
+  spsc_ring<sim_frame, SIM_INBOX_SIZE> inbox; // 相手のルータ(スタブなら注入するスレッド)から
+};
+
+struct sim_link {
+  int a, b;
+  net_device *dev_a, *dev_b;
+  std::atomic<bool> up{true};
+};
+
+/* スタブに届いたパケットの中身 */
+struct sim_payload {
+  uint32_t magic;
+  uint32_t seq;
+  uint64_t sent_at;
+  uint16_t src;
+  uint16_t dst;
+  uint8_t expected_hops; // 送った時点の最短経路で通るルータの数(到達できなければ0)
+} __attribute__((packed));
+
+struct sim_router {
+  int id;
+  worker *w;
+  net_device *stub;
+  std::vector<net_device *> ports; // リンクにつながるデバイス
+
+  // このルータのスレッドだけが書き、終了した後に集計する
+  uint64_t delivered = 0;
+  uint64_t hop_mismatches = 0;
+  uint64_t wrapped = 0; // Hop Limitが増えて届いたパケット
+  uint64_t hops_total = 0;
+  uint32_t hops_max = 0;
+  uint64_t first_delivery = 0;
+  std::vector<uint32_t> latencies_us;
+  uint64_t lost_loss = 0;    // 損失として捨てたフレーム
+  uint64_t lost_down = 0;    // リンクが落ちていて捨てたフレーム
+  uint64_t inbox_drops = 0;  // 相手の受信待ちが一杯で捨てたフレーム
+};
+
+sim_options options;
+sim_router routers[SIM_MAX_ROUTERS];
+std::vector<sim_link *> links;
+std::atomic<int> sim_ready{0};
+std::atomic<bool> sim_stopping{false};
+uint64_t sim_start = 0;
+
+uint8_t sim_sink_mac[6] = {0x02, 0xff, 0x00, 0x00, 0x00, 0x01}; // スタブの先の端末
+
+uint64_t sim_now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline sim_port *sim_port_of(net_device *dev) { return (sim_port *)dev->data; }
+
+/* 2001:db8:<hi>:<lo>::<host> */
+in6_addr sim_addr(uint16_t hi, uint16_t lo, uint16_t host) {
+  in6_addr addr{};
+  addr.s6_addr[0] = 0x20;
+  addr.s6_addr[1] = 0x01;
+  addr.s6_addr[2] = 0x0d;
+  addr.s6_addr[3] = 0xb8;
+  addr.s6_addr[4] = hi >> 8;
+  addr.s6_addr[5] = hi & 0xff;
+  addr.s6_addr[6] = lo >> 8;
+  addr.s6_addr[7] = lo & 0xff;
+  addr.s6_addr[14] = host >> 8;
+  addr.s6_addr[15] = host & 0xff;
+  return addr;
+}
+
+/* ルータrのスタブのネットワーク(2001:db8:1:r::/64、端末は::2) */
+in6_addr sim_stub_prefix(int r) { return sim_addr(1, r, 0); }
+
+/* k番目のリンクのネットワーク(2001:db8:8000+k::/64、aが::1、bが::2) */
+in6_addr sim_link_addr(int k, int host) { return sim_addr(0x8000 + k, 0, host); }
+
+/* 仮想リンク: 送信キューのフレームを、遅延を付けて相手のデバイスの受信待ちに渡す */
+int sim_link_flush(net_device *dev) {
+  worker_device *wdev = worker_device_of(dev);
+  sim_port *port = sim_port_of(dev);
+  sim_router *router = port->router;
+  sim_port *peer = sim_port_of(port->peer);
+  bool up = port->link->up.load(std::memory_order_relaxed);
+  uint64_t deliver_at = sim_now_ns() + (uint64_t)options.delay_us * 1000;
+  std::uniform_real_distribution<double> loss_dist(0, 100);
+  bool wake = false;
+  while (wdev->tx_count > 0) {
+    worker_tx_frame *queued = &wdev->tx_queue[wdev->tx_head];
+    wdev->tx_head = (wdev->tx_head + 1) & (TX_QUEUE_LEN - 1);
+    wdev->tx_count--;
+    if (!up) {
+      router->lost_down++;
+      worker_release_tx(queued);
+      continue;
+    }
+    if (options.loss > 0 and loss_dist(port->rng) < options.loss) {
+      router->lost_loss++;
+      worker_release_tx(queued);
+      continue;
+    }
+    my_buf *frame = worker_take_tx(queued); // 相手の受信待ちに渡すのでmy_bufにする
+    bool was_empty;
+    if (!peer->inbox.push({deliver_at, frame}, &was_empty)) {
+      router->inbox_drops++;
+      my_buf::my_buf_free(frame);
+      continue;
+    }
+    wdev->tx_packets++;
+    wdev->tx_bytes += frame->len;
+    wake |= was_empty;
+  }
+  if (wake) {
+    worker_wake(peer->router->w);
+  }
+  return 0;
+}
+
+/* スタブ: 端末に届いたパケットを数える */
+int sim_stub_flush(net_device *dev) {
+  worker_device *wdev = worker_device_of(dev);
+  sim_router *router = sim_port_of(dev)->router;
+  uint64_t now = sim_now_ns();
+  while (wdev->tx_count > 0) {
+    worker_tx_frame *frame = &wdev->tx_queue[wdev->tx_head];
+    wdev->tx_head = (wdev->tx_head + 1) & (TX_QUEUE_LEN - 1);
+    wdev->tx_count--;
+    wdev->tx_packets++;
+    wdev->tx_bytes += frame->len;
+
+    ethernet_header *eth = (ethernet_header *)frame->data;
+    if (frame->len >= ETHERNET_HEADER_SIZE + sizeof(ipv6_header) + sizeof(sim_payload) and ntohs(eth->type) == ETHER_TYPE_IPV6) {
+      ipv6_header *ip = (ipv6_header *)(frame->data + ETHERNET_HEADER_SIZE);
+      sim_payload *payload = (sim_payload *)(ip + 1);
+      if (ip->next_hdr == SIM_NEXT_HDR and payload->magic == SIM_PAYLOAD_MAGIC and ip->hop_limit > SIM_HOP_LIMIT) {
+        router->wrapped++; // 経路の入れ替え中のループでHop Limitが0を過ぎて戻った
+      } else if (ip->next_hdr == SIM_NEXT_HDR and payload->magic == SIM_PAYLOAD_MAGIC) {
+        uint32_t hops = SIM_HOP_LIMIT - ip->hop_limit;
+        router->delivered++;
+        router->hops_total += hops;
+        router->hops_max = std::max(router->hops_max, hops);
+        if (hops != payload->expected_hops) {
+          router->hop_mismatches++;
+        }
+        if (router->first_delivery == 0) {
+          router->first_delivery = now;
+        }
+        router->latencies_us.push_back((now - payload->sent_at) / 1000);
+      }
+    }
+    worker_release_tx(frame);
+  }
+  return 0;
+}
+
+/*
+ * 受信待ちのうち時刻になったフレームをグラフに流す(net_device_pollと同じ手順)
+ * 次に受け取れるフレームまでの時間(ミリ秒、無ければ-1)を返す
+ */
+int sim_router_receive(sim_router *router) {
+  uint64_t now = sim_now_ns();
+  uint64_t next = UINT64_MAX;
+  uint32_t n = 0;
+  auto receive = [&](net_device *dev) {
+    sim_port *port = sim_port_of(dev);
+    worker_device *wdev = worker_device_of(dev);
+    sim_frame *frame;
+    while ((frame = port->inbox.front()) != nullptr) {
+      if (frame->deliver_at > now) {
+        next = std::min(next, frame->deliver_at);
+        return;
+      }
+      if (n == GRAPH_VECTOR_SIZE) {
+        next = now;
+        return;
+      }
+      my_buf *buf = frame->buf;
+      port->inbox.release();
+      uint32_t len = std::min<uint32_t>(buf->len, GRAPH_FRAME_SIZE);
+      memcpy(graph->frames[n], buf->buffer, len);
+      my_buf::my_buf_free(buf);
+      wdev->rx_packets++;
+      wdev->rx_bytes += len;
+
+      graph_buffer *b = &graph->buffers[n++];
+      b->data = graph->frames[n - 1];
+      b->len = len;
+      b->rx_dev = dev;
+      b->trace = nullptr;
+      graph_enqueue(GRAPH_NODE_ETHERNET_INPUT, b);
+    }
+  };
+  receive(router->stub);
+  for (net_device *dev : router->ports) {
+    receive(dev);
+  }
+  if (n > 0) {
+    graph_dispatch();
+    trace_commit();
+  }
+  if (next == UINT64_MAX) {
+    return -1;
+  }
+  return next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+}
+
+void *sim_router_main(void *arg) {
+  sim_router *router = (sim_router *)arg;
+  worker *w = router->w;
+  worker_init_thread(w);
+
+  w->timer_fd = timer_wheel_create_timerfd();
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->timer_fd;
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev);
+
+  // 起動する前に入れておいた設定を反映してから動き始める
+  while (worker_process_control_ring(w)) {
+  }
+  sim_ready.fetch_add(1, std::memory_order_release);
+
+  epoll_event ev_ret[4];
+  int timeout = 0;
+  while (!sim_stopping.load(std::memory_order_acquire)) {
+    int nfds = epoll_wait(w->epoll_fd, ev_ret, 4, timeout);
+    for (int i = 0; i < nfds; i++) {
+      if (ev_ret[i].data.ptr == &w->timer_fd) {
+        timer_wheel_handle_timerfd(w->timer_fd);
+      } else {
+        uint64_t count;
+        read(w->wake_fd, &count, sizeof(count));
+      }
+    }
+    bool remaining = worker_process_control_ring(w);
+    timeout = sim_router_receive(router);
+    worker_flush_tx(w);
+    if (remaining) {
+      timeout = 0;
+    }
+  }
+  stats_collect_nd(&w->stats);
+  return nullptr;
+}
+
+net_device *sim_create_device(const char *name, sim_router *router) {
+  net_device *dev = (net_device *)calloc(1, sizeof(net_device) + sizeof(sim_port));
+  snprintf(dev->name, sizeof(dev->name), "%s", name);
+  uint32_t index = net_dev_count;
+  uint8_t mac_addr[6] = {0x02, 0x00, 0x00, 0x00, (uint8_t)(index >> 8), (uint8_t)index};
+  memcpy(dev->mac_addr, mac_addr, 6);
+  dev->ops.transmit = worker_queue_tx;
+  dev->ops.flush = sim_link_flush;
+  net_device_register(dev, net_dev_count + 1);
+
+  sim_port *port = new (dev->data) sim_port();
+  port->router = router;
+  port->rng.seed(options.seed * 1000003 + index);
+  return dev;
+}
+
+/* デバイスにアドレスを付けて、ルータの直接接続経路とlocal経路を入れる */
+void sim_configure_address(sim_router *router, net_device *dev, in6_addr address) {
+  configure_ipv6_address(dev, address, 64); // workersに登録したワーカーはいないので、アドレスを付けるだけになる
+  sim_port_of(dev)->addr = address;
+
+  worker_msg msg{};
+  msg.type = worker_msg_type::local_route;
+  msg.local.v6dev = dev->ipv6_dev;
+  worker_send_msg(router->w, msg);
+
+  msg = {};
+  msg.type = worker_msg_type::connected_route;
+  msg.connected.dev = dev;
+  msg.connected.prefix = address;
+  msg.connected.prefix_len = 64;
+  worker_send_msg(router->w, msg);
+}
+
+void sim_add_link(int a, int b) {
+  for (sim_link *link : links) {
+    if ((link->a == a and link->b == b) or (link->a == b and link->b == a)) {
+      return;
+    }
+  }
+  sim_link *link = new sim_link();
+  link->a = a;
+  link->b = b;
+  links.push_back(link);
+}
+
+void sim_build_topology(std::mt19937_64 &rng) {
+  int n = options.routers;
+  for (int i = 0; i + 1 < n; i++) {
+    if (options.topology == sim_topology::random) {
+      sim_add_link(std::uniform_int_distribution<int>(0, i)(rng), i + 1);
+    } else {
+      sim_add_link(i, i + 1);
+    }
+  }
+  if (options.topology == sim_topology::ring and n > 2) {
+    sim_add_link(n - 1, 0);
+  }
+  if (options.topology == sim_topology::random) {
+    std::uniform_int_distribution<int> pick(0, n - 1);
+    for (int i = 0; i < n / 2; i++) {
+      int a = pick(rng), b = pick(rng);
+      if (a != b) {
+        sim_add_link(a, b);
+      }
+    }
+  }
+}
+
+/*
+ * 上がっているリンクだけで最短経路を計算する
+ * next_hop[r][d]はルータrからdのスタブへのネクストホップのデバイス(到達できなければnullptr)
+ */
+struct sim_routing {
+  std::vector<std::vector<net_device *>> next_hop;
+  std::vector<std::vector<int>> dist;
+};
+
+sim_routing sim_compute_routes() {
+  int n = options.routers;
+  sim_routing routing;
+  routing.next_hop.assign(n, std::vector<net_device *>(n, nullptr));
+  routing.dist.assign(n, std::vector<int>(n, -1));
+  for (int d = 0; d < n; d++) {
+    // dから幅優先で探し、見つけたリンクを逆向きにたどるのがネクストホップになる
+    std::queue<int> queue;
+    routing.dist[d][d] = 0;
+    queue.push(d);
+    while (!queue.empty()) {
+      int r = queue.front();
+      queue.pop();
+      for (net_device *dev : routers[r].ports) {
+        sim_port *port = sim_port_of(dev);
+        if (!port->link->up.load(std::memory_order_relaxed)) {
+          continue;
+        }
+        int peer = sim_port_of(port->peer)->router->id;
+        if (routing.dist[peer][d] != -1) {
+          continue;
+        }
+        routing.dist[peer][d] = routing.dist[r][d] + 1;
+        routing.next_hop[peer][d] = port->peer;
+        queue.push(peer);
+      }
+    }
+  }
+  return routing;
+}
+
+/* 経路の差分を各ルータに送る(oldがnullptrなら全て) */
+uint32_t sim_install_routes(const sim_routing &routing, const sim_routing *old) {
+  uint32_t updates = 0;
+  for (int r = 0; r < options.routers; r++) {
+    for (int d = 0; d < options.routers; d++) {
+      net_device *dev = routing.next_hop[r][d];
+      if (r == d or (old != nullptr and old->next_hop[r][d] == dev)) {
+        continue;
+      }
+      worker_msg msg{};
+      msg.type = worker_msg_type::route_update;
+      msg.route.prefix = sim_stub_prefix(d);
+      msg.route.prefix_len = 64;
+      if (dev != nullptr) {
+        msg.route.type = ROUTE_UPDATE_ADD;
+        msg.route.next_hop = sim_port_of(sim_port_of(dev)->peer)->addr;
+      } else {
+        msg.route.type = ROUTE_UPDATE_WITHDRAW;
+      }
+      while (!worker_send_msg(routers[r].w, msg)) {
+        usleep(100);
+      }
+      updates++;
+    }
+  }
+  return updates;
+}
+
+/* srcのスタブの端末からdstのスタブの端末へのパケットを注入する */
+bool sim_inject(int src, int dst, uint32_t seq, uint8_t expected_hops) {
+  uint32_t len = ETHERNET_HEADER_SIZE + sizeof(ipv6_header) + sizeof(sim_payload);
+  my_buf *buf = my_buf::create(len);
+  ethernet_header *eth = (ethernet_header *)buf->buffer;
+  memcpy(eth->dst_addr, routers[src].stub->mac_addr, 6);
+  memcpy(eth->src_addr, sim_sink_mac, 6);
+  eth->type = htons(ETHER_TYPE_IPV6);
+  ipv6_header *ip = (ipv6_header *)(eth + 1);
+  ip->ver_tc_fl = htonl(0x60000000);
+  ip->payload_len = htons(sizeof(sim_payload));
+  ip->next_hdr = SIM_NEXT_HDR;
+  ip->hop_limit = SIM_HOP_LIMIT;
+  ip->src_addr = sim_addr(1, src, 2);
+  ip->dst_addr = sim_addr(1, dst, 2);
+  sim_payload *payload = (sim_payload *)(ip + 1);
+  payload->magic = SIM_PAYLOAD_MAGIC;
+  payload->seq = seq;
+  payload->sent_at = sim_now_ns();
+  payload->src = src;
+  payload->dst = dst;
+  payload->expected_hops = expected_hops;
+
+  bool was_empty;
+  if (!sim_port_of(routers[src].stub)->inbox.push({payload->sent_at, buf}, &was_empty)) {
+    my_buf::my_buf_free(buf);
+    return false;
+  }
+  if (was_empty) {
+    worker_wake(routers[src].w);
+  }
+  return true;
+}
+
+uint32_t sim_percentile(const std::vector<uint32_t> &sorted, double ratio) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t rank = std::min(sorted.size() - 1, (size_t)(sorted.size() * ratio));
+  return sorted[rank];
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:d:l:p:i:c:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      options.routers = atoi(optarg);
+      break;
+    case 't':
+      if (strcmp(optarg, "ring") == 0) {
+        options.topology = sim_topology::ring;
+      } else if (strcmp(optarg, "random") == 0) {
+        options.topology = sim_topology::random;
+      } else {
+        options.topology = sim_topology::line;
+      }
+      break;
+    case 'd':
+      options.delay_us = atoi(optarg);
+      break;
+    case 'l':
+      options.loss = atof(optarg);
+      break;
+    case 'p':
+      options.packets = strtoull(optarg, nullptr, 10);
+      break;
+    case 'i':
+      options.interval_us = atoi(optarg);
+      break;
+    case 'c':
+      options.churn = atoi(optarg);
+      break;
+    case 'r':
+      options.seed = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n routers] [-t line|ring|random] [-d delay_us] [-l loss_percent] [-p packets] [-i interval_us] [-c churn] [-r seed]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  options.routers = std::min(std::max(options.routers, 2), SIM_MAX_ROUTERS);
+
+  set_log_level(LOG_CATEGORY_INFO, 0); // ルータごとの設定のログは出さない
+
+  std::mt19937_64 rng(options.seed);
+  sim_build_topology(rng);
+
+  // 全てのデバイスを登録してから、その数に合わせてワーカーを作る
+  char name[32];
+  for (int r = 0; r < options.routers; r++) {
+    routers[r].id = r;
+    snprintf(name, sizeof(name), "r%d-stub", r);
+    routers[r].stub = sim_create_device(name, &routers[r]);
+    routers[r].stub->ops.flush = sim_stub_flush;
+  }
+  for (size_t k = 0; k < links.size(); k++) {
+    sim_link *link = links[k];
+    snprintf(name, sizeof(name), "r%d-r%d", link->a, link->b);
+    link->dev_a = sim_create_device(name, &routers[link->a]);
+    snprintf(name, sizeof(name), "r%d-r%d", link->b, link->a);
+    link->dev_b = sim_create_device(name, &routers[link->b]);
+    sim_port_of(link->dev_a)->link = link;
+    sim_port_of(link->dev_a)->peer = link->dev_b;
+    sim_port_of(link->dev_b)->link = link;
+    sim_port_of(link->dev_b)->peer = link->dev_a;
+    routers[link->a].ports.push_back(link->dev_a);
+    routers[link->b].ports.push_back(link->dev_b);
+  }
+  for (int r = 0; r < options.routers; r++) {
+    routers[r].w = worker_create(r, -1, net_dev_count);
+    if (routers[r].w == nullptr) {
+      return 1;
+    }
+  }
+
+  // アドレス、スタブの端末のND、最短経路を各ルータに送っておく
+  for (int r = 0; r < options.routers; r++) {
+    sim_configure_address(&routers[r], routers[r].stub, sim_addr(1, r, 1));
+    worker_msg msg{};
+    msg.type = worker_msg_type::static_neighbor;
+    msg.neighbor.dev = routers[r].stub;
+    msg.neighbor.v6_addr = sim_addr(1, r, 2);
+    memcpy(msg.neighbor.mac_addr, sim_sink_mac, 6);
+    worker_send_msg(routers[r].w, msg);
+  }
+  for (size_t k = 0; k < links.size(); k++) {
+    sim_configure_address(&routers[links[k]->a], links[k]->dev_a, sim_link_addr(k, 1));
+    sim_configure_address(&routers[links[k]->b], links[k]->dev_b, sim_link_addr(k, 2));
+  }
+  sim_routing routing = sim_compute_routes();
+  sim_install_routes(routing, nullptr);
+
+  const char *topology_names[] = {"line", "ring", "random"};
+  printf("%d routers, %s topology, %zu links, delay %u us, loss %.2f%%, %lu packets every %u us, %u route churns\n", options.routers,
+         topology_names[(int)options.topology], links.size(), options.delay_us, options.loss, options.packets, options.interval_us, options.churn);
+
+  for (int r = 0; r < options.routers; r++) {
+    if (pthread_create(&routers[r].w->thread, nullptr, sim_router_main, &routers[r]) != 0) {
+      LOG_ERROR("failed to start router %d\n", r);
+      return 1;
+    }
+  }
+  while (sim_ready.load(std::memory_order_acquire) < options.routers) {
+    usleep(1000);
+  }
+
+  // パケットを注入しながら、決めた間隔でリンクを1つ落とし(前に落としたリンクは戻し)経路を計算し直す
+  std::uniform_int_distribution<int> pick_router(0, options.routers - 1);
+  std::uniform_int_distribution<size_t> pick_link(0, links.size() - 1);
+  uint64_t churn_every = options.churn > 0 ? options.packets / (options.churn + 1) : 0;
+  uint32_t churns = 0, route_updates = 0;
+  sim_link *down_link = nullptr;
+  uint64_t inject_drops = 0, unreachable = 0;
+  sim_start = sim_now_ns();
+  for (uint64_t seq = 0; seq < options.packets; seq++) {
+    if (churn_every > 0 and seq > 0 and seq % churn_every == 0 and churns < options.churn) {
+      if (down_link != nullptr) {
+        down_link->up.store(true, std::memory_order_relaxed);
+      }
+      down_link = links[pick_link(rng)];
+      down_link->up.store(false, std::memory_order_relaxed);
+      sim_routing updated = sim_compute_routes();
+      route_updates += sim_install_routes(updated, &routing);
+      routing = std::move(updated);
+      churns++;
+    }
+    int src = pick_router(rng);
+    int dst = pick_router(rng);
+    if (src == dst) {
+      dst = (dst + 1) % options.routers;
+    }
+    int dist = routing.dist[src][dst];
+    if (dist < 0) {
+      unreachable++;
+    }
+    if (!sim_inject(src, dst, seq, dist < 0 ? 0 : dist + 1)) {
+      inject_drops++;
+    }
+    if (options.interval_us > 0) {
+      usleep(options.interval_us);
+    }
+  }
+  uint64_t send_elapsed = sim_now_ns() - sim_start;
+  usleep(SIM_DRAIN_MS * 1000);
+
+  sim_stopping.store(true, std::memory_order_release);
+  for (int r = 0; r < options.routers; r++) {
+    worker_wake(routers[r].w);
+  }
+  for (int r = 0; r < options.routers; r++) {
+    pthread_join(routers[r].w->thread, nullptr);
+  }
+
+  // 集計
+  uint64_t delivered = 0, wrapped = 0, hop_mismatches = 0, hops_total = 0, lost_loss = 0, lost_down = 0, inbox_drops = 0, first_delivery = UINT64_MAX;
+  uint32_t hops_max = 0;
+  std::vector<uint32_t> latencies;
+  stats_counters total{};
+  uint64_t tx_queue_drops = 0;
+  for (int r = 0; r < options.routers; r++) {
+    sim_router *router = &routers[r];
+    delivered += router->delivered;
+    wrapped += router->wrapped;
+    hop_mismatches += router->hop_mismatches;
+    hops_total += router->hops_total;
+    hops_max = std::max(hops_max, router->hops_max);
+    lost_loss += router->lost_loss;
+    lost_down += router->lost_down;
+    inbox_drops += router->inbox_drops;
+    if (router->first_delivery != 0) {
+      first_delivery = std::min(first_delivery, router->first_delivery);
+    }
+    latencies.insert(latencies.end(), router->latencies_us.begin(), router->latencies_us.end());
+    for (int i = 0; i < STATS_DROP_COUNT; i++) {
+      total.drops[i] += router->w->stats.drops[i];
+    }
+    for (int i = 0; i < STATS_ND_COUNT; i++) {
+      total.nd[i] += router->w->stats.nd[i];
+    }
+    for (int i = 0; i < STATS_ICMPV6_ERROR_COUNT; i++) {
+      total.icmpv6_errors[i] += router->w->stats.icmpv6_errors[i];
+    }
+    for (int i = 0; i < STATS_FLOW_COUNT; i++) {
+      total.flow[i] += router->w->stats.flow[i];
+    }
+    for (uint32_t i = 0; i < net_dev_count; i++) {
+      tx_queue_drops += router->w->devs[i].tx_queue_drops;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("sent %lu packets in %.3f s, delivered %lu (%.2f%%), %lu unreachable when sent\n", options.packets, send_elapsed / 1e9, delivered,
+         options.packets > 0 ? 100.0 * delivered / options.packets : 0.0, unreachable);
+  if (first_delivery != UINT64_MAX) {
+    printf("first delivery after %.3f ms\n", (first_delivery - sim_start) / 1e6);
+  }
+  printf("hops: avg %.2f, max %u, %lu not on the shortest path, %lu arrived with a wrapped hop limit\n", delivered > 0 ? (double)hops_total / delivered : 0.0,
+         hops_max, hop_mismatches, wrapped);
+  printf("latency: p50 %u us, p99 %u us, max %u us\n", sim_percentile(latencies, 0.5), sim_percentile(latencies, 0.99),
+         latencies.empty() ? 0 : latencies.back());
+  printf("route churns %u (%u route updates)\n", churns, route_updates);
+  printf("link frames lost %lu, dropped on down links %lu, inbox full %lu, injection failed %lu, tx queue drops %lu\n", lost_loss, lost_down, inbox_drops,
+         inject_drops, tx_queue_drops);
+  printf("drops:");
+  for (int i = 0; i < STATS_DROP_COUNT; i++) {
+    printf(" %s %lu%s", stats_drop_reason_names[i], total.drops[i], i + 1 < STATS_DROP_COUNT ? "," : "\n");
+  }
+  printf("icmpv6 errors:");
+  for (int i = 0; i < STATS_ICMPV6_ERROR_COUNT; i++) {
+    printf(" %s %lu%s", stats_icmpv6_error_event_names[i], total.icmpv6_errors[i], i + 1 < STATS_ICMPV6_ERROR_COUNT ? "," : "\n");
+  }
+  printf("flow cache:");
+  for (int i = 0; i < STATS_FLOW_COUNT; i++) {
+    printf(" %s %lu%s", stats_flow_event_names[i], total.flow[i], i + 1 < STATS_FLOW_COUNT ? "," : "\n");
+  }
+  printf("nd:");
+  for (int i = 0; i < STATS_ND_COUNT; i++) {
+    printf(" %s %lu%s", stats_nd_event_names[i], total.nd[i], i + 1 < STATS_ND_COUNT ? "," : "\n");
+  }
+  return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * curo-stats: 動作中のcuroが共有メモリに公開している統計を読んで表示する
+ * ルータにはシステムコールを発行させず、ワーカーごとの領域をseqlockで読んで合計する
+ *
+ * 使い方: curo-stats [-i 間隔(ミリ秒)] [-n 回数]
+ */
+#include "stats.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* 全てのワーカーを合計した値 */
+struct stats_snapshot {
+  uint64_t taken_ns;
+  stats_counters counters;
+  stats_shm_device *devs;
+};
+
+uint64_t now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ワーカーの領域を書き込み中でない時にコピーする */
+void read_worker(stats_shm_worker *shm, uint32_t device_count, stats_counters *counters, stats_shm_device *devs) {
+  while (true) {
+    uint32_t seq1 = shm->seq.load(std::memory_order_acquire);
+    if (seq1 & 1) {
+      continue;
+    }
+    memcpy(counters, &shm->counters, sizeof(stats_counters));
+    memcpy(devs, stats_shm_devices_of(shm), sizeof(stats_shm_device) * device_count);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (shm->seq.load(std::memory_order_relaxed) == seq1) {
+      return;
+    }
+  }
+}
+
+void take_snapshot(stats_shm_header *header, stats_snapshot *snap) {
+  uint32_t device_count = header->device_count;
+  memset(&snap->counters, 0, sizeof(stats_counters));
+  memset(snap->devs, 0, sizeof(stats_shm_device) * device_count);
+
+  stats_counters counters;
+  stats_shm_device *devs = (stats_shm_device *)calloc(device_count, sizeof(stats_shm_device));
+  for (uint32_t w = 0; w < header->worker_count; w++) {
+    read_worker(stats_shm_worker_at(header, w), device_count, &counters, devs);
+    for (int i = 0; i < STATS_DROP_COUNT; i++) {
+      snap->counters.drops[i] += counters.drops[i];
+    }
+    for (int i = 0; i < 256; i++) {
+      snap->counters.icmpv6_rx[i] += counters.icmpv6_rx[i];
+      snap->counters.icmpv6_tx[i] += counters.icmpv6_tx[i];
+    }
+    for (int i = 0; i < STATS_ND_COUNT; i++) {
+      snap->counters.nd[i] += counters.nd[i];
+    }
+    for (int i = 0; i < STATS_ICMPV6_ERROR_COUNT; i++) {
+      snap->counters.icmpv6_errors[i] += counters.icmpv6_errors[i];
+    }
+    for (int c = 0; c < STATS_PUNT_CLASS_COUNT; c++) {
+      for (int e = 0; e < STATS_PUNT_EVENT_COUNT; e++) {
+        snap->counters.punt[c][e] += counters.punt[c][e];
+      }
+    }
+    for (int i = 0; i < STATS_FLOW_COUNT; i++) {
+      snap->counters.flow[i] += counters.flow[i];
+    }
+    for (uint32_t i = 0; i < device_count; i++) {
+      snap->devs[i].rx_packets += devs[i].rx_packets;
+      snap->devs[i].rx_bytes += devs[i].rx_bytes;
+      snap->devs[i].tx_packets += devs[i].tx_packets;
+      snap->devs[i].tx_bytes += devs[i].tx_bytes;
+      snap->devs[i].tx_drops += devs[i].tx_drops;
+      snap->devs[i].tx_errors += devs[i].tx_errors;
+    }
+  }
+  free(devs);
+  snap->taken_ns = now_ns();
+}
+
+/* 前回からの増分を1秒あたりに直す */
+double rate(uint64_t now, uint64_t prev, double seconds) { return seconds > 0 ? (now - prev) / seconds : 0; }
+
+void print_snapshot(stats_shm_header *header, const stats_snapshot *snap, const stats_snapshot *prev) {
+  double seconds = prev != nullptr ? (snap->taken_ns - prev->taken_ns) / 1e9 : 0;
+  stats_shm_device_info *infos = stats_shm_device_infos(header);
+
+  printf("curo pid %u, %u workers\n", header->pid, header->worker_count);
+  printf("%-16s %12s %10s %14s %12s %10s %14s %8s %8s\n", "device", "rx packets", "rx pps", "rx bytes", "tx packets", "tx pps", "tx bytes", "tx drop", "tx err");
+  for (uint32_t i = 0; i < header->device_count; i++) {
+    const stats_shm_device *d = &snap->devs[i];
+    if (d->rx_packets == 0 and d->tx_packets == 0 and d->tx_drops == 0 and d->tx_errors == 0) {
+      continue; // 使われていないデバイスは省く
+    }
+    double rx_pps = prev != nullptr ? rate(d->rx_packets, prev->devs[i].rx_packets, seconds) : 0;
+    double tx_pps = prev != nullptr ? rate(d->tx_packets, prev->devs[i].tx_packets, seconds) : 0;
+    printf("%-16s %12lu %10.0f %14lu %12lu %10.0f %14lu %8lu %8lu\n", infos[i].name, d->rx_packets, rx_pps, d->rx_bytes, d->tx_packets, tx_pps, d->tx_bytes, d->tx_drops,
+           d->tx_errors);
+  }
+
+  printf("drops:");
+  for (int i = 0; i < STATS_DROP_COUNT; i++) {
+    printf(" %s %lu", stats_drop_reason_names[i], snap->counters.drops[i]);
+    if (prev != nullptr and snap->counters.drops[i] != prev->counters.drops[i]) {
+      printf(" (%.0f/s)", rate(snap->counters.drops[i], prev->counters.drops[i], seconds));
+    }
+    printf(i + 1 < STATS_DROP_COUNT ? "," : "\n");
+  }
+
+  printf("icmpv6:");
+  for (int i = 0; i < 256; i++) {
+    if (snap->counters.icmpv6_rx[i] != 0 or snap->counters.icmpv6_tx[i] != 0) {
+      printf(" type %d rx %lu tx %lu,", i, snap->counters.icmpv6_rx[i], snap->counters.icmpv6_tx[i]);
+    }
+  }
+  printf("\n");
+
+  printf("icmpv6 errors:");
+  for (int i = 0; i < STATS_ICMPV6_ERROR_COUNT; i++) {
+    printf(" %s %lu", stats_icmpv6_error_event_names[i], snap->counters.icmpv6_errors[i]);
+    if (prev != nullptr and snap->counters.icmpv6_errors[i] != prev->counters.icmpv6_errors[i]) {
+      printf(" (%.0f/s)", rate(snap->counters.icmpv6_errors[i], prev->counters.icmpv6_errors[i], seconds));
+    }
+    printf(i + 1 < STATS_ICMPV6_ERROR_COUNT ? "," : "\n");
+  }
+
+  printf("punt:");
+  for (int c = 0; c < STATS_PUNT_CLASS_COUNT; c++) {
+    printf(" %s", stats_punt_class_names[c]);
+    for (int e = 0; e < STATS_PUNT_EVENT_COUNT; e++) {
+      printf(" %s %lu", stats_punt_event_names[e], snap->counters.punt[c][e]);
+      if (prev != nullptr and snap->counters.punt[c][e] != prev->counters.punt[c][e]) {
+        printf(" (%.0f/s)", rate(snap->counters.punt[c][e], prev->counters.punt[c][e], seconds));
+      }
+    }
+    printf(c + 1 < STATS_PUNT_CLASS_COUNT ? "," : "\n");
+  }
+
+  printf("flow cache:");
+  for (int i = 0; i < STATS_FLOW_COUNT; i++) {
+    printf(" %s %lu", stats_flow_event_names[i], snap->counters.flow[i]);
+    if (prev != nullptr and snap->counters.flow[i] != prev->counters.flow[i]) {
+      printf(" (%.0f/s)", rate(snap->counters.flow[i], prev->counters.flow[i], seconds));
+    }
+    printf(i + 1 < STATS_FLOW_COUNT ? "," : "\n");
+  }
+
+  printf("nd:");
+  for (int i = 0; i < STATS_ND_COUNT; i++) {
+    printf(" %s %lu%s", stats_nd_event_names[i], snap->counters.nd[i], i + 1 < STATS_ND_COUNT ? "," : "\n");
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  int interval_ms = 1000;
+  int count = 0; // 0なら止めるまで表示を続ける
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval_ms = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-i interval_ms] [-n count]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  int fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0);
+  if (fd == -1) {
+    fprintf(stderr, "failed to open %s: %s (is curo running?)\n", STATS_SHM_NAME, strerror(errno));
+    return 1;
+  }
+  struct stat st{};
+  if (fstat(fd, &st) == -1 or (size_t)st.st_size < sizeof(stats_shm_header)) {
+    fprintf(stderr, "invalid stats in %s\n", STATS_SHM_NAME);
+    return 1;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror("failed to mmap");
+    return 1;
+  }
+
+  stats_shm_header *header = (stats_shm_header *)addr;
+  if (header->magic != STATS_SHM_MAGIC or header->version != STATS_SHM_VERSION or header->drop_reason_count != STATS_DROP_COUNT or
+      header->nd_event_count != STATS_ND_COUNT or header->icmpv6_error_event_count != STATS_ICMPV6_ERROR_COUNT or
+      header->punt_class_count != STATS_PUNT_CLASS_COUNT or header->punt_event_count != STATS_PUNT_EVENT_COUNT or
+      header->flow_event_count != STATS_FLOW_COUNT) {
+    fprintf(stderr, "stats in %s are not ready or built by a different version\n", STATS_SHM_NAME);
+    return 1;
+  }
+  if ((size_t)header->workers_offset + (size_t)header->worker_size * header->worker_count > (size_t)st.st_size) {
+    fprintf(stderr, "stats in %s are truncated\n", STATS_SHM_NAME);
+    return 1;
+  }
+
+  stats_snapshot snaps[2];
+  for (stats_snapshot &snap : snaps) {
+    snap.devs = (stats_shm_device *)calloc(header->device_count, sizeof(stats_shm_device));
+  }
+  stats_snapshot *prev = nullptr;
+  for (int n = 0; count == 0 or n < count; n++) {
+    stats_snapshot *snap = &snaps[n % 2];
+    take_snapshot(header, snap);
+    if (n > 0) {
+      printf("\n");
+    }
+    print_snapshot(header, snap, prev);
+    prev = snap;
+    if (count == 0 or n + 1 < count) {
+      usleep(interval_ms * 1000);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,305 @@
+#include "trace.h"
+
+#include "acl.h"
+#include "ethernet.h"
+#include "graph.h"
+#include "ipv6.h"
+#include "log.h"
+#include "net.h"
+#include "stats.h"
+#include "worker.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+/* トレースするパケットの条件 */
+struct trace_filter {
+  uint32_t count = TRACE_DEFAULT_COUNT; // 記録するパケットの数(全てのワーカーの合計)
+  uint32_t sample = 1;                  // 条件に合うパケットのうち何個に1個を記録するか
+  int dev_index = -1;                   // 受信したデバイス(-1なら全て)
+  int next_hdr = -1;                    // 次ヘッダ(-1なら全て)
+  in6_addr src_prefix{};
+  uint32_t src_prefix_len = 0;
+  in6_addr dst_prefix{};
+  uint32_t dst_prefix_len = 0;
+};
+
+trace_filter trace_config;
+
+std::atomic<bool> trace_active{false};
+std::atomic<uint32_t> trace_generation{0};
+std::atomic<int64_t> trace_remaining{0};
+
+thread_local trace_ring *trace_local = nullptr;
+
+/* アドレスがプレフィックスに含まれるか */
+bool trace_prefix_match(const in6_addr &addr, const in6_addr &prefix, uint32_t prefix_len) {
+  uint32_t bytes = prefix_len / 8;
+  if (memcmp(addr.s6_addr, prefix.s6_addr, bytes) != 0) {
+    return false;
+  }
+  uint32_t bits = prefix_len % 8;
+  if (bits == 0) {
+    return true;
+  }
+  uint8_t mask = 0xff << (8 - bits);
+  return (addr.s6_addr[bytes] & mask) == (prefix.s6_addr[bytes] & mask);
+}
+
+/* "2001:db8::/32"の形式のプレフィックスを読む */
+bool trace_parse_prefix(const char *str, size_t len, in6_addr *prefix, uint32_t *prefix_len) {
+  char buf[INET6_ADDRSTRLEN + 4];
+  if (len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  char *slash = strchr(buf, '/');
+  *prefix_len = 128;
+  if (slash != nullptr) {
+    *slash = '\0';
+    *prefix_len = atoi(slash + 1);
+  }
+  return *prefix_len <= 128 and inet_pton(AF_INET6, buf, prefix) == 1;
+}
+
+/* 環境変数CURO_TRACEからトレースの条件を読む(デバイスを登録した後に呼ぶ) */
+void init_trace() {
+  const char *env = getenv("CURO_TRACE");
+  while (env != nullptr and *env != '\0') {
+    const char *end = strchr(env, ',');
+    size_t len = end != nullptr ? end - env : strlen(env);
+    const char *value = (const char *)memchr(env, '=', len);
+    if (value != nullptr) {
+      size_t key_len = value - env;
+      value++;
+      size_t value_len = len - key_len - 1;
+      if (strncmp(env, "count", key_len) == 0) {
+        trace_config.count = atoi(value);
+      } else if (strncmp(env, "sample", key_len) == 0) {
+        trace_config.sample = atoi(value) > 0 ? atoi(value) : 1;
+      } else if (strncmp(env, "proto", key_len) == 0) {
+        trace_config.next_hdr = atoi(value);
+      } else if (strncmp(env, "dev", key_len) == 0) {
+        char name[sizeof(net_device::name)] = {};
+        memcpy(name, value, value_len < sizeof(name) - 1 ? value_len : sizeof(name) - 1);
+        net_device *dev = get_net_device_by_name(name);
+        if (dev == nullptr) {
+          LOG_ERROR("unknown trace device %s\n", name);
+        } else {
+          trace_config.dev_index = dev->index;
+        }
+      } else if (strncmp(env, "src", key_len) == 0) {
+        if (!trace_parse_prefix(value, value_len, &trace_config.src_prefix, &trace_config.src_prefix_len)) {
+          LOG_ERROR("invalid trace source prefix\n");
+        }
+      } else if (strncmp(env, "dst", key_len) == 0) {
+        if (!trace_parse_prefix(value, value_len, &trace_config.dst_prefix, &trace_config.dst_prefix_len)) {
+          LOG_ERROR("invalid trace destination prefix\n");
+        }
+      }
+    }
+    env = end != nullptr ? end + 1 : nullptr;
+  }
+}
+
+/* 現在のワーカーのトレースのリングを用意する */
+void trace_init_worker(worker *w) {
+  w->trace = new trace_ring();
+  trace_local = w->trace;
+}
+
+/* 受信したパケットが条件に合えば、トレースするエントリを割り当てる */
+void trace_capture(graph_buffer *buffer) {
+  trace_ring *ring = trace_local;
+  uint32_t generation = trace_generation.load(std::memory_order_acquire);
+  if (ring->generation.load(std::memory_order_relaxed) != generation) { // 新しく始めたトレースなので前の記録を消す
+    ring->head = 0;
+    ring->matched = 0;
+    ring->committed.store(0, std::memory_order_relaxed);
+    ring->generation.store(generation, std::memory_order_release);
+  }
+  if (ring->head == TRACE_RING_SIZE) {
+    return;
+  }
+
+  const trace_filter &filter = trace_config;
+  if (filter.dev_index != -1 and buffer->rx_dev->index != (uint32_t)filter.dev_index) {
+    return;
+  }
+  uint16_t ether_type = 0;
+  ipv6_header *packet = nullptr;
+  if (buffer->len >= ETHERNET_HEADER_SIZE) {
+    ether_type = ntohs(((ethernet_header *)buffer->data)->type);
+    if (ether_type == ETHER_TYPE_IPV6 and buffer->len >= ETHERNET_HEADER_SIZE + sizeof(ipv6_header)) {
+      packet = (ipv6_header *)(buffer->data + ETHERNET_HEADER_SIZE);
+    }
+  }
+  bool needs_ipv6 = filter.next_hdr != -1 or filter.src_prefix_len != 0 or filter.dst_prefix_len != 0;
+  if (needs_ipv6) {
+    if (packet == nullptr or (filter.next_hdr != -1 and packet->next_hdr != filter.next_hdr) or
+        !trace_prefix_match(packet->src_addr, filter.src_prefix, filter.src_prefix_len) or
+        !trace_prefix_match(packet->dst_addr, filter.dst_prefix, filter.dst_prefix_len)) {
+      return;
+    }
+  }
+  if (ring->matched++ % filter.sample != 0) {
+    return;
+  }
+  if (trace_remaining.fetch_sub(1, std::memory_order_relaxed) <= 0) { // 決めた数を記録し終えた
+    trace_active.store(false, std::memory_order_relaxed);
+    return;
+  }
+
+  trace_record *record = &ring->records[ring->head++];
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  record->timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  record->rx_dev_index = buffer->rx_dev->index;
+  record->len = buffer->len;
+  record->ether_type = ether_type;
+  record->step_count = 0;
+  record->is_ipv6 = packet != nullptr;
+  if (packet != nullptr) {
+    record->next_hdr = packet->next_hdr;
+    record->hop_limit = packet->hop_limit;
+    record->src_addr = packet->src_addr;
+    record->dst_addr = packet->dst_addr;
+  } else {
+    record->next_hdr = 0;
+    record->hop_limit = 0;
+    memset(&record->src_addr, 0, sizeof(in6_addr));
+    memset(&record->dst_addr, 0, sizeof(in6_addr));
+  }
+  buffer->trace = record;
+}
+
+void trace_add_step(trace_record *record, uint8_t node, trace_decision decision, uint8_t arg, uint32_t dev_index, const in6_addr *addr) {
+  if (record->step_count == TRACE_MAX_STEPS) {
+    return;
+  }
+  trace_step *step = &record->steps[record->step_count++];
+  step->node = node;
+  step->decision = decision;
+  step->arg = arg;
+  step->dev_index = dev_index;
+  if (addr != nullptr) {
+    step->addr = *addr;
+  }
+}
+
+/* トレースを始める、または止める */
+void toggle_trace() {
+  if (trace_active.load(std::memory_order_relaxed)) {
+    trace_active.store(false, std::memory_order_relaxed);
+    printf("trace stopped\n");
+    return;
+  }
+  trace_remaining.store(trace_config.count, std::memory_order_relaxed);
+  trace_generation.fetch_add(1, std::memory_order_release);
+  trace_active.store(true, std::memory_order_release);
+  printf("tracing %u packets (1 in %u matching)\n", trace_config.count, trace_config.sample);
+}
+
+const char *trace_dev_name(uint32_t index) { return index < net_dev_count ? net_devs[index]->name : "?"; }
+
+void trace_print_step(const trace_step *step) {
+  char addr[INET6_ADDRSTRLEN];
+  inet_ntop(AF_INET6, &step->addr, addr, sizeof(addr));
+  printf("    %-16s ", graph_node_name((graph_node_index)step->node));
+  switch (step->decision) {
+  case TRACE_ETHER_IPV6:
+    printf("ipv6\n");
+    break;
+  case TRACE_DROP:
+    printf("drop (%s)\n", step->arg < STATS_DROP_COUNT ? stats_drop_reason_names[step->arg] : "?");
+    break;
+  case TRACE_IPV6_UNICAST:
+    printf("unicast\n");
+    break;
+  case TRACE_IPV6_SOLICITED_NODE:
+    printf("solicited-node multicast on %s\n", trace_dev_name(step->dev_index));
+    break;
+  case TRACE_FIB_LOCAL:
+    printf("local route %s on %s\n", addr, trace_dev_name(step->dev_index));
+    break;
+  case TRACE_FIB_CONNECTED:
+    printf("connected route on %s\n", trace_dev_name(step->dev_index));
+    break;
+  case TRACE_FIB_NETWORK:
+    printf("route via %s\n", addr);
+    break;
+  case TRACE_ND_HIT:
+    printf("nd hit %s on %s\n", addr, trace_dev_name(step->dev_index));
+    break;
+  case TRACE_ND_MISS:
+    printf("nd miss %s, waiting for resolution\n", addr);
+    break;
+  case TRACE_REWRITE:
+    printf("rewritten, hop limit %d\n", step->arg);
+    break;
+  case TRACE_LOCAL_ICMPV6:
+    printf("icmpv6 type %d\n", step->arg);
+    break;
+  case TRACE_ICMPV6_ERROR:
+    printf("icmpv6 error type %d to %s\n", step->arg, addr);
+    break;
+  case TRACE_PUNT:
+    printf("punted to control plane (%s)\n", step->arg < STATS_PUNT_CLASS_COUNT ? stats_punt_class_names[step->arg] : "?");
+    break;
+  case TRACE_FLOW_HIT:
+    printf("flow cache hit via %s\n", trace_dev_name(step->dev_index));
+    break;
+  case TRACE_ACL:
+    if (step->dev_index == UINT32_MAX) {
+      printf("acl default %s\n", acl_action_names[step->arg]);
+    } else {
+      printf("acl rule %u %s\n", step->dev_index, acl_action_names[step->arg]);
+    }
+    break;
+  case TRACE_NPTV6:
+    printf("nptv6 %s translated to %s on %s\n", step->arg == 0 ? "destination" : "source", addr, trace_dev_name(step->dev_index));
+    break;
+  case TRACE_TX_QUEUED:
+    printf("queued on %s\n", trace_dev_name(step->dev_index));
+    break;
+  case TRACE_TX_DROPPED:
+    printf("tx queue full on %s\n", trace_dev_name(step->dev_index));
+    break;
+  default:
+    printf("?\n");
+    break;
+  }
+}
+
+/* 記録し終えたトレースを表示する(ワーカーは止めない) */
+void dump_trace() {
+  uint32_t generation = trace_generation.load(std::memory_order_relaxed);
+  for (int i = 0; i < worker_count; i++) {
+    trace_ring *ring = workers[i]->trace;
+    if (ring == nullptr or ring->generation.load(std::memory_order_acquire) != generation) {
+      continue;
+    }
+    uint32_t count = ring->committed.load(std::memory_order_acquire);
+    for (uint32_t n = 0; n < count; n++) {
+      const trace_record *record = &ring->records[n];
+      printf("worker %d packet %u: %lu.%09lu rx %s %u bytes", i, n, record->timestamp / 1000000000, record->timestamp % 1000000000, trace_dev_name(record->rx_dev_index),
+             record->len);
+      if (record->is_ipv6) {
+        char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &record->src_addr, src, sizeof(src));
+        inet_ntop(AF_INET6, &record->dst_addr, dst, sizeof(dst));
+        printf(", %s > %s next-header %d hop-limit %d\n", src, dst, record->next_hdr, record->hop_limit);
+      } else {
+        printf(", ether type %04x\n", record->ether_type);
+      }
+      for (uint8_t s = 0; s < record->step_count; s++) {
+        trace_print_step(&record->steps[s]);
+      }
+    }
+  }
+  printf("trace %s, %ld packets left\n", trace_active.load(std::memory_order_relaxed) ? "running" : "stopped",
+         std::max<int64_t>(trace_remaining.load(std::memory_order_relaxed), 0));
+}
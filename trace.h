@@ -0,0 +1,106 @@
+#ifndef CURO_TRACE_H
+#define CURO_TRACE_H
+
+#include "config.h"
+#include <atomic>
+#include <cstdint>
+#include <netinet/in.h>
+
+#define TRACE_RING_SIZE 256     // ワーカーごとに記録できるパケットの数
+#define TRACE_MAX_STEPS 8       // 1つのパケットについて記録するノードの数
+#define TRACE_DEFAULT_COUNT 50  // 't'で記録するパケットの数(環境変数CURO_TRACEで変えられる)
+
+struct graph_buffer;
+struct worker;
+
+/*
+ * 転送処理のパケットトレース
+ * 't'で始めると、フィルタに合うパケットのうち最初のcount個(またはsample個に1個)について、
+ * 通ったノードと判断の内容(経路、NDのヒット/ミス、送信したデバイスなど)をワーカーごとのリングに記録する
+ * 記録し終えたエントリは書き換えないので、'T'で転送を止めずにメインスレッドから表示できる
+ * トレースしていない時の負担は、受信したパケットごとのフラグの確認と、ノードでのポインタの確認だけ
+ *
+ * フィルタは環境変数で指定する(例: CURO_TRACE=count=20,sample=10,dst=2001:db8::/32,proto=58,dev=router1-host1)
+ */
+enum trace_decision : uint8_t {
+  TRACE_ETHER_IPV6,          // IPv6のフレームを受け取った
+  TRACE_DROP,                // 捨てた(argは理由)
+  TRACE_IPV6_UNICAST,        // ユニキャストなので経路を引く
+  TRACE_FLOW_HIT,            // フローキャッシュに当たったので経路を引かずに送る(devは出力先)
+  TRACE_ACL,                 // ACLを評価した(argは動作、dev_indexは合ったルールの番号)
+  TRACE_NPTV6,               // NPTv6でプレフィックスを書き換えた(argは0なら宛先、1なら送信元、addrは書き換えた後のアドレス)
+  TRACE_IPV6_SOLICITED_NODE, // 自分の要請ノードマルチキャストアドレス宛て
+  TRACE_FIB_LOCAL,           // 自分のアドレス宛て(addrは宛先のアドレス)
+  TRACE_FIB_CONNECTED,       // 直接接続の経路(devは出力先)
+  TRACE_FIB_NETWORK,         // ネクストホップを経由する経路(addrはネクストホップ)
+  TRACE_ND_HIT,              // 近隣のMACアドレスを解決済み(addrは近隣のアドレス、devは出力先)
+  TRACE_ND_MISS,             // 未解決なのでNDで解決を待つ(addrは近隣のアドレス)
+  TRACE_REWRITE,             // ヘッダを書き換えた(argは書き換えた後のHop Limit)
+  TRACE_LOCAL_ICMPV6,        // ICMPv6の処理に渡した(argはタイプ)
+  TRACE_ICMPV6_ERROR,        // ICMPv6エラーに書き換えて送り返す(argはタイプ、addrは宛先)
+  TRACE_PUNT,                // 制御プレーンのスレッドに渡した(argは種類)
+  TRACE_TX_QUEUED,           // 送信キューに入れた(devは出力先)
+  TRACE_TX_DROPPED           // 送信キューが一杯で捨てた(devは出力先)
+};
+
+struct trace_step {
+  uint8_t node; // graph_node_index
+  uint8_t decision;
+  uint8_t arg;
+  uint32_t dev_index;
+  in6_addr addr;
+};
+
+struct trace_record {
+  uint64_t timestamp; // 受信した時刻(CLOCK_MONOTONIC、ナノ秒)
+  uint32_t rx_dev_index;
+  uint32_t len;
+  uint16_t ether_type;
+  uint8_t is_ipv6; // IPv6ヘッダの内容を記録したか
+  uint8_t next_hdr;
+  uint8_t hop_limit;
+  in6_addr src_addr;
+  in6_addr dst_addr;
+  uint8_t step_count;
+  trace_step steps[TRACE_MAX_STEPS];
+};
+
+/* ワーカーごとのトレースのリング(記録し終えた分までをcommittedで公開する) */
+struct trace_ring {
+  std::atomic<uint32_t> generation{0}; // どの't'の記録か
+  std::atomic<uint32_t> committed{0};  // 表示してよいエントリの数
+  uint32_t head = 0;                   // 書き込み中のエントリの数(ワーカーだけが使う)
+  uint64_t matched = 0;                // フィルタに合ったパケットの数(間引きに使う)
+  trace_record records[TRACE_RING_SIZE];
+};
+
+extern std::atomic<bool> trace_active;
+extern thread_local trace_ring *trace_local;
+
+inline bool trace_enabled() { return __builtin_expect(trace_active.load(std::memory_order_relaxed), 0); }
+
+void trace_capture(graph_buffer *buffer);
+void trace_add_step(trace_record *record, uint8_t node, trace_decision decision, uint8_t arg, uint32_t dev_index, const in6_addr *addr);
+
+/* 受信したベクタを処理し終えたら、記録したエントリを表示できるようにする */
+inline void trace_commit() {
+  trace_ring *ring = trace_local;
+  if (__builtin_expect(ring->head != ring->committed.load(std::memory_order_relaxed), 0)) {
+    ring->committed.store(ring->head, std::memory_order_release);
+  }
+}
+
+/* トレースするパケットなら、ノードでの判断を記録する */
+#define TRACE_STEP(buffer, node, decision, arg, dev_index, addr)                         \
+  do {                                                                                 \
+    if (__builtin_expect((buffer)->trace != nullptr, 0)) {                             \
+      trace_add_step((buffer)->trace, node, decision, arg, dev_index, addr);           \
+    }                                                                                  \
+  } while (0)
+
+void init_trace();
+void trace_init_worker(worker *w);
+void toggle_trace();
+void dump_trace();
+
+#endif // CURO_TRACE_H
@@ -1,5 +1,6 @@
 #include "utils.h"
 
+#include <ctime>
 #include <iostream>
 
 /**
@@ -24,8 +25,8 @@ uint32_t htonl(uint32_t v) { return swap_byte_order_32(v); }
 
 #endif
 
-uint8_t ip_string_pool_index = 0;
-char ip_string_pool[4][16]; // 16バイト(xxx.xxx.xxx.xxxの文字数+1)の領域を4つ確保
+thread_local uint8_t ip_string_pool_index = 0;
+thread_local char ip_string_pool[4][16]; // 16バイト(xxx.xxx.xxx.xxxの文字数+1)の領域を4つ確保
 
 /**
  * IPアドレスから文字列に変換
@@ -46,8 +47,8 @@ const char *ip_ntoa(uint32_t in) {
 // ホストバイトオーダーのIPアドレスから文字列に変換
 const char *ip_htoa(uint32_t in) { return ip_ntoa(swap_byte_order_32(in)); }
 
-uint8_t mac_addr_string_pool_index = 0;
-char mac_addr_string_pool[4][18]; // 18バイト(xxx.xxx.xxx.xxxの文字数+1)の領域を4つ確保
+thread_local uint8_t mac_addr_string_pool_index = 0;
+thread_local char mac_addr_string_pool[4][18]; // 18バイト(xxx.xxx.xxx.xxxの文字数+1)の領域を4つ確保
 
 /**
  * MACアドレスから文字列に変換
@@ -60,26 +61,45 @@ const char *mac_addr_toa(const uint8_t *addr) {
   return mac_addr_string_pool[mac_addr_string_pool_index];
 }
 
+uint64_t token_bucket_now_ns() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* トークンバケットを満タンの状態で初期化する */
+void token_bucket_init(token_bucket *bucket, uint32_t rate, uint32_t burst) {
+  bucket->rate = rate;
+  bucket->burst = burst;
+  bucket->tokens = burst * 1000000000ull;
+  bucket->last_refill = token_bucket_now_ns();
+}
+
 /**
- * Checksumの計算
- * @param buffer 計算する対象のデータ
- * @param count 計算するデータの長さ
- * @param start 計算する初期値
- * @return 計算されたチェックサム
+ * トークンを1つ消費する
+ * @return トークンが残っていればtrue、制限に引っかかったらfalse
  */
-uint16_t checksum_16(uint16_t *buffer, size_t count, uint16_t start) {
-  uint32_t sum = start;
-  // まず16ビット毎に足す
-  while (count > 1) {
-    sum += *buffer++;
-    count -= 2;
+bool token_bucket_consume(token_bucket *bucket) {
+  uint64_t now = token_bucket_now_ns();
+  uint64_t max_tokens = bucket->burst * 1000000000ull;
+
+  // 経過時間分だけ補充する(1秒あたりrate個)
+  if (now > bucket->last_refill) {
+    uint64_t elapsed = now - bucket->last_refill;
+    if (elapsed >= 1000000000ull * bucket->burst / (bucket->rate ? bucket->rate : 1)) {
+      bucket->tokens = max_tokens;
+    } else {
+      bucket->tokens += elapsed * bucket->rate;
+      if (bucket->tokens > max_tokens) {
+        bucket->tokens = max_tokens;
+      }
+    }
+    bucket->last_refill = now;
   }
-  // もし1バイト余ってたら足す
-  if (count > 0)
-    sum += *(uint8_t *)buffer;
-  // あふれた桁を折り返して足す
-  while (sum >> 16)
-    sum = (sum & 0xffff) + (sum >> 16);
-
-  return ~sum; // 論理否定(NOT)をとる
-}
+
+  if (bucket->tokens < 1000000000ull) {
+    return false;
+  }
+  bucket->tokens -= 1000000000ull;
+  return true;
+}
\ No newline at end of file
@@ -18,6 +18,25 @@ const char *ip_ntoa(uint32_t in);
 const char *ip_htoa(uint32_t in);
 const char *mac_addr_toa(const uint8_t *addr);
 
-uint16_t checksum_16(uint16_t *buffer, size_t count, uint16_t start = 0);
+/* 64ビットの値をかき混ぜる(MurmurHash3のfinalizer) */
+inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+/* トークンバケットによる流量制限 */
+struct token_bucket {
+  uint32_t rate;        // 1秒あたりに補充するトークン数
+  uint32_t burst;       // 溜めておけるトークンの最大数
+  uint64_t tokens;      // 残りのトークン数(1/1000000000単位)
+  uint64_t last_refill; // 最後に補充した時刻(ナノ秒)
+};
+
+void token_bucket_init(token_bucket *bucket, uint32_t rate, uint32_t burst);
+bool token_bucket_consume(token_bucket *bucket);
 
 #endif // CURO_UTILS_H
@@ -0,0 +1,626 @@
+#include "worker.h"
+
+#include "acl.h"
+#include "flow_cache.h"
+#include "graph.h"
+#include "icmpv6.h"
+#include "ipv6.h"
+#include "latency.h"
+#include "log.h"
+#include "my_buf.h"
+#include "nd.h"
+#include "nptv6.h"
+#include "patricia_trie.h"
+#include "pipeline.h"
+#include "punt.h"
+#include "timer.h"
+#include <cerrno>
+#include <ctime>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * ワーカーはCPUごとに1つずつ動き、互いにデータを共有しない
+ * 経路表、NDテーブル、タイマー、my_bufのキャッシュはスレッドごとに持ち、
+ * 設定や経路更新は制御スレッドからのリングで、NDで学習した内容は他のワーカーからのリングで受け取る
+ */
+
+worker *workers[MAX_WORKERS];
+int worker_count = 0;
+
+thread_local worker *current_worker = nullptr;
+
+std::atomic<bool> workers_stopping{false};
+
+uint64_t worker_now_us() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* ワーカーを起こす */
+void worker_wake(worker *w) {
+  uint64_t one = 1;
+  if (write(w->wake_fd, &one, sizeof(one)) == -1 and errno != EAGAIN) {
+    LOG_ERROR("failed to wake worker %d: %s\n", w->id, strerror(errno));
+  }
+}
+
+/* このプロセスが使えるCPUの一覧をcpusに入れ、その数を返す */
+int worker_allowed_cpus(int *cpus) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    LOG_ERROR("failed to sched_getaffinity: %s\n", strerror(errno));
+    return 0;
+  }
+
+  int cpu_count = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus[cpu_count++] = cpu;
+    }
+  }
+  return cpu_count;
+}
+
+/*
+ * ワーカーを1つ作る(workersには登録しない)
+ * cpuが-1ならCPUに固定しない
+ */
+worker *worker_create(int id, int cpu, int device_count) {
+  worker *w = new worker();
+  w->id = id;
+  w->cpu = cpu;
+  w->timer_fd = -1;
+  w->devs = new worker_device[device_count]();
+  w->tx_pending = new net_device *[device_count]();
+  for (int j = 0; j < device_count; j++) {
+    w->devs[j].fd = -1;
+  }
+
+  w->epoll_fd = epoll_create1(0);
+  w->wake_fd = eventfd(0, EFD_NONBLOCK);
+  if (w->epoll_fd == -1 or w->wake_fd == -1) {
+    LOG_ERROR("failed to create worker %d: %s\n", id, strerror(errno));
+    return nullptr;
+  }
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->wake_fd;
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) != 0) {
+    LOG_ERROR("failed to epoll_ctl wake fd: %s\n", strerror(errno));
+    return nullptr;
+  }
+  return w;
+}
+
+/* ワーカーを準備する(countが0以下なら使えるCPUの数だけ) */
+int init_workers(int count, int device_count) {
+  int cpus[CPU_SETSIZE];
+  int cpu_count = worker_allowed_cpus(cpus);
+
+  if (count <= 0) {
+    count = cpu_count;
+  }
+  if (count > MAX_WORKERS) {
+    count = MAX_WORKERS;
+  }
+
+  for (int i = 0; i < count; i++) {
+    worker *w = worker_create(i, cpu_count > 0 ? cpus[i % cpu_count] : -1, device_count);
+    if (w == nullptr) {
+      return -1;
+    }
+    workers[i] = w;
+  }
+  worker_count = count;
+
+  // 受け取る側のワーカーが、送信元のワーカーごとにND学習イベントのリングを持つ
+  for (int dst = 0; dst < worker_count; dst++) {
+    for (int src = 0; src < worker_count; src++) {
+      if (src != dst) {
+        workers[dst]->nd_rings[src] = new spsc_ring<nd_event, WORKER_ND_EVENT_RING_SIZE>();
+      }
+    }
+  }
+  return 0;
+}
+
+/* 対話的なコマンドを現在のワーカーで実行する */
+void worker_exec_command(char command) {
+  if (command == 'a') {
+    printf("worker %d\n", current_worker->id);
+    dump_nd_table_entry();
+  } else if (command == 'r') {
+    dump_ipv6_route(ipv6_fib);
+  } else if (command == 'f') {
+    if (current_worker != punt_worker) { // 制御プレーンのスレッドは転送しないので表を持たない
+      printf("worker %d\n", current_worker->id);
+      dump_flow_cache();
+    }
+  } else if (command == 'g') {
+    printf("worker %d\n", current_worker->id);
+    dump_graph_stats();
+#ifdef ENABLE_LATENCY_HISTOGRAM
+  } else if (command == 'h') {
+    printf("worker %d\n", current_worker->id);
+    dump_latency_histograms();
+  } else if (command == 'H') {
+    reset_latency_histograms();
+#endif
+  }
+  current_worker->commands_done.fetch_add(1, std::memory_order_release);
+}
+
+/* 制御スレッドからのメッセージを処理する */
+void worker_handle_msg(const worker_msg &msg) {
+  if (msg.type == worker_msg_type::route_update) { // 変わったプレフィックスに含まれる宛先のフローだけ引き直す
+    flow_cache_invalidate_prefix(msg.route.prefix, msg.route.prefix_len);
+  } else if (msg.type != worker_msg_type::command) { // 経路表、NDテーブル、ACL、NPTv6の変換のどれかが変わるので、覚えた判断は使えない
+    flow_cache_invalidate();
+  }
+  switch (msg.type) {
+  case worker_msg_type::route_update:
+    control_apply_route_update(&msg.route);
+    break;
+  case worker_msg_type::connected_route:
+    install_connected_route(msg.connected.dev, msg.connected.prefix, msg.connected.prefix_len);
+    break;
+  case worker_msg_type::local_route:
+    install_local_route(msg.local.v6dev);
+    break;
+  case worker_msg_type::static_neighbor:
+    update_nd_table_entry(msg.neighbor.dev, (uint8_t *)msg.neighbor.mac_addr, msg.neighbor.v6_addr, nd_state::permanent);
+    break;
+  case worker_msg_type::acl_update:
+    acl_install(msg.acl.classifier);
+    break;
+  case worker_msg_type::npt_mapping_add:
+    install_npt_mapping(msg.npt.mapping);
+    break;
+  case worker_msg_type::command:
+    worker_exec_command(msg.command);
+    break;
+  }
+}
+
+/*
+ * パケットの処理の合間に制御メッセージをまとめて処理する
+ * 残っていればtrueを返す
+ */
+bool worker_process_control_ring(worker *w) {
+  uint64_t deadline = worker_now_us() + ROUTE_UPDATE_TIME_SLICE_US;
+  worker_msg msg;
+  for (int i = 0; i < ROUTE_UPDATE_BATCH_SIZE; i++) {
+    if (!w->control_ring.pop(&msg)) {
+      return false;
+    }
+    worker_handle_msg(msg);
+    if (i % 16 == 15 and worker_now_us() >= deadline) { // 時刻の取得は16件ごとにする
+      break;
+    }
+  }
+  return true;
+}
+
+/* 送信キューにフレームを入れたデバイスを、周期の最後に送信するリストに入れる */
+void worker_schedule_tx(net_device *dev) {
+  worker_device *wdev = worker_device_of(dev);
+  if (wdev->tx_scheduled or wdev->tx_blocked) {
+    return;
+  }
+  wdev->tx_scheduled = true;
+  current_worker->tx_pending[current_worker->tx_pending_count++] = dev;
+}
+
+/* グラフの受信用のバッファの中のフレームか(次に受信するまで書き換えられない) */
+bool worker_is_graph_frame(const uint8_t *buffer, size_t len) {
+  if (graph == nullptr) {
+    return false;
+  }
+  const uint8_t *frames = &graph->frames[0][0];
+  return buffer >= frames and buffer + len <= frames + sizeof(graph->frames);
+}
+
+/* 送信キューのフレームをmy_bufにコピーする */
+void worker_copy_tx(worker_tx_frame *frame) {
+  my_buf *buf = my_buf::create(frame->len);
+  memcpy(buf->buffer, frame->data, frame->len);
+  frame->data = buf->buffer;
+  frame->buf = buf;
+}
+
+/*
+ * フレームを送信キューに入れる(一杯なら後から来たものを捨てる)
+ * グラフの受信用のバッファのフレームはそのまま指し、周期の最後か次に受信する前の送信までコピーしない
+ * ソケットが一杯で待っている間は次の受信まで残るので、初めからコピーする
+ */
+int worker_queue_tx(net_device *dev, uint8_t *buffer, size_t len) {
+  worker_device *wdev = worker_device_of(dev);
+  if (wdev->tx_count == TX_QUEUE_LEN) {
+    wdev->tx_queue_drops++;
+    return -1;
+  }
+  worker_tx_frame *frame = &wdev->tx_queue[(wdev->tx_head + wdev->tx_count) & (TX_QUEUE_LEN - 1)];
+  frame->data = buffer;
+  frame->len = len;
+  frame->buf = nullptr;
+  if (wdev->tx_blocked or !worker_is_graph_frame(buffer, len)) {
+    worker_copy_tx(frame);
+  }
+  wdev->tx_count++;
+  if (wdev->tx_count > wdev->tx_depth_max) {
+    wdev->tx_depth_max = wdev->tx_count;
+  }
+  worker_schedule_tx(dev);
+  return 0;
+}
+
+/* 送信し終えたか捨てたフレームを解放する(受信用のバッファを指していれば何もしない) */
+void worker_release_tx(worker_tx_frame *frame) {
+  if (frame->buf != nullptr) {
+    my_buf::my_buf_free(frame->buf);
+    frame->buf = nullptr;
+  }
+}
+
+/* 送信キューのフレームをmy_bufとして引き取る(受信用のバッファを指していればここでコピーする) */
+my_buf *worker_take_tx(worker_tx_frame *frame) {
+  if (frame->buf == nullptr) {
+    worker_copy_tx(frame);
+  }
+  my_buf *buf = frame->buf;
+  frame->buf = nullptr;
+  return buf;
+}
+
+/* ソケットが書き込めるようになるのを待つか(待つ間はEPOLLOUTでも起こしてもらう) */
+void worker_set_tx_blocked(net_device *dev, bool blocked) {
+  worker_device *wdev = worker_device_of(dev);
+  if (wdev->tx_blocked == blocked) {
+    return;
+  }
+  epoll_event ev{};
+  ev.events = blocked ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = dev;
+  epoll_ctl(current_worker->epoll_fd, EPOLL_CTL_MOD, wdev->fd, &ev);
+  wdev->tx_blocked = blocked;
+}
+
+/* 周期の最後と受信する前に、送信キューにフレームがあるデバイスからまとめて送信する */
+void worker_flush_tx(worker *w) {
+  uint32_t count = w->tx_pending_count;
+  w->tx_pending_count = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    net_device *dev = w->tx_pending[i];
+    worker_device *wdev = &w->devs[dev->index];
+    wdev->tx_scheduled = false;
+    dev->ops.flush(dev);
+    // ソケットが一杯で送れずに残ったフレームは、次の受信で上書きされる前にコピーしておく
+    for (uint32_t j = 0; j < wdev->tx_count; j++) {
+      worker_tx_frame *frame = &wdev->tx_queue[(wdev->tx_head + j) & (TX_QUEUE_LEN - 1)];
+      if (frame->buf == nullptr) {
+        worker_copy_tx(frame);
+      }
+    }
+  }
+}
+
+/* 他のワーカーが学習したNDの内容を反映する */
+void worker_process_nd_rings(worker *w) {
+  nd_event event;
+  for (int src = 0; src <= worker_count; src++) { // worker_countは制御プレーンのスレッド
+    if (w->nd_rings[src] == nullptr) {
+      continue;
+    }
+    while (w->nd_rings[src]->pop(&event)) {
+      local_stats->nd[STATS_ND_EVENT_APPLIED]++;
+      if (event.is_advertisement) {
+        nd_learn_advertisement(event.has_mac_addr ? event.mac_addr : nullptr, event.v6_addr, event.flags);
+      } else {
+        nd_learn_solicitation(event.dev, event.mac_addr, event.v6_addr);
+      }
+    }
+  }
+}
+
+/* 現在のスレッドをワーカーとして使えるようにする(CPUへの固定とスレッドごとのテーブルの初期化) */
+void worker_init_thread(worker *w) {
+  current_worker = w;
+
+  // 割り当てられたCPUに固定する
+  if (w->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      LOG_ERROR("failed to pin worker %d to cpu %d: %s\n", w->id, w->cpu, strerror(errno));
+    }
+  }
+
+  // スレッドごとのテーブルを初期化
+  graph_init();
+  init_timer_wheel();
+  init_nd_table();
+  icmpv6_init_worker();
+  punt_init_worker(w);
+  flow_cache_init_worker();
+  npt_init_worker();
+  stats_start_worker(w);
+  trace_init_worker(w);
+#ifdef ENABLE_LATENCY_HISTOGRAM
+  latency_init_worker();
+#endif
+
+  in6_addr root_addr;
+  memset(&root_addr, 0x00, sizeof(root_addr));
+  ipv6_fib = create_patricia_node(root_addr, 0, false, nullptr);
+}
+
+void *worker_main(void *arg) {
+  worker *w = (worker *)arg;
+  worker_init_thread(w);
+
+  // NDなどのタイマーを進めるtimerfd
+  w->timer_fd = timer_wheel_create_timerfd();
+  if (w->timer_fd < 0) {
+    return nullptr;
+  }
+
+  /*
+   * epollのイベントにはデバイスのポインタを持たせ、デバイスを探さずに処理できるようにする
+   * timerfdとeventfdは、ワーカーの中のfdのアドレスで見分ける
+   */
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->timer_fd;
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev);
+
+  for (net_device *dev = net_dev_list; dev; dev = dev->next) {
+    if (w->devs[dev->index].fd == -1) { // パイプラインモードでは受信スレッドが受け取る
+      continue;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = dev;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->devs[dev->index].fd, &ev) != 0) {
+      LOG_ERROR("failed to epoll_ctl device %s: %s\n", dev->name, strerror(errno));
+      return nullptr;
+    }
+  }
+
+  epoll_event ev_ret[MAX_EPOLL_EVENTS];
+  int timeout = -1;
+  while (!workers_stopping.load(std::memory_order_acquire)) {
+    int nfds = epoll_wait(w->epoll_fd, ev_ret, MAX_EPOLL_EVENTS, timeout);
+    if (nfds < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("failed to epoll_wait: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < nfds; i++) {
+      void *ptr = ev_ret[i].data.ptr;
+      if (ptr == &w->timer_fd) {
+        timer_wheel_handle_timerfd(w->timer_fd);
+        continue;
+      }
+      if (ptr == &w->wake_fd) {
+        uint64_t count;
+        read(w->wake_fd, &count, sizeof(count));
+        continue;
+      }
+      net_device *dev = (net_device *)ptr;
+      if (ev_ret[i].events & EPOLLOUT) { // 書き込めるようになったので溜まっていた分を送る
+        worker_set_tx_blocked(dev, false);
+        dev->ops.flush(dev);
+      }
+      if (ev_ret[i].events & EPOLLIN) {
+        worker_flush_tx(w); // 送信キューが指している受信用のバッファを上書きする前に送る
+        dev->ops.poll(dev);
+      }
+    }
+
+    bool remaining = false;
+#ifdef ENABLE_PIPELINE_MODE
+    remaining = pipeline_lookup_poll();
+#endif
+
+#ifdef ENABLE_PUNT_QUEUE
+    if (w == punt_worker) {
+      worker_flush_tx(w); // punt_pollも受信用のバッファにコピーする
+      if (punt_poll()) {
+        remaining = true;
+      }
+    }
+#endif
+
+    worker_process_nd_rings(w);
+
+    // 制御メッセージや受信リングの記述子が残っていれば待たずに次の周期へ進む
+    if (worker_process_control_ring(w)) {
+      remaining = true;
+    }
+
+    worker_flush_tx(w);
+    timeout = remaining ? 0 : -1;
+  }
+  return nullptr;
+}
+
+/* 1つのワーカーのスレッドを起動する */
+bool worker_start(worker *w) { return pthread_create(&w->thread, nullptr, worker_main, w) == 0; }
+
+/* ワーカーのスレッドを起動する */
+void start_workers() {
+  for (int i = 0; i < worker_count; i++) {
+    if (!worker_start(workers[i])) {
+      LOG_ERROR("failed to start worker %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (punt_worker != nullptr and !worker_start(punt_worker)) {
+    LOG_ERROR("failed to start control plane thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* 1つのワーカーのスレッドを止める(止める合図は全てのワーカーに共通なので、終了時にだけ使う) */
+void worker_stop(worker *w) {
+  workers_stopping.store(true, std::memory_order_release);
+  worker_wake(w);
+  pthread_join(w->thread, nullptr);
+}
+
+/* ワーカーのスレッドを止める */
+void stop_workers() {
+  workers_stopping.store(true, std::memory_order_release);
+  for (int i = 0; i < worker_count; i++) {
+    worker_wake(workers[i]);
+  }
+  if (punt_worker != nullptr) {
+    worker_wake(punt_worker);
+  }
+  for (int i = 0; i < worker_count; i++) {
+    pthread_join(workers[i]->thread, nullptr);
+  }
+  if (punt_worker != nullptr) {
+    pthread_join(punt_worker->thread, nullptr);
+  }
+}
+
+/* 全てのワーカーの制御リングの空きのうち最小のもの */
+uint32_t worker_control_ring_space() {
+  uint32_t space = ROUTE_UPDATE_QUEUE_SIZE;
+  for (int i = 0; i < worker_count; i++) {
+    uint32_t s = workers[i]->control_ring.free_space();
+    if (s < space) {
+      space = s;
+    }
+  }
+  if (punt_worker != nullptr and punt_worker->control_ring.free_space() < space) {
+    space = punt_worker->control_ring.free_space();
+  }
+  return space;
+}
+
+/* 全てのワーカーにメッセージを送る(制御スレッドから呼ぶ) */
+bool worker_broadcast_msg(const worker_msg &msg) {
+  if (worker_control_ring_space() == 0) {
+    LOG_ERROR("worker control ring is full\n");
+    return false;
+  }
+  for (int i = 0; i < worker_count; i++) {
+    worker_send_msg(workers[i], msg);
+  }
+  if (punt_worker != nullptr) { // 制御プレーンのスレッドも応答を送るのに経路表を使う
+    worker_send_msg(punt_worker, msg);
+  }
+  return true;
+}
+
+/* 1つのワーカーにメッセージを送る(リングが一杯ならfalse) */
+bool worker_send_msg(worker *w, const worker_msg &msg) {
+  bool was_empty;
+  if (!w->control_ring.push(msg, &was_empty)) {
+    return false;
+  }
+  if (was_empty) {
+    worker_wake(w);
+  }
+  return true;
+}
+
+/* ワーカーでコマンドを実行し、終わるまで待つ */
+void worker_run_command_on(worker *w, const worker_msg &msg) {
+  uint32_t done = w->commands_done.load(std::memory_order_acquire);
+  bool was_empty;
+  while (!w->control_ring.push(msg, &was_empty)) {
+    usleep(1000);
+  }
+  if (was_empty) {
+    worker_wake(w);
+  }
+  while (w->commands_done.load(std::memory_order_acquire) == done) {
+    usleep(1000);
+  }
+}
+
+/* 全てのワーカーなら制御プレーンのスレッドでも実行する */
+void worker_run_command(char command, bool all_workers) {
+  worker_msg msg{};
+  msg.type = worker_msg_type::command;
+  msg.command = command;
+
+  int count = all_workers ? worker_count : 1;
+  for (int i = 0; i < count; i++) { // 出力が混ざらないように1つずつ実行する
+    worker_run_command_on(workers[i], msg);
+  }
+  if (all_workers and punt_worker != nullptr) {
+    worker_run_command_on(punt_worker, msg);
+  }
+}
+
+/* NDで学習した内容を他のワーカーに伝える(ワーカーから呼ぶ) */
+void worker_publish_nd_event(const nd_event &event) {
+  worker *self = current_worker;
+  for (int i = 0; i < worker_count; i++) {
+    if (i == self->id) {
+      continue;
+    }
+    bool was_empty;
+    if (!workers[i]->nd_rings[self->id]->push(event, &was_empty)) {
+      local_stats->nd[STATS_ND_EVENT_DROPPED]++;
+      continue;
+    }
+    local_stats->nd[STATS_ND_EVENT_PUBLISHED]++;
+    if (was_empty) {
+      worker_wake(workers[i]);
+    }
+  }
+}
+
+/* 1つのワーカーのカウンタを表示する */
+void dump_worker(worker *w) {
+  auto counter = [](const auto &value) { return __atomic_load_n(&value, __ATOMIC_RELAXED); }; // 他のスレッドが更新している
+  printf("%s %d (cpu %d) control queue %u nd events dropped %lu\n", w == punt_worker ? "control plane" : "worker", w->id, w->cpu, w->control_ring.size(),
+         counter(w->stats.nd[STATS_ND_EVENT_DROPPED]));
+  printf("  drops:");
+  for (int r = 0; r < STATS_DROP_COUNT; r++) {
+    printf(" %s %lu%s", stats_drop_reason_names[r], counter(w->stats.drops[r]), r + 1 < STATS_DROP_COUNT ? "," : "\n");
+  }
+  printf("  icmpv6 errors:");
+  for (int e = 0; e < STATS_ICMPV6_ERROR_COUNT; e++) {
+    printf(" %s %lu%s", stats_icmpv6_error_event_names[e], counter(w->stats.icmpv6_errors[e]), e + 1 < STATS_ICMPV6_ERROR_COUNT ? "," : "\n");
+  }
+  if (punt_worker != nullptr and w != punt_worker) {
+    printf("  punt:");
+    for (int c = 0; c < STATS_PUNT_CLASS_COUNT; c++) {
+      printf(" %s queued %lu policed %lu queue full %lu%s", stats_punt_class_names[c], counter(w->stats.punt[c][STATS_PUNT_QUEUED]),
+             counter(w->stats.punt[c][STATS_PUNT_POLICED]), counter(w->stats.punt[c][STATS_PUNT_QUEUE_FULL]), c + 1 < STATS_PUNT_CLASS_COUNT ? "," : "\n");
+    }
+  }
+  for (net_device *dev = net_dev_list; dev; dev = dev->next) {
+    worker_device *wdev = &w->devs[dev->index];
+    uint64_t tx_packets = counter(wdev->tx_packets), tx_flushes = counter(wdev->tx_flushes);
+    printf("  %-16s rx %lu packets %lu bytes, tx %lu packets %lu bytes, nd incomplete %u\n", dev->name, counter(wdev->rx_packets), counter(wdev->rx_bytes), tx_packets,
+           counter(wdev->tx_bytes), counter(wdev->nd_incomplete));
+    printf("  %-16s tx queue depth %u (max %u), drops %lu, errors %lu, eagain %lu, flushes %lu (avg batch %.1f, max %u)\n", "", counter(wdev->tx_count), counter(wdev->tx_depth_max),
+           counter(wdev->tx_queue_drops), counter(wdev->tx_errors), counter(wdev->tx_eagain), tx_flushes, tx_flushes > 0 ? (double)tx_packets / tx_flushes : 0.0,
+           counter(wdev->tx_batch_max));
+  }
+}
+
+/* ワーカーごとのカウンタを表示する */
+void dump_worker_counters() {
+  for (int i = 0; i < worker_count; i++) {
+    dump_worker(workers[i]);
+  }
+  if (punt_worker != nullptr) {
+    dump_worker(punt_worker);
+  }
+}
@@ -0,0 +1,167 @@
+#ifndef CURO_WORKER_H
+#define CURO_WORKER_H
+
+#include "config.h"
+#include "control.h"
+#include "net.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+#include <atomic>
+#include <pthread.h>
+
+#define WORKER_ND_EVENT_RING_SIZE 1024 // ワーカー間でND学習イベントを渡すリングの大きさ
+
+/* ワーカーへの制御メッセージの種類 */
+enum class worker_msg_type : uint8_t {
+  route_update,    // 制御ソケットから受け取った経路の追加/削除
+  connected_route, // 直接接続経路の追加
+  local_route,     // ルータ自身のアドレスの経路の追加
+  static_neighbor, // 静的なNDエントリの追加
+  acl_update,      // コンパイルしたACLへの差し替え
+  npt_mapping_add, // NPTv6の変換の組の追加
+  command          // 対話的なコマンドの実行
+};
+
+struct acl_classifier;
+struct npt_mapping;
+
+/* 制御スレッドからワーカーに送るメッセージ */
+struct worker_msg {
+  worker_msg_type type;
+  union {
+    route_update_msg route;
+    struct {
+      net_device *dev;
+      in6_addr prefix;
+      uint32_t prefix_len;
+    } connected;
+    struct {
+      ipv6_device *v6dev;
+    } local;
+    struct {
+      net_device *dev;
+      in6_addr v6_addr;
+      uint8_t mac_addr[6];
+    } neighbor;
+    struct {
+      acl_classifier *classifier;
+    } acl;
+    struct {
+      npt_mapping *mapping;
+    } npt;
+    char command;
+  };
+};
+
+/* 他のワーカーが受け取ったNS/NAで学習した内容 */
+struct nd_event {
+  net_device *dev;
+  in6_addr v6_addr;
+  uint8_t mac_addr[6];
+  bool has_mac_addr;
+  bool is_advertisement; // NAならtrue、NSならfalse
+  uint8_t flags;         // NAのフラグ
+};
+
+struct my_buf;
+
+/*
+ * 送信キューに入れたフレーム
+ * グラフの受信用のバッファで書き換えたフレームは、次に受信する前に送信するのでコピーせずに指しておく
+ * それ以外のフレームと、ソケットが一杯で次の受信まで残るフレームはmy_bufにコピーする
+ */
+struct worker_tx_frame {
+  uint8_t *data; // フレームの先頭
+  uint32_t len;
+  my_buf *buf;   // コピーしたバッファ(受信用のバッファを指している間はnullptr)
+};
+
+/* ワーカーごとのデバイスのデータ */
+struct alignas(CACHE_LINE_SIZE) worker_device {
+  int fd;                 // このワーカーが受信・送信に使うソケット
+  uint32_t nd_incomplete; // このデバイスでアドレス解決中のNDエントリの数
+  uint32_t npt_mappings;  // このデバイスを外部とするNPTv6の変換の組の数
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+
+  // 送信キュー(ポーリング周期の最後にまとめて送信する)
+  worker_tx_frame tx_queue[TX_QUEUE_LEN];
+  uint32_t tx_head;    // 次に送信する位置
+  uint32_t tx_count;   // キューに溜まっている数
+  bool tx_scheduled;   // 送信待ちのリストに入っているか
+  bool tx_blocked;     // ソケットのバッファが一杯で書き込めるようになるのを待っているか
+  uint32_t tx_depth_max;
+  uint32_t tx_batch_max;
+  uint64_t tx_flushes;     // まとめて送信した回数
+  uint64_t tx_queue_drops; // キューが一杯で捨てたフレーム
+  uint64_t tx_errors;      // 送信エラーで捨てたフレーム
+  uint64_t tx_eagain;      // ソケットのバッファが一杯で送信を待たされた回数
+};
+
+/* 転送処理を行うワーカー */
+struct alignas(CACHE_LINE_SIZE) worker {
+  int id;
+  int cpu;      // 固定するCPU(-1なら固定しない)
+  int epoll_fd;
+  int wake_fd;  // リングにメッセージを入れた時に起こすためのeventfd
+  int timer_fd; // タイマーホイールを進めるtimerfd
+  pthread_t thread;
+  worker_device *devs; // net_device::indexで引く
+
+  net_device **tx_pending; // 送信キューにフレームがあるデバイス
+  uint32_t tx_pending_count;
+
+  spsc_ring<worker_msg, ROUTE_UPDATE_QUEUE_SIZE> control_ring;       // 制御スレッドから
+  spsc_ring<nd_event, WORKER_ND_EVENT_RING_SIZE> *nd_rings[MAX_WORKERS + 1]; // 他のワーカーと制御プレーンのスレッドから(送信元のidで引く)
+
+  std::atomic<uint32_t> commands_done; // 実行し終えたコマンドの数
+
+  stats_counters stats;       // このワーカーのカウンタ
+  stats_shm_worker *stats_shm; // カウンタを書き出す共有メモリの領域(公開しないならnullptr)
+  timer_entry stats_timer;
+
+  trace_ring *trace; // パケットトレースの記録
+};
+
+extern worker *workers[MAX_WORKERS];
+extern int worker_count;
+
+extern thread_local worker *current_worker;
+
+/* 現在のワーカーから見たデバイスのデータ */
+inline worker_device *worker_device_of(net_device *dev) { return &current_worker->devs[dev->index]; }
+
+int worker_allowed_cpus(int *cpus);
+
+worker *worker_create(int id, int cpu, int device_count);
+int init_workers(int count, int device_count);
+bool worker_start(worker *w);
+void start_workers();
+void stop_workers();
+void worker_stop(worker *w);
+
+bool worker_broadcast_msg(const worker_msg &msg);
+bool worker_send_msg(worker *w, const worker_msg &msg);
+uint32_t worker_control_ring_space();
+void worker_run_command(char command, bool all_workers);
+void worker_wake(worker *w);
+
+void worker_init_thread(worker *w);
+bool worker_process_control_ring(worker *w);
+void worker_flush_tx(worker *w);
+
+int worker_queue_tx(net_device *dev, uint8_t *buffer, size_t len);
+void worker_release_tx(worker_tx_frame *frame);
+my_buf *worker_take_tx(worker_tx_frame *frame);
+void worker_schedule_tx(net_device *dev);
+void worker_set_tx_blocked(net_device *dev, bool blocked);
+
+void worker_publish_nd_event(const nd_event &event);
+
+void dump_worker_counters();
+
+#endif // CURO_WORKER_H